@@ -43,6 +43,267 @@ static void symbol_table_add(symbol_table_t *t, symbol_t *s)
     tc_debug(0, "<%s> %s, %s\n", t->name, token_type_to_str(s->type), s->name);
 }
 
+// declare a compiler generated scalar local in function scope 't'
+symbol_t *symbol_table_add_temp(symbol_table_t *t, const char *prefix)
+{
+    static int count;
+    symbol_t *s = zalloc(sizeof(symbol_t));
+    symbol_t *fun = symbol_table_lookup(t, t->name, 1);
+    char name[32];
+
+    snprintf(name, sizeof(name), ".%s%d", prefix, count++); // can't clash with identifiers
+    s->name = strdup(name);
+    s->type = TOK_KEYWORD_INT;
+    symbol_table_add(t, s);
+    fun->var_count++;
+    s->index = fun->arg_count + fun->var_count;
+    return s;
+}
+
+// the scalar local that plain identifier 'node' names in scope 't', NULL otherwise
+symbol_t *local_scalar(symbol_table_t *t, cast_node_t *node)
+{
+    symbol_t *sym;
+
+    if (node->type != CAST_IDENTIFIER || node->expr.array_expr)
+        return NULL;
+    sym = symbol_table_lookup(t, node->expr.identifier, 1);
+    if (!sym || sym->index == 0 || sym->array_size)
+        return NULL; // globals may change in any call
+    return sym;
+}
+
+// CAST nodes made by the passes that rewrite the tree
+cast_node_t *new_node(enum cast_node_type type, int line_number)
+{
+    cast_node_t *n = zalloc(sizeof(cast_node_t));
+
+    n->type = type;
+    n->line_number = line_number;
+    return n;
+}
+
+cast_node_t *new_assign(symbol_t *sym, cast_node_t *expr)
+{
+    cast_node_t *n = new_node(CAST_ASSIGN_STMT, expr->line_number);
+
+    n->assign_stmt.identifier = sym->name;
+    n->assign_stmt.expr = expr;
+    return n;
+}
+
+// shallow copy of 'node' that is in no list
+cast_node_t *copy_node(cast_node_t *node)
+{
+    cast_node_t *n = zalloc(sizeof(cast_node_t));
+
+    *n = *node;
+    INIT_LIST_NODE(&n->list);
+    return n;
+}
+
+/*
+ * Effects of the function being analyzed and of the while loops around the
+ * node being traversed, innermost last.
+ */
+static struct {
+    struct effects **stack;
+    int nr, alloc;
+} scopes;
+static symbol_table_t *global_table;
+
+static void scope_push(struct effects *e)
+{
+    ALLOC_GROW(scopes.stack, scopes.nr + 1, scopes.alloc);
+    scopes.stack[scopes.nr++] = e;
+}
+
+// number of assignments to 'sym' in 'e', by name to stay safe with shadowing
+int effects_writes(struct effects *e, symbol_t *sym)
+{
+    int n = 0;
+
+    for (int i = 0; i < e->nr_writes; i++)
+        if (!strcmp(e->writes[i]->name, sym->name))
+            n++;
+    return n;
+}
+
+void effects_add_write(struct effects *e, symbol_t *sym)
+{
+    ALLOC_GROW(e->writes, e->nr_writes + 1, e->alloc_writes);
+    e->writes[e->nr_writes++] = sym;
+}
+
+static void effects_add_call(struct effects *e, char *name)
+{
+    for (int i = 0; i < e->nr_calls; i++)
+        if (!strcmp(e->calls[i], name))
+            return;
+    ALLOC_GROW(e->calls, e->nr_calls + 1, e->alloc_calls);
+    e->calls[e->nr_calls++] = name;
+}
+
+// whether 'sym' may change while the code with effects 'e' runs
+int effects_clobber(struct effects *e, symbol_t *sym)
+{
+    if (effects_writes(e, sym))
+        return 1;
+    if (sym->index) // locals are private to their function
+        return 0;
+    for (int i = 0; i < e->nr_calls; i++) {
+        symbol_t *f = symbol_table_lookup(global_table, e->calls[i], 0);
+        if (f && f->effects && effects_writes(f->effects, sym))
+            return 1;
+    }
+    return 0;
+}
+
+static void record_write(symbol_t *s)
+{
+    for (int i = 0; i < scopes.nr; i++) {
+        // a function only keeps the globals it writes, loops keep every assignment
+        if (i == 0 && (s->index || effects_writes(scopes.stack[0], s)))
+            continue;
+        effects_add_write(scopes.stack[i], s);
+    }
+}
+
+// add the globals written by callees to their callers until nothing changes
+static void propagate_effects(cast_node_t *program)
+{
+    int changed;
+
+    do {
+        cast_node_t *d;
+        changed = 0;
+        list_for_each_entry(d, &program->program.declarations, list) {
+            if (d->type != CAST_FUN_DECLARATION)
+                continue;
+            struct effects *e = symbol_table_lookup(global_table, d->fun_declaration.identifier, 0)->effects;
+            for (int i = 0; i < e->nr_calls; i++) {
+                symbol_t *f = symbol_table_lookup(global_table, e->calls[i], 0);
+                if (!f || !f->effects || f->effects == e)
+                    continue;
+                for (int j = 0; j < f->effects->nr_writes; j++) {
+                    if (!effects_writes(e, f->effects->writes[j])) {
+                        effects_add_write(e, f->effects->writes[j]);
+                        changed = 1;
+                    }
+                }
+            }
+        }
+    } while (changed);
+}
+
+// Collect the effects of every function and while loop, see struct effects
+static void collect_effects(cast_node_t *node, symbol_table_t *symtab)
+{
+    if (!node)
+        return;
+    switch (node->type) {
+    case CAST_PROGRAM:
+        {
+            cast_node_t *d;
+            global_table = node->program.symbol_table;
+            list_for_each_entry(d, &node->program.declarations, list) {
+                collect_effects(d, global_table);
+            }
+        }
+        break;
+    case CAST_VAR_DECLARATION:
+        collect_effects(node->var_declaration.var_declarator_list, symtab);
+        break;
+    case CAST_VAR_DECLARATOR_LIST:
+        {
+            cast_node_t *var_declarator;
+            list_for_each_entry(var_declarator, &node->var_declarator_list.var_declarators, list) {
+                collect_effects(var_declarator, symtab);
+            }
+        }
+        break;
+    case CAST_VAR_DECLARATOR:
+        if (node->var_declarator.expr) {
+            collect_effects(node->var_declarator.expr, symtab);
+            record_write(symbol_table_lookup(symtab, node->var_declarator.identifier, 1));
+        }
+        break;
+    case CAST_FUN_DECLARATION:
+        {
+            symbol_t *s = symbol_table_lookup(symtab, node->fun_declaration.identifier, 0);
+            s->effects = zalloc(sizeof(struct effects));
+            scope_push(s->effects);
+            collect_effects(node->fun_declaration.compound_stmt, node->fun_declaration.symbol_table);
+            scopes.nr--;
+        }
+        break;
+    case CAST_COMPOUND_STMT:
+        {
+            cast_node_t *stmt;
+            list_for_each_entry(stmt, &node->compound_stmt.stmts, list) {
+                if (stmt->type == CAST_COMPOUND_STMT && stmt->compound_stmt.symbol_table)
+                    collect_effects(stmt, stmt->compound_stmt.symbol_table);
+                else
+                    collect_effects(stmt, symtab);
+            }
+        }
+        break;
+    case CAST_ASSIGN_STMT:
+        collect_effects(node->assign_stmt.array_expr, symtab);
+        collect_effects(node->assign_stmt.expr, symtab);
+        record_write(symbol_table_lookup(symtab, node->assign_stmt.identifier, 1));
+        break;
+    case CAST_RETURN_STMT:
+        collect_effects(node->return_stmt.expr, symtab);
+        break;
+    case CAST_WHILE_STMT:
+        node->while_stmt.effects = zalloc(sizeof(struct effects));
+        scope_push(node->while_stmt.effects);
+        collect_effects(node->while_stmt.expr, symtab);
+        collect_effects(node->while_stmt.stmt, symtab);
+        scopes.nr--;
+        break;
+    case CAST_IF_STMT:
+        collect_effects(node->if_stmt.expr, symtab);
+        collect_effects(node->if_stmt.if_stmt, symtab);
+        collect_effects(node->if_stmt.else_stmt, symtab);
+        break;
+    case CAST_CALL_STMT:
+        collect_effects(node->call_stmt.expr, symtab);
+        break;
+    case CAST_CALL_EXPR:
+        {
+            cast_node_t *arg;
+            for (int i = 0; i < scopes.nr; i++)
+                effects_add_call(scopes.stack[i], node->call_expr.identifier);
+            list_for_each_entry(arg, &node->call_expr.args_list, list) {
+                collect_effects(arg, symtab);
+            }
+        }
+        break;
+    case CAST_LOGICAL_EXPR:
+    case CAST_RELATIONAL_EXPR:
+    case CAST_SIMPLE_EXPR:
+    case CAST_TERM:
+        collect_effects(node->expr.op.left, symtab);
+        collect_effects(node->expr.op.right, symtab);
+        break;
+    case CAST_IDENTIFIER:
+        collect_effects(node->expr.array_expr, symtab);
+        break;
+    default:
+        break;
+    }
+}
+
+// (re)compute the effects after the symbols are known or passes moved code around
+void analyze_effects(cast_node_t *ast)
+{
+    scopes.nr = 0;
+    collect_effects(ast, NULL);
+    propagate_effects(ast);
+}
+
 // Traverse CAST recursively in a depth-first manner
 static void traverse_cast(cast_node_t *node, symbol_table_t *symtab)
 {
@@ -79,6 +340,7 @@ static void traverse_cast(cast_node_t *node, symbol_table_t *symtab)
             symbol_t *s = zalloc(sizeof(symbol_t));
             s->name = strdup(node->var_declarator.identifier);
             s->type = node->var_declarator.type;
+            s->array_size = node->var_declarator.array_size;
             symbol_table_add(symtab, s);
             symbol_t *fun = symbol_table_lookup(symtab, symtab->name, 1);
             if (fun && fun->symbol_type) { // local variable
@@ -98,6 +360,7 @@ static void traverse_cast(cast_node_t *node, symbol_table_t *symtab)
             s->name = strdup(node->fun_declaration.identifier);
             s->type = node->fun_declaration.type;
             s->symbol_type = 1; // function
+            s->defined = node->fun_declaration.compound_stmt != NULL;
             symbol_table_add(symtab, s); // add function name to global symbol table
             symbol_table_t *local = symbol_table_create(); // create a local symbol table
             node->fun_declaration.symbol_table = local;
@@ -146,6 +409,7 @@ static void traverse_cast(cast_node_t *node, symbol_table_t *symtab)
                 panic("‘%s’ undeclared (first use in %s function)\n",
                       node->assign_stmt.identifier, symtab->name);
             tc_debug(0, "Assign identifier: %s\n", node->assign_stmt.identifier);
+            traverse_cast(node->assign_stmt.array_expr, symtab);
             traverse_cast(node->assign_stmt.expr, symtab);
             break;
         }
@@ -200,7 +464,14 @@ static void traverse_cast(cast_node_t *node, symbol_table_t *symtab)
     return;
 }
 
+// add a function made by a pass to the symbols of the program
+void analyze_declaration(cast_node_t *ast, cast_node_t *decl)
+{
+    traverse_cast(decl, ast->program.symbol_table);
+}
+
 void analyze_semantics(cast_node_t *cast_root)
 {
     traverse_cast(cast_root, NULL);
+    analyze_effects(cast_root);
 }
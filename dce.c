@@ -0,0 +1,398 @@
+#include "tc.h"
+
+/*
+ * Dead code elimination over the CAST, run after the IR passes.
+ *
+ * Unreachable code: an if or while with a constant condition keeps only the
+ * branch that runs, and the statements of a list after one that never
+ * completes, like a return, are dropped.
+ *
+ * Dead stores: the SSA IR is built again and every instruction the result of
+ * the program depends on is marked, starting from stores to memory, calls,
+ * branches and returns. An assignment to a local whose value ends up
+ * unmarked is never read, it is removed, or only its call is kept.
+ *
+ * Unused locals: the locals no statement refers to anymore give back their
+ * stack slot, the others are packed into a smaller frame.
+ */
+static struct {
+    int unreachable; // statements that can't run
+    int dead_stores; // assignments nobody reads
+    int unused; // locals without a stack slot now
+} stats;
+
+static inline int is_const(cast_node_t *node)
+{
+    return node->type == CAST_NUMBER;
+}
+
+// overwrite statement 'node' with 'with', keeping its place in any list
+static void replace_stmt(cast_node_t *node, cast_node_t *with)
+{
+    struct list_node list = node->list;
+
+    *node = *with;
+    node->list = list;
+    if (with->type == CAST_COMPOUND_STMT) { // the statements point back to their list head
+        INIT_LIST_HEAD(&node->compound_stmt.stmts);
+        list_splice_init(&with->compound_stmt.stmts, &node->compound_stmt.stmts);
+    }
+}
+
+// take 'node' out of its list, or leave an empty statement where there is none
+static void remove_stmt(cast_node_t *node)
+{
+    if (list_linked(&node->list)) {
+        list_del(&node->list);
+        return;
+    }
+    node->type = CAST_COMPOUND_STMT;
+    INIT_LIST_HEAD(&node->compound_stmt.stmts);
+    node->compound_stmt.symbol_table = NULL;
+}
+
+static int count_stmts(cast_node_t *node)
+{
+    int n = 1;
+
+    if (!node)
+        return 0;
+    switch (node->type) {
+    case CAST_COMPOUND_STMT:
+        {
+            cast_node_t *s;
+            n = 0;
+            list_for_each_entry(s, &node->compound_stmt.stmts, list) {
+                n += count_stmts(s);
+            }
+        }
+        break;
+    case CAST_IF_STMT:
+        n += count_stmts(node->if_stmt.if_stmt) + count_stmts(node->if_stmt.else_stmt);
+        break;
+    case CAST_WHILE_STMT:
+        n += count_stmts(node->while_stmt.stmt);
+        break;
+    default:
+        break;
+    }
+    return n;
+}
+
+// control never gets past 'node', the language has no break
+static int never_completes(cast_node_t *node)
+{
+    switch (node->type) {
+    case CAST_RETURN_STMT:
+        return 1;
+    case CAST_COMPOUND_STMT:
+        {
+            cast_node_t *s;
+            list_for_each_entry(s, &node->compound_stmt.stmts, list) {
+                if (never_completes(s))
+                    return 1;
+            }
+        }
+        return 0;
+    case CAST_IF_STMT:
+        return node->if_stmt.else_stmt && never_completes(node->if_stmt.if_stmt) &&
+               never_completes(node->if_stmt.else_stmt);
+    case CAST_WHILE_STMT:
+        return is_const(node->while_stmt.expr) && node->while_stmt.expr->expr.num;
+    default:
+        return 0;
+    }
+}
+
+static void remove_unreachable(cast_node_t *node)
+{
+    if (!node)
+        return;
+    switch (node->type) {
+    case CAST_COMPOUND_STMT:
+        {
+            cast_node_t *s;
+            int dead = 0;
+            list_for_each_entry(s, &node->compound_stmt.stmts, list) {
+                if (dead) {
+                    stats.unreachable += count_stmts(s);
+                    list_del(&s->list);
+                    continue;
+                }
+                remove_unreachable(s);
+                dead = never_completes(s);
+            }
+        }
+        break;
+    case CAST_IF_STMT:
+        if (is_const(node->if_stmt.expr)) {
+            cast_node_t *taken = node->if_stmt.if_stmt, *other = node->if_stmt.else_stmt;
+            if (!node->if_stmt.expr->expr.num) {
+                taken = node->if_stmt.else_stmt;
+                other = node->if_stmt.if_stmt;
+            }
+            stats.unreachable += count_stmts(other) + 1;
+            if (taken) {
+                replace_stmt(node, taken);
+                remove_unreachable(node);
+            } else {
+                remove_stmt(node);
+            }
+            break;
+        }
+        remove_unreachable(node->if_stmt.if_stmt);
+        remove_unreachable(node->if_stmt.else_stmt);
+        break;
+    case CAST_WHILE_STMT:
+        if (is_const(node->while_stmt.expr) && !node->while_stmt.expr->expr.num) {
+            stats.unreachable += count_stmts(node);
+            remove_stmt(node);
+            break;
+        }
+        remove_unreachable(node->while_stmt.stmt);
+        break;
+    default:
+        break;
+    }
+}
+
+static void mark(struct ir_value *v, char *live)
+{
+    if (live[v->id])
+        return;
+    live[v->id] = 1;
+    for (int i = 0; i < v->nr_args; i++)
+        mark(v->args[i], live);
+}
+
+static int has_call(cast_node_t *node)
+{
+    if (!node)
+        return 0;
+    switch (node->type) {
+    case CAST_CALL_EXPR:
+        return 1;
+    case CAST_IDENTIFIER:
+        return has_call(node->expr.array_expr);
+    case CAST_LOGICAL_EXPR:
+    case CAST_RELATIONAL_EXPR:
+    case CAST_SIMPLE_EXPR:
+    case CAST_TERM:
+        return has_call(node->expr.op.left) || has_call(node->expr.op.right);
+    default:
+        return 0;
+    }
+}
+
+static inline cast_node_t *stored_expr(cast_node_t *node)
+{
+    return node->type == CAST_ASSIGN_STMT ? node->assign_stmt.expr : node->var_declarator.expr;
+}
+
+// a dead assignment that calls more than a single function has to stay
+static int must_keep(cast_node_t *node)
+{
+    cast_node_t *expr = stored_expr(node);
+
+    return has_call(expr) && !(expr->type == CAST_CALL_EXPR && node->type == CAST_ASSIGN_STMT);
+}
+
+// drop an assignment whose value is never read, what it calls still runs
+static void remove_store(cast_node_t *node)
+{
+    cast_node_t *expr = stored_expr(node);
+
+    if (expr->type == CAST_CALL_EXPR && node->type == CAST_ASSIGN_STMT) {
+        node->type = CAST_CALL_STMT;
+        node->call_stmt.expr = expr;
+    } else if (node->type == CAST_ASSIGN_STMT) {
+        remove_stmt(node);
+    } else {
+        node->var_declarator.expr = NULL;
+    }
+    stats.dead_stores++;
+}
+
+static inline struct ir_value *def_value(struct ir_def *def)
+{
+    struct ir_value *v = def->value;
+
+    while (v->forward)
+        v = v->forward;
+    return v;
+}
+
+static void remove_dead_stores(struct ir_function *fn)
+{
+    char *live = zalloc(fn->nr_values);
+    struct ir_value *v;
+
+    for (int i = 0; i < fn->nr_blocks; i++) {
+        list_for_each_entry(v, &fn->blocks[i]->insns, list) {
+            if (v->op == IR_STORE || v->op == IR_CALL || ir_is_terminator(v))
+                mark(v, live);
+        }
+    }
+    for (int i = 0; i < fn->nr_defs; i++) // what they read stays needed
+        if (must_keep(fn->defs[i].node))
+            mark(def_value(fn->defs + i), live);
+    for (int i = 0; i < fn->nr_defs; i++)
+        if (!live[def_value(fn->defs + i)->id] && !must_keep(fn->defs[i].node))
+            remove_store(fn->defs[i].node);
+    free(live);
+}
+
+static struct {
+    symbol_t **syms; // referred to by a statement
+    int nr_syms, alloc_syms;
+    symbol_table_t **tables; // of the function being packed
+    int nr_tables, alloc_tables;
+} refs;
+
+static void add_ref(symbol_table_t *symtab, char *name)
+{
+    symbol_t *sym = symbol_table_lookup(symtab, name, 1);
+
+    for (int i = 0; i < refs.nr_syms; i++)
+        if (refs.syms[i] == sym)
+            return;
+    ALLOC_GROW(refs.syms, refs.nr_syms + 1, refs.alloc_syms);
+    refs.syms[refs.nr_syms++] = sym;
+}
+
+static void add_table(symbol_table_t *symtab)
+{
+    ALLOC_GROW(refs.tables, refs.nr_tables + 1, refs.alloc_tables);
+    refs.tables[refs.nr_tables++] = symtab;
+}
+
+static void collect_refs(cast_node_t *node, symbol_table_t *symtab)
+{
+    cast_node_t *n;
+
+    if (!node)
+        return;
+    switch (node->type) {
+    case CAST_VAR_DECLARATION:
+        list_for_each_entry(n, &node->var_declaration.var_declarator_list->var_declarator_list.var_declarators, list) {
+            if (n->var_declarator.expr) {
+                collect_refs(n->var_declarator.expr, symtab);
+                add_ref(symtab, n->var_declarator.identifier);
+            }
+        }
+        break;
+    case CAST_COMPOUND_STMT:
+        list_for_each_entry(n, &node->compound_stmt.stmts, list) {
+            if (n->type == CAST_COMPOUND_STMT && n->compound_stmt.symbol_table) {
+                add_table(n->compound_stmt.symbol_table);
+                collect_refs(n, n->compound_stmt.symbol_table);
+            } else {
+                collect_refs(n, symtab);
+            }
+        }
+        break;
+    case CAST_ASSIGN_STMT:
+        add_ref(symtab, node->assign_stmt.identifier);
+        collect_refs(node->assign_stmt.array_expr, symtab);
+        collect_refs(node->assign_stmt.expr, symtab);
+        break;
+    case CAST_IF_STMT:
+        collect_refs(node->if_stmt.expr, symtab);
+        collect_refs(node->if_stmt.if_stmt, symtab);
+        collect_refs(node->if_stmt.else_stmt, symtab);
+        break;
+    case CAST_WHILE_STMT:
+        collect_refs(node->while_stmt.expr, symtab);
+        collect_refs(node->while_stmt.stmt, symtab);
+        break;
+    case CAST_RETURN_STMT:
+        collect_refs(node->return_stmt.expr, symtab);
+        break;
+    case CAST_CALL_STMT:
+        collect_refs(node->call_stmt.expr, symtab);
+        break;
+    case CAST_CALL_EXPR:
+        list_for_each_entry(n, &node->call_expr.args_list, list) {
+            collect_refs(n, symtab);
+        }
+        break;
+    case CAST_LOGICAL_EXPR:
+    case CAST_RELATIONAL_EXPR:
+    case CAST_SIMPLE_EXPR:
+    case CAST_TERM:
+        collect_refs(node->expr.op.left, symtab);
+        collect_refs(node->expr.op.right, symtab);
+        break;
+    case CAST_IDENTIFIER:
+        add_ref(symtab, node->expr.identifier);
+        collect_refs(node->expr.array_expr, symtab);
+        break;
+    default:
+        break;
+    }
+}
+
+static int by_index(const void *a, const void *b)
+{
+    return (*(symbol_t **)a)->index - (*(symbol_t **)b)->index;
+}
+
+// give the locals still referred to consecutive slots after the parameters
+static void pack_locals(cast_node_t *decl, symbol_t *fun)
+{
+    symbol_t **locals = NULL;
+    int nr = 0, alloc = 0, count = 0;
+
+    refs.nr_syms = refs.nr_tables = 0;
+    add_table(decl->fun_declaration.symbol_table);
+    collect_refs(decl->fun_declaration.compound_stmt, decl->fun_declaration.symbol_table);
+    for (int t = 0; t < refs.nr_tables; t++) {
+        for (int i = 0; i < TABLE_SIZE; i++) {
+            struct hlist_node *node;
+            hlist_for_each(node, refs.tables[t]->table + i) {
+                symbol_t *s = hlist_entry(node, symbol_t, list);
+                if (s->index <= fun->arg_count)
+                    continue; // parameters keep theirs
+                ALLOC_GROW(locals, nr + 1, alloc);
+                locals[nr++] = s;
+            }
+        }
+    }
+    qsort(locals, nr, sizeof(*locals), by_index);
+    for (int i = 0; i < nr; i++) {
+        int used = 0;
+        for (int j = 0; j < refs.nr_syms && !used; j++)
+            used = refs.syms[j] == locals[i];
+        if (!used) {
+            stats.unused++;
+            continue; // keeps a stale index, nothing refers to it
+        }
+        count += locals[i]->array_size ? locals[i]->array_size : 1;
+        locals[i]->index = fun->arg_count + count;
+    }
+    if (count < fun->var_count)
+        tc_debug(0, "%s: frame of %d locals instead of %d\n", fun->name, count, fun->var_count);
+    fun->var_count = count;
+    free(locals);
+}
+
+void eliminate_dead_code(cast_node_t *ast)
+{
+    struct ir_program *prog;
+    struct ir_function *fn;
+    cast_node_t *d;
+
+    list_for_each_entry(d, &ast->program.declarations, list) {
+        if (d->type == CAST_FUN_DECLARATION)
+            remove_unreachable(d->fun_declaration.compound_stmt);
+    }
+    prog = build_ir(ast);
+    list_for_each_entry(fn, &prog->functions, list) {
+        remove_dead_stores(fn);
+        pack_locals(fn->decl, fn->sym);
+    }
+    analyze_effects(ast);
+    print_stat("dce", "unreachable statements removed", stats.unreachable);
+    print_stat("dce", "dead stores removed", stats.dead_stores);
+    print_stat("dce", "unused locals removed", stats.unused);
+}
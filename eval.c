@@ -0,0 +1,490 @@
+#include "tc.h"
+
+/*
+ * Compile-time evaluation of calls to pure functions, run before
+ * inline_functions() so a call like fibonacci(20) becomes a number instead
+ * of being inlined.
+ *
+ * A function is pure when it takes and returns ints and only computes on
+ * its parameters and locals: it writes and reads no globals, uses no
+ * strings and only calls pure functions, itself included. Purity is the
+ * greatest fixpoint over the call graph, so mutually recursive functions
+ * are pure unless one of them isn't.
+ *
+ * A call to a pure function whose arguments are constant is run by a small
+ * interpreter over the CAST and replaced with the value it returns. The
+ * interpreter gives up and leaves the call alone on what would trap or is
+ * undefined at run time: division by zero, an index out of its array, a
+ * local read before it is assigned, falling off the end of the function.
+ * It also gives up when the call takes too many steps or nests too deep, a
+ * budget that keeps the compile time bounded.
+ */
+#define EVAL_MAX_STEPS 1000000 // CAST nodes evaluated for one call
+#define EVAL_MAX_TOTAL 10000000 // for the whole program
+#define EVAL_MAX_DEPTH 1000 // nested calls
+
+struct pure_fn {
+    cast_node_t *decl;
+    symbol_t *sym;
+    int pure;
+};
+
+// local storage of a call being evaluated, see the index of symbol_t
+struct frame {
+    int *slots;
+    char *set; // the slot was assigned
+    symbol_table_t *symtab; // innermost scope
+};
+
+// what running a statement leads to
+enum {
+    EXEC_NEXT,
+    EXEC_RETURN,
+    EXEC_FAIL
+};
+
+static struct {
+    struct pure_fn *fns;
+    int nr_fns, alloc_fns;
+    long steps, total;
+    int depth;
+    int entered; // calls whose body started running
+    int ret; // returned by the call being evaluated
+} ev;
+
+static struct {
+    int pure;      // functions found pure
+    int evaluated; // calls replaced with their value
+    int failed;    // calls that trapped or ran out of budget
+} stats;
+
+static struct pure_fn *find_fn(char *name)
+{
+    for (int i = 0; i < ev.nr_fns; i++)
+        if (!strcmp(ev.fns[i].decl->fun_declaration.identifier, name))
+            return ev.fns + i;
+    return NULL;
+}
+
+// whether 'node' only uses what a pure function may, calls aside
+static int local_only(cast_node_t *node, symbol_table_t *symtab)
+{
+    symbol_t *sym;
+    char *name = NULL;
+
+    if (!node)
+        return 1;
+    switch (node->type) {
+    case CAST_VAR_DECLARATION:
+        return node->var_declaration.type == TOK_KEYWORD_INT &&
+               local_only(node->var_declaration.var_declarator_list, symtab);
+    case CAST_VAR_DECLARATOR_LIST:
+        {
+            cast_node_t *d;
+            list_for_each_entry(d, &node->var_declarator_list.var_declarators, list) {
+                if ((d->var_declarator.array_size && d->var_declarator.expr) ||
+                    !local_only(d->var_declarator.expr, symtab))
+                    return 0;
+            }
+        }
+        return 1;
+    case CAST_COMPOUND_STMT:
+        {
+            cast_node_t *s;
+            if (node->compound_stmt.symbol_table)
+                symtab = node->compound_stmt.symbol_table;
+            list_for_each_entry(s, &node->compound_stmt.stmts, list) {
+                if (!local_only(s, symtab))
+                    return 0;
+            }
+        }
+        return 1;
+    case CAST_ASSIGN_STMT:
+        name = node->assign_stmt.identifier;
+        if (!local_only(node->assign_stmt.array_expr, symtab) ||
+            !local_only(node->assign_stmt.expr, symtab))
+            return 0;
+        break;
+    case CAST_IF_STMT:
+        return local_only(node->if_stmt.expr, symtab) &&
+               local_only(node->if_stmt.if_stmt, symtab) &&
+               local_only(node->if_stmt.else_stmt, symtab);
+    case CAST_WHILE_STMT:
+        return local_only(node->while_stmt.expr, symtab) &&
+               local_only(node->while_stmt.stmt, symtab);
+    case CAST_RETURN_STMT:
+        return node->return_stmt.expr && local_only(node->return_stmt.expr, symtab);
+    case CAST_CALL_STMT:
+        return local_only(node->call_stmt.expr, symtab);
+    case CAST_CALL_EXPR:
+        {
+            cast_node_t *arg;
+            list_for_each_entry(arg, &node->call_expr.args_list, list) {
+                if (!local_only(arg, symtab))
+                    return 0;
+            }
+        }
+        return 1;
+    case CAST_LOGICAL_EXPR:
+    case CAST_RELATIONAL_EXPR:
+    case CAST_SIMPLE_EXPR:
+    case CAST_TERM:
+        return local_only(node->expr.op.left, symtab) && local_only(node->expr.op.right, symtab);
+    case CAST_IDENTIFIER:
+        name = node->expr.identifier;
+        if (!local_only(node->expr.array_expr, symtab))
+            return 0;
+        break;
+    case CAST_NUMBER:
+        return 1;
+    default:
+        return 0; // strings
+    }
+    sym = symbol_table_lookup(symtab, name, 1);
+    return sym && sym->index;
+}
+
+static int pure_signature(cast_node_t *d)
+{
+    cast_node_t *param;
+
+    if (d->fun_declaration.type != TOK_KEYWORD_INT)
+        return 0;
+    if (d->fun_declaration.param_list) {
+        list_for_each_entry(param, &d->fun_declaration.param_list->param_list.params, list) {
+            if (param->param.type != TOK_KEYWORD_INT)
+                return 0;
+        }
+    }
+    return 1;
+}
+
+// mark the pure functions, optimistically first, then drop callers of impure ones
+static void find_pure_functions(cast_node_t *ast)
+{
+    symbol_table_t *global = ast->program.symbol_table;
+    int changed;
+    cast_node_t *d;
+
+    list_for_each_entry(d, &ast->program.declarations, list) {
+        struct pure_fn *f;
+        if (d->type != CAST_FUN_DECLARATION || !d->fun_declaration.compound_stmt)
+            continue;
+        ALLOC_GROW(ev.fns, ev.nr_fns + 1, ev.alloc_fns);
+        f = ev.fns + ev.nr_fns++;
+        f->decl = d;
+        f->sym = symbol_table_lookup(global, d->fun_declaration.identifier, 0);
+        f->pure = strcmp(d->fun_declaration.identifier, "main") && pure_signature(d) &&
+                  !f->sym->effects->nr_writes &&
+                  local_only(d->fun_declaration.compound_stmt, d->fun_declaration.symbol_table);
+    }
+    do {
+        changed = 0;
+        for (int i = 0; i < ev.nr_fns; i++) {
+            struct effects *e = ev.fns[i].sym->effects;
+            if (!ev.fns[i].pure)
+                continue;
+            for (int j = 0; j < e->nr_calls; j++) {
+                struct pure_fn *g = find_fn(e->calls[j]);
+                if (!g || !g->pure) {
+                    ev.fns[i].pure = 0;
+                    changed = 1;
+                    break;
+                }
+            }
+        }
+    } while (changed);
+    for (int i = 0; i < ev.nr_fns; i++)
+        if (ev.fns[i].pure) {
+            tc_debug(0, "pure function %s\n", ev.fns[i].decl->fun_declaration.identifier);
+            stats.pure++;
+        }
+}
+
+static int step(void)
+{
+    ev.total++;
+    return ++ev.steps <= EVAL_MAX_STEPS && ev.total <= EVAL_MAX_TOTAL;
+}
+
+/*
+ * The slot of 'name' in 'fr', indexed by 'idx' for arrays, -1 when it can't
+ * be accessed. Elements of an array end at its index.
+ */
+static int find_slot(struct frame *fr, char *name, cast_node_t *idx_expr, int idx)
+{
+    symbol_t *sym;
+
+    if (!fr || !(sym = symbol_table_lookup(fr->symtab, name, 1)) || !sym->index)
+        return -1;
+    if (!sym->array_size)
+        return idx_expr ? -1 : sym->index;
+    if (!idx_expr || idx < 0 || idx >= sym->array_size)
+        return -1;
+    return sym->index - sym->array_size + 1 + idx;
+}
+
+static int exec_stmt(cast_node_t *node, struct frame *fr);
+
+static int eval_expr(cast_node_t *node, struct frame *fr, int *val);
+
+static int eval_call(cast_node_t *call, struct frame *fr, int *val)
+{
+    struct pure_fn *f = find_fn(call->call_expr.identifier);
+    cast_node_t *arg;
+    struct frame callee;
+    int n = 0, nr_slots, ret;
+
+    if (!f || !f->pure || ev.depth == EVAL_MAX_DEPTH)
+        return 0;
+    nr_slots = f->sym->arg_count + f->sym->var_count + 1;
+    callee.slots = zalloc(nr_slots * sizeof(int));
+    callee.set = zalloc(nr_slots);
+    callee.symtab = f->decl->fun_declaration.symbol_table;
+    list_for_each_entry(arg, &call->call_expr.args_list, list) {
+        if (++n > f->sym->arg_count || !eval_expr(arg, fr, &callee.slots[n])) {
+            ret = EXEC_FAIL;
+            goto out;
+        }
+        callee.set[n] = 1; // parameters are numbered in order from 1
+    }
+    if (n != f->sym->arg_count) {
+        ret = EXEC_FAIL;
+        goto out;
+    }
+    ev.entered++;
+    ev.depth++;
+    ret = exec_stmt(f->decl->fun_declaration.compound_stmt, &callee);
+    ev.depth--;
+    if (ret == EXEC_RETURN)
+        *val = ev.ret;
+out:
+    free(callee.slots);
+    free(callee.set);
+    return ret == EXEC_RETURN; // falling off the end returns garbage
+}
+
+static int eval_expr(cast_node_t *node, struct frame *fr, int *val)
+{
+    int l, r, idx = 0, slot;
+
+    if (!step())
+        return 0;
+    switch (node->type) {
+    case CAST_NUMBER:
+        *val = node->expr.num;
+        return 1;
+    case CAST_IDENTIFIER:
+        if (node->expr.array_expr && !eval_expr(node->expr.array_expr, fr, &idx))
+            return 0;
+        slot = find_slot(fr, node->expr.identifier, node->expr.array_expr, idx);
+        if (slot < 0 || !fr->set[slot])
+            return 0;
+        *val = fr->slots[slot];
+        return 1;
+    case CAST_CALL_EXPR:
+        return eval_call(node, fr, val);
+    case CAST_LOGICAL_EXPR:
+        if (!eval_expr(node->expr.op.left, fr, &l))
+            return 0;
+        if ((l != 0) == (node->expr.op.type == TOK_OPERATOR_LOGICAL_OR)) { // short-circuited
+            *val = l != 0;
+            return 1;
+        }
+        if (!eval_expr(node->expr.op.right, fr, &r))
+            return 0;
+        *val = r != 0;
+        return 1;
+    case CAST_RELATIONAL_EXPR:
+    case CAST_SIMPLE_EXPR:
+    case CAST_TERM:
+        return eval_expr(node->expr.op.left, fr, &l) && eval_expr(node->expr.op.right, fr, &r) &&
+               eval_op(node->expr.op.type, l, r, val);
+    default:
+        return 0;
+    }
+}
+
+static int exec_stmt(cast_node_t *node, struct frame *fr)
+{
+    int val, idx = 0, slot, ret = EXEC_NEXT;
+
+    if (!node)
+        return EXEC_NEXT;
+    if (!step())
+        return EXEC_FAIL;
+    switch (node->type) {
+    case CAST_VAR_DECLARATION:
+        {
+            cast_node_t *d;
+            list_for_each_entry(d, &node->var_declaration.var_declarator_list->var_declarator_list.var_declarators, list) {
+                if (!d->var_declarator.expr)
+                    continue;
+                slot = find_slot(fr, d->var_declarator.identifier, NULL, 0);
+                if (slot < 0 || !eval_expr(d->var_declarator.expr, fr, &val))
+                    return EXEC_FAIL;
+                fr->slots[slot] = val;
+                fr->set[slot] = 1;
+            }
+        }
+        return EXEC_NEXT;
+    case CAST_COMPOUND_STMT:
+        {
+            symbol_table_t *outer = fr->symtab;
+            cast_node_t *s;
+            if (node->compound_stmt.symbol_table)
+                fr->symtab = node->compound_stmt.symbol_table;
+            list_for_each_entry(s, &node->compound_stmt.stmts, list) {
+                if ((ret = exec_stmt(s, fr)) != EXEC_NEXT)
+                    break;
+            }
+            fr->symtab = outer;
+        }
+        return ret;
+    case CAST_ASSIGN_STMT:
+        if (node->assign_stmt.array_expr && !eval_expr(node->assign_stmt.array_expr, fr, &idx))
+            return EXEC_FAIL;
+        if (!eval_expr(node->assign_stmt.expr, fr, &val))
+            return EXEC_FAIL;
+        slot = find_slot(fr, node->assign_stmt.identifier, node->assign_stmt.array_expr, idx);
+        if (slot < 0)
+            return EXEC_FAIL;
+        fr->slots[slot] = val;
+        fr->set[slot] = 1;
+        return EXEC_NEXT;
+    case CAST_IF_STMT:
+        if (!eval_expr(node->if_stmt.expr, fr, &val))
+            return EXEC_FAIL;
+        return exec_stmt(val ? node->if_stmt.if_stmt : node->if_stmt.else_stmt, fr);
+    case CAST_WHILE_STMT:
+        for (;;) {
+            if (!eval_expr(node->while_stmt.expr, fr, &val))
+                return EXEC_FAIL;
+            if (!val)
+                return EXEC_NEXT;
+            if ((ret = exec_stmt(node->while_stmt.stmt, fr)) != EXEC_NEXT)
+                return ret;
+        }
+    case CAST_RETURN_STMT:
+        if (!node->return_stmt.expr || !eval_expr(node->return_stmt.expr, fr, &ev.ret))
+            return EXEC_FAIL;
+        return EXEC_RETURN;
+    case CAST_CALL_STMT:
+        return eval_expr(node->call_stmt.expr, fr, &val) ? EXEC_NEXT : EXEC_FAIL;
+    default:
+        return EXEC_FAIL;
+    }
+}
+
+// replace the calls in 'node' that evaluate to a constant, innermost first
+static void fold_calls(cast_node_t *node)
+{
+    int val;
+
+    if (!node)
+        return;
+    switch (node->type) {
+    case CAST_PROGRAM:
+        {
+            cast_node_t *d;
+            list_for_each_entry(d, &node->program.declarations, list) {
+                fold_calls(d);
+            }
+        }
+        break;
+    case CAST_VAR_DECLARATION:
+        fold_calls(node->var_declaration.var_declarator_list);
+        break;
+    case CAST_VAR_DECLARATOR_LIST:
+        {
+            cast_node_t *d;
+            list_for_each_entry(d, &node->var_declarator_list.var_declarators, list) {
+                fold_calls(d->var_declarator.expr);
+            }
+        }
+        break;
+    case CAST_FUN_DECLARATION:
+        fold_calls(node->fun_declaration.compound_stmt);
+        break;
+    case CAST_COMPOUND_STMT:
+        {
+            cast_node_t *s;
+            list_for_each_entry(s, &node->compound_stmt.stmts, list) {
+                fold_calls(s);
+            }
+        }
+        break;
+    case CAST_ASSIGN_STMT:
+        fold_calls(node->assign_stmt.array_expr);
+        fold_calls(node->assign_stmt.expr);
+        break;
+    case CAST_IF_STMT:
+        fold_calls(node->if_stmt.expr);
+        fold_calls(node->if_stmt.if_stmt);
+        fold_calls(node->if_stmt.else_stmt);
+        break;
+    case CAST_WHILE_STMT:
+        fold_calls(node->while_stmt.expr);
+        fold_calls(node->while_stmt.stmt);
+        break;
+    case CAST_RETURN_STMT:
+        fold_calls(node->return_stmt.expr);
+        break;
+    case CAST_CALL_STMT:
+        if (node->call_stmt.expr->type == CAST_CALL_EXPR) {
+            cast_node_t *arg; // the value isn't used, only the arguments can fold
+            list_for_each_entry(arg, &node->call_stmt.expr->call_expr.args_list, list) {
+                fold_calls(arg);
+            }
+        }
+        break;
+    case CAST_CALL_EXPR:
+        {
+            struct pure_fn *f = find_fn(node->call_expr.identifier);
+            cast_node_t *arg;
+            list_for_each_entry(arg, &node->call_expr.args_list, list) {
+                fold_calls(arg);
+            }
+            if (!f || !f->pure || ev.total >= EVAL_MAX_TOTAL)
+                break;
+            ev.steps = ev.depth = ev.entered = 0;
+            if (!eval_call(node, NULL, &val)) { // without a frame only constant arguments evaluate
+                if (ev.entered)
+                    stats.failed++;
+                break;
+            }
+            tc_debug(0, "evaluate %s to %d in %ld steps\n", node->call_expr.identifier, val, ev.steps);
+            node->type = CAST_NUMBER;
+            node->expr.num = val;
+            stats.evaluated++;
+        }
+        break;
+    case CAST_LOGICAL_EXPR:
+    case CAST_RELATIONAL_EXPR:
+    case CAST_SIMPLE_EXPR:
+    case CAST_TERM:
+        fold_calls(node->expr.op.left);
+        fold_calls(node->expr.op.right);
+        break;
+    case CAST_IDENTIFIER:
+        fold_calls(node->expr.array_expr);
+        break;
+    default:
+        break;
+    }
+}
+
+void evaluate_pure_calls(cast_node_t *ast)
+{
+    if (options.no_eval)
+        goto out;
+    find_pure_functions(ast);
+    if (stats.pure)
+        fold_calls(ast);
+    if (stats.evaluated)
+        analyze_effects(ast); // the evaluated calls are gone
+out:
+    print_stat("eval", "pure functions", stats.pure);
+    print_stat("eval", "calls evaluated", stats.evaluated);
+    print_stat("eval", "calls given up", stats.failed);
+}
@@ -0,0 +1,405 @@
+#include "tc.h"
+
+/*
+ * Constant folding and algebraic simplification over the CAST. Runs between
+ * analyze_semantics() and generate_code() and rewrites expressions in place,
+ * so the generator only sees the simplest form. Arithmetic wraps like the
+ * 32-bit instructions the generator emits.
+ */
+static struct {
+    int folded;       // operations on two constants evaluated
+    int simplified;   // identities like x + 0 or x - x applied
+    int reassociated; // constants of (x + c1) + c2 combined
+} stats;
+
+static inline int is_num(cast_node_t *node)
+{
+    return node->type == CAST_NUMBER;
+}
+
+static inline int is_num_eq(cast_node_t *node, int val)
+{
+    return node->type == CAST_NUMBER && node->expr.num == val;
+}
+
+// expressions without calls can be dropped or duplicated freely
+int is_pure(cast_node_t *node)
+{
+    switch (node->type) {
+    case CAST_NUMBER:
+    case CAST_STRING:
+        return 1;
+    case CAST_IDENTIFIER:
+        return !node->expr.array_expr || is_pure(node->expr.array_expr);
+    case CAST_LOGICAL_EXPR:
+    case CAST_RELATIONAL_EXPR:
+    case CAST_SIMPLE_EXPR:
+    case CAST_TERM:
+        return is_pure(node->expr.op.left) && is_pure(node->expr.op.right);
+    default:
+        return 0;
+    }
+}
+
+// whether two pure expressions always have the same value
+int same_expr(cast_node_t *a, cast_node_t *b)
+{
+    if (a->type != b->type || !is_pure(a))
+        return 0;
+    switch (a->type) {
+    case CAST_NUMBER:
+        return a->expr.num == b->expr.num;
+    case CAST_IDENTIFIER:
+        if (strcmp(a->expr.identifier, b->expr.identifier))
+            return 0;
+        if (!a->expr.array_expr || !b->expr.array_expr)
+            return a->expr.array_expr == b->expr.array_expr;
+        return same_expr(a->expr.array_expr, b->expr.array_expr);
+    case CAST_LOGICAL_EXPR:
+    case CAST_RELATIONAL_EXPR:
+    case CAST_SIMPLE_EXPR:
+    case CAST_TERM:
+        return a->expr.op.type == b->expr.op.type &&
+               same_expr(a->expr.op.left, b->expr.op.left) &&
+               same_expr(a->expr.op.right, b->expr.op.right);
+    default:
+        return 0;
+    }
+}
+
+static inline void set_num(cast_node_t *node, int val)
+{
+    node->type = CAST_NUMBER;
+    node->expr.num = val;
+}
+
+static cast_node_t *new_num(int val)
+{
+    cast_node_t *n = zalloc(sizeof(cast_node_t));
+
+    set_num(n, val);
+    return n;
+}
+
+// overwrite 'node' with its subtree 'with', keeping its place in any list
+static void replace_node(cast_node_t *node, cast_node_t *with)
+{
+    struct list_node list = node->list;
+
+    *node = *with;
+    node->list = list;
+    if (with->type == CAST_CALL_EXPR) { // the arguments point back to their list head
+        INIT_LIST_HEAD(&node->call_expr.args_list);
+        list_splice_init(&with->call_expr.args_list, &node->call_expr.args_list);
+    }
+    free(with);
+}
+
+// turn 'node' into the 0/1 truth value of its subtree 'x'
+static void replace_with_bool(cast_node_t *node, cast_node_t *x)
+{
+    if (x->type == CAST_RELATIONAL_EXPR || x->type == CAST_LOGICAL_EXPR) {
+        replace_node(node, x);
+        return;
+    }
+    node->type = CAST_RELATIONAL_EXPR;
+    node->expr.op.type = TOK_OPERATOR_NOT_EQUAL;
+    node->expr.op.left = x;
+    node->expr.op.right = new_num(0);
+}
+
+// evaluate 'l op r' into 'val', fails for what would trap at run time
+int eval_op(enum token_type op, int l, int r, int *val)
+{
+    unsigned int ul = l, ur = r;
+
+    switch (op) {
+    case TOK_OPERATOR_ADD:
+        *val = ul + ur;
+        break;
+    case TOK_OPERATOR_SUB:
+        *val = ul - ur;
+        break;
+    case TOK_OPERATOR_MUL:
+        *val = ul * ur;
+        break;
+    case TOK_OPERATOR_DIV:
+    case TOK_OPERATOR_MOD:
+        if (r == 0 || (l == (int)0x80000000 && r == -1))
+            return 0;
+        *val = op == TOK_OPERATOR_DIV ? l / r : l % r;
+        break;
+    case TOK_OPERATOR_LESS_THAN:
+        *val = l < r;
+        break;
+    case TOK_OPERATOR_LESS_THAN_OR_EQUAL_TO:
+        *val = l <= r;
+        break;
+    case TOK_OPERATOR_GREATER_THAN:
+        *val = l > r;
+        break;
+    case TOK_OPERATOR_GREATER_THAN_OR_EQUAL_TO:
+        *val = l >= r;
+        break;
+    case TOK_OPERATOR_EQUAL:
+        *val = l == r;
+        break;
+    case TOK_OPERATOR_NOT_EQUAL:
+        *val = l != r;
+        break;
+    case TOK_OPERATOR_LOGICAL_AND:
+        *val = l && r;
+        break;
+    case TOK_OPERATOR_LOGICAL_OR:
+        *val = l || r;
+        break;
+    default:
+        return 0;
+    }
+    return 1;
+}
+
+static inline void swap_operands(cast_node_t *node)
+{
+    cast_node_t *t = node->expr.op.left;
+
+    node->expr.op.left = node->expr.op.right;
+    node->expr.op.right = t;
+}
+
+// make 'node' x + k, written as x - (-k) for negative k
+static void set_add_const(cast_node_t *node, cast_node_t *x, int k)
+{
+    if (k == 0) {
+        replace_node(node, x);
+        return;
+    }
+    node->expr.op.left = x;
+    if (k < 0 && k != (int)0x80000000) {
+        node->expr.op.type = TOK_OPERATOR_SUB;
+        node->expr.op.right = new_num(-k);
+    } else {
+        node->expr.op.type = TOK_OPERATOR_ADD;
+        node->expr.op.right = new_num(k);
+    }
+}
+
+static void fold_simple_expr(cast_node_t *node)
+{
+    cast_node_t *l = node->expr.op.left, *r = node->expr.op.right;
+    int add = node->expr.op.type == TOK_OPERATOR_ADD;
+
+    if (add && is_num(l)) { // keep constants on the right
+        swap_operands(node);
+        l = node->expr.op.left;
+        r = node->expr.op.right;
+    }
+    if (is_num_eq(r, 0)) { // x + 0, x - 0
+        replace_node(node, l);
+        stats.simplified++;
+    } else if (!add && same_expr(l, r)) { // x - x
+        set_num(node, 0);
+        stats.simplified++;
+    } else if (is_num(r) && l->type == CAST_SIMPLE_EXPR && is_num(l->expr.op.right)) {
+        // (x +- c1) +- c2 => x + k
+        unsigned int k = l->expr.op.right->expr.num;
+        if (l->expr.op.type == TOK_OPERATOR_SUB)
+            k = -k;
+        k = add ? k + r->expr.num : k - r->expr.num;
+        set_add_const(node, l->expr.op.left, k);
+        stats.reassociated++;
+    } else if (!add && is_num(l) && r->type == CAST_SIMPLE_EXPR && is_num(r->expr.op.right)) {
+        // c1 - (x +- c2) => (c1 -+ c2) - x
+        unsigned int k = l->expr.num;
+        if (r->expr.op.type == TOK_OPERATOR_ADD)
+            k -= r->expr.op.right->expr.num;
+        else
+            k += r->expr.op.right->expr.num;
+        l->expr.num = k;
+        node->expr.op.right = r->expr.op.left;
+        stats.reassociated++;
+    }
+}
+
+static void fold_term(cast_node_t *node)
+{
+    cast_node_t *l = node->expr.op.left, *r = node->expr.op.right;
+
+    if (node->expr.op.type == TOK_OPERATOR_MUL) {
+        if (is_num(l)) { // keep constants on the right
+            swap_operands(node);
+            l = node->expr.op.left;
+            r = node->expr.op.right;
+        }
+        if (is_num_eq(r, 1)) { // x * 1
+            replace_node(node, l);
+            stats.simplified++;
+        } else if (is_num_eq(r, 0) && is_pure(l)) { // x * 0
+            set_num(node, 0);
+            stats.simplified++;
+        } else if (is_num(r) && l->type == CAST_TERM &&
+                   l->expr.op.type == TOK_OPERATOR_MUL && is_num(l->expr.op.right)) {
+            // (x * c1) * c2 => x * (c1 * c2)
+            r->expr.num = (unsigned int)r->expr.num * l->expr.op.right->expr.num;
+            node->expr.op.left = l->expr.op.left;
+            stats.reassociated++;
+        }
+    } else if (is_num_eq(r, 1)) {
+        if (node->expr.op.type == TOK_OPERATOR_DIV) { // x / 1
+            replace_node(node, l);
+            stats.simplified++;
+        } else if (is_pure(l)) { // x % 1
+            set_num(node, 0);
+            stats.simplified++;
+        }
+    }
+}
+
+static void fold_relational_expr(cast_node_t *node)
+{
+    if (!same_expr(node->expr.op.left, node->expr.op.right))
+        return;
+    switch (node->expr.op.type) { // x op x
+    case TOK_OPERATOR_EQUAL:
+    case TOK_OPERATOR_LESS_THAN_OR_EQUAL_TO:
+    case TOK_OPERATOR_GREATER_THAN_OR_EQUAL_TO:
+        set_num(node, 1);
+        break;
+    default:
+        set_num(node, 0);
+        break;
+    }
+    stats.simplified++;
+}
+
+static void fold_logical_expr(cast_node_t *node)
+{
+    cast_node_t *l = node->expr.op.left, *r = node->expr.op.right;
+    int and = node->expr.op.type == TOK_OPERATOR_LOGICAL_AND;
+
+    if (is_num(l)) {
+        if ((l->expr.num != 0) != and) // 0 && x, 1 || x
+            set_num(node, !and);
+        else // 1 && x, 0 || x
+            replace_with_bool(node, r);
+        stats.simplified++;
+    } else if (is_num(r)) {
+        if ((r->expr.num != 0) == and) // x && 1, x || 0
+            replace_with_bool(node, l);
+        else if (is_pure(l)) // x && 0, x || 1
+            set_num(node, !and);
+        else
+            return;
+        stats.simplified++;
+    }
+}
+
+static void fold_expr(cast_node_t *node)
+{
+    int val;
+
+    if (!node)
+        return;
+    switch (node->type) {
+    case CAST_IDENTIFIER:
+        fold_expr(node->expr.array_expr);
+        break;
+    case CAST_CALL_EXPR:
+        {
+            cast_node_t *arg;
+            list_for_each_entry(arg, &node->call_expr.args_list, list) {
+                fold_expr(arg);
+            }
+        }
+        break;
+    case CAST_LOGICAL_EXPR:
+    case CAST_RELATIONAL_EXPR:
+    case CAST_SIMPLE_EXPR:
+    case CAST_TERM:
+        fold_expr(node->expr.op.left);
+        fold_expr(node->expr.op.right);
+        if (is_num(node->expr.op.left) && is_num(node->expr.op.right) &&
+            eval_op(node->expr.op.type, node->expr.op.left->expr.num,
+                    node->expr.op.right->expr.num, &val)) {
+            set_num(node, val);
+            stats.folded++;
+        } else if (node->type == CAST_SIMPLE_EXPR)
+            fold_simple_expr(node);
+        else if (node->type == CAST_TERM)
+            fold_term(node);
+        else if (node->type == CAST_RELATIONAL_EXPR)
+            fold_relational_expr(node);
+        else
+            fold_logical_expr(node);
+        break;
+    default:
+        break;
+    }
+}
+
+static void fold_node(cast_node_t *node)
+{
+    if (!node)
+        return;
+    switch (node->type) {
+    case CAST_PROGRAM:
+        {
+            cast_node_t *d;
+            list_for_each_entry(d, &node->program.declarations, list) {
+                fold_node(d);
+            }
+        }
+        break;
+    case CAST_VAR_DECLARATION:
+        fold_node(node->var_declaration.var_declarator_list);
+        break;
+    case CAST_VAR_DECLARATOR_LIST:
+        {
+            cast_node_t *var_declarator;
+            list_for_each_entry(var_declarator, &node->var_declarator_list.var_declarators, list) {
+                fold_expr(var_declarator->var_declarator.expr);
+            }
+        }
+        break;
+    case CAST_FUN_DECLARATION:
+        fold_node(node->fun_declaration.compound_stmt);
+        break;
+    case CAST_COMPOUND_STMT:
+        {
+            cast_node_t *s;
+            list_for_each_entry(s, &node->compound_stmt.stmts, list) {
+                fold_node(s);
+            }
+        }
+        break;
+    case CAST_ASSIGN_STMT:
+        fold_expr(node->assign_stmt.array_expr);
+        fold_expr(node->assign_stmt.expr);
+        break;
+    case CAST_IF_STMT:
+        fold_expr(node->if_stmt.expr);
+        fold_node(node->if_stmt.if_stmt);
+        fold_node(node->if_stmt.else_stmt);
+        break;
+    case CAST_WHILE_STMT:
+        fold_expr(node->while_stmt.expr);
+        fold_node(node->while_stmt.stmt);
+        break;
+    case CAST_RETURN_STMT:
+        fold_expr(node->return_stmt.expr);
+        break;
+    case CAST_CALL_STMT:
+        fold_expr(node->call_stmt.expr);
+        break;
+    default:
+        break;
+    }
+}
+
+void fold_constants(cast_node_t *ast)
+{
+    fold_node(ast);
+    print_stat("fold", "constants folded", stats.folded);
+    print_stat("fold", "identities simplified", stats.simplified);
+    print_stat("fold", "constants reassociated", stats.reassociated);
+}
@@ -1,159 +1,2865 @@
 #include "tc.h"
 
-#define alloc_nr(x) (((x)+16)*3/2)
+// stack offset of a variable or parameter
+static inline int to_offset(int index)
+{
+    return index * -4;
+}
+
+#define ROUND_UP_8(x) (((x) + 7) & ~7)
+// Round up to 16 bytes to keep stack 16 bytes-aligned
+// see https://stackoverflow.com/questions/49391001/why-does-the-x86-64-amd64-system-v-abi-mandate-a-16-byte-stack-alignment
+#define ROUND_UP_16(x) (((x) + 15) & ~15)
+
+static struct mir_program prog;
+static struct list_head *insns; // where emit() appends
+static int label_count = 0;
+
+static const enum reg arg_regs[6] = {
+    REG_RDI, REG_RSI, REG_RDX, REG_RCX, REG_R8, REG_R9
+};
+
+/*
+ * Register classes. %rax and %rdx are never allocated: they are the scratch
+ * pair of idivl, carry return values and break parallel-move cycles.
+ * %rcx, %rsi and %rdi are reserved for expression temporaries and parameters
+ * that arrive in them, variables get %r8-%r11 when they don't live across a
+ * call and callee-saved ones otherwise.
+ */
+#define REG_BIT(r) (1U << (r))
+#define CALLEE_SAVED_REGS (REG_BIT(REG_RBX) | REG_BIT(REG_R12) | REG_BIT(REG_R13) | \
+                           REG_BIT(REG_R14) | REG_BIT(REG_R15))
+#define VAR_CALLER_REGS (REG_BIT(REG_R8) | REG_BIT(REG_R9) | REG_BIT(REG_R10) | REG_BIT(REG_R11))
+#define TEMP_ONLY_REGS (REG_BIT(REG_RCX) | REG_BIT(REG_RSI) | REG_BIT(REG_RDI))
+
+static const enum reg var_reg_order[] = {
+    REG_R8, REG_R9, REG_R10, REG_R11, REG_RBX, REG_R12, REG_R13, REG_R14, REG_R15
+};
+static const enum reg temp_reg_order[] = {
+    REG_RCX, REG_RSI, REG_RDI, REG_R8, REG_R9, REG_R10, REG_R11,
+    REG_RBX, REG_R12, REG_R13, REG_R14, REG_R15
+};
+
+/*
+ * How the frame is set up. By default %rbp points to it. A leaf function
+ * whose frame fits into the 128 bytes below %rsp that the System V ABI keeps
+ * from signal handlers, the red zone, needs no setup at all. Otherwise
+ * -fomit-frame-pointer moves %rsp once and addresses the frame from it.
+ * Slots are always addressed from %rbp while generating and rebased at the end.
+ */
+enum frame_kind {
+    FRAME_RBP,
+    FRAME_RED_ZONE,
+    FRAME_RSP,
+};
+#define RED_ZONE_SIZE 128
+
+// the function being generated
+static struct {
+    symbol_t *sym;
+    symbol_t *params[6];
+    int exit_label;
+    int entry_label;          // after the prologue, where self tail calls jump back to
+    int self_tail;            // the function has self tail calls
+    unsigned int var_regs;    // registers held by variables of this function
+    unsigned int temp_busy;   // registers holding a live temporary
+    enum reg temp_hint;       // where the next temporary is wanted, an argument register
+    unsigned int callee_used; // callee-saved registers to preserve
+    int locals_size;          // bytes of the to_offset() area
+    char *spill_busy;
+    int nr_spill, alloc_spill;
+    struct mir_insn **tail_jumps; // get the epilogue in front once the frame is known
+    int nr_tail, alloc_tail;
+    enum frame_kind frame_kind;
+    int frame_size;           // bytes %rsp moves by for FRAME_RSP
+} fn;
+
+static struct {
+    int tail_calls; // calls that became jumps
+    int self_tail_calls; // recursion that became loops
+    int frames_omitted; // functions without %rbp setup
+    int loops_vectorized; // loops that got a vector loop in front
+    int lea; // additions and multiplications done by lea
+    int mem_operands; // loads folded into the instruction using them
+    int mem_updates; // read-modify-write instructions on memory
+    int selects; // if statements done by cmov or setcc
+    int reordered; // right operands evaluated first as they need more registers
+    int spills; // temporaries spilled for want of registers
+} stats;
+
+/*
+ * Live intervals of scalar locals and parameters. Events (reads, writes and
+ * calls) are numbered in evaluation order of the function body; a variable
+ * touched inside a loop is live across the whole loop.
+ */
+struct interval {
+    symbol_t *sym;
+    int start, end;
+    int crosses_call;
+};
+
+struct range {
+    int start, end;
+};
+
+static struct {
+    struct interval *iv;
+    int nr_iv, alloc_iv;
+    int *calls;
+    int nr_calls, alloc_calls;
+    struct range *loops;
+    int nr_loops, alloc_loops;
+    int pos;
+} live;
+
+static void live_touch(symbol_t *sym)
+{
+    struct interval *iv = NULL;
+
+    if (!sym || sym->index == 0 || sym->array_size)
+        return; // globals and arrays stay in memory
+    for (int i = 0; i < live.nr_iv; i++) {
+        if (live.iv[i].sym == sym) {
+            iv = live.iv + i;
+            break;
+        }
+    }
+    if (!iv) {
+        ALLOC_GROW(live.iv, live.nr_iv + 1, live.alloc_iv);
+        iv = live.iv + live.nr_iv++;
+        iv->sym = sym;
+        iv->start = live.pos;
+        iv->crosses_call = 0;
+    }
+    iv->end = live.pos++;
+}
+
+// 'return f(...)' has nothing left to do after the call, f can return for us
+static inline int tail_call(cast_node_t *node)
+{
+    return node->return_stmt.expr && node->return_stmt.expr->type == CAST_CALL_EXPR;
+}
+
+// 'return f(...)' in f itself reuses the frame and jumps back to the entry
+static int self_tail_call(cast_node_t *node)
+{
+    cast_node_t *call = node->return_stmt.expr;
+
+    return tail_call(node) && !strcmp(call->call_expr.identifier, fn.sym->name) &&
+           list_size(&call->call_expr.args_list) == fn.sym->arg_count && fn.sym->arg_count <= 6;
+}
+
+static void live_scan(cast_node_t *node, symbol_table_t *symtab)
+{
+    if (!node)
+        return;
+    switch (node->type) {
+    case CAST_VAR_DECLARATION:
+        live_scan(node->var_declaration.var_declarator_list, symtab);
+        break;
+    case CAST_VAR_DECLARATOR_LIST:
+        {
+            cast_node_t *var_declarator;
+            list_for_each_entry(var_declarator, &node->var_declarator_list.var_declarators, list) {
+                live_scan(var_declarator, symtab);
+            }
+        }
+        break;
+    case CAST_VAR_DECLARATOR:
+        if (node->var_declarator.expr) {
+            live_scan(node->var_declarator.expr, symtab);
+            live_touch(symbol_table_lookup(symtab, node->var_declarator.identifier, 0));
+        }
+        break;
+    case CAST_COMPOUND_STMT:
+        {
+            cast_node_t *s;
+            list_for_each_entry(s, &node->compound_stmt.stmts, list) {
+                live_scan(s, symtab);
+            }
+        }
+        break;
+    case CAST_ASSIGN_STMT:
+        live_scan(node->assign_stmt.array_expr, symtab);
+        live_scan(node->assign_stmt.expr, symtab);
+        live_touch(symbol_table_lookup(symtab, node->assign_stmt.identifier, 1));
+        break;
+    case CAST_IF_STMT:
+        live_scan(node->if_stmt.expr, symtab);
+        live_scan(node->if_stmt.if_stmt, symtab);
+        live_scan(node->if_stmt.else_stmt, symtab);
+        break;
+    case CAST_WHILE_STMT:
+        {
+            int start = live.pos;
+            live_scan(node->while_stmt.expr, symtab);
+            live_scan(node->while_stmt.stmt, symtab);
+            // inner loops are recorded before outer ones
+            ALLOC_GROW(live.loops, live.nr_loops + 1, live.alloc_loops);
+            live.loops[live.nr_loops].start = start;
+            live.loops[live.nr_loops++].end = live.pos++;
+        }
+        break;
+    case CAST_RETURN_STMT:
+        if (self_tail_call(node)) {
+            // the arguments are stored to the parameters before jumping back
+            cast_node_t *arg;
+            int i = 0;
+            list_for_each_entry(arg, &node->return_stmt.expr->call_expr.args_list, list) {
+                live_scan(arg, symtab);
+            }
+            list_for_each_entry(arg, &node->return_stmt.expr->call_expr.args_list, list) {
+                live_touch(fn.params[i++]);
+            }
+            fn.self_tail = 1;
+            break;
+        }
+        live_scan(node->return_stmt.expr, symtab);
+        break;
+    case CAST_CALL_STMT:
+        live_scan(node->call_stmt.expr, symtab);
+        break;
+    case CAST_CALL_EXPR:
+        {
+            cast_node_t *arg;
+            list_for_each_entry(arg, &node->call_expr.args_list, list) {
+                live_scan(arg, symtab);
+            }
+            ALLOC_GROW(live.calls, live.nr_calls + 1, live.alloc_calls);
+            live.calls[live.nr_calls++] = live.pos++;
+        }
+        break;
+    case CAST_LOGICAL_EXPR:
+    case CAST_RELATIONAL_EXPR:
+    case CAST_SIMPLE_EXPR:
+    case CAST_TERM:
+        live_scan(node->expr.op.left, symtab);
+        live_scan(node->expr.op.right, symtab);
+        break;
+    case CAST_IDENTIFIER:
+        live_scan(node->expr.array_expr, symtab);
+        live_touch(symbol_table_lookup(symtab, node->expr.identifier, 1));
+        break;
+    default:
+        break;
+    }
+}
+
+static int interval_cmp(const void *a, const void *b)
+{
+    return ((const struct interval *)a)->start - ((const struct interval *)b)->start;
+}
+
+/*
+ * Linear scan register allocation (Poletto & Sarkar) of scalar locals and
+ * parameters. Variables that lose the scan keep their to_offset() slot.
+ * Returns the set of registers handed out.
+ */
+static unsigned int linear_scan(int param_regs)
+{
+    struct interval **active;
+    unsigned int used = 0, var_regs = 0;
+    int nr_active = 0;
+
+    for (int i = 0; i < live.nr_iv; i++)
+        live.iv[i].sym->reg = REG_NONE;
+    qsort(live.iv, live.nr_iv, sizeof(struct interval), interval_cmp);
+    active = zalloc(sizeof(*active) * (live.nr_iv + 1));
+    for (int i = 0; i < live.nr_iv; i++) {
+        struct interval *iv = live.iv + i;
+        unsigned int allowed = iv->crosses_call ? CALLEE_SAVED_REGS :
+                                                  CALLEE_SAVED_REGS | VAR_CALLER_REGS;
+        enum reg reg = REG_NONE;
+        int j, k;
+
+        // expire intervals that ended before this one starts
+        for (j = k = 0; j < nr_active; j++) {
+            if (active[j]->end < iv->start)
+                used &= ~REG_BIT(active[j]->sym->reg);
+            else
+                active[k++] = active[j];
+        }
+        nr_active = k;
+
+        // a parameter that isn't needed after a call stays where it arrives
+        for (j = 0; j < 6 && param_regs && !iv->crosses_call; j++) {
+            if (fn.params[j] == iv->sym && arg_regs[j] != REG_RDX && !(used & REG_BIT(arg_regs[j]))) {
+                reg = arg_regs[j];
+                goto found;
+            }
+        }
+
+        for (j = 0; j < sizeof(var_reg_order) / sizeof(var_reg_order[0]); j++) {
+            if ((allowed & REG_BIT(var_reg_order[j])) && !(used & REG_BIT(var_reg_order[j]))) {
+                reg = var_reg_order[j];
+                break;
+            }
+        }
+        if (reg == REG_NONE) {
+            // spill whichever usable interval ends last
+            struct interval *spill = NULL;
+            int spill_idx = -1;
+            for (j = 0; j < nr_active; j++) {
+                if ((allowed & REG_BIT(active[j]->sym->reg)) &&
+                    (!spill || active[j]->end > spill->end)) {
+                    spill = active[j];
+                    spill_idx = j;
+                }
+            }
+            if (spill && spill->end > iv->end) {
+                reg = spill->sym->reg;
+                spill->sym->reg = REG_NONE;
+                active[spill_idx] = active[--nr_active];
+                used &= ~REG_BIT(reg);
+                tc_debug(0, "spill %s\n", spill->sym->name);
+            } else {
+                tc_debug(0, "spill %s\n", iv->sym->name);
+                continue;
+            }
+        }
+found:
+        iv->sym->reg = reg;
+        used |= REG_BIT(reg);
+        var_regs |= REG_BIT(reg);
+        active[nr_active++] = iv;
+        tc_debug(0, "%s -> %s [%d, %d]\n", iv->sym->name, mir_reg_name(reg), iv->start, iv->end);
+    }
+    free(active);
+    return var_regs;
+}
+
+// live intervals of the variables of 'fun', then the registers for them
+static unsigned int allocate_registers(cast_node_t *fun, symbol_table_t *symtab)
+{
+    unsigned int var_regs;
+    int free_temps = 0;
+
+    live.nr_iv = live.nr_calls = live.nr_loops = 0;
+    live.pos = 1; // 0 is the function entry where parameters get defined
+    live_scan(fun->fun_declaration.compound_stmt, symtab);
+    if (fun->fun_declaration.param_list) {
+        cast_node_t *param;
+        list_for_each_entry(param, &fun->fun_declaration.param_list->param_list.params, list) {
+            symbol_t *sym = symbol_table_lookup(symtab, param->param.identifier, 0);
+            for (int i = 0; i < live.nr_iv; i++)
+                if (live.iv[i].sym == sym)
+                    live.iv[i].start = 0;
+        }
+    }
+    for (int l = 0; l < live.nr_loops; l++) {
+        for (int i = 0; i < live.nr_iv; i++) {
+            struct interval *iv = live.iv + i;
+            if (iv->start <= live.loops[l].end && iv->end >= live.loops[l].start) {
+                if (live.loops[l].start < iv->start)
+                    iv->start = live.loops[l].start;
+                if (live.loops[l].end > iv->end)
+                    iv->end = live.loops[l].end;
+            }
+        }
+    }
+    for (int i = 0; i < live.nr_iv; i++) {
+        struct interval *iv = live.iv + i;
+        for (int c = 0; c < live.nr_calls; c++)
+            if (iv->start < live.calls[c] && live.calls[c] < iv->end)
+                iv->crosses_call = 1;
+    }
+
+    var_regs = linear_scan(1);
+    for (int i = 0; i < sizeof(temp_reg_order) / sizeof(temp_reg_order[0]); i++)
+        if (!(var_regs & REG_BIT(temp_reg_order[i])))
+            free_temps++;
+    // parameters in %rcx, %rsi or %rdi must not leave fewer temporaries than without them
+    if (free_temps < 3)
+        var_regs = linear_scan(0);
+    return var_regs;
+}
+
+/*
+ * Expression values live on a value stack. An entry is an immediate, a
+ * register-allocated variable (read only), a stack slot of a local, a
+ * temporary register owned by the entry or a temporary spilled to the frame.
+ */
+enum value_kind {
+    VAL_IMM,
+    VAL_VAR,
+    VAL_MEM,
+    VAL_TEMP,
+    VAL_SPILL
+};
+
+struct value {
+    enum value_kind kind;
+    enum reg reg; // VAL_VAR, VAL_TEMP
+    int imm;      // VAL_IMM
+    int slot;     // VAL_SPILL
+    struct mir_operand mem; // VAL_MEM
+};
+
+static struct value *vstack;
+static int vsp, alloc_vstack;
+
+static inline int spill_offset(int slot)
+{
+    return -(fn.locals_size + 8 * (slot + 1));
+}
+
+static int spill_alloc(void)
+{
+    int i, old = fn.alloc_spill;
+
+    for (i = 0; i < fn.alloc_spill; i++)
+        if (!fn.spill_busy[i])
+            break;
+    if (i == fn.alloc_spill) {
+        ALLOC_GROW(fn.spill_busy, i + 1, fn.alloc_spill);
+        memset(fn.spill_busy + old, 0, fn.alloc_spill - old);
+    }
+    fn.spill_busy[i] = 1;
+    if (i + 1 > fn.nr_spill)
+        fn.nr_spill = i + 1;
+    return i;
+}
+
+static struct value *vpush(enum value_kind kind)
+{
+    struct value *v;
+
+    ALLOC_GROW(vstack, vsp + 1, alloc_vstack);
+    v = vstack + vsp++;
+    memset(v, 0, sizeof(*v));
+    v->kind = kind;
+    return v;
+}
+
+static inline struct value *vtop(void)
+{
+    return vstack + vsp - 1;
+}
+
+static inline struct value vpop(void)
+{
+    return vstack[--vsp];
+}
+
+static inline struct mir_insn *emit(enum mir_opcode op, struct mir_operand src, struct mir_operand dst)
+{
+    struct mir_insn *insn = mir_insn_new(op, src, dst);
+
+    list_add_tail(&insn->list, insns);
+    return insn;
+}
+
+static inline void emit_label(int label)
+{
+    emit(MIR_LABEL, mir_label(label), mir_none());
+}
+
+static inline void emit_jmp(enum mir_cond cond, int label)
+{
+    emit(cond ? MIR_JCC : MIR_JMP, mir_label(label), mir_none())->cond = cond;
+}
+
+static void value_spill(struct value *v)
+{
+    int slot = spill_alloc();
+
+    emit(MIR_MOVQ, mir_reg(v->reg), mir_mem(REG_RBP, spill_offset(slot)));
+    if (v->kind == VAL_TEMP)
+        fn.temp_busy &= ~REG_BIT(v->reg);
+    v->kind = VAL_SPILL;
+    v->slot = slot;
+}
+
+static void value_release(struct value *v)
+{
+    if (v->kind == VAL_TEMP)
+        fn.temp_busy &= ~REG_BIT(v->reg);
+    else if (v->kind == VAL_SPILL)
+        fn.spill_busy[v->slot] = 0;
+}
+
+static enum reg temp_alloc(void)
+{
+    unsigned int taken = fn.var_regs | fn.temp_busy;
+    enum reg reg = fn.temp_hint;
+
+    fn.temp_hint = REG_NONE;
+    if (reg != REG_NONE && reg != REG_RDX && !(taken & REG_BIT(reg)))
+        goto found;
+
+    for (int i = 0; i < sizeof(temp_reg_order) / sizeof(temp_reg_order[0]); i++) {
+        reg = temp_reg_order[i];
+        if (!(taken & REG_BIT(reg)))
+            goto found;
+    }
+    // out of registers, spill the oldest temporary on the value stack
+    for (int i = 0; i < vsp; i++) {
+        if (vstack[i].kind == VAL_TEMP) {
+            reg = vstack[i].reg;
+            value_spill(vstack + i);
+            stats.spills++;
+            goto found;
+        }
+    }
+    panic("FIX ME:out of temporary registers\n");
+found:
+    fn.temp_busy |= REG_BIT(reg);
+    if (REG_BIT(reg) & CALLEE_SAVED_REGS)
+        fn.callee_used |= REG_BIT(reg);
+    return reg;
+}
+
+// operand of a value used as a 32-bit source
+static struct mir_operand value_src(struct value *v)
+{
+    switch (v->kind) {
+    case VAL_IMM:
+        return mir_imm(v->imm);
+    case VAL_VAR:
+    case VAL_TEMP:
+        return mir_reg(v->reg);
+    case VAL_SPILL:
+        return mir_mem(REG_RBP, spill_offset(v->slot));
+    case VAL_MEM:
+        break;
+    }
+    return v->mem;
+}
+
+static inline int value_in_reg(struct value *v)
+{
+    return v->kind == VAL_VAR || v->kind == VAL_TEMP;
+}
+
+static inline int value_in_mem(struct value *v)
+{
+    return v->kind == VAL_MEM || v->kind == VAL_SPILL;
+}
+
+// turn the value into a temporary register it owns
+static enum reg value_to_reg(struct value *v)
+{
+    enum reg reg;
+
+    if (v->kind == VAL_TEMP)
+        return v->reg;
+    reg = temp_alloc();
+    if (v->kind == VAL_SPILL) {
+        emit(MIR_MOVQ, mir_mem(REG_RBP, spill_offset(v->slot)), mir_reg(reg));
+        fn.spill_busy[v->slot] = 0;
+    } else
+        emit(MIR_MOVL, value_src(v), mir_reg(reg));
+    v->kind = VAL_TEMP;
+    v->reg = reg;
+    return reg;
+}
+
+/*
+ * Caller-saved registers don't survive a call: move the values below 'top'
+ * that live in them to free callee-saved registers, or spill to the frame.
+ */
+static void save_values_for_call(int top)
+{
+    for (int i = 0; i < top; i++) {
+        struct value *v = vstack + i;
+        unsigned int taken = fn.var_regs | fn.temp_busy;
+        enum reg reg = REG_NONE;
+
+        if (!value_in_reg(v) || (REG_BIT(v->reg) & CALLEE_SAVED_REGS))
+            continue;
+        for (int j = 0; j < sizeof(temp_reg_order) / sizeof(temp_reg_order[0]); j++) {
+            if ((REG_BIT(temp_reg_order[j]) & CALLEE_SAVED_REGS) &&
+                !(taken & REG_BIT(temp_reg_order[j]))) {
+                reg = temp_reg_order[j];
+                break;
+            }
+        }
+        if (reg == REG_NONE) {
+            value_spill(v);
+            continue;
+        }
+        emit(MIR_MOVQ, mir_reg(v->reg), mir_reg(reg));
+        if (v->kind == VAL_TEMP)
+            fn.temp_busy &= ~REG_BIT(v->reg);
+        fn.temp_busy |= REG_BIT(reg);
+        fn.callee_used |= REG_BIT(reg);
+        v->kind = VAL_TEMP;
+        v->reg = reg;
+    }
+}
+
+/*
+ * Values below 'top' must stay in the same place on every path through a
+ * short-circuit expression. Move the ones a call or a spill on only one of
+ * the paths could relocate to the frame first.
+ */
+static void freeze_values(int top)
+{
+    for (int i = 0; i < top; i++) {
+        struct value *v = vstack + i;
+        if (v->kind == VAL_TEMP ||
+            (v->kind == VAL_VAR && !(REG_BIT(v->reg) & CALLEE_SAVED_REGS)))
+            value_spill(v);
+    }
+}
+
+// emit dst[i] = src[i] for all i as if the moves happened at once
+static void parallel_move(enum reg *src, enum reg *dst, int n)
+{
+    int pending = n, i, j;
+
+    while (pending) {
+        int progress = 0;
+        for (i = 0; i < n; i++) {
+            if (dst[i] == REG_NONE)
+                continue;
+            if (src[i] != dst[i]) {
+                for (j = 0; j < n; j++)
+                    if (j != i && dst[j] != REG_NONE && src[j] == dst[i])
+                        break;
+                if (j < n)
+                    continue; // dst[i] is still to be read
+                emit(MIR_MOVQ, mir_reg(src[i]), mir_reg(dst[i]));
+            }
+            dst[i] = REG_NONE;
+            pending--;
+            progress = 1;
+        }
+        if (!progress) { // only cycles are left, break one with %rax
+            enum reg r;
+            for (i = 0; dst[i] == REG_NONE; i++)
+                ;
+            r = src[i];
+            emit(MIR_MOVQ, mir_reg(r), mir_reg(REG_RAX));
+            for (j = 0; j < n; j++)
+                if (dst[j] != REG_NONE && src[j] == r)
+                    src[j] = REG_RAX;
+        }
+    }
+}
+
+// memory operand of element idx + offset of local or global 'sym', 'idx' may be NULL
+static struct mir_operand element_operand(symbol_t *sym, struct value *idx, int offset, enum reg *base)
+{
+    *base = REG_NONE;
+    if (!idx || idx->kind == VAL_IMM) {
+        int disp = ((idx ? idx->imm : 0) + offset) * 4;
+        if (sym->index == 0)
+            return mir_rip(sym->name, disp);
+        return mir_mem(REG_RBP, to_offset(sym->index) + disp);
+    }
+    enum reg r;
+    if (idx->kind == VAL_TEMP)
+        r = idx->reg;
+    else {
+        r = temp_alloc();
+        if (idx->kind == VAL_SPILL)
+            fn.spill_busy[idx->slot] = 0;
+    }
+    emit(MIR_MOVSLQ, value_src(idx), mir_reg(r)); // sign extend the index
+    idx->kind = VAL_TEMP;
+    idx->reg = r;
+    if (sym->index == 0) {
+        *base = temp_alloc();
+        emit(MIR_LEAQ, mir_rip(sym->name, 0), mir_reg(*base)); // Load address of array
+        return mir_mem_index(*base, r, 4, offset * 4);
+    }
+    return mir_mem_index(REG_RBP, r, 4, to_offset(sym->index) + offset * 4);
+}
+
+static void generate_asm(cast_node_t *node, symbol_table_t *symtab);
+
+// store the value on top of the value stack to variable 'sym', element idx + offset of an array
+static void generate_store(symbol_t *sym, struct value *idx, int offset)
+{
+    struct value v = vpop();
+    struct mir_operand dst;
+    enum reg base;
+
+    if (!idx && sym->reg) {
+        if (!(v.kind == VAL_VAR && v.reg == sym->reg))
+            emit(MIR_MOVL, value_src(&v), mir_reg(sym->reg));
+        value_release(&v);
+        return;
+    }
+    if (value_in_mem(&v))
+        value_to_reg(&v); // no memory to memory move
+    dst = element_operand(sym, idx, offset, &base);
+    emit(MIR_MOVL, value_src(&v), dst); // Store value in variable
+    value_release(&v);
+    if (idx)
+        value_release(idx);
+    if (base)
+        fn.temp_busy &= ~REG_BIT(base);
+}
+
+/*
+ * Multiplication by a constant as a short lea/shl/add sequence, which beats
+ * the 3 cycle latency of imull: c = f1 * f2 << shift with lea factors of
+ * 3, 5 or 9, optionally negated, or c = (1 << shift) +- 1.
+ */
+struct mul_plan {
+    int factor[2]; // 1 when unused
+    int shift;
+    int neg;
+    int add; // 1 or -1 for (x << shift) +- x, 0 for the lea form
+};
+
+static int mul_plan(int c, struct mul_plan *p)
+{
+    unsigned int u = c < 0 ? -(unsigned int)c : c;
+    int n = 0;
+
+    memset(p, 0, sizeof(*p));
+    p->factor[0] = p->factor[1] = 1;
+    if (u == 0 || c == (int)0x80000000)
+        return 0;
+    p->neg = c < 0;
+    p->shift = __builtin_ctz(u);
+    u >>= p->shift;
+    while (u != 1 && n < 2) {
+        int f = u % 9 == 0 ? 9 : u % 5 == 0 ? 5 : u % 3 == 0 ? 3 : 0;
+        if (!f)
+            break;
+        p->factor[n++] = f;
+        u /= f;
+    }
+    if (u == 1 && n + (p->shift != 0) + p->neg <= 2) // at most two instructions
+        return 1;
+    memset(p, 0, sizeof(*p));
+    if (c > 0 && __builtin_popcount(c - 1) == 1) {
+        p->shift = __builtin_ctz(c - 1);
+        p->add = 1;
+        return 1;
+    }
+    if (c > 0 && __builtin_popcount(c + 1) == 1) {
+        p->shift = __builtin_ctz(c + 1);
+        p->add = -1;
+        return 1;
+    }
+    return 0;
+}
+
+// dst = src * c for a plan from mul_plan(), 'src' may be 'dst'
+static void emit_mul_const(enum reg src, enum reg dst, struct mul_plan *p)
+{
+    if (p->add) {
+        enum reg x = src;
+        if (src == dst) { // keep a copy of x to add back
+            x = temp_alloc();
+            emit(MIR_MOVL, mir_reg(src), mir_reg(x));
+        } else
+            emit(MIR_MOVL, mir_reg(src), mir_reg(dst));
+        emit(MIR_SHLL, mir_imm(p->shift), mir_reg(dst));
+        emit(p->add > 0 ? MIR_ADDL : MIR_SUBL, mir_reg(x), mir_reg(dst));
+        if (x != src)
+            fn.temp_busy &= ~REG_BIT(x);
+        return;
+    }
+    for (int i = 0; i < 2 && p->factor[i] > 1; i++) {
+        emit(MIR_LEAL, mir_mem_index(src, src, p->factor[i] - 1, 0), mir_reg(dst));
+        src = dst;
+    }
+    if (src != dst)
+        emit(MIR_MOVL, mir_reg(src), mir_reg(dst));
+    if (p->shift)
+        emit(MIR_SHLL, mir_imm(p->shift), mir_reg(dst));
+    if (p->neg)
+        emit(MIR_NEGL, mir_none(), mir_reg(dst));
+}
+
+static enum mir_cond generate_compare(cast_node_t *node, symbol_table_t *symtab);
+
+/*
+ * Jump to 'label' when the truth of condition 'node' equals 'jump_if' and
+ * fall through otherwise. Comparisons become cmp + jcc without materializing
+ * a 0/1 value and && / || short-circuit through chains of jumps, so the right
+ * operand is skipped when the left one decides.
+ */
+static void generate_branch(cast_node_t *node, symbol_table_t *symtab, int label, int jump_if)
+{
+    struct value v;
+
+    if (node->type == CAST_RELATIONAL_EXPR) {
+        enum mir_cond cond = generate_compare(node, symtab);
+        emit_jmp(jump_if ? cond : mir_cond_negate(cond), label);
+        return;
+    }
+    if (node->type == CAST_LOGICAL_EXPR) {
+        int and = node->expr.op.type == TOK_OPERATOR_LOGICAL_AND;
+        if (and != jump_if) { // either operand decides alone
+            generate_branch(node->expr.op.left, symtab, label, jump_if);
+            generate_branch(node->expr.op.right, symtab, label, jump_if);
+        } else {
+            int skip = label_count++;
+            generate_branch(node->expr.op.left, symtab, skip, !jump_if);
+            generate_branch(node->expr.op.right, symtab, label, jump_if);
+            emit_label(skip);
+        }
+        return;
+    }
+    generate_asm(node, symtab);
+    v = vpop();
+    if (v.kind == VAL_IMM) {
+        if (!v.imm == !jump_if)
+            emit_jmp(CC_NONE, label);
+        return;
+    }
+    if (value_in_reg(&v))
+        emit(MIR_TESTL, mir_reg(v.reg), mir_reg(v.reg)); // Test condition
+    else
+        emit(MIR_CMPL, mir_imm(0), value_src(&v));
+    emit_jmp(jump_if ? CC_NE : CC_E, label);
+    value_release(&v);
+}
+
+/*
+ * Magic number M and shift s of signed division by constant d, so that
+ * n / d == mulhs(M, n) (+/- n) >> s, plus one for negative quotients.
+ * See Hacker's Delight, 10-4 Signed Division by Divisors >= 2.
+ */
+static void div_magic(int d, int *magic, int *shift)
+{
+    const unsigned int two31 = 0x80000000;
+    unsigned int ad = d < 0 ? -(unsigned int)d : d;
+    unsigned int t = two31 + ((unsigned int)d >> 31);
+    unsigned int anc = t - 1 - t % ad; // absolute value of nc
+    unsigned int q1 = two31 / anc, r1 = two31 - q1 * anc;
+    unsigned int q2 = two31 / ad, r2 = two31 - q2 * ad;
+    unsigned int delta;
+    int p = 31;
+
+    do {
+        p++;
+        q1 = 2 * q1;
+        r1 = 2 * r1;
+        if (r1 >= anc) {
+            q1++;
+            r1 -= anc;
+        }
+        q2 = 2 * q2;
+        r2 = 2 * r2;
+        if (r2 >= ad) {
+            q2++;
+            r2 -= ad;
+        }
+        delta = ad - r2;
+    } while (q1 < delta || (q1 == delta && r1 == 0));
+    *magic = q2 + 1;
+    if (d < 0)
+        *magic = -*magic;
+    *shift = p - 32;
+}
+
+// whether n / d and n % d can be done without idivl
+static inline int div_by_const_ok(int d)
+{
+    return d != 0 && d != 1 && d != -1 && d != (int)0x80000000;
+}
+
+/*
+ * n / d or n % d for constant d with shifts for powers of two and a
+ * multiply-high by the magic reciprocal otherwise. Only %eax and %edx are
+ * clobbered, returns which of them holds the result. A dividend known to be
+ * 'nonneg' needs no rounding toward zero.
+ */
+static enum reg generate_div_const(struct mir_operand n, int d, int mod, int nonneg)
+{
+    struct mir_operand eax = mir_reg(REG_RAX), edx = mir_reg(REG_RDX);
+    int magic, shift;
+
+    if (d > 0 && !(d & (d - 1))) {
+        int k = __builtin_ctz(d);
+        if (nonneg) { // a mask or a shift
+            emit(MIR_MOVL, n, eax);
+            if (mod)
+                emit(MIR_ANDL, mir_imm(d - 1), eax);
+            else
+                emit(MIR_SHRL, mir_imm(k), eax);
+            return REG_RAX;
+        }
+        // bias negative dividends by d - 1 to round toward zero
+        emit(MIR_MOVL, n, eax);
+        emit(MIR_MOVL, eax, edx);
+        if (k > 1)
+            emit(MIR_SARL, mir_imm(31), edx);
+        emit(MIR_SHRL, mir_imm(32 - k), edx);
+        emit(MIR_ADDL, eax, edx);
+        if (mod) { // n - ((n + bias) & -d)
+            emit(MIR_ANDL, mir_imm(-d), edx);
+            emit(MIR_SUBL, edx, eax);
+            return REG_RAX;
+        }
+        emit(MIR_SARL, mir_imm(k), edx);
+        return REG_RDX;
+    }
+    div_magic(d, &magic, &shift);
+    emit(MIR_MOVSLQ, n, eax);
+    emit(MIR_IMULQ, mir_imm(magic), eax);
+    if ((d > 0 && magic < 0) || (d < 0 && magic > 0)) {
+        emit(MIR_SARQ, mir_imm(32), eax); // high half of the product
+        emit(d > 0 ? MIR_ADDL : MIR_SUBL, n, eax);
+        if (shift)
+            emit(MIR_SARL, mir_imm(shift), eax);
+    } else
+        emit(MIR_SARQ, mir_imm(32 + shift), eax);
+    if (!nonneg || d < 0) { // add one to negative quotients to round toward zero
+        emit(MIR_MOVL, eax, edx);
+        emit(MIR_SHRL, mir_imm(31), edx);
+        emit(MIR_ADDL, edx, eax);
+    }
+    if (!mod)
+        return REG_RAX;
+    emit(MIR_IMULL, mir_imm(d), eax); // n - n / d * d
+    emit(MIR_MOVL, n, edx);
+    emit(MIR_SUBL, eax, edx);
+    return REG_RDX;
+}
+
+/*
+ * Instruction selection by bottom-up rewriting (BURS). Expressions and
+ * assignments are tiled with x86-64 instructions: a first walk labels every
+ * node with the cheapest rule deriving each nonterminal from it, counting
+ * instructions, then the tree is reduced from the nonterminal its user asks
+ * for and the chosen rules emit their code. A rule matches one operator
+ * whose operands are reduced to the given nonterminals first, chain rules
+ * turn one nonterminal into another. Addressing modes, memory operands,
+ * immediates, lea and inc/dec are lines of the table, a new pattern is one
+ * more line and at most one more emitter.
+ *
+ * Reduced operands stay on the value stack until the rule using them runs,
+ * so they are spilled and saved across calls like any other value. Memory
+ * operands holding address registers or reading globals (NT_RMEM) are only
+ * formed when nothing runs between them and their user.
+ */
+enum burs_nt {
+    NT_NONE,  // operand the rule doesn't evaluate
+    NT_STMT,  // assignment done
+    NT_VAL,   // any value
+    NT_SRC,   // value or memory operand as the source of an instruction
+    NT_REG,   // value in a register
+    NT_TEMP,  // value in a temporary register of its own
+    NT_IMM,   // constant
+    NT_MEM,   // slot of the frame, good until popped
+    NT_RMEM,  // memory operand to use right away
+    NT_CC,    // flags of a comparison
+    NT_ADDR,  // base + index * scale + disp, for lea
+    NT_INDEX, // index * 2, 4 or 8
+    NT_BDISP, // base + disp
+    NR_NT
+};
+
+enum burs_op {
+    B_CHAIN,    // a nonterminal
+    B_NUM,
+    B_VAR,
+    B_ELEM,     // array element, the operand is the index
+    B_ADD,
+    B_SUB,
+    B_MUL,
+    B_DIV,
+    B_MOD,
+    B_CMP,
+    B_OTHER,    // calls, && and ||, strings, generate_asm() does them
+    B_ASSIGN,   // the operands are the index of an array element and the value
+    B_ADD_TO,   // x = x + y or x = y + x, the operands are y and x
+    B_SUB_FROM, // x = x - y
+    B_MUL_BY,   // x = x * y or x = y * x
+};
+
+// what an operand was reduced to, taken off the value stack for the rule using it
+struct tile {
+    struct value v[2];
+    int nr;             // values it has on the value stack
+    int base, index;    // NT_ADDR, NT_INDEX, NT_BDISP: 1 + which of v, 0 for none
+    int scale, disp;
+    struct mir_operand mem; // NT_RMEM
+    enum reg held[2];   // index and base register 'mem' needs
+    enum mir_cond cond; // NT_CC
+};
+
+struct burs_rule {
+    const char *name;
+    enum burs_nt lhs;
+    enum burs_op op;
+    enum burs_nt kid[2]; // what the operands are reduced to, the operand for B_CHAIN
+    int cost;
+    int (*cond)(cast_node_t *node); // further constraint on the node, may be NULL
+    void (*emit)(cast_node_t *node, struct tile *kid, struct tile *out);
+};
+
+#define BURS_INF 0x100000
+
+struct burs_state {
+    int cost[NR_NT];
+    const struct burs_rule *rule[NR_NT];
+    int need; // Sethi-Ullman number, registers the evaluation takes
+    int pure; // see is_pure()
+};
+
+static symbol_table_t *burs_symtab; // scope of the tree being selected
+
+static inline symbol_t *burs_sym(char *name)
+{
+    return symbol_table_lookup(burs_symtab, name, 1);
+}
+
+static enum burs_op burs_op(cast_node_t *node)
+{
+    switch (node->type) {
+    case CAST_NUMBER:
+        return B_NUM;
+    case CAST_IDENTIFIER:
+        return node->expr.array_expr ? B_ELEM : B_VAR;
+    case CAST_SIMPLE_EXPR:
+        return node->expr.op.type == TOK_OPERATOR_ADD ? B_ADD : B_SUB;
+    case CAST_TERM:
+        if (node->expr.op.type == TOK_OPERATOR_MUL)
+            return B_MUL;
+        return node->expr.op.type == TOK_OPERATOR_DIV ? B_DIV : B_MOD;
+    case CAST_RELATIONAL_EXPR:
+        return B_CMP;
+    default:
+        return B_OTHER;
+    }
+}
+
+// whether 'e' reads what assignment 'node' writes
+static int is_target(cast_node_t *node, cast_node_t *e)
+{
+    cast_node_t *idx = node->assign_stmt.array_expr;
+
+    if (e->type != CAST_IDENTIFIER || strcmp(e->expr.identifier, node->assign_stmt.identifier))
+        return 0;
+    if (!idx || !e->expr.array_expr)
+        return !idx && !e->expr.array_expr;
+    return same_expr(idx, e->expr.array_expr);
+}
+
+// the operator of an assignment that updates its target in place, or B_ASSIGN
+static enum burs_op burs_update(cast_node_t *node)
+{
+    cast_node_t *e = node->assign_stmt.expr;
+
+    if (e->type == CAST_SIMPLE_EXPR) {
+        int add = e->expr.op.type == TOK_OPERATOR_ADD;
+        if (is_target(node, e->expr.op.left) || (add && is_target(node, e->expr.op.right)))
+            return add ? B_ADD_TO : B_SUB_FROM;
+    } else if (e->type == CAST_TERM && e->expr.op.type == TOK_OPERATOR_MUL) {
+        if (is_target(node, e->expr.op.left) || is_target(node, e->expr.op.right))
+            return B_MUL_BY;
+    }
+    return B_ASSIGN;
+}
+
+// operand 'i' of 'node' matched as 'op', NULL if it has none
+static cast_node_t *burs_kid(cast_node_t *node, enum burs_op op, int i)
+{
+    cast_node_t *e;
+
+    switch (op) {
+    case B_ELEM:
+        return i ? NULL : node->expr.array_expr;
+    case B_ADD:
+    case B_SUB:
+    case B_MUL:
+    case B_DIV:
+    case B_MOD:
+    case B_CMP:
+        return i ? node->expr.op.right : node->expr.op.left;
+    case B_ASSIGN:
+        return i ? node->assign_stmt.expr : node->assign_stmt.array_expr;
+    case B_ADD_TO:
+    case B_SUB_FROM:
+    case B_MUL_BY:
+        e = node->assign_stmt.expr;
+        if (is_target(node, e->expr.op.left))
+            return i ? e->expr.op.left : e->expr.op.right;
+        return i ? e->expr.op.right : e->expr.op.left;
+    default:
+        return NULL;
+    }
+}
+
+/*
+ * Conditions of the rules
+ */
+static int in_reg(cast_node_t *node)
+{
+    return burs_sym(node->expr.identifier)->reg != REG_NONE;
+}
+
+static int in_frame(cast_node_t *node)
+{
+    symbol_t *sym = burs_sym(node->expr.identifier);
+
+    return !sym->reg && sym->index;
+}
+
+static int is_local(cast_node_t *node)
+{
+    return burs_sym(node->expr.identifier)->index != 0;
+}
+
+static int is_global(cast_node_t *node)
+{
+    return burs_sym(node->expr.identifier)->index == 0;
+}
+
+static inline int is_num_node(cast_node_t *node, int *val)
+{
+    if (node->type != CAST_NUMBER)
+        return 0;
+    *val = node->expr.num;
+    return 1;
+}
+
+// a[i +- c] with the offset small enough to go into the displacement
+static int near_offset(cast_node_t *node)
+{
+    cast_node_t *idx = node->expr.array_expr;
+    int c;
+
+    return idx->type == CAST_SIMPLE_EXPR && is_num_node(idx->expr.op.right, &c) &&
+           c > -0x100000 && c < 0x100000;
+}
+
+static int local_offset(cast_node_t *node)
+{
+    return is_local(node) && near_offset(node);
+}
+
+static int global_offset(cast_node_t *node)
+{
+    return is_global(node) && near_offset(node);
+}
+
+static int right_one(cast_node_t *node)
+{
+    int c;
+
+    return is_num_node(node->expr.op.right, &c) && c == 1;
+}
+
+static int left_zero(cast_node_t *node)
+{
+    int c;
+
+    return is_num_node(node->expr.op.left, &c) && c == 0;
+}
+
+// index register scale
+static int right_scale(cast_node_t *node)
+{
+    int c;
+
+    return is_num_node(node->expr.op.right, &c) && (c == 2 || c == 4 || c == 8);
+}
+
+// x * c as (x,x,c-1)
+static int right_lea_factor(cast_node_t *node)
+{
+    int c;
+
+    return is_num_node(node->expr.op.right, &c) && (c == 2 || c == 3 || c == 5 || c == 9);
+}
+
+static int right_pow2(cast_node_t *node)
+{
+    int c;
+
+    return is_num_node(node->expr.op.right, &c) && c > 1 && !(c & (c - 1));
+}
+
+static int right_mul_plan(cast_node_t *node)
+{
+    struct mul_plan p;
+    int c;
+
+    return is_num_node(node->expr.op.right, &c) && mul_plan(c, &p);
+}
+
+static int right_div_const(cast_node_t *node)
+{
+    int c;
+
+    return is_num_node(node->expr.op.right, &c) && div_by_const_ok(c);
+}
+
+// evaluating the right operand can't call anything or need many registers
+static int right_leaf(cast_node_t *node)
+{
+    cast_node_t *r = node->expr.op.right;
+
+    return r->type == CAST_NUMBER || (r->type == CAST_IDENTIFIER && !r->expr.array_expr);
+}
+
+static int to_reg(cast_node_t *node)
+{
+    return !node->assign_stmt.array_expr && burs_sym(node->assign_stmt.identifier)->reg;
+}
+
+static int to_scalar(cast_node_t *node)
+{
+    return !node->assign_stmt.array_expr;
+}
+
+static int to_elem(cast_node_t *node)
+{
+    return node->assign_stmt.array_expr != NULL;
+}
+
+static int to_elem_offset(cast_node_t *node)
+{
+    cast_node_t *idx = node->assign_stmt.array_expr;
+    int c;
+
+    return idx && idx->type == CAST_SIMPLE_EXPR && is_num_node(idx->expr.op.right, &c) &&
+           c > -0x100000 && c < 0x100000;
+}
+
+static int update_reg(cast_node_t *node)
+{
+    return to_reg(node);
+}
+
+static int update_reg_one(cast_node_t *node)
+{
+    int c;
+
+    return to_reg(node) && is_num_node(burs_kid(node, burs_update(node), 0), &c) && c == 1;
+}
+
+static int update_reg_plan(cast_node_t *node)
+{
+    struct mul_plan p;
+    int c;
+
+    return to_reg(node) && is_num_node(burs_kid(node, B_MUL_BY, 0), &c) && mul_plan(c, &p);
+}
+
+// memory is only read once, so nothing may run that could change it
+static int update_mem(cast_node_t *node)
+{
+    return !to_reg(node) && is_pure(node->assign_stmt.expr) &&
+           (!node->assign_stmt.array_expr || is_pure(node->assign_stmt.array_expr));
+}
+
+static int update_mem_one(cast_node_t *node)
+{
+    int c;
+
+    return update_mem(node) && is_num_node(burs_kid(node, burs_update(node), 0), &c) && c == 1;
+}
+
+/*
+ * Emitters of the rules
+ */
+static struct value *out_push(struct tile *out, enum value_kind kind)
+{
+    out->nr++;
+    return vpush(kind);
+}
+
+static void tile_push(struct tile *t)
+{
+    for (int i = 0; i < t->nr; i++)
+        *vpush(t->v[i].kind) = t->v[i];
+}
+
+static void tile_release(struct tile *t)
+{
+    for (int i = 0; i < t->nr; i++)
+        value_release(&t->v[i]);
+    for (int i = 0; i < 2; i++)
+        if (t->held[i])
+            fn.temp_busy &= ~REG_BIT(t->held[i]);
+}
+
+static inline int tile_is_imm(struct tile *t)
+{
+    return t->nr && t->v[0].kind == VAL_IMM;
+}
+
+static inline int tile_in_mem(struct tile *t)
+{
+    return !t->nr || value_in_mem(&t->v[0]);
+}
+
+// the operand of a value or memory tile
+static struct mir_operand tile_operand(struct tile *t)
+{
+    if (t->nr)
+        return value_src(&t->v[0]);
+    stats.mem_operands++;
+    return t->mem;
+}
+
+// turn a value or memory tile into a temporary register it owns
+static enum reg tile_to_temp(struct tile *t)
+{
+    enum reg reg;
+
+    if (t->nr)
+        return value_to_reg(&t->v[0]);
+    reg = t->held[0] ? t->held[0] : temp_alloc(); // the index register takes the element
+    emit(MIR_MOVL, t->mem, mir_reg(reg));
+    if (t->held[1])
+        fn.temp_busy &= ~REG_BIT(t->held[1]);
+    memset(t, 0, sizeof(*t));
+    t->nr = 1;
+    t->v[0].kind = VAL_TEMP;
+    t->v[0].reg = reg;
+    return reg;
+}
+
+// the lea operand of an address tile, with its registers loaded
+static struct mir_operand lea_operand(struct tile *t)
+{
+    for (int i = 0; i < t->nr; i++)
+        if (!value_in_reg(&t->v[i]))
+            value_to_reg(&t->v[i]);
+    return mir_mem_index(t->base ? t->v[t->base - 1].reg : REG_NONE,
+                         t->index ? t->v[t->index - 1].reg : REG_NONE, t->scale, t->disp);
+}
+
+static void emit_same(cast_node_t *node, struct tile *k, struct tile *out)
+{
+    *out = *k;
+    tile_push(k);
+}
+
+static void emit_mem(cast_node_t *node, struct tile *k, struct tile *out)
+{
+    out->mem = k->v[0].mem;
+}
+
+static void emit_temp(cast_node_t *node, struct tile *k, struct tile *out)
+{
+    tile_to_temp(k);
+    *out_push(out, VAL_TEMP) = k->v[0];
+}
+
+static void emit_lea(cast_node_t *node, struct tile *k, struct tile *out)
+{
+    struct mir_operand addr = lea_operand(k);
+    enum reg dst = REG_NONE;
+
+    for (int i = 0; i < k->nr && !dst; i++)
+        if (k->v[i].kind == VAL_TEMP)
+            dst = k->v[i].reg;
+    if (!dst)
+        dst = temp_alloc();
+    emit(MIR_LEAL, addr, mir_reg(dst));
+    for (int i = 0; i < k->nr; i++)
+        if (!(k->v[i].kind == VAL_TEMP && k->v[i].reg == dst))
+            value_release(&k->v[i]);
+    out_push(out, VAL_TEMP)->reg = dst;
+    stats.lea++;
+}
+
+static void emit_set(cast_node_t *node, struct tile *k, struct tile *out)
+{
+    enum reg reg = temp_alloc();
+
+    out_push(out, VAL_TEMP)->reg = reg;
+    emit(MIR_SET, mir_none(), mir_reg(reg))->cond = k->cond;
+    emit(MIR_MOVZBL, mir_reg(reg), mir_reg(reg)); // Zero extend
+}
+
+static void emit_num(cast_node_t *node, struct tile *k, struct tile *out)
+{
+    out_push(out, VAL_IMM)->imm = node->expr.num;
+}
+
+static void emit_var(cast_node_t *node, struct tile *k, struct tile *out)
+{
+    symbol_t *sym = burs_sym(node->expr.identifier);
+
+    if (sym->reg)
+        out_push(out, VAL_VAR)->reg = sym->reg;
+    else if (sym->index) // Local variable in the stack frame
+        out_push(out, VAL_MEM)->mem = mir_mem(REG_RBP, to_offset(sym->index));
+    else // Global variable, read where it is used
+        out->mem = mir_rip(sym->name, 0);
+}
+
+// constant index into a local array
+static void emit_elem_mem(cast_node_t *node, struct tile *k, struct tile *out)
+{
+    enum reg base;
+
+    out_push(out, VAL_MEM)->mem = element_operand(burs_sym(node->expr.identifier), &k->v[0], 0, &base);
+}
+
+static void emit_elem(cast_node_t *node, struct tile *k, struct tile *out)
+{
+    struct value idx = k->v[0];
+
+    out->mem = element_operand(burs_sym(node->expr.identifier), &idx, k->disp, &out->held[1]);
+    if (idx.kind == VAL_TEMP)
+        out->held[0] = idx.reg;
+}
+
+static void emit_other(cast_node_t *node, struct tile *k, struct tile *out)
+{
+    generate_asm(node, burs_symtab);
+    out->nr = 1;
+}
+
+static enum mir_opcode alu_opcode(cast_node_t *node)
+{
+    if (node->type == CAST_TERM)
+        return MIR_IMULL;
+    return node->expr.op.type == TOK_OPERATOR_ADD ? MIR_ADDL : MIR_SUBL;
+}
+
+// left = left op right
+static void emit_binary(cast_node_t *node, struct tile *k, struct tile *out)
+{
+    enum reg reg = tile_to_temp(&k[0]);
+
+    emit(alu_opcode(node), tile_operand(&k[1]), mir_reg(reg));
+    tile_release(&k[1]);
+    *out_push(out, VAL_TEMP) = k[0].v[0];
+}
+
+// right = left op right, for commutative op
+static void emit_binary_swap(cast_node_t *node, struct tile *k, struct tile *out)
+{
+    enum reg reg = tile_to_temp(&k[1]);
+
+    emit(alu_opcode(node), value_src(&k[0].v[0]), mir_reg(reg));
+    tile_release(&k[0]);
+    *out_push(out, VAL_TEMP) = k[1].v[0];
+}
+
+static void emit_incdec(cast_node_t *node, struct tile *k, struct tile *out)
+{
+    enum reg reg = tile_to_temp(&k[0]);
+
+    emit(node->expr.op.type == TOK_OPERATOR_ADD ? MIR_INCL : MIR_DECL, mir_none(), mir_reg(reg));
+    *out_push(out, VAL_TEMP) = k[0].v[0];
+}
+
+static void emit_neg(cast_node_t *node, struct tile *k, struct tile *out)
+{
+    enum reg reg = tile_to_temp(&k[1]);
+
+    emit(MIR_NEGL, mir_none(), mir_reg(reg));
+    *out_push(out, VAL_TEMP) = k[1].v[0];
+}
+
+// sum of the operands as an address, registers become base or index, constants displacement
+static void emit_address(cast_node_t *node, struct tile *k, struct tile *out)
+{
+    int sub = node->expr.op.type == TOK_OPERATOR_SUB;
+
+    for (int i = 0; i < 2; i++) {
+        struct tile *t = &k[i];
+        int pos = out->nr;
+        if (tile_is_imm(t)) {
+            unsigned int d = t->v[0].imm;
+            out->disp = (unsigned int)out->disp + (sub ? -d : d);
+            continue;
+        }
+        if (!t->base && !t->index) // a register
+            t->base = 1;
+        for (int j = 0; j < t->nr; j++)
+            *out_push(out, t->v[j].kind) = t->v[j];
+        out->disp = (unsigned int)out->disp + t->disp;
+        if (t->base && !out->base) {
+            out->base = pos + t->base;
+        } else if (t->base) {
+            out->index = pos + t->base;
+            out->scale = 1;
+        }
+        if (t->index) {
+            out->index = pos + t->index;
+            out->scale = t->scale;
+        }
+    }
+}
+
+static void emit_index(cast_node_t *node, struct tile *k, struct tile *out)
+{
+    *out_push(out, k[0].v[0].kind) = k[0].v[0];
+    out->index = 1;
+    out->scale = k[1].v[0].imm;
+}
+
+static void emit_lea_factor(cast_node_t *node, struct tile *k, struct tile *out)
+{
+    *out_push(out, k[0].v[0].kind) = k[0].v[0];
+    out->base = out->index = 1;
+    out->scale = k[1].v[0].imm - 1;
+}
+
+// x * c by shifts, adds and lea, see mul_plan()
+static void emit_mul_imm(cast_node_t *node, struct tile *k, struct tile *out)
+{
+    struct value *l = &k[0].v[0];
+    struct mul_plan p;
+    enum reg dst;
+
+    mul_plan(k[1].v[0].imm, &p);
+    if (!value_in_reg(l))
+        value_to_reg(l);
+    dst = l->kind == VAL_TEMP ? l->reg : temp_alloc();
+    emit_mul_const(l->reg, dst, &p);
+    out_push(out, VAL_TEMP)->reg = dst;
+}
+
+static void emit_div(cast_node_t *node, struct tile *k, struct tile *out)
+{
+    int mod = node->expr.op.type == TOK_OPERATOR_MOD;
+    struct value_range *ln = node->expr.op.left->range, *rn = node->expr.op.right->range;
+    int nonneg = ln && ln->lo >= 0;
+    struct value *l = &k[0].v[0];
+    enum reg res;
+
+    if (l->kind == VAL_IMM)
+        value_to_reg(l);
+    if (tile_is_imm(&k[1]) && div_by_const_ok(k[1].v[0].imm)) {
+        res = generate_div_const(value_src(l), k[1].v[0].imm, mod, nonneg);
+    } else {
+        if (tile_is_imm(&k[1]))
+            tile_to_temp(&k[1]); // idivl takes no immediate
+        emit(MIR_MOVL, value_src(l), mir_reg(REG_RAX));
+        if (nonneg && rn && rn->lo > 0) { // both positive, divide unsigned
+            emit(MIR_MOVL, mir_imm(0), mir_reg(REG_RDX));
+            emit(MIR_DIVL, tile_operand(&k[1]), mir_none());
+        } else {
+            emit(MIR_CLTD, mir_none(), mir_none()); // Sign extend %eax to %edx:%eax
+            emit(MIR_IDIVL, tile_operand(&k[1]), mir_none());
+        }
+        res = mod ? REG_RDX : REG_RAX; // remainder or quotient
+    }
+    tile_release(&k[1]);
+    if (l->kind != VAL_TEMP) {
+        value_release(l);
+        l->kind = VAL_TEMP;
+        l->reg = temp_alloc();
+    }
+    emit(MIR_MOVL, mir_reg(res), mir_reg(l->reg));
+    *out_push(out, VAL_TEMP) = *l;
+}
+
+static enum mir_cond relational_cond(cast_node_t *node)
+{
+    switch (node->expr.op.type) {
+    case TOK_OPERATOR_LESS_THAN:
+        return CC_L;
+    case TOK_OPERATOR_GREATER_THAN:
+        return CC_G;
+    case TOK_OPERATOR_LESS_THAN_OR_EQUAL_TO:
+        return CC_LE;
+    case TOK_OPERATOR_GREATER_THAN_OR_EQUAL_TO:
+        return CC_GE;
+    case TOK_OPERATOR_EQUAL:
+        return CC_E;
+    case TOK_OPERATOR_NOT_EQUAL:
+        return CC_NE;
+    default:
+        panic("Invalid relational operator\n");
+    }
+}
+
+static void emit_compare(cast_node_t *node, struct tile *k, struct tile *out)
+{
+    struct tile *l = &k[0], *r = &k[1];
+
+    out->cond = relational_cond(node);
+    if (tile_is_imm(l) && !tile_is_imm(r)) { // compare against the immediate instead
+        l = &k[1];
+        r = &k[0];
+        out->cond = mir_cond_swap(out->cond);
+    }
+    if (tile_is_imm(l) || (tile_in_mem(l) && tile_in_mem(r)))
+        tile_to_temp(l);
+    emit(MIR_CMPL, tile_operand(r), tile_operand(l));
+    tile_release(r);
+    tile_release(l);
+}
+
+// target of an update, the register variable or the memory operand
+static struct mir_operand update_target(cast_node_t *node, struct tile *k)
+{
+    if (k[1].mem.kind == OPND_NONE)
+        return mir_reg(burs_sym(node->assign_stmt.identifier)->reg);
+    stats.mem_updates++;
+    if (tile_in_mem(&k[0]))
+        tile_to_temp(&k[0]); // no memory to memory operation
+    return k[1].mem;
+}
+
+static void emit_update(cast_node_t *node, struct tile *k, struct tile *out)
+{
+    struct mir_operand dst = update_target(node, k);
+    enum burs_op op = burs_update(node);
+
+    emit(op == B_ADD_TO ? MIR_ADDL : op == B_SUB_FROM ? MIR_SUBL : MIR_IMULL, tile_operand(&k[0]), dst);
+    tile_release(&k[0]);
+    tile_release(&k[1]);
+}
+
+static void emit_update_one(cast_node_t *node, struct tile *k, struct tile *out)
+{
+    struct mir_operand dst = update_target(node, k);
+
+    emit(burs_update(node) == B_ADD_TO ? MIR_INCL : MIR_DECL, mir_none(), dst);
+    tile_release(&k[1]);
+}
+
+static void emit_update_plan(cast_node_t *node, struct tile *k, struct tile *out)
+{
+    enum reg reg = burs_sym(node->assign_stmt.identifier)->reg;
+    struct mul_plan p;
+
+    mul_plan(k[0].v[0].imm, &p);
+    emit_mul_const(reg, reg, &p);
+}
+
+static void emit_assign(cast_node_t *node, struct tile *k, struct tile *out)
+{
+    symbol_t *sym = burs_sym(node->assign_stmt.identifier);
+    struct tile *v = &k[1];
+
+    if (v->base || v->index) { // lea right into the register variable
+        emit(MIR_LEAL, lea_operand(v), mir_reg(sym->reg));
+        tile_release(v);
+        stats.lea++;
+    } else if (!v->nr) { // so is the load
+        emit(MIR_MOVL, tile_operand(v), mir_reg(sym->reg));
+        tile_release(v);
+    } else {
+        *vpush(v->v[0].kind) = v->v[0];
+        generate_store(sym, node->assign_stmt.array_expr ? &k[0].v[0] : NULL, k[0].disp);
+    }
+}
+
+/*
+ * The rules. Costs count instructions, the first of equally cheap rules
+ * wins. Rules for registers come before those for memory because register
+ * variables have no address and the NT_RMEM ones must read memory last.
+ */
+static const struct burs_rule burs_rules[] = {
+    // leaves
+    { "imm: NUM", NT_IMM, B_NUM, { NT_NONE }, 0, NULL, emit_num },
+    { "reg: VAR", NT_REG, B_VAR, { NT_NONE }, 0, in_reg, emit_var },
+    { "mem: VAR", NT_MEM, B_VAR, { NT_NONE }, 0, in_frame, emit_var },
+    { "rmem: VAR", NT_RMEM, B_VAR, { NT_NONE }, 0, is_global, emit_var },
+    { "mem: ELEM(imm)", NT_MEM, B_ELEM, { NT_IMM }, 0, is_local, emit_elem_mem },
+    { "rmem: ELEM(imm)", NT_RMEM, B_ELEM, { NT_IMM }, 0, is_global, emit_elem },
+    { "rmem: ELEM(bdisp)", NT_RMEM, B_ELEM, { NT_BDISP }, 1, local_offset, emit_elem },
+    { "rmem: ELEM(bdisp)", NT_RMEM, B_ELEM, { NT_BDISP }, 2, global_offset, emit_elem },
+    { "rmem: ELEM(val)", NT_RMEM, B_ELEM, { NT_VAL }, 1, is_local, emit_elem },
+    { "rmem: ELEM(val)", NT_RMEM, B_ELEM, { NT_VAL }, 2, is_global, emit_elem },
+    { "temp: OTHER", NT_TEMP, B_OTHER, { NT_NONE }, 1, NULL, emit_other },
+    // arithmetic
+    { "temp: ADD(temp, 1)", NT_TEMP, B_ADD, { NT_TEMP, NT_IMM }, 1, right_one, emit_incdec },
+    { "temp: ADD(temp, src)", NT_TEMP, B_ADD, { NT_TEMP, NT_SRC }, 1, NULL, emit_binary },
+    { "temp: ADD(val, temp)", NT_TEMP, B_ADD, { NT_VAL, NT_TEMP }, 1, NULL, emit_binary_swap },
+    { "bdisp: ADD(reg, imm)", NT_BDISP, B_ADD, { NT_REG, NT_IMM }, 0, NULL, emit_address },
+    { "addr: ADD(reg, reg)", NT_ADDR, B_ADD, { NT_REG, NT_REG }, 0, NULL, emit_address },
+    { "addr: ADD(reg, index)", NT_ADDR, B_ADD, { NT_REG, NT_INDEX }, 0, NULL, emit_address },
+    { "addr: ADD(index, reg)", NT_ADDR, B_ADD, { NT_INDEX, NT_REG }, 0, NULL, emit_address },
+    { "addr: ADD(bdisp, reg)", NT_ADDR, B_ADD, { NT_BDISP, NT_REG }, 0, NULL, emit_address },
+    { "addr: ADD(bdisp, index)", NT_ADDR, B_ADD, { NT_BDISP, NT_INDEX }, 0, NULL, emit_address },
+    { "addr: ADD(addr, imm)", NT_ADDR, B_ADD, { NT_ADDR, NT_IMM }, 0, NULL, emit_address },
+    { "temp: SUB(temp, 1)", NT_TEMP, B_SUB, { NT_TEMP, NT_IMM }, 1, right_one, emit_incdec },
+    { "temp: SUB(0, temp)", NT_TEMP, B_SUB, { NT_IMM, NT_TEMP }, 1, left_zero, emit_neg },
+    { "temp: SUB(temp, src)", NT_TEMP, B_SUB, { NT_TEMP, NT_SRC }, 1, NULL, emit_binary },
+    { "bdisp: SUB(reg, imm)", NT_BDISP, B_SUB, { NT_REG, NT_IMM }, 0, NULL, emit_address },
+    { "addr: SUB(addr, imm)", NT_ADDR, B_SUB, { NT_ADDR, NT_IMM }, 0, NULL, emit_address },
+    { "index: MUL(reg, imm)", NT_INDEX, B_MUL, { NT_REG, NT_IMM }, 0, right_scale, emit_index },
+    { "addr: MUL(reg, imm)", NT_ADDR, B_MUL, { NT_REG, NT_IMM }, 0, right_lea_factor, emit_lea_factor },
+    { "temp: MUL(temp, imm)", NT_TEMP, B_MUL, { NT_TEMP, NT_IMM }, 1, right_pow2, emit_mul_imm },
+    { "temp: MUL(reg, imm)", NT_TEMP, B_MUL, { NT_REG, NT_IMM }, 2, right_mul_plan, emit_mul_imm },
+    { "temp: MUL(temp, src)", NT_TEMP, B_MUL, { NT_TEMP, NT_SRC }, 3, NULL, emit_binary },
+    { "temp: MUL(val, temp)", NT_TEMP, B_MUL, { NT_VAL, NT_TEMP }, 3, NULL, emit_binary_swap },
+    { "temp: DIV(val, imm)", NT_TEMP, B_DIV, { NT_VAL, NT_IMM }, 4, right_div_const, emit_div },
+    { "temp: DIV(val, src)", NT_TEMP, B_DIV, { NT_VAL, NT_SRC }, 20, NULL, emit_div },
+    { "temp: MOD(val, imm)", NT_TEMP, B_MOD, { NT_VAL, NT_IMM }, 5, right_div_const, emit_div },
+    { "temp: MOD(val, src)", NT_TEMP, B_MOD, { NT_VAL, NT_SRC }, 20, NULL, emit_div },
+    // comparisons
+    { "cc: CMP(reg, src)", NT_CC, B_CMP, { NT_REG, NT_SRC }, 1, NULL, emit_compare },
+    { "cc: CMP(mem, reg)", NT_CC, B_CMP, { NT_MEM, NT_REG }, 1, NULL, emit_compare },
+    { "cc: CMP(mem, imm)", NT_CC, B_CMP, { NT_MEM, NT_IMM }, 1, NULL, emit_compare },
+    { "cc: CMP(imm, reg)", NT_CC, B_CMP, { NT_IMM, NT_REG }, 1, NULL, emit_compare },
+    { "cc: CMP(imm, mem)", NT_CC, B_CMP, { NT_IMM, NT_MEM }, 1, NULL, emit_compare },
+    { "cc: CMP(imm, rmem)", NT_CC, B_CMP, { NT_IMM, NT_RMEM }, 1, NULL, emit_compare },
+    { "cc: CMP(rmem, imm)", NT_CC, B_CMP, { NT_RMEM, NT_IMM }, 1, NULL, emit_compare },
+    { "cc: CMP(rmem, reg)", NT_CC, B_CMP, { NT_RMEM, NT_REG }, 1, right_leaf, emit_compare },
+    { "cc: CMP(val, val)", NT_CC, B_CMP, { NT_VAL, NT_VAL }, 2, NULL, emit_compare },
+    // assignments
+    { "stmt: ADD_TO(1, reg)", NT_STMT, B_ADD_TO, { NT_IMM, NT_NONE }, 1, update_reg_one, emit_update_one },
+    { "stmt: ADD_TO(src, reg)", NT_STMT, B_ADD_TO, { NT_SRC, NT_NONE }, 1, update_reg, emit_update },
+    { "stmt: ADD_TO(1, rmem)", NT_STMT, B_ADD_TO, { NT_IMM, NT_RMEM }, 1, update_mem_one, emit_update_one },
+    { "stmt: ADD_TO(imm, rmem)", NT_STMT, B_ADD_TO, { NT_IMM, NT_RMEM }, 1, update_mem, emit_update },
+    { "stmt: ADD_TO(reg, rmem)", NT_STMT, B_ADD_TO, { NT_REG, NT_RMEM }, 1, update_mem, emit_update },
+    { "stmt: SUB_FROM(1, reg)", NT_STMT, B_SUB_FROM, { NT_IMM, NT_NONE }, 1, update_reg_one, emit_update_one },
+    { "stmt: SUB_FROM(src, reg)", NT_STMT, B_SUB_FROM, { NT_SRC, NT_NONE }, 1, update_reg, emit_update },
+    { "stmt: SUB_FROM(1, rmem)", NT_STMT, B_SUB_FROM, { NT_IMM, NT_RMEM }, 1, update_mem_one, emit_update_one },
+    { "stmt: SUB_FROM(imm, rmem)", NT_STMT, B_SUB_FROM, { NT_IMM, NT_RMEM }, 1, update_mem, emit_update },
+    { "stmt: SUB_FROM(reg, rmem)", NT_STMT, B_SUB_FROM, { NT_REG, NT_RMEM }, 1, update_mem, emit_update },
+    { "stmt: MUL_BY(imm, reg)", NT_STMT, B_MUL_BY, { NT_IMM, NT_NONE }, 2, update_reg_plan, emit_update_plan },
+    { "stmt: MUL_BY(src, reg)", NT_STMT, B_MUL_BY, { NT_SRC, NT_NONE }, 3, update_reg, emit_update },
+    { "stmt: ASSIGN(addr)", NT_STMT, B_ASSIGN, { NT_NONE, NT_ADDR }, 1, to_reg, emit_assign },
+    { "stmt: ASSIGN(rmem)", NT_STMT, B_ASSIGN, { NT_NONE, NT_RMEM }, 1, to_reg, emit_assign },
+    { "stmt: ASSIGN(val)", NT_STMT, B_ASSIGN, { NT_NONE, NT_VAL }, 1, to_scalar, emit_assign },
+    { "stmt: ASSIGN(bdisp, val)", NT_STMT, B_ASSIGN, { NT_BDISP, NT_VAL }, 1, to_elem_offset, emit_assign },
+    { "stmt: ASSIGN(val, val)", NT_STMT, B_ASSIGN, { NT_VAL, NT_VAL }, 1, to_elem, emit_assign },
+    // conversions
+    { "val: reg", NT_VAL, B_CHAIN, { NT_REG }, 0, NULL, emit_same },
+    { "val: mem", NT_VAL, B_CHAIN, { NT_MEM }, 0, NULL, emit_same },
+    { "val: imm", NT_VAL, B_CHAIN, { NT_IMM }, 0, NULL, emit_same },
+    { "reg: temp", NT_REG, B_CHAIN, { NT_TEMP }, 0, NULL, emit_same },
+    { "src: val", NT_SRC, B_CHAIN, { NT_VAL }, 0, NULL, emit_same },
+    { "src: rmem", NT_SRC, B_CHAIN, { NT_RMEM }, 0, NULL, emit_same },
+    { "rmem: mem", NT_RMEM, B_CHAIN, { NT_MEM }, 0, NULL, emit_mem },
+    { "addr: index", NT_ADDR, B_CHAIN, { NT_INDEX }, 0, NULL, emit_same },
+    { "addr: bdisp", NT_ADDR, B_CHAIN, { NT_BDISP }, 0, NULL, emit_same },
+    { "temp: reg", NT_TEMP, B_CHAIN, { NT_REG }, 1, NULL, emit_temp },
+    { "temp: mem", NT_TEMP, B_CHAIN, { NT_MEM }, 1, NULL, emit_temp },
+    { "temp: imm", NT_TEMP, B_CHAIN, { NT_IMM }, 1, NULL, emit_temp },
+    { "temp: rmem", NT_TEMP, B_CHAIN, { NT_RMEM }, 1, NULL, emit_temp },
+    { "temp: addr", NT_TEMP, B_CHAIN, { NT_ADDR }, 1, NULL, emit_lea },
+    { "temp: cc", NT_TEMP, B_CHAIN, { NT_CC }, 2, NULL, emit_set },
+};
+
+#define NR_BURS_RULES (sizeof(burs_rules) / sizeof(burs_rules[0]))
+
+/*
+ * Registers the evaluation of expression 'node' takes, its operands labelled
+ * already. An operation whose operands need as much takes one more to keep
+ * the first operand while the second is evaluated, otherwise the operand
+ * needing more goes first and the other one fits into what it leaves.
+ */
+static int burs_need(cast_node_t *node, enum burs_op op)
+{
+    cast_node_t *l = burs_kid(node, op, 0), *r = burs_kid(node, op, 1);
+    int nl, nr;
+
+    switch (op) {
+    case B_ELEM: // index, plus the address of a global array
+        nl = l->state->need;
+        nr = 1 + is_global(node);
+        return nl > nr ? nl : nr;
+    case B_ADD:
+    case B_SUB:
+    case B_MUL:
+    case B_DIV:
+    case B_MOD:
+    case B_CMP:
+        nl = l->state->need;
+        nr = r->state->need;
+        if (nl == nr)
+            return nl + 1;
+        return nl > nr ? nl : nr;
+    default:
+        return 1;
+    }
+}
+
+// find the cheapest rule for every nonterminal of 'node' and its operands
+static void burs_label(cast_node_t *node)
+{
+    enum burs_op ops[2] = { burs_op(node) };
+    int nr_ops = 1, changed;
+    struct burs_state *s;
+
+    if (node->type == CAST_ASSIGN_STMT) { // also try to update the target in place
+        ops[0] = B_ASSIGN;
+        ops[1] = burs_update(node);
+        nr_ops = 1 + (ops[1] != B_ASSIGN);
+    }
+    for (int o = 0; o < nr_ops; o++) {
+        for (int i = 0; i < 2; i++) {
+            cast_node_t *kid = burs_kid(node, ops[o], i);
+            if (kid)
+                burs_label(kid);
+        }
+    }
+    if (!node->state)
+        node->state = zalloc(sizeof(struct burs_state));
+    s = node->state;
+    s->need = burs_need(node, ops[0]);
+    switch (ops[0]) {
+    case B_NUM:
+    case B_VAR:
+        s->pure = 1;
+        break;
+    case B_ELEM:
+        s->pure = node->expr.array_expr->state->pure;
+        break;
+    case B_OTHER:
+    case B_ASSIGN:
+        s->pure = is_pure(node);
+        break;
+    default:
+        s->pure = node->expr.op.left->state->pure && node->expr.op.right->state->pure;
+        break;
+    }
+    for (int nt = 0; nt < NR_NT; nt++) {
+        s->cost[nt] = BURS_INF;
+        s->rule[nt] = NULL;
+    }
+    for (const struct burs_rule *r = burs_rules; r < burs_rules + NR_BURS_RULES; r++) {
+        int cost = r->cost, o;
+        if (r->op == B_CHAIN)
+            continue;
+        for (o = 0; o < nr_ops && ops[o] != r->op; o++)
+            ;
+        if (o == nr_ops || (r->cond && !r->cond(node)))
+            continue;
+        for (int i = 0; i < 2; i++) {
+            cast_node_t *kid = burs_kid(node, r->op, i);
+            if (r->kid[i] != NT_NONE)
+                cost += kid ? kid->state->cost[r->kid[i]] : BURS_INF;
+        }
+        if (cost < s->cost[r->lhs]) {
+            s->cost[r->lhs] = cost;
+            s->rule[r->lhs] = r;
+        }
+    }
+    do {
+        changed = 0;
+        for (const struct burs_rule *r = burs_rules; r < burs_rules + NR_BURS_RULES; r++) {
+            if (r->op == B_CHAIN && s->cost[r->kid[0]] + r->cost < s->cost[r->lhs]) {
+                s->cost[r->lhs] = s->cost[r->kid[0]] + r->cost;
+                s->rule[r->lhs] = r;
+                changed = 1;
+            }
+        }
+    } while (changed);
+}
+
+// whether deriving 'nt' from 'node' holds registers that aren't on the value stack
+static int burs_holds(cast_node_t *node, enum burs_nt nt)
+{
+    const struct burs_rule *r = node->state->rule[nt];
+
+    while (r && r->op == B_CHAIN)
+        r = node->state->rule[r->kid[0]];
+    return r && r->lhs == NT_RMEM && r->op == B_ELEM && r->kid[0] != NT_IMM;
+}
+
+/*
+ * Which operand of rule 'r' matching 'node' to evaluate first, 1 for the
+ * right one when it needs more registers. Only pure operands can swap, and
+ * not when the right one would hold address registers meanwhile.
+ */
+static int burs_first(cast_node_t *node, const struct burs_rule *r)
+{
+    cast_node_t *l, *k;
+
+    if (r->op == B_CHAIN || r->kid[0] == NT_NONE || r->kid[1] == NT_NONE)
+        return 0;
+    l = burs_kid(node, r->op, 0);
+    k = burs_kid(node, r->op, 1);
+    if (k->state->need <= l->state->need || !l->state->pure || !k->state->pure ||
+        burs_holds(k, r->kid[1]))
+        return 0;
+    stats.reordered++;
+    return 1;
+}
+
+// emit the code of the rules deriving 'nt' from 'node', operands first
+static void burs_reduce(cast_node_t *node, enum burs_nt nt, struct tile *out)
+{
+    const struct burs_rule *r = node->state->rule[nt];
+    struct tile kid[2];
+    int first;
+
+    if (!r)
+        panic("FIX ME:no instruction pattern at line %d\n", node->line_number);
+    memset(kid, 0, sizeof(kid));
+    memset(out, 0, sizeof(*out));
+    first = burs_first(node, r);
+    if (r->op == B_CHAIN) {
+        burs_reduce(node, r->kid[0], &kid[0]);
+    } else {
+        for (int i = 0; i < 2; i++)
+            if (r->kid[i ^ first] != NT_NONE)
+                burs_reduce(burs_kid(node, r->op, i ^ first), r->kid[i ^ first], &kid[i ^ first]);
+    }
+    for (int i = 1; i >= 0; i--)
+        for (int j = kid[i ^ first].nr - 1; j >= 0; j--)
+            kid[i ^ first].v[j] = vpop();
+    tc_debug(0, "select %s\n", r->name);
+    r->emit(node, kid, out);
+}
+
+// push the value of expression 'node'
+static void select_expr(cast_node_t *node, symbol_table_t *symtab)
+{
+    struct tile t;
+
+    burs_symtab = symtab;
+    burs_label(node);
+    burs_reduce(node, NT_VAL, &t);
+}
+
+// compare the operands of relational expression 'node' and return the condition to test
+static enum mir_cond generate_compare(cast_node_t *node, symbol_table_t *symtab)
+{
+    struct tile t;
 
-#define ALLOC_GROW(x, nr, alloc) \
-	do { \
-		if ((nr) > alloc) { \
-			if (alloc_nr(alloc) < (nr)) \
-				alloc = (nr); \
-			else \
-				alloc = alloc_nr(alloc); \
-			x = realloc((x), alloc * sizeof(*(x))); \
-		} \
-	} while (0)
+    burs_symtab = symtab;
+    burs_label(node);
+    burs_reduce(node, NT_CC, &t);
+    return t.cond;
+}
+
+// assignment 'node', a[exp1] = exp2
+static void select_stmt(cast_node_t *node, symbol_table_t *symtab)
+{
+    struct tile t;
+
+    burs_symtab = symtab;
+    burs_label(node);
+    burs_reduce(node, NT_STMT, &t);
+}
 
-#define STRBUF_INIT  { 0, 0, 0, NULL }
+/*
+ * If-conversion. An if statement whose arms only assign cheap values to one
+ * scalar becomes a branchless select: the values of both arms are computed,
+ * the condition compared and cmov keeps one, so a data dependent condition
+ * can't mispredict. Else-if chains nest and a missing arm keeps the value of
+ * the variable, arms assigning 1 and 0 are a setcc. All of it runs whatever
+ * the condition, so it has to be pure and can't trap: no division by
+ * variables and elements only at constant indexes inside the array.
+ */
+#define SELECT_MAX_COST 8  // nodes of the values and inner conditions
+#define SELECT_MAX_DEPTH 3 // nested ifs
 
-static void strbuf_grow(struct strbuf *sb, size_t extra)
+// nodes of expression 'node', more than SELECT_MAX_COST when it can't be run speculatively
+static int select_cost(cast_node_t *node, symbol_table_t *symtab)
 {
-	if (sb->len + extra + 1 <= sb->len)
-    	panic("you want to use way too much memory");
-	ALLOC_GROW(sb->buf, sb->len + extra + 1, sb->alloc);
+    symbol_t *sym;
+    int c;
+
+    switch (node->type) {
+    case CAST_NUMBER:
+        return 1;
+    case CAST_IDENTIFIER:
+        if (!node->expr.array_expr)
+            return 1;
+        sym = symbol_table_lookup(symtab, node->expr.identifier, 1);
+        if (!is_num_node(node->expr.array_expr, &c) || c < 0 || c >= sym->array_size)
+            return SELECT_MAX_COST + 1;
+        return 1;
+    case CAST_TERM:
+        if (node->expr.op.type != TOK_OPERATOR_MUL &&
+            !(is_num_node(node->expr.op.right, &c) && div_by_const_ok(c)))
+            return SELECT_MAX_COST + 1;
+        // fall through
+    case CAST_SIMPLE_EXPR:
+    case CAST_RELATIONAL_EXPR:
+        return 1 + select_cost(node->expr.op.left, symtab) + select_cost(node->expr.op.right, symtab);
+    default:
+        return SELECT_MAX_COST + 1;
+    }
 }
 
-static inline void strbuf_setlen(struct strbuf *sb, size_t len)
+// the statement block 'stmt' consists of, NULL when it is empty
+static cast_node_t *select_single(cast_node_t *stmt)
 {
-	sb->len = len;
-	sb->buf[len] = '\0';
+    while (stmt && stmt->type == CAST_COMPOUND_STMT) {
+        if (list_empty(&stmt->compound_stmt.stmts))
+            return NULL;
+        if (list_size(&stmt->compound_stmt.stmts) > 1)
+            break;
+        stmt = list_first_entry(&stmt->compound_stmt.stmts, cast_node_t, list);
+    }
+    return stmt;
 }
 
-static inline size_t strbuf_avail(struct strbuf *sb)
+// the variable the first assignment in 'stmt' writes
+static char *select_target(cast_node_t *stmt)
 {
-	return sb->alloc ? sb->alloc - sb->len - 1 : 0;
+    char *name = NULL;
+
+    stmt = select_single(stmt);
+    if (!stmt)
+        return NULL;
+    if (stmt->type == CAST_ASSIGN_STMT)
+        return stmt->assign_stmt.identifier;
+    if (stmt->type == CAST_IF_STMT) {
+        name = select_target(stmt->if_stmt.if_stmt);
+        if (!name && stmt->if_stmt.else_stmt)
+            name = select_target(stmt->if_stmt.else_stmt);
+    }
+    return name;
 }
 
-static void strbuf_add(struct strbuf *sb, const void *data, size_t len)
+// whether 'stmt' does nothing but assign cheap values to 'sym', adds up their cost
+static int select_ok(cast_node_t *stmt, symbol_t *sym, symbol_table_t *symtab, int depth, int *cost)
 {
-	strbuf_grow(sb, len);
-	memcpy(sb->buf + sb->len, data, len);
-	strbuf_setlen(sb, sb->len + len);
+    cast_node_t *cond;
+
+    stmt = select_single(stmt);
+    if (!stmt)
+        return 1;
+    switch (stmt->type) {
+    case CAST_ASSIGN_STMT:
+        if (stmt->assign_stmt.array_expr ||
+            symbol_table_lookup(symtab, stmt->assign_stmt.identifier, 1) != sym)
+            return 0;
+        *cost += select_cost(stmt->assign_stmt.expr, symtab);
+        return 1;
+    case CAST_IF_STMT:
+        cond = stmt->if_stmt.expr;
+        if (depth == SELECT_MAX_DEPTH || cond->type != CAST_RELATIONAL_EXPR || !is_pure(cond))
+            return 0;
+        if (depth) // only runs when the outer conditions say so
+            *cost += select_cost(cond, symtab);
+        return select_ok(stmt->if_stmt.if_stmt, sym, symtab, depth + 1, cost) &&
+               (!stmt->if_stmt.else_stmt ||
+                select_ok(stmt->if_stmt.else_stmt, sym, symtab, depth + 1, cost));
+    default:
+        return 0;
+    }
 }
 
-static inline void strbuf_addstr(struct strbuf *sb, const char *s)
+static inline int assigns_num(cast_node_t *stmt, int num)
 {
-	strbuf_add(sb, s, strlen(s));
+    int c;
+
+    return stmt && stmt->type == CAST_ASSIGN_STMT && is_num_node(stmt->assign_stmt.expr, &c) &&
+           c == num;
 }
 
-static void strbuf_addf(struct strbuf *sb, const char *fmt, ...)
+/*
+ * Push the value 'sym' has after 'stmt', which passed select_ok(). On the
+ * outermost level the select may write the register of 'sym' right away.
+ */
+static void select_value(cast_node_t *stmt, symbol_t *sym, symbol_table_t *symtab, int top)
 {
-	int len;
-	va_list ap;
+    cast_node_t *then, *other;
+    struct value t, f;
+    enum mir_cond cond;
+    enum reg base;
 
-	va_start(ap, fmt);
-	len = vsnprintf(sb->buf + sb->len, sb->alloc - sb->len, fmt, ap);
-	va_end(ap);
-	if (len < 0)
-		len = 0;
-	if (len > strbuf_avail(sb)) {
-		strbuf_grow(sb, len);
-		va_start(ap, fmt);
-		len = vsnprintf(sb->buf + sb->len, sb->alloc - sb->len, fmt, ap);
-		va_end(ap);
-	}
-	strbuf_setlen(sb, sb->len + len);
+    stmt = select_single(stmt);
+    if (!stmt) { // unchanged
+        if (sym->reg)
+            vpush(VAL_VAR)->reg = sym->reg;
+        else
+            vpush(VAL_MEM)->mem = element_operand(sym, NULL, 0, &base);
+        return;
+    }
+    if (stmt->type == CAST_ASSIGN_STMT) {
+        select_expr(stmt->assign_stmt.expr, symtab);
+        return;
+    }
+    then = select_single(stmt->if_stmt.if_stmt);
+    other = stmt->if_stmt.else_stmt ? select_single(stmt->if_stmt.else_stmt) : NULL;
+    if ((assigns_num(then, 1) && assigns_num(other, 0)) ||
+        (assigns_num(then, 0) && assigns_num(other, 1))) {
+        cond = generate_compare(stmt->if_stmt.expr, symtab);
+        if (assigns_num(then, 0))
+            cond = mir_cond_negate(cond);
+        f.reg = temp_alloc();
+        emit(MIR_SET, mir_none(), mir_reg(f.reg))->cond = cond;
+        emit(MIR_MOVZBL, mir_reg(f.reg), mir_reg(f.reg));
+        vpush(VAL_TEMP)->reg = f.reg;
+        return;
+    }
+    select_value(then, sym, symtab, 0);
+    if (vtop()->kind == VAL_IMM)
+        value_to_reg(vtop()); // cmov takes no immediate
+    select_value(other, sym, symtab, 0);
+    if (!(top && vtop()->kind == VAL_VAR && vtop()->reg == sym->reg))
+        value_to_reg(vtop()); // the value cmov overwrites
+    cond = generate_compare(stmt->if_stmt.expr, symtab);
+    // nothing from here on changes the flags
+    f = vpop();
+    t = vpop();
+    if (!value_in_reg(&f))
+        value_to_reg(&f); // spilled by the comparison
+    emit(MIR_CMOV, value_src(&t), mir_reg(f.reg))->cond = cond;
+    value_release(&t);
+    *vpush(f.kind) = f;
 }
 
-static void strbuf_vinsertf(struct strbuf *sb, size_t pos, const char *fmt, va_list ap)
+// if statement 'node' as a select, 0 when it isn't one
+static int generate_select(cast_node_t *node, symbol_table_t *symtab)
 {
-    int len, len2;
-    char save;
-    va_list cp;
+    char *name = select_target(node);
+    symbol_t *sym;
+    int cost = 0;
 
-    if (pos > sb->len)
-        panic("`pos' is too far after the end of the buffer");
-    va_copy(cp, ap);
-    len = vsnprintf(sb->buf + sb->len, 0, fmt, cp);
-    va_end(cp);
-    if (len < 0)
-        panic("your vsnprintf is broken (returned %d)", len);
-    if (!len)
-        return; /* nothing to do */
-    strbuf_grow(sb, len);
-    memmove(sb->buf + pos + len, sb->buf + pos, sb->len - pos);
-    /* vsnprintf() will append a NUL, overwriting one of our characters */
-    save = sb->buf[pos + len];
-    len2 = vsnprintf(sb->buf + pos, len + 1, fmt, ap);
-    sb->buf[pos + len] = save;
-    if (len2 != len)
-        panic("your vsnprintf is broken (returns inconsistent lengths)");
-    strbuf_setlen(sb, sb->len + len);
+    if (!name)
+        return 0;
+    sym = symbol_table_lookup(symtab, name, 1);
+    if (sym->array_size || !select_ok(node, sym, symtab, 0, &cost) || cost > SELECT_MAX_COST)
+        return 0;
+    select_value(node, sym, symtab, 1);
+    generate_store(sym, NULL, 0);
+    stats.selects++;
+    return 1;
 }
 
-static inline void strbuf_insertf(struct strbuf *sb, size_t pos, const char *fmt, ...)
+static void generate_params(cast_node_t *node, symbol_table_t *symtab)
 {
-    va_list ap;
-    va_start(ap, fmt);
-    strbuf_vinsertf(sb, pos, fmt, ap);
-    va_end(ap);
+    enum reg src[6], dst[6];
+    cast_node_t *param;
+    int n = 0;
+
+    list_for_each_entry(param, &node->param_list.params, list) {
+        symbol_t *sym = symbol_table_lookup(symtab, param->param.identifier, 0);
+        tc_debug(0, "local param %s, index %d\n", sym->name, sym->index);
+        if (sym->index > 6)
+            panic("FIX ME:too many parameters\n");
+        if (sym->reg) { // move parameter from argument register to its own
+            src[n] = arg_regs[sym->index - 1];
+            dst[n++] = sym->reg;
+        } else // or to local stack frame
+            emit(MIR_MOVL, mir_reg(arg_regs[sym->index - 1]), mir_mem(REG_RBP, to_offset(sym->index)));
+    }
+    parallel_move(src, dst, n);
 }
 
-static inline void strbuf_head_addf(struct strbuf *sb, const char *fmt, ...)
+// evaluate the arguments of a call into the argument registers
+static void generate_args(cast_node_t *node, symbol_table_t *symtab)
 {
-    va_list ap;
-    va_start(ap, fmt);
-    strbuf_vinsertf(sb, 0, fmt, ap);
-    va_end(ap);
+    symbol_t *callee;
+    enum reg src[6], dst[6];
+    int arg_count = list_size(&node->call_expr.args_list);
+    int base = vsp, n = 0;
+    cast_node_t *arg;
+
+    if (arg_count > 6)
+        panic("FIX ME:too many arguments\n");
+    list_for_each_entry(arg, &node->call_expr.args_list, list) {
+        fn.temp_hint = arg_regs[n++]; // compute the argument right where it is passed
+        generate_asm(arg, symtab);
+    }
+    fn.temp_hint = REG_NONE;
+    n = 0;
+    save_values_for_call(base);
+    // Pass the first six arguments in registers
+    for (int i = 0; i < arg_count; i++) {
+        struct value *v = vstack + base + i;
+        if (value_in_reg(v)) {
+            src[n] = v->reg;
+            dst[n++] = arg_regs[i];
+        }
+    }
+    parallel_move(src, dst, n);
+    for (int i = 0; i < arg_count; i++) {
+        struct value *v = vstack + base + i;
+        if (v->kind == VAL_SPILL)
+            emit(MIR_MOVQ, mir_mem(REG_RBP, spill_offset(v->slot)), mir_reg(arg_regs[i]));
+        else if (!value_in_reg(v))
+            emit(MIR_MOVL, value_src(v), mir_reg(arg_regs[i]));
+        value_release(v);
+    }
+    vsp = base;
+    // we need to zero out %eax before calling a variadic function
+    // see https://stackoverflow.com/questions/6212665/why-is-eax-zeroed-before-a-call-to-printf
+    // functions defined in this file never are
+    callee = symbol_table_lookup(symtab, node->call_expr.identifier, 1);
+    if (!callee || !callee->defined)
+        emit(MIR_MOVL, mir_imm(0), mir_reg(REG_RAX));
 }
 
-void strbuf_splice(struct strbuf *sb, size_t pos, size_t len,
-                   const void *data, size_t dlen)
+static void generate_call(cast_node_t *node, symbol_table_t *symtab, int want_result)
 {
-    if ((pos + len < pos))
-		panic("you want to use way too much memory");
-	if ((pos > sb->len))
-		panic("`pos' is too far after the end of the buffer");
-	if ((pos + len > sb->len))
-		panic("`pos + len' is too far after the end of the buffer");
+    enum reg hint = fn.temp_hint; // for the return value, the arguments take their own
 
-	if (dlen >= len)
-		strbuf_grow(sb, dlen - len);
-    memmove(sb->buf + pos + dlen,
-            sb->buf + pos + len,
-            sb->len - pos - len);
-    memcpy(sb->buf + pos, data, dlen);
-	strbuf_setlen(sb, sb->len + dlen - len);
+    generate_args(node, symtab);
+    // Call the function
+    emit(MIR_CALL, mir_sym(node->call_expr.identifier), mir_none());
+    if (!want_result)
+        return;
+    // Keep the return value on the value stack
+    fn.temp_hint = hint;
+    enum reg reg = temp_alloc();
+    vpush(VAL_TEMP)->reg = reg;
+    emit(MIR_MOVL, mir_reg(REG_RAX), mir_reg(reg));
 }
 
-// stack offset of a variable or parameter
-static inline int to_offset(int index)
+/*
+ * Nothing of the frame is needed after a tail call. A call to the function
+ * itself stores the arguments to the parameters and jumps back to the entry,
+ * any other call tears down the frame and jumps to the callee, which returns
+ * straight to our caller. No argument can point into the frame, arrays are
+ * never passed by address.
+ */
+static void generate_tail_call(cast_node_t *node, symbol_table_t *symtab)
 {
-    return index * -4;
+    enum reg src[6], dst[6];
+    int base = vsp, n = 0, i;
+    cast_node_t *arg;
+
+    if (!self_tail_call(node)) {
+        generate_args(node->return_stmt.expr, symtab);
+        ALLOC_GROW(fn.tail_jumps, fn.nr_tail + 1, fn.alloc_tail);
+        fn.tail_jumps[fn.nr_tail++] = emit(MIR_JMP, mir_sym(node->return_stmt.expr->call_expr.identifier),
+                                           mir_none());
+        stats.tail_calls++;
+        return;
+    }
+    list_for_each_entry(arg, &node->return_stmt.expr->call_expr.args_list, list) {
+        generate_asm(arg, symtab);
+    }
+    // the parameters are about to change, no argument may still read them
+    for (i = base; i < vsp; i++)
+        if (vstack[i].kind == VAL_VAR || vstack[i].kind == VAL_MEM)
+            value_to_reg(vstack + i);
+    for (i = 0; i < vsp - base; i++) {
+        struct value *v = vstack + base + i;
+        symbol_t *sym = fn.params[i];
+        if (sym->reg && value_in_reg(v)) {
+            src[n] = v->reg;
+            dst[n++] = sym->reg;
+        } else if (sym->reg) {
+            emit(v->kind == VAL_SPILL ? MIR_MOVQ : MIR_MOVL, value_src(v), mir_reg(sym->reg));
+        } else {
+            if (v->kind == VAL_SPILL)
+                value_to_reg(v);
+            emit(MIR_MOVL, value_src(v), mir_mem(REG_RBP, to_offset(sym->index)));
+        }
+    }
+    parallel_move(src, dst, n);
+    for (i = base; i < vsp; i++)
+        value_release(vstack + i);
+    vsp = base;
+    emit_jmp(CC_NONE, fn.entry_label);
+    stats.self_tail_calls++;
+}
+
+/*
+ * Loop vectorizer. A counted loop over int arrays
+ *
+ *     while (i < n) { a[i] = E; ... s = s + E; ... i = i + 1; }
+ *
+ * where every element is indexed by exactly i, E combines elements b[i],
+ * loop invariants, +, - and * and s only sums, runs 4 iterations at a time
+ * in SSE2 registers, 8 with -mavx2. The scalar loop follows and finishes the
+ * iterations left. Arrays never overlap and an iteration only touches its own
+ * elements, so running a statement for several iterations before the next
+ * one computes the same values. Integer sums wrap the same in any order.
+ */
+#define NR_VREGS 14 // %xmm14 and %xmm15 are scratch of emit_vector_insn()
+#define MAX_VBASES 3 // registers holding the address of a global array, temp_alloc() has that many
+
+static struct {
+    symbol_table_t *symtab;
+    symbol_t *iv; // the induction variable i
+    cast_node_t *body;
+    struct {
+        symbol_t *sym; // NULL for the number
+        int num;
+        int xreg;
+    } inv[NR_VREGS]; // broadcast invariants
+    int nr_inv;
+    struct {
+        symbol_t *sym;
+        int xreg;
+    } sum[NR_VREGS]; // accumulators of the sums
+    int nr_sum;
+    struct {
+        symbol_t *sym;
+        int xreg;
+    } priv[NR_VREGS]; // temporaries like .cse0 set and used by the same iteration
+    int nr_priv;
+    struct {
+        symbol_t *sym;
+        enum reg reg;
+    } base[MAX_VBASES];
+    int nr_base;
+} vl;
+
+static int vec_written(symbol_t *sym)
+{
+    cast_node_t *s;
+
+    list_for_each_entry(s, &vl.body->compound_stmt.stmts, list) {
+        if (symbol_table_lookup(vl.symtab, s->assign_stmt.identifier, 1) == sym)
+            return 1;
+    }
+    return 0;
+}
+
+static inline int vec_is_index(cast_node_t *node)
+{
+    return node->type == CAST_IDENTIFIER && !node->expr.array_expr &&
+           symbol_table_lookup(vl.symtab, node->expr.identifier, 1) == vl.iv;
+}
+
+// broadcast register of invariant 'sym' or number 'num', -1 if there is none
+static int vec_invariant(symbol_t *sym, int num, int add)
+{
+    for (int i = 0; i < vl.nr_inv; i++) {
+        if (vl.inv[i].sym == sym && (sym || vl.inv[i].num == num))
+            return i;
+    }
+    if (!add || vl.nr_inv == NR_VREGS)
+        return -1;
+    vl.inv[vl.nr_inv].sym = sym;
+    vl.inv[vl.nr_inv].num = num;
+    vl.inv[vl.nr_inv].xreg = vl.nr_inv;
+    return vl.nr_inv++;
+}
+
+// whether 'node' is a number or a scalar the loop leaves alone
+static int vec_is_invariant(cast_node_t *node)
+{
+    symbol_t *sym;
+
+    if (node->type == CAST_NUMBER)
+        return 1;
+    if (node->type != CAST_IDENTIFIER || node->expr.array_expr)
+        return 0;
+    sym = symbol_table_lookup(vl.symtab, node->expr.identifier, 1);
+    return !sym->symbol_type && !sym->array_size && !vec_written(sym);
+}
+
+// index into vl.inv of invariant 'node', added when 'add' is set
+static int vec_leaf(cast_node_t *node, int add)
+{
+    if (!vec_is_invariant(node))
+        return -1;
+    if (node->type == CAST_NUMBER)
+        return vec_invariant(NULL, node->expr.num, add);
+    return vec_invariant(symbol_table_lookup(vl.symtab, node->expr.identifier, 1), 0, add);
+}
+
+static int vec_find_private(symbol_t *sym)
+{
+    for (int i = 0; i < vl.nr_priv; i++) {
+        if (vl.priv[i].sym == sym)
+            return i;
+    }
+    return -1;
+}
+
+// index into vl.priv of 'node' when it reads a temporary already set
+static int vec_private(cast_node_t *node)
+{
+    if (node->type != CAST_IDENTIFIER || node->expr.array_expr)
+        return -1;
+    return vec_find_private(symbol_table_lookup(vl.symtab, node->expr.identifier, 1));
+}
+
+// the vector register holding invariant or temporary 'node', -1 for other nodes
+static int vec_leaf_reg(cast_node_t *node)
+{
+    int i = vec_private(node);
+
+    if (i >= 0)
+        return vl.priv[i].xreg;
+    i = vec_leaf(node, 0);
+    return i >= 0 ? vl.inv[i].xreg : -1;
+}
+
+// global array 'sym' gets an address register, 0 if there are too many
+static int vec_base(symbol_t *sym)
+{
+    int i;
+
+    if (sym->index)
+        return 1;
+    for (i = 0; i < vl.nr_base && vl.base[i].sym != sym; i++)
+        ;
+    if (i == MAX_VBASES)
+        return 0;
+    if (i == vl.nr_base)
+        vl.base[vl.nr_base++].sym = sym;
+    return 1;
+}
+
+// the summand of sum statement 's', NULL when it is no s = s + E, E + s or s - E
+static cast_node_t *vec_summand(cast_node_t *s)
+{
+    cast_node_t *expr = s->assign_stmt.expr, *l, *r;
+
+    if (s->assign_stmt.array_expr || expr->type != CAST_SIMPLE_EXPR)
+        return NULL;
+    l = expr->expr.op.left;
+    r = expr->expr.op.right;
+    if (expr->expr.op.type == TOK_OPERATOR_ADD && r->type == CAST_IDENTIFIER &&
+        !r->expr.array_expr && !strcmp(r->expr.identifier, s->assign_stmt.identifier)) {
+        r = l;
+        l = expr->expr.op.right;
+    }
+    if (l->type != CAST_IDENTIFIER || l->expr.array_expr ||
+        strcmp(l->expr.identifier, s->assign_stmt.identifier))
+        return NULL;
+    return r;
+}
+
+/*
+ * Vector registers expression 'node' needs besides the invariants, -1 when
+ * it can't be vectorized. Binary operations compute the left operand into
+ * the first free register and the right one into the next.
+ */
+static int vec_need(cast_node_t *node)
+{
+    symbol_t *sym;
+    int l, r;
+
+    switch (node->type) {
+    case CAST_NUMBER:
+        return vec_leaf(node, 1) < 0 ? -1 : 0;
+    case CAST_IDENTIFIER:
+        if (vec_private(node) >= 0)
+            return 0;
+        if (!node->expr.array_expr)
+            return vec_leaf(node, 1) < 0 ? -1 : 0;
+        sym = symbol_table_lookup(vl.symtab, node->expr.identifier, 1);
+        if (sym->symbol_type || !sym->array_size || !vec_is_index(node->expr.array_expr) ||
+            !vec_base(sym))
+            return -1;
+        return 1;
+    case CAST_TERM:
+        if (node->expr.op.type != TOK_OPERATOR_MUL)
+            return -1;
+        // fall through
+    case CAST_SIMPLE_EXPR:
+        l = vec_need(node->expr.op.left);
+        r = vec_need(node->expr.op.right);
+        if (l < 0 || r < 0)
+            return -1;
+        if (l < 1)
+            l = 1; // an invariant is copied first
+        return r && r + 1 > l ? r + 1 : l;
+    default:
+        return -1;
+    }
+}
+
+// whether 'node' is a loop of the form above, fills in vl
+static int vec_loop(cast_node_t *node, symbol_table_t *symtab)
+{
+    cast_node_t *cond = node->while_stmt.expr, *body = node->while_stmt.stmt;
+    cast_node_t *s, *inc, *limit;
+    int need = 0;
+
+    memset(&vl, 0, sizeof(vl));
+    vl.symtab = symtab;
+    vl.body = body;
+    if (cond->type != CAST_RELATIONAL_EXPR ||
+        (cond->expr.op.type != TOK_OPERATOR_LESS_THAN &&
+         cond->expr.op.type != TOK_OPERATOR_LESS_THAN_OR_EQUAL_TO) ||
+        cond->expr.op.left->type != CAST_IDENTIFIER || cond->expr.op.left->expr.array_expr)
+        return 0;
+    vl.iv = symbol_table_lookup(symtab, cond->expr.op.left->expr.identifier, 1);
+    if (vl.iv->symbol_type || vl.iv->array_size)
+        return 0;
+    if (body->type != CAST_COMPOUND_STMT || list_size(&body->compound_stmt.stmts) < 2)
+        return 0;
+    list_for_each_entry(s, &body->compound_stmt.stmts, list) {
+        if (s->type != CAST_ASSIGN_STMT)
+            return 0;
+    }
+
+    // i = i + 1 comes last
+    inc = list_last_entry(&body->compound_stmt.stmts, cast_node_t, list);
+    if (inc->assign_stmt.array_expr || inc->assign_stmt.expr->type != CAST_SIMPLE_EXPR ||
+        symbol_table_lookup(symtab, inc->assign_stmt.identifier, 1) != vl.iv)
+        return 0;
+    s = inc->assign_stmt.expr;
+    if (s->expr.op.type != TOK_OPERATOR_ADD ||
+        !((vec_is_index(s->expr.op.left) && s->expr.op.right->type == CAST_NUMBER &&
+           s->expr.op.right->expr.num == 1) ||
+          (vec_is_index(s->expr.op.right) && s->expr.op.left->type == CAST_NUMBER &&
+           s->expr.op.left->expr.num == 1)))
+        return 0;
+
+    // n only reads what the loop leaves alone
+    limit = cond->expr.op.right;
+    if (!vec_is_invariant(limit) &&
+        !(limit->type == CAST_SIMPLE_EXPR && vec_is_invariant(limit->expr.op.left) &&
+          vec_is_invariant(limit->expr.op.right)))
+        return 0;
+
+    list_for_each_entry(s, &body->compound_stmt.stmts, list) {
+        symbol_t *sym = symbol_table_lookup(symtab, s->assign_stmt.identifier, 1);
+        int n;
+        if (s == inc)
+            break;
+        if (sym->symbol_type || sym == vl.iv)
+            return 0;
+        if (s->assign_stmt.array_expr) { // a[i] = E
+            if (!sym->array_size || !vec_is_index(s->assign_stmt.array_expr) || !vec_base(sym))
+                return 0;
+            n = vec_need(s->assign_stmt.expr);
+        } else if (vec_summand(s)) {
+            int j;
+            for (j = 0; j < vl.nr_sum; j++)
+                if (vl.sum[j].sym == sym)
+                    return 0; // the other sum would miss this one
+            if (vl.nr_sum == NR_VREGS)
+                return 0;
+            vl.sum[vl.nr_sum++].sym = sym;
+            n = vec_need(vec_summand(s));
+        } else if (sym->name[0] == '.' && sym->index) {
+            /*
+             * A temporary of the optimizer is only read where its assignment
+             * dominates, in the body after it. Statements before it already
+             * failed to read it as it isn't written yet.
+             */
+            n = vec_need(s->assign_stmt.expr);
+            if (n < 0 || vec_find_private(sym) >= 0 || vl.nr_priv == NR_VREGS)
+                return 0;
+            vl.priv[vl.nr_priv++].sym = sym;
+        } else
+            return 0;
+        if (n < 0)
+            return 0;
+        if (n > need)
+            need = n;
+    }
+    if (vl.nr_inv + vl.nr_sum + vl.nr_priv + need > NR_VREGS)
+        return 0;
+    for (int j = 0; j < vl.nr_inv; j++) {
+        // numbers go through a register too, there are just as many
+        if (!vl.inv[j].sym && vl.inv[j].num && vl.nr_base == MAX_VBASES)
+            return 0;
+    }
+    for (int j = 0; j < vl.nr_sum; j++)
+        vl.sum[j].xreg = vl.nr_inv + j;
+    for (int j = 0; j < vl.nr_priv; j++)
+        vl.priv[j].xreg = vl.nr_inv + vl.nr_sum + j;
+    return 1;
+}
+
+// the register or memory of scalar 'sym'
+static struct mir_operand scalar_operand(symbol_t *sym)
+{
+    enum reg base;
+
+    if (sym->reg)
+        return mir_reg(sym->reg);
+    return element_operand(sym, NULL, 0, &base);
+}
+
+// vector of elements i.. of array 'sym', the index is in %rax
+static struct mir_operand vec_element(symbol_t *sym)
+{
+    if (sym->index)
+        return mir_mem_index(REG_RBP, REG_RAX, 4, to_offset(sym->index));
+    for (int i = 0; i < vl.nr_base; i++) {
+        if (vl.base[i].sym == sym)
+            return mir_mem_index(vl.base[i].reg, REG_RAX, 4, 0);
+    }
+    panic("FIX ME:no address register for %s\n", sym->name);
+}
+
+static struct mir_operand vec_operand(cast_node_t *node, int d);
+
+// compute 'node' into vector register 'd', the registers from 'free' on are unused
+static void vec_gen(cast_node_t *node, int d, int free)
+{
+    struct mir_operand src;
+    enum mir_opcode op;
+
+    switch (node->type) {
+    case CAST_IDENTIFIER:
+        if (node->expr.array_expr) {
+            src = vec_element(symbol_table_lookup(vl.symtab, node->expr.identifier, 1));
+            emit(MIR_VMOVDQU, src, mir_xreg(d));
+            break;
+        }
+        // fall through
+    case CAST_NUMBER:
+        emit(MIR_VMOVDQU, mir_xreg(vec_leaf_reg(node)), mir_xreg(d));
+        break;
+    case CAST_SIMPLE_EXPR:
+    case CAST_TERM:
+        if (node->expr.op.type == TOK_OPERATOR_MUL)
+            op = MIR_VPMULLD;
+        else
+            op = node->expr.op.type == TOK_OPERATOR_ADD ? MIR_VPADDD : MIR_VPSUBD;
+        if (op != MIR_VPSUBD && vec_leaf_reg(node->expr.op.left) >= 0 &&
+            vec_leaf_reg(node->expr.op.right) < 0) {
+            // commutative, compute the other operand in place instead of copying
+            vec_gen(node->expr.op.right, d, free);
+            src = mir_xreg(vec_leaf_reg(node->expr.op.left));
+        } else {
+            vec_gen(node->expr.op.left, d, free);
+            src = vec_operand(node->expr.op.right, free);
+        }
+        emit(op, src, mir_xreg(d));
+        break;
+    default:
+        panic("Can't vectorize node type %d\n", node->type);
+    }
+}
+
+// the register of an invariant or temporary 'node', otherwise 'd' computed
+static struct mir_operand vec_operand(cast_node_t *node, int d)
+{
+    int x = vec_leaf_reg(node);
+
+    if (x >= 0)
+        return mir_xreg(x);
+    vec_gen(node, d, d + 1);
+    return mir_xreg(d);
+}
+
+/*
+ * Emit the vector loop in front of while loop 'node' when it has the form
+ * above. It runs while a whole vector of iterations is left and updates i
+ * and the sums for the scalar loop.
+ */
+static void generate_vector_loop(cast_node_t *node, symbol_table_t *symtab)
+{
+    cast_node_t *cond = node->while_stmt.expr, *s;
+    int width = options.avx2 ? 8 : 4;
+    int skip_label, loop_label, temp, last;
+    enum reg imm_reg = REG_NONE;
+    struct value n;
+
+    if (options.no_vectorize || !vec_loop(node, symtab))
+        return;
+    skip_label = label_count++;
+    loop_label = label_count++;
+    temp = vl.nr_inv + vl.nr_sum + vl.nr_priv;
+
+    // %rax runs over i sign extended, up to %rdx = n - width + 1 (+ 1 for <=)
+    generate_asm(cond->expr.op.right, symtab);
+    n = vpop();
+    last = cond->expr.op.type == TOK_OPERATOR_LESS_THAN ? width - 1 : width - 2;
+    if (n.kind == VAL_IMM && n.imm >= 0) {
+        emit(MIR_MOVQ, mir_imm(n.imm - last), mir_reg(REG_RDX));
+    } else {
+        if (n.kind == VAL_IMM)
+            emit(MIR_MOVQ, mir_imm(n.imm), mir_reg(REG_RDX));
+        else
+            emit(MIR_MOVSLQ, value_src(&n), mir_reg(REG_RDX));
+        emit(MIR_SUBQ, mir_imm(last), mir_reg(REG_RDX));
+    }
+    value_release(&n);
+    emit(MIR_MOVSLQ, scalar_operand(vl.iv), mir_reg(REG_RAX));
+    emit(MIR_CMPQ, mir_reg(REG_RDX), mir_reg(REG_RAX));
+    emit_jmp(CC_GE, skip_label);
+
+    for (int i = 0; i < vl.nr_base; i++) {
+        vl.base[i].reg = temp_alloc();
+        emit(MIR_LEAQ, mir_rip(vl.base[i].sym->name, 0), mir_reg(vl.base[i].reg));
+    }
+    for (int i = 0; i < vl.nr_inv; i++) {
+        struct mir_operand x = mir_xreg(vl.inv[i].xreg);
+        if (vl.inv[i].sym) {
+            emit(MIR_VBROADCAST, scalar_operand(vl.inv[i].sym), x);
+        } else if (vl.inv[i].num == 0) {
+            emit(MIR_VPXOR, x, x);
+        } else {
+            if (imm_reg == REG_NONE)
+                imm_reg = temp_alloc();
+            emit(MIR_MOVL, mir_imm(vl.inv[i].num), mir_reg(imm_reg));
+            emit(MIR_VBROADCAST, mir_reg(imm_reg), x);
+        }
+    }
+    for (int i = 0; i < vl.nr_sum; i++)
+        emit(MIR_VPXOR, mir_xreg(vl.sum[i].xreg), mir_xreg(vl.sum[i].xreg));
+
+    emit(MIR_ALIGN, mir_imm(4), mir_imm(10));
+    emit_label(loop_label);
+    list_for_each_entry(s, &vl.body->compound_stmt.stmts, list) {
+        symbol_t *sym = symbol_table_lookup(symtab, s->assign_stmt.identifier, 1);
+        int j;
+        if (sym == vl.iv)
+            break;
+        if (s->assign_stmt.array_expr) {
+            emit(MIR_VMOVDQU, vec_operand(s->assign_stmt.expr, temp), vec_element(sym));
+            continue;
+        }
+        j = vec_find_private(sym);
+        if (j >= 0) {
+            int x = vec_leaf_reg(s->assign_stmt.expr);
+            if (x >= 0)
+                emit(MIR_VMOVDQU, mir_xreg(x), mir_xreg(vl.priv[j].xreg));
+            else
+                vec_gen(s->assign_stmt.expr, vl.priv[j].xreg, temp);
+            continue;
+        }
+        for (j = 0; vl.sum[j].sym != sym; j++)
+            ;
+        emit(s->assign_stmt.expr->expr.op.type == TOK_OPERATOR_ADD ? MIR_VPADDD : MIR_VPSUBD,
+             vec_operand(vec_summand(s), temp), mir_xreg(vl.sum[j].xreg));
+    }
+    emit(MIR_ADDQ, mir_imm(width), mir_reg(REG_RAX));
+    emit(MIR_CMPQ, mir_reg(REG_RDX), mir_reg(REG_RAX));
+    emit_jmp(CC_L, loop_label);
+
+    emit(MIR_MOVL, mir_reg(REG_RAX), scalar_operand(vl.iv));
+    for (int i = 0; i < vl.nr_sum; i++) {
+        emit(MIR_VHSUM, mir_xreg(vl.sum[i].xreg), mir_reg(REG_RDX));
+        emit(MIR_ADDL, mir_reg(REG_RDX), scalar_operand(vl.sum[i].sym));
+    }
+    if (options.avx2)
+        emit(MIR_VZEROUPPER, mir_none(), mir_none()); // no penalty for SSE code after us
+    emit_label(skip_label);
+    for (int i = 0; i < vl.nr_base; i++)
+        fn.temp_busy &= ~REG_BIT(vl.base[i].reg);
+    if (imm_reg != REG_NONE)
+        fn.temp_busy &= ~REG_BIT(imm_reg);
+    stats.loops_vectorized++;
+}
+
+// restore the callee-saved registers and the frame of the caller, returns how many were saved
+static int generate_epilogue(int frame)
+{
+    int saved = 0;
+
+    for (int r = REG_RAX; r < REG_NR; r++) {
+        if (fn.callee_used & REG_BIT(r))
+            emit(MIR_MOVQ, mir_mem(REG_RBP, -(frame + 8 * ++saved)), mir_reg(r));
+    }
+    if (fn.frame_kind == FRAME_RBP)
+        emit(MIR_LEAVE, mir_none(), mir_none()); // restore stack pointer
+    else if (fn.frame_kind == FRAME_RSP)
+        emit(MIR_ADDQ, mir_imm(fn.frame_size), mir_reg(REG_RSP));
+    return saved;
+}
+
+// whether the function calls anything, also when it leaves with a tail call
+static int is_leaf(struct mir_function *body)
+{
+    struct mir_insn *insn;
+
+    if (fn.nr_tail)
+        return 0;
+    list_for_each_entry(insn, &body->insns, list) {
+        if (insn->op == MIR_CALL)
+            return 0;
+    }
+    return 1;
 }
 
-static struct strbuf ir = STRBUF_INIT;
+// pick how to set up a frame of 'size' bytes below the return address and %rbp
+static void choose_frame(struct mir_function *body, int size)
+{
+    fn.frame_kind = FRAME_RBP;
+    if (is_leaf(body) && size <= RED_ZONE_SIZE) {
+        fn.frame_kind = FRAME_RED_ZONE;
+    } else if (options.omit_frame_pointer) {
+        fn.frame_kind = FRAME_RSP;
+        fn.frame_size = ROUND_UP_16(size) + 8; // %rsp is 16 bytes aligned at calls again
+    }
+    if (fn.frame_kind != FRAME_RBP)
+        stats.frames_omitted++;
+}
 
-static inline void generate_function_prologue(const char *name)
+// turn the %rbp relative slots into %rsp relative ones
+static void rebase_frame(struct mir_function *body)
 {
-    strbuf_addf(&ir, "\n\t.globl %s\n", name);
-    strbuf_addstr(&ir, "\t.text\n");
-	strbuf_addf(&ir, "\t.type %s, @function\n", name);
-    strbuf_addstr(&ir, name);
-    strbuf_addstr(&ir, ":\n");
-    strbuf_addstr(&ir, "\tendbr64\n");
-    strbuf_addstr(&ir, "\tpushq %rbp\n");
-    strbuf_addstr(&ir, "\tmovq %rsp, %rbp\n");
+    // slots keep their offsets, counted from the return address instead of the saved %rbp
+    int delta = fn.frame_kind == FRAME_RSP ? fn.frame_size : 0;
+    struct mir_insn *insn;
+
+    if (fn.frame_kind == FRAME_RBP)
+        return;
+    list_for_each_entry(insn, &body->insns, list) {
+        struct mir_operand *o[2] = { &insn->src, &insn->dst };
+        for (int i = 0; i < 2; i++) {
+            if (o[i]->kind == OPND_MEM && o[i]->reg == REG_RBP) {
+                o[i]->reg = REG_RSP;
+                o[i]->val += delta;
+            }
+        }
+    }
 }
 
-static inline void generate_function_epilogue(void)
+static void generate_function(cast_node_t *node, symbol_table_t *symtab)
 {
-    strbuf_addstr(&ir, "\tleave\n"); // restore stack pointer
-    strbuf_addstr(&ir, "\tret\n");
+    symbol_t *sym = symbol_table_lookup(symtab, node->fun_declaration.identifier, 0);
+    symbol_table_t *local = node->fun_declaration.symbol_table;
+    struct mir_function *body;
+    struct mir_insn *last;
+    cast_node_t *param;
+    int frame, saved, n = 0;
+
+    if (!node->fun_declaration.compound_stmt)
+        return; // just a declaration
+    free(fn.tail_jumps);
+    free(fn.spill_busy);
+    memset(&fn, 0, sizeof(fn));
+    fn.sym = sym;
+    if (node->fun_declaration.param_list) {
+        list_for_each_entry(param, &node->fun_declaration.param_list->param_list.params, list) {
+            if (n < 6)
+                fn.params[n++] = symbol_table_lookup(local, param->param.identifier, 0);
+        }
+    }
+    fn.exit_label = label_count++;
+    fn.entry_label = label_count++;
+    fn.locals_size = ROUND_UP_8((sym->var_count + sym->arg_count) * 4);
+    fn.var_regs = allocate_registers(node, local);
+    fn.callee_used = fn.var_regs & CALLEE_SAVED_REGS;
+    body = zalloc(sizeof(struct mir_function));
+    body->name = node->fun_declaration.identifier;
+    INIT_LIST_HEAD(&body->insns);
+    list_add_tail(&body->list, &prog.functions);
+    insns = &body->insns;
+
+    // Generate function parameters
+    if (node->fun_declaration.param_list)
+        generate_params(node->fun_declaration.param_list, local);
+    if (fn.self_tail)
+        emit_label(fn.entry_label);
+    // Generate function body
+    generate_asm(node->fun_declaration.compound_stmt, local);
+
+    // Fall into the epilogue instead of jumping to it
+    last = list_last_entry(&body->insns, struct mir_insn, list);
+    if (last && last->op == MIR_JMP && last->src.kind == OPND_LABEL && last->src.val == fn.exit_label) {
+        list_del(&last->list);
+        free(last);
+    }
+    emit_label(fn.exit_label);
+    frame = fn.locals_size + 8 * fn.nr_spill;
+    choose_frame(body, frame + 8 * __builtin_popcount(fn.callee_used));
+    if (fn.frame_kind == FRAME_RED_ZONE && !fn.callee_used) {
+        // nothing to tear down, return right away instead of jumping to the ret
+        struct mir_insn *insn;
+        list_for_each_entry(insn, &body->insns, list) {
+            if (insn->op == MIR_JMP && insn->src.kind == OPND_LABEL && insn->src.val == fn.exit_label) {
+                insn->op = MIR_RET;
+                insn->src = mir_none();
+            }
+        }
+    }
+    saved = generate_epilogue(frame);
+    emit(MIR_RET, mir_none(), mir_none());
+    for (int i = 0; i < fn.nr_tail; i++) {
+        struct list_head epilogue;
+        INIT_LIST_HEAD(&epilogue);
+        insns = &epilogue;
+        generate_epilogue(frame);
+        __list_splice(&epilogue, fn.tail_jumps[i]->list.prev, &fn.tail_jumps[i]->list);
+    }
+
+    // Generate function prologue now that the frame size is known
+    struct list_head head;
+    INIT_LIST_HEAD(&head);
+    insns = &head;
+    emit(MIR_ENDBR64, mir_none(), mir_none());
+    if (fn.frame_kind == FRAME_RBP) {
+        emit(MIR_PUSHQ, mir_reg(REG_RBP), mir_none());
+        emit(MIR_MOVQ, mir_reg(REG_RSP), mir_reg(REG_RBP));
+        if (frame + 8 * saved > 0)
+            emit(MIR_SUBQ, mir_imm(ROUND_UP_16(frame + 8 * saved)), mir_reg(REG_RSP));
+    } else if (fn.frame_kind == FRAME_RSP)
+        emit(MIR_SUBQ, mir_imm(fn.frame_size), mir_reg(REG_RSP));
+    saved = 0;
+    for (int r = REG_RAX; r < REG_NR; r++) {
+        if (fn.callee_used & REG_BIT(r))
+            emit(MIR_MOVQ, mir_reg(r), mir_mem(REG_RBP, -(frame + 8 * ++saved)));
+    }
+    list_splice_init(&head, &body->insns);
+    rebase_frame(body);
 }
 
 static void generate_asm(cast_node_t *node, symbol_table_t *symtab)
 {
-    static int label_count = 0;
     if (!node)
         return;
     switch (node->type) {
@@ -182,91 +2888,34 @@ static void generate_asm(cast_node_t *node, symbol_table_t *symtab)
             if (sym->index == 0) {// global variable
                 int size = node->var_declarator.array_size ? node->var_declarator.array_size : 1;
                 int align = 4 * (size > 8 ? 8 : size);
-                strbuf_addf(&ir, "\n\t.globl %s\n", sym->name);
-                strbuf_addf(&ir, "\t.align %d\n", align); // align to at most 32 bytes
-                strbuf_addf(&ir, "\t.type %s, @object\n", sym->name); // @object is for data
-                strbuf_addf(&ir, "\t.size %s, %d\n", sym->name, size * 4); // size in bytes
+                strbuf_addf(&prog.data, "\n\t.globl %s\n", sym->name);
+                strbuf_addf(&prog.data, "\t.align %d\n", align); // align to at most 32 bytes
+                strbuf_addf(&prog.data, "\t.type %s, @object\n", sym->name); // @object is for data
+                strbuf_addf(&prog.data, "\t.size %s, %d\n", sym->name, size * 4); // size in bytes
                 if (node->var_declarator.expr) {
-                    strbuf_addstr(&ir, "\t.data\n"); // data section
-                    strbuf_addf(&ir, "%s:\n", sym->name);
-                    strbuf_addf(&ir, "\t.long %d\n", node->var_declarator.expr->expr.num);
+                    strbuf_addstr(&prog.data, "\t.data\n"); // data section
+                    strbuf_addf(&prog.data, "%s:\n", sym->name);
+                    strbuf_addf(&prog.data, "\t.long %d\n", node->var_declarator.expr->expr.num);
                 } else {
-                    strbuf_addstr(&ir, "\t.bss\n"); // uninitialized data section
-                    strbuf_addf(&ir, "%s:\n", sym->name);
-                    strbuf_addf(&ir, "\t.zero %d\n", size * 4); // zero out size * 4 bytes
+                    strbuf_addstr(&prog.data, "\t.bss\n"); // uninitialized data section
+                    strbuf_addf(&prog.data, "%s:\n", sym->name);
+                    strbuf_addf(&prog.data, "\t.zero %d\n", size * 4); // zero out size * 4 bytes
                 }
             } else {
                 tc_debug(0, "local variable %s, index %d\n", sym->name, sym->index);
                 if (node->var_declarator.expr) { // initialize the variable
                     // for local variables, we support real expressions.
                     generate_asm(node->var_declarator.expr, symtab);
-                    strbuf_addstr(&ir, "\tpopq %rax\n"); //get the value of the expression
-                    strbuf_addf(&ir, "\tmovl %%eax, %d(%%rbp)\n", to_offset(sym->index)); // initialize the variable
+                    generate_store(sym, NULL, 0);
                 }
             }
         }
         break;
     case CAST_FUN_DECLARATION:
-        {
-            symbol_t *sym = symbol_table_lookup(symtab, node->fun_declaration.identifier, 0);
-            // Generate function header
-            generate_function_prologue(node->fun_declaration.identifier);
-            // Allocate space for local variables and round up to 16 bytes to keep stack 16 bytes-aligned
-            // see https://stackoverflow.com/questions/49391001/why-does-the-x86-64-amd64-system-v-abi-mandate-a-16-byte-stack-alignment
-            #define ROUND_UP_16(x) (((x) + 15) & ~15)
-            if (sym->var_count+sym->arg_count > 0)
-                strbuf_addf(&ir, "\tsubq $%d, %%rsp\n", ROUND_UP_16((sym->var_count+sym->arg_count) * 4));
-            // Generate function parameters
-            generate_asm(node->fun_declaration.param_list, node->fun_declaration.symbol_table);
-            // Generate function body
-            generate_asm(node->fun_declaration.compound_stmt, node->fun_declaration.symbol_table);
-            // Add return statement if none exists
-            cast_node_t *last = list_last_entry(&node->fun_declaration.compound_stmt->compound_stmt.stmts, cast_node_t, list);
-            if (last && last->type != CAST_RETURN_STMT)
-                generate_function_epilogue();
-        }
+        generate_function(node, symtab);
         break;
     case CAST_PARAM_LIST:
-        {
-            cast_node_t *param;
-            list_for_each_entry(param, &node->param_list.params, list) {
-                generate_asm(param, symtab);
-            }
-        }
-        break;
-    case CAST_PARAM:
-        // move parameter from register or stack to local stack frame
-        {
-            symbol_t *sym = symbol_table_lookup(symtab, node->param.identifier, 0);
-            tc_debug(0, "local param %s, index %d\n", sym->name, sym->index);
-            switch (sym->index) {
-                case 1:
-                    // 1st parameter is in %edi, move it to -4(%rbp)
-                    strbuf_addstr(&ir, "\tmovl %edi, -4(%rbp)\n");
-                    break;
-                case 2:
-                    // 2nd parameter is in %esi, move it to -8(%rbp)
-                    strbuf_addstr(&ir, "\tmovl %esi, -8(%rbp)\n");
-                    break;
-                case 3:
-                    // 3rd parameter is in %edx, move it to -12(%rbp)
-                    strbuf_addstr(&ir, "\tmovl %edx, -12(%rbp)\n");
-                case 4:
-                    // 4th parameter is in %ecx, move it to -16(%rbp)
-                    strbuf_addstr(&ir, "\tmovl %ecx, -16(%rbp)\n");
-                    break;
-                case 5:
-                    // 5th parameter is in %r8d, move it to -20(%rbp)
-                    strbuf_addstr(&ir, "\tmovl %r8d, -20(%rbp)\n");
-                    break;
-                case 6:
-                    // 6th parameter is in %r9d, move it to -24(%rbp)
-                    strbuf_addstr(&ir, "\tmovl %r9d, -24(%rbp)\n");
-                    break;
-                default:
-                    panic("FIX ME:too many parameters\n");
-            }
-        }
+        generate_params(node, symtab);
         break;
     case CAST_COMPOUND_STMT:
         {
@@ -277,263 +2926,105 @@ static void generate_asm(cast_node_t *node, symbol_table_t *symtab)
         }
         break;
     case CAST_ASSIGN_STMT:
-        { // a[exp1] = [exp2]
-            symbol_t *sym = symbol_table_lookup(symtab, node->assign_stmt.identifier, 1);
-            if (node->expr.array_expr)
-                generate_asm(node->expr.array_expr, symtab); // exp1
-            generate_asm(node->assign_stmt.expr, symtab); // exp2
-            strbuf_addstr(&ir, "\tpopq %rax\n"); // Pop value of expression
-            if (sym->index == 0) {
-                if (node->expr.array_expr) {
-                    strbuf_addstr(&ir, "\tpopq %r11\n"); // Pop array index
-                    strbuf_addf(&ir, "\tleaq %s(%%rip), %%r10\n", sym->name); // Load address of array into %r10
-                    strbuf_addstr(&ir, "\tmovl %eax, (%r10,%r11,4)\n"); // Store value in array
-                } else
-                    strbuf_addf(&ir, "\tmovl %%eax, %s(%%rip)\n", sym->name); // Store value in variable
-            } else {
-                if (node->expr.array_expr) {
-                    strbuf_addstr(&ir, "\tpopq %r11\n"); // Pop array index
-                    strbuf_addf(&ir, "\tmovl %%eax, %d(%%rbp,%%r11,4)\n", to_offset(sym->index)); // Store value in array
-                } else
-                    strbuf_addf(&ir, "\tmovl %%eax, %d(%%rbp)\n", to_offset(sym->index)); // Store value in variable
-            }
-        }
+        select_stmt(node, symtab);
         break;
     case CAST_RETURN_STMT:
+        if (tail_call(node)) {
+            generate_tail_call(node, symtab);
+            break;
+        }
         // Generate return value
-        generate_asm(node->return_stmt.expr, symtab);
-        strbuf_addstr(&ir, "\tpopq %rax\n"); // Pop return value
-        generate_function_epilogue();
+        if (node->return_stmt.expr) {
+            generate_asm(node->return_stmt.expr, symtab);
+            struct value v = vpop();
+            if (v.kind == VAL_SPILL)
+                emit(MIR_MOVQ, mir_mem(REG_RBP, spill_offset(v.slot)), mir_reg(REG_RAX));
+            else
+                emit(MIR_MOVL, value_src(&v), mir_reg(REG_RAX));
+            value_release(&v);
+        }
+        emit_jmp(CC_NONE, fn.exit_label);
         break;
     case CAST_WHILE_STMT: {
+        // Rotated into a guarded do-while, each iteration takes one conditional branch
         int start_label = label_count++;
         int end_label = label_count++;
-        // Generate code for condition
-        strbuf_addf(&ir, ".L%d:\n", start_label);
-        generate_asm(node->while_stmt.expr, symtab);
-        strbuf_addstr(&ir, "\tpopq %rax\n");       // Pop condition result
-        strbuf_addstr(&ir, "\ttest %rax, %rax\n"); // Test condition
-        strbuf_addf(&ir, "\tje .L%d\n", end_label); // Jump to end of while loop if condition is false
+        generate_vector_loop(node, symtab); // the scalar loop does what is left
+        generate_branch(node->while_stmt.expr, symtab, end_label, 0); // Skip the loop if condition is false
+        emit(MIR_ALIGN, mir_imm(4), mir_imm(10)); // Align loop head to 16 bytes, pad at most 10
+        emit_label(start_label);
         // Generate code for body
         generate_asm(node->while_stmt.stmt, symtab);
-        strbuf_addf(&ir, "\tjmp .L%d\n", start_label); // Jump to start of while loop
+        generate_branch(node->while_stmt.expr, symtab, start_label, 1); // Loop while condition is true
         // Generate code for end of while loop
-        strbuf_addf(&ir, ".L%d:\n", end_label);
+        emit_label(end_label);
         }
         break;
     case CAST_CALL_STMT:
-        generate_asm(node->call_stmt.expr, symtab);
-        strbuf_addstr(&ir, "\tpopq %rax\n"); // Pop return value to make sure stack is 16-byte aligned
+        generate_call(node->call_stmt.expr, symtab, 0); // Drop return value
         break;
     case CAST_CALL_EXPR:
-        {
-            // Generate code for function arguments
-            cast_node_t *arg;
-            int arg_count = list_size(&node->call_expr.args_list);
-            if (arg_count > 6)
-                panic("FIX ME:too many arguments\n");
-            // Evaluate arguments in reverse order
-            list_for_each_entry_reverse(arg, &node->call_expr.args_list, list) {
-                generate_asm(arg, symtab);
-            }
-            // Pass the first six arguments in registers
-            for (int i = 1; i <= arg_count; i++) {
-                switch (i) {
-                    case 1:
-                        strbuf_addstr(&ir, "\tpopq %rdi\n");
-                        break;
-                    case 2:
-                        strbuf_addstr(&ir, "\tpopq %rsi\n");
-                        break;
-                    case 3:
-                        strbuf_addstr(&ir, "\tpopq %rdx\n");
-                        break;
-                    case 4:
-                        strbuf_addstr(&ir, "\tpopq %rcx\n");
-                        break;
-                    case 5:
-                        strbuf_addstr(&ir, "\tpopq %r8\n");
-                        break;
-                    case 6:
-                        strbuf_addstr(&ir, "\tpopq %r9\n");
-                    default:
-                        break;
-                }
-            }
-            // we need to zero out %eax before calling a variadic function
-            // see https://stackoverflow.com/questions/6212665/why-is-eax-zeroed-before-a-call-to-printf
-            strbuf_addstr(&ir, "\tmovl $0, %eax\n");
-            // Call the function
-            strbuf_addf(&ir, "\tcall %s\n", node->call_expr.identifier);
-            // Pop arguments off the stack if there are more than 6
-            // Push the return value onto the stack
-            strbuf_addstr(&ir, "\tpushq %rax\n");
-        }
+        generate_call(node, symtab, 1);
         break;
     case CAST_IF_STMT:
+        if (generate_select(node, symtab))
+            break;
         {
             int else_label;
             int end_label = label_count++;
             // Generate code for condition
-            generate_asm(node->if_stmt.expr, symtab);
-            strbuf_addstr(&ir, "\tpopq %rax\n");       // Pop condition value
-            strbuf_addstr(&ir, "\ttest %rax, %rax\n"); // Test condition
-            // Generate code for then branch
             if (node->if_stmt.else_stmt) {
                 else_label = label_count++;
-                strbuf_addf(&ir, "\tje .L%d\n", else_label); // Jump to else branch if condition is false
+                generate_branch(node->if_stmt.expr, symtab, else_label, 0); // Jump to else branch if condition is false
             } else
-                strbuf_addf(&ir, "\tje .L%d\n", end_label); // Jump to end of if statement if else branch is not present
+                generate_branch(node->if_stmt.expr, symtab, end_label, 0); // Jump to end of if statement if else branch is not present
+            // Generate code for then branch
             generate_asm(node->if_stmt.if_stmt, symtab);
             // Generate code for else branch
             if (node->if_stmt.else_stmt) {
-                strbuf_addf(&ir, "\tjmp .L%d\n", end_label); // Jump to end of if statement
-                strbuf_addf(&ir, ".L%d:\n", else_label);
+                emit_jmp(CC_NONE, end_label); // Jump to end of if statement
+                emit_label(else_label);
                 generate_asm(node->if_stmt.else_stmt, symtab);
             }
             // Generate code for end of if statement
-            strbuf_addf(&ir, ".L%d:\n", end_label);
-        }
-        break;
-    case CAST_LOGICAL_EXPR: {
-        generate_asm(node->expr.op.right, symtab);
-        generate_asm(node->expr.op.left, symtab);
-        strbuf_addstr(&ir, "\tpopq %rax\n"); // Pop left operand
-        strbuf_addstr(&ir, "\tpopq %rcx\n"); // Pop right operand
-        // Compare left and right operands
-        switch (node->expr.op.type) {
-        case TOK_OPERATOR_LOGICAL_AND:
-            strbuf_addstr(&ir, "\tandq %rcx, %rax\n"); // AND left and right operands
-            break;
-        case TOK_OPERATOR_LOGICAL_OR:
-            strbuf_addstr(&ir, "\torq %rcx, %rax\n"); // OR left and right operands
-            break;
-        default:
-            panic("Invalid logical operator");
-        }
-        // Push result onto the stack
-        strbuf_addstr(&ir, "\tpushq %rax\n");
-    }
-        break;
-    case CAST_RELATIONAL_EXPR: {
-        // Generate code for left and right operands
-        generate_asm(node->expr.op.right, symtab);
-        generate_asm(node->expr.op.left, symtab);
-        strbuf_addstr(&ir, "\tpopq %rax\n"); // Pop left operand
-        strbuf_addstr(&ir, "\tpopq %rcx\n"); // Pop right operand
-        // Compare left and right operands
-        switch (node->expr.op.type) {
-        case TOK_OPERATOR_LESS_THAN:
-            strbuf_addstr(&ir, "\tcmpl %ecx, %eax\n"); // Compare left and right operands
-            strbuf_addstr(&ir, "\tsetl %al\n"); // Set %al to 1 if left operand is less than right operand
-            break;
-        case TOK_OPERATOR_GREATER_THAN:
-            strbuf_addstr(&ir, "\tcmpl %ecx, %eax\n");
-            strbuf_addstr(&ir, "\tsetg %al\n"); // Set %al to 1 if left operand is greater than right operand
-            break;
-        case TOK_OPERATOR_LESS_THAN_OR_EQUAL_TO:
-            strbuf_addstr(&ir, "\tcmpl %ecx, %eax\n");
-            strbuf_addstr(&ir, "\tsetle %al\n"); // Set %al to 1 if left operand is less than or equal to right operand
-            break;
-        case TOK_OPERATOR_GREATER_THAN_OR_EQUAL_TO:
-            strbuf_addstr(&ir, "\tcmpl %ecx, %eax\n");
-            strbuf_addstr(&ir, "\tsetge %al\n"); // Set %al to 1 if left operand is greater than or equal to right operand
-            break;
-        case TOK_OPERATOR_EQUAL:
-            strbuf_addstr(&ir, "\tcmpl %ecx, %eax\n");
-            strbuf_addstr(&ir, "\tsete %al\n"); // Set %al to 1 if left operand is equal to right operand
-            break;
-        case TOK_OPERATOR_NOT_EQUAL:
-            strbuf_addstr(&ir, "\tcmpl %ecx, %eax\n");
-            strbuf_addstr(&ir, "\tsetne %al\n"); // Set %al to 1 if left operand is not equal to right operand
-            break;
-        default:
-            panic("Invalid relational operator\n");
-            break;
+            emit_label(end_label);
         }
-        // Push result of comparison onto stack
-        strbuf_addstr(&ir, "\tmovzbl %al, %eax\n"); // Zero extend %al to %eax
-        strbuf_addstr(&ir, "\tpushq %rax\n");
-    }
         break;
-    case CAST_SIMPLE_EXPR:
+    case CAST_LOGICAL_EXPR:
         {
-            char *op;
-            if (node->expr.op.type == TOK_OPERATOR_ADD)
-                op = "addl";
-            else if (node->expr.op.type == TOK_OPERATOR_SUB)
-                op = "subl";
-            else
-                panic("Unknown operator type %d\n", node->expr.op.type);
-            generate_asm(node->expr.op.right, symtab);
-            generate_asm(node->expr.op.left, symtab);
-            strbuf_addstr(&ir, "\tpopq %rax\n");		   // Pop left operand
-            strbuf_addstr(&ir, "\tpopq %r10\n");		   // Pop right operand
-            strbuf_addf(&ir, "\t%s %%r10d, %%eax\n", op); // operate left and right operands
-            strbuf_addstr(&ir, "\tpushq %rax\n");		   // Push result
+            // 1 or 0 depending on where the short-circuit jumps end up
+            int false_label = label_count++;
+            int end_label = label_count++;
+            enum reg reg;
+            freeze_values(vsp);
+            generate_branch(node, symtab, false_label, 0);
+            reg = temp_alloc();
+            emit(MIR_MOVL, mir_imm(1), mir_reg(reg));
+            emit_jmp(CC_NONE, end_label);
+            emit_label(false_label);
+            emit(MIR_MOVL, mir_imm(0), mir_reg(reg));
+            emit_label(end_label);
+            vpush(VAL_TEMP)->reg = reg;
         }
         break;
+    case CAST_SIMPLE_EXPR:
+    case CAST_RELATIONAL_EXPR:
     case CAST_TERM:
-        {
-            char *op;
-            if (node->expr.op.type == TOK_OPERATOR_MUL)
-                op = "imull";
-            else if (node->expr.op.type == TOK_OPERATOR_DIV ||
-                     node->expr.op.type == TOK_OPERATOR_MOD)
-                op = "idivl";
-            else
-                panic("Unknown operator type %d\n", node->expr.op.type);
-            generate_asm(node->expr.op.right, symtab);
-            generate_asm(node->expr.op.left, symtab);
-            strbuf_addstr(&ir, "\tpopq %rax\n"); 	// Pop left operand
-            strbuf_addstr(&ir, "\tpopq %r10\n");	// Pop right operand
-            if (strcmp(op, "idivl") == 0)
-                strbuf_addstr(&ir, "\tcqo\n");	// Sign extend %rax to %rdx:%rax
-            strbuf_addf(&ir, "\t%s %%r10d\n", op); // operate left and right operands
-            if (node->expr.op.type == TOK_OPERATOR_MOD)
-                strbuf_addstr(&ir, "\tmovl %edx, %eax\n"); // Move remainder into %eax
-            strbuf_addstr(&ir, "\tpushq %rax\n"); // Push result
-        }
-        break;
     case CAST_IDENTIFIER:
-        {
-            symbol_t *sym = symbol_table_lookup(symtab, node->expr.identifier, 1);
-            // Load the value of the identifier into %rax
-            if (sym->index == 0) { // Global variable
-                if (node->expr.array_expr) {
-                    generate_asm(node->expr.array_expr, symtab);
-                    strbuf_addstr(&ir, "\tpopq %rax\n"); // Pop array index
-                    strbuf_addf(&ir, "\tleaq %s(%%rip), %%r10\n", sym->name);
-                    strbuf_addf(&ir, "\tmovl (%r10,%rax,4), %%eax\n");
-                } else
-                    strbuf_addf(&ir, "\tmovl %s(%%rip), %%eax\n", sym->name);
-            } else { // Local variable
-                if (node->expr.array_expr) {
-                    generate_asm(node->expr.array_expr, symtab);
-                    strbuf_addstr(&ir, "\tpopq %r10\n"); // Pop array index
-                    // move array value into %eax
-                    strbuf_addf(&ir, "\tmovl %d(%%rbp,%%r10,4), %%eax\n", to_offset(sym->index));
-
-                } else
-                    strbuf_addf(&ir, "\tmovl %d(%%rbp), %%eax\n", to_offset(sym->index));
-            }
-            strbuf_addstr(&ir, "\tpushq %rax\n"); // Push result onto stack
-        }
-        break;
     case CAST_NUMBER:
-        // Generate code for number and push it on the stack
-        strbuf_addf(&ir, "\tmovl $%d, %%eax\n", node->expr.num);
-        strbuf_addstr(&ir, "\tpushq %rax\n");
+        select_expr(node, symtab);
         break;
     case CAST_STRING:
         {
-        // Generate code for string and push it on the stack
+        // Generate code for string and keep its address on the value stack
         static int string_count = 0;
-        strbuf_head_addf(&ir, "\t.section\t.rodata\n.LC%d:\n\t.string %s\n",
-                         string_count, node->expr.string);
-        strbuf_addf(&ir, "\tleaq .LC%d(%%rip), %%rax\n", string_count);
-        strbuf_addf(&ir, "\tpushq %%rax\n");
-        string_count++;
+        char *name = zalloc(16);
+        snprintf(name, 16, ".LC%d", string_count++);
+        strbuf_addf(&prog.rodata, "\t.section\t.rodata\n%s:\n\t.string %s\n",
+                    name, node->expr.string);
+        enum reg reg = temp_alloc();
+        vpush(VAL_TEMP)->reg = reg;
+        emit(MIR_LEAQ, mir_rip(name, 0), mir_reg(reg));
         }
         break;
     default:
@@ -542,8 +3033,20 @@ static void generate_asm(cast_node_t *node, symbol_table_t *symtab)
     return;
 }
 
-struct strbuf *generate_code(cast_node_t *node)
+struct mir_program *generate_code(cast_node_t *node)
 {
+	INIT_LIST_HEAD(&prog.functions);
+	prog.avx2 = options.avx2;
 	generate_asm(node, node->program.symbol_table);
-	return &ir;
+	print_stat("generator", "tail calls", stats.tail_calls);
+	print_stat("generator", "tail recursions", stats.self_tail_calls);
+	print_stat("generator", "frames omitted", stats.frames_omitted);
+	print_stat("generator", "loops vectorized", stats.loops_vectorized);
+	print_stat("generator", "lea selected", stats.lea);
+	print_stat("generator", "memory operands", stats.mem_operands);
+	print_stat("generator", "memory updates", stats.mem_updates);
+	print_stat("generator", "branches converted", stats.selects);
+	print_stat("generator", "operands reordered", stats.reordered);
+	print_stat("generator", "temporaries spilled", stats.spills);
+	return &prog;
 }
@@ -0,0 +1,403 @@
+#include "tc.h"
+
+/*
+ * Global value numbering over the SSA IR, run after build_ir(). The blocks
+ * are walked down the dominator tree with a scoped table of the expressions
+ * computed so far, so a value is only matched with one that is computed on
+ * every path to it. Constants, operations and loads with the same operands
+ * get the same value number. A load only matches while nothing could have
+ * written its variable: stores and calls to functions that write it kill it,
+ * and so does entering a block that has several preds, as the code along the
+ * other paths isn't known.
+ *
+ * The redundant operation or array load is then removed from the CAST: the
+ * first computation is moved into a new local assigned in front of its
+ * statement and the later ones read that local. This needs a computation
+ * that can run a bit earlier, see scan_expr().
+ */
+struct site {
+    cast_node_t *node;
+    cast_node_t *stmt; // in a statement list
+    int movable; // can be computed in front of 'stmt'
+    symbol_t *temp; // holds its value once it was moved
+};
+
+struct entry {
+    enum ir_opcode op;
+    enum token_type tok;
+    int num;
+    symbol_t *sym;
+    struct ir_value *a, *b; // value numbers of the operands
+    struct ir_value *vn; // value number, the first value computing it
+    struct ir_value *avail; // computes it where the entry is visible
+    int gen; // of the memory when a load was seen
+};
+
+struct kill {
+    symbol_t *sym; // NULL kills every load
+    int gen;
+};
+
+// how scan_expr() may move an expression
+enum {
+    EVAL_ALWAYS, // every time its statement runs
+    EVAL_MAYBE, // right operands of && and ||
+    EVAL_STAY // can't move, e.g. in a while condition
+};
+
+static struct {
+    symbol_table_t *symtab; // of the function
+    symbol_table_t *global;
+    struct site *sites;
+    int nr_sites, alloc_sites;
+    int called; // a call of the statement being scanned was evaluated
+    int wrote; // a declarator of the statement was initialized
+    struct entry *table; // scoped, innermost last
+    int nr_table, alloc_table;
+    struct kill *kills; // along the dominator tree path, innermost last
+    int nr_kills, alloc_kills;
+    int gen;
+    struct ir_value **vn; // by value id, NULL for itself
+} gvn;
+
+static struct {
+    int eliminated;
+} stats;
+
+// reads globals or arrays, which a call may write and arrays may fault
+static int reads_memory(cast_node_t *node, symbol_table_t *symtab, int arrays_only)
+{
+    switch (node->type) {
+    case CAST_IDENTIFIER:
+        if (node->expr.array_expr)
+            return 1;
+        return !arrays_only && !is_ssa_var(symbol_table_lookup(symtab, node->expr.identifier, 1));
+    case CAST_LOGICAL_EXPR:
+    case CAST_RELATIONAL_EXPR:
+    case CAST_SIMPLE_EXPR:
+    case CAST_TERM:
+        return reads_memory(node->expr.op.left, symtab, arrays_only) ||
+               reads_memory(node->expr.op.right, symtab, arrays_only);
+    default:
+        return 0;
+    }
+}
+
+static int may_trap(cast_node_t *node)
+{
+    switch (node->type) {
+    case CAST_IDENTIFIER:
+        return node->expr.array_expr != NULL;
+    case CAST_TERM:
+        if (node->expr.op.type != TOK_OPERATOR_MUL)
+            return 1;
+        /* fallthrough */
+    case CAST_LOGICAL_EXPR:
+    case CAST_RELATIONAL_EXPR:
+    case CAST_SIMPLE_EXPR:
+        return may_trap(node->expr.op.left) || may_trap(node->expr.op.right);
+    default:
+        return 0;
+    }
+}
+
+static struct site *find_site(cast_node_t *node)
+{
+    for (int i = 0; i < gvn.nr_sites; i++)
+        if (gvn.sites[i].node == node)
+            return gvn.sites + i;
+    return NULL;
+}
+
+/*
+ * Record where the expressions of statement 'stmt' can be computed. One is
+ * movable in front of the statement unless a call evaluated before it may
+ * write what it reads, and only when it can't fault if it was evaluated
+ * conditionally. Nothing of the statement is assigned before it finishes,
+ * except the declarators of a declaration.
+ */
+static void scan_expr(cast_node_t *node, cast_node_t *stmt, int eval, symbol_table_t *symtab)
+{
+    struct site *s;
+    cast_node_t *arg;
+
+    if (!node)
+        return;
+    ALLOC_GROW(gvn.sites, gvn.nr_sites + 1, gvn.alloc_sites);
+    s = gvn.sites + gvn.nr_sites++;
+    memset(s, 0, sizeof(*s));
+    s->node = node;
+    s->stmt = stmt;
+    s->movable = eval != EVAL_STAY && !gvn.wrote &&
+                 !(gvn.called && reads_memory(node, symtab, 0)) &&
+                 !(eval == EVAL_MAYBE && may_trap(node));
+    switch (node->type) {
+    case CAST_IDENTIFIER:
+        scan_expr(node->expr.array_expr, stmt, eval, symtab);
+        break;
+    case CAST_CALL_EXPR:
+        list_for_each_entry(arg, &node->call_expr.args_list, list) {
+            scan_expr(arg, stmt, eval, symtab);
+        }
+        gvn.called = 1;
+        break;
+    case CAST_LOGICAL_EXPR:
+        scan_expr(node->expr.op.left, stmt, eval, symtab);
+        scan_expr(node->expr.op.right, stmt, eval == EVAL_STAY ? EVAL_STAY : EVAL_MAYBE, symtab);
+        break;
+    case CAST_RELATIONAL_EXPR:
+    case CAST_SIMPLE_EXPR:
+    case CAST_TERM:
+        scan_expr(node->expr.op.left, stmt, eval, symtab);
+        scan_expr(node->expr.op.right, stmt, eval, symtab);
+        break;
+    default:
+        break;
+    }
+}
+
+// 'in_list' statements can have a new one inserted in front of them
+static void scan_stmt(cast_node_t *node, symbol_table_t *symtab, int in_list)
+{
+    int eval = in_list ? EVAL_ALWAYS : EVAL_STAY;
+
+    if (!node)
+        return;
+    gvn.called = gvn.wrote = 0;
+    switch (node->type) {
+    case CAST_COMPOUND_STMT:
+        {
+            cast_node_t *stmt;
+            list_for_each_entry(stmt, &node->compound_stmt.stmts, list) {
+                if (stmt->type == CAST_COMPOUND_STMT && stmt->compound_stmt.symbol_table)
+                    scan_stmt(stmt, stmt->compound_stmt.symbol_table, 1);
+                else
+                    scan_stmt(stmt, symtab, 1);
+            }
+        }
+        break;
+    case CAST_VAR_DECLARATION:
+        {
+            cast_node_t *d;
+            list_for_each_entry(d, &node->var_declaration.var_declarator_list->var_declarator_list.var_declarators, list) {
+                scan_expr(d->var_declarator.expr, node, eval, symtab);
+                gvn.wrote |= d->var_declarator.expr != NULL;
+            }
+        }
+        break;
+    case CAST_ASSIGN_STMT:
+        scan_expr(node->assign_stmt.array_expr, node, eval, symtab);
+        scan_expr(node->assign_stmt.expr, node, eval, symtab);
+        break;
+    case CAST_IF_STMT:
+        scan_expr(node->if_stmt.expr, node, eval, symtab);
+        scan_stmt(node->if_stmt.if_stmt, symtab, 0);
+        scan_stmt(node->if_stmt.else_stmt, symtab, 0);
+        break;
+    case CAST_WHILE_STMT:
+        scan_expr(node->while_stmt.expr, node, EVAL_STAY, symtab);
+        scan_stmt(node->while_stmt.stmt, symtab, 0);
+        break;
+    case CAST_RETURN_STMT:
+        scan_expr(node->return_stmt.expr, node, eval, symtab);
+        break;
+    case CAST_CALL_STMT:
+        scan_expr(node->call_stmt.expr, node, eval, symtab);
+        break;
+    default:
+        break;
+    }
+}
+
+static void pin_sites(cast_node_t *node)
+{
+    struct site *s = find_site(node);
+
+    if (s)
+        s->movable = 0;
+    switch (node->type) {
+    case CAST_IDENTIFIER:
+        if (node->expr.array_expr)
+            pin_sites(node->expr.array_expr);
+        break;
+    case CAST_RELATIONAL_EXPR:
+    case CAST_SIMPLE_EXPR:
+    case CAST_TERM:
+        pin_sites(node->expr.op.left);
+        pin_sites(node->expr.op.right);
+        break;
+    default:
+        break;
+    }
+}
+
+static void set_ident(cast_node_t *node, symbol_t *sym)
+{
+    node->type = CAST_IDENTIFIER;
+    node->expr.identifier = sym->name;
+    node->expr.array_expr = NULL;
+}
+
+// compute the expression of 's' into a new local in front of its statement
+static void move_to_temp(struct site *s)
+{
+    cast_node_t *expr = zalloc(sizeof(cast_node_t));
+    cast_node_t *assign = zalloc(sizeof(cast_node_t));
+
+    *expr = *s->node;
+    INIT_LIST_NODE(&expr->list);
+    pin_sites(expr); // already in front, must not move past the new statement
+    s->temp = symbol_table_add_temp(gvn.symtab, "cse");
+    set_ident(s->node, s->temp);
+    assign->type = CAST_ASSIGN_STMT;
+    assign->line_number = s->stmt->line_number;
+    assign->assign_stmt.identifier = s->temp->name;
+    assign->assign_stmt.expr = expr;
+    __list_add(&assign->list, s->stmt->list.prev, &s->stmt->list);
+    tc_debug(0, "%s holds a common subexpression\n", s->temp->name);
+}
+
+// replace the computation of 'v' with what 'avail' computed
+static int eliminate(struct ir_value *v, struct ir_value *avail)
+{
+    struct site *s = find_site(avail->node);
+
+    if (!s || (!s->temp && !s->movable))
+        return 0;
+    if (!s->temp)
+        move_to_temp(s);
+    set_ident(v->node, s->temp);
+    stats.eliminated++;
+    return 1;
+}
+
+static inline struct ir_value *value_number(struct ir_value *v)
+{
+    return gvn.vn[v->id] ? gvn.vn[v->id] : v;
+}
+
+static void kill(symbol_t *sym)
+{
+    ALLOC_GROW(gvn.kills, gvn.nr_kills + 1, gvn.alloc_kills);
+    gvn.kills[gvn.nr_kills].sym = sym;
+    gvn.kills[gvn.nr_kills++].gen = ++gvn.gen;
+}
+
+// whether the variable loaded by entry 'e' may have changed since
+static int killed(struct entry *e)
+{
+    for (int i = gvn.nr_kills - 1; i >= 0 && gvn.kills[i].gen > e->gen; i--)
+        if (!gvn.kills[i].sym || gvn.kills[i].sym == e->sym)
+            return 1;
+    return 0;
+}
+
+static struct entry *lookup(struct entry *key)
+{
+    for (int i = gvn.nr_table - 1; i >= 0; i--) {
+        struct entry *e = gvn.table + i;
+        if (e->op != key->op || e->tok != key->tok || e->num != key->num ||
+            e->sym != key->sym || e->a != key->a || e->b != key->b)
+            continue;
+        return e->op == IR_LOAD && killed(e) ? NULL : e;
+    }
+    return NULL;
+}
+
+static void insert(struct entry *key, struct ir_value *vn, struct ir_value *avail)
+{
+    ALLOC_GROW(gvn.table, gvn.nr_table + 1, gvn.alloc_table);
+    key->vn = vn;
+    key->avail = avail;
+    key->gen = gvn.gen;
+    gvn.table[gvn.nr_table++] = *key;
+}
+
+static int is_commutative(enum token_type tok)
+{
+    return tok == TOK_OPERATOR_ADD || tok == TOK_OPERATOR_MUL ||
+           tok == TOK_OPERATOR_EQUAL || tok == TOK_OPERATOR_NOT_EQUAL;
+}
+
+static void number_value(struct ir_value *v)
+{
+    struct entry key = { .op = v->op }, *e;
+
+    switch (v->op) {
+    case IR_CONST:
+        key.num = v->num;
+        break;
+    case IR_BINOP:
+        key.tok = v->tok;
+        key.a = value_number(v->args[0]);
+        key.b = value_number(v->args[1]);
+        if (is_commutative(v->tok) && key.a->id > key.b->id) {
+            key.a = key.b;
+            key.b = value_number(v->args[0]);
+        }
+        break;
+    case IR_LOAD:
+        key.sym = v->sym;
+        key.a = v->nr_args ? value_number(v->args[0]) : NULL;
+        break;
+    case IR_STORE:
+        kill(v->sym);
+        return;
+    case IR_CALL:
+        {
+            symbol_t *f = symbol_table_lookup(gvn.global, v->name, 0);
+            if (f && f->effects) // others can't see the globals
+                for (int i = 0; i < f->effects->nr_writes; i++)
+                    kill(f->effects->writes[i]);
+        }
+        return;
+    default: // every other value is different from the rest
+        return;
+    }
+    e = lookup(&key);
+    if (!e) {
+        insert(&key, v, v);
+        return;
+    }
+    gvn.vn[v->id] = e->vn;
+    // scalar loads are as cheap as reading a copy
+    if (!v->node || (v->op == IR_LOAD && !v->nr_args) || v->op == IR_CONST)
+        return;
+    if (!eliminate(v, e->avail))
+        insert(&key, e->vn, v); // later ones may reuse this one instead
+}
+
+static void number_block(struct ir_block *b)
+{
+    int nr_table = gvn.nr_table, nr_kills = gvn.nr_kills;
+    struct ir_value *v;
+
+    if (b->nr_preds > 1) // the other paths may write anything
+        kill(NULL);
+    list_for_each_entry(v, &b->insns, list) {
+        number_value(v);
+    }
+    for (int i = 0; i < b->nr_kids; i++)
+        number_block(b->kids[i]);
+    gvn.nr_table = nr_table;
+    gvn.nr_kills = nr_kills;
+}
+
+void number_values(cast_node_t *ast, struct ir_program *prog)
+{
+    struct ir_function *fn;
+    int eliminated = stats.eliminated;
+
+    gvn.global = ast->program.symbol_table;
+    list_for_each_entry(fn, &prog->functions, list) {
+        gvn.symtab = fn->decl->fun_declaration.symbol_table;
+        gvn.nr_sites = 0;
+        scan_stmt(fn->decl->fun_declaration.compound_stmt, gvn.symtab, 0);
+        gvn.vn = zalloc(fn->nr_values * sizeof(*gvn.vn));
+        number_block(fn->blocks[0]);
+        free(gvn.vn);
+    }
+    if (stats.eliminated > eliminated) // the new locals are written in loops
+        analyze_effects(ast);
+    print_stat("gvn", "expressions eliminated", stats.eliminated);
+}
@@ -0,0 +1,738 @@
+#include "tc.h"
+
+/*
+ * Function inlining over the CAST, run before fold_constants() so constant
+ * arguments fold into the inlined body and the loop passes see through the
+ * calls.
+ *
+ * A call to a small non-recursive function defined in the file is replaced
+ * with a copy of its body placed in front of the statement making the call.
+ * Parameters and locals of the callee become new locals of the caller, the
+ * arguments are assigned to them first and every return stores into a result
+ * local that takes the place of the call in the statement. Returns are only
+ * lowered when no code after them can run: a return ends its list, and the
+ * rest of the list after an if with returns moves into the branch that lacks
+ * one, as long as the other branch returns on every path.
+ *
+ * Moving the call in front of its statement must not change what the
+ * statement sees, so only the first call the statement evaluates is inlined,
+ * and only when what was evaluated before it can't be written by the callee.
+ * The bodies of while loops and both branches of if statements are statement
+ * lists of their own, but while conditions and the right operands of && and
+ * || are evaluated conditionally and are left alone.
+ */
+#define INLINE_SIZE 40 // CAST nodes of a callee worth its call overhead
+#define INLINE_MAX_SIZE 200 // for callees declared inline
+#define INLINE_CONST_BONUS 10 // per constant argument, it will fold into the body
+#define MAX_INLINE_SITES 64 // per caller, bounds the growth of the code
+
+struct callee {
+    cast_node_t *decl;
+    symbol_t *sym;
+    int size; // CAST nodes of the body
+    int ok; // -1 not checked yet
+    int stamp; // call graph walk
+};
+
+struct rename {
+    char *name;
+    symbol_t *sym; // new local of the caller
+    cast_node_t *arg; // or the argument itself when the parameter is read only
+};
+
+static struct {
+    struct callee *callees;
+    int nr_callees, alloc_callees;
+    int stamp;
+    symbol_table_t *symtab; // of the caller
+    int sites; // inlined into the caller
+    // scanning a statement for the call to inline
+    int impure, reads_global, no_pick;
+    // copying the body of a callee
+    struct callee *callee;
+    struct rename *map;
+    int nr_map, alloc_map;
+    symbol_t *result;
+} inl;
+
+static struct {
+    int inlined;
+} stats;
+
+static cast_node_t *new_compound(int line_number)
+{
+    cast_node_t *n = new_node(CAST_COMPOUND_STMT, line_number);
+
+    INIT_LIST_HEAD(&n->compound_stmt.stmts);
+    return n;
+}
+
+// sum of 'fn' over every statement and expression of the tree 'node'
+static int visit_nodes(cast_node_t *node, int (*fn)(cast_node_t *node))
+{
+    int n;
+
+    if (!node)
+        return 0;
+    n = fn(node);
+    switch (node->type) {
+    case CAST_VAR_DECLARATION:
+        n += visit_nodes(node->var_declaration.var_declarator_list, fn);
+        break;
+    case CAST_VAR_DECLARATOR_LIST:
+        {
+            cast_node_t *var_declarator;
+            list_for_each_entry(var_declarator, &node->var_declarator_list.var_declarators, list) {
+                n += visit_nodes(var_declarator, fn);
+            }
+        }
+        break;
+    case CAST_VAR_DECLARATOR:
+        n += visit_nodes(node->var_declarator.expr, fn);
+        break;
+    case CAST_COMPOUND_STMT:
+        {
+            cast_node_t *s;
+            list_for_each_entry(s, &node->compound_stmt.stmts, list) {
+                n += visit_nodes(s, fn);
+            }
+        }
+        break;
+    case CAST_ASSIGN_STMT:
+        n += visit_nodes(node->assign_stmt.array_expr, fn);
+        n += visit_nodes(node->assign_stmt.expr, fn);
+        break;
+    case CAST_IF_STMT:
+        n += visit_nodes(node->if_stmt.expr, fn);
+        n += visit_nodes(node->if_stmt.if_stmt, fn);
+        n += visit_nodes(node->if_stmt.else_stmt, fn);
+        break;
+    case CAST_WHILE_STMT:
+        n += visit_nodes(node->while_stmt.expr, fn);
+        n += visit_nodes(node->while_stmt.stmt, fn);
+        break;
+    case CAST_RETURN_STMT:
+        n += visit_nodes(node->return_stmt.expr, fn);
+        break;
+    case CAST_CALL_STMT:
+        n += visit_nodes(node->call_stmt.expr, fn);
+        break;
+    case CAST_CALL_EXPR:
+        {
+            cast_node_t *arg;
+            list_for_each_entry(arg, &node->call_expr.args_list, list) {
+                n += visit_nodes(arg, fn);
+            }
+        }
+        break;
+    case CAST_LOGICAL_EXPR:
+    case CAST_RELATIONAL_EXPR:
+    case CAST_SIMPLE_EXPR:
+    case CAST_TERM:
+        n += visit_nodes(node->expr.op.left, fn);
+        n += visit_nodes(node->expr.op.right, fn);
+        break;
+    case CAST_IDENTIFIER:
+        n += visit_nodes(node->expr.array_expr, fn);
+        break;
+    default:
+        break;
+    }
+    return n;
+}
+
+static int one(cast_node_t *node)
+{
+    return 1;
+}
+
+static int is_return(cast_node_t *node)
+{
+    return node->type == CAST_RETURN_STMT;
+}
+
+// a block with declarations of its own, its symbols are not in the function scope
+static int is_block(cast_node_t *node)
+{
+    return node->type == CAST_COMPOUND_STMT && node->compound_stmt.symbol_table;
+}
+
+static int always_returns(cast_node_t *node)
+{
+    if (!node)
+        return 0;
+    switch (node->type) {
+    case CAST_RETURN_STMT:
+        return 1;
+    case CAST_COMPOUND_STMT:
+        {
+            cast_node_t *s;
+            list_for_each_entry(s, &node->compound_stmt.stmts, list) {
+                if (always_returns(s))
+                    return 1;
+            }
+        }
+        return 0;
+    case CAST_IF_STMT:
+        return always_returns(node->if_stmt.if_stmt) && always_returns(node->if_stmt.else_stmt);
+    default:
+        return 0;
+    }
+}
+
+static struct callee *find_callee(char *name)
+{
+    for (int i = 0; i < inl.nr_callees; i++)
+        if (!strcmp(inl.callees[i].decl->fun_declaration.identifier, name))
+            return inl.callees + i;
+    return NULL;
+}
+
+// whether 'f' can reach 'target' in the call graph
+static int reaches(struct callee *f, struct callee *target)
+{
+    f->stamp = inl.stamp;
+    for (int i = 0; i < f->sym->effects->nr_calls; i++) {
+        struct callee *g = find_callee(f->sym->effects->calls[i]);
+        if (!g)
+            continue; // library function
+        if (g == target)
+            return 1;
+        if (g->stamp != inl.stamp && reaches(g, target))
+            return 1;
+    }
+    return 0;
+}
+
+static struct rename *find_rename(char *name)
+{
+    for (int i = 0; i < inl.nr_map; i++)
+        if (!strcmp(inl.map[i].name, name))
+            return inl.map + i;
+    return NULL;
+}
+
+static char *new_name(char *name)
+{
+    struct rename *r = find_rename(name);
+
+    return r ? r->sym->name : name;
+}
+
+// map the symbols of 'f' not mapped yet to new locals of the caller, or to themselves
+static void map_symbols(struct callee *f, int temps)
+{
+    symbol_table_t *t = f->decl->fun_declaration.symbol_table;
+
+    for (int i = 0; i < TABLE_SIZE; i++) {
+        struct hlist_node *node;
+        hlist_for_each(node, t->table + i) {
+            symbol_t *s = hlist_entry(node, symbol_t, list);
+            struct rename *r;
+            if (find_rename(s->name))
+                continue; // parameter
+            ALLOC_GROW(inl.map, inl.nr_map + 1, inl.alloc_map);
+            r = inl.map + inl.nr_map++;
+            r->name = s->name;
+            r->sym = temps ? symbol_table_add_temp(inl.symtab, "l") : s;
+            r->arg = NULL;
+        }
+    }
+}
+
+static cast_node_t *clone_expr(cast_node_t *node)
+{
+    struct rename *r;
+    cast_node_t *n;
+
+    if (!node)
+        return NULL;
+    if (node->type == CAST_IDENTIFIER && (r = find_rename(node->expr.identifier)) && r->arg)
+        return copy_node(r->arg); // a number or a scalar of the caller
+    n = copy_node(node);
+    switch (node->type) {
+    case CAST_IDENTIFIER:
+        n->expr.identifier = new_name(node->expr.identifier);
+        n->expr.array_expr = clone_expr(node->expr.array_expr);
+        break;
+    case CAST_CALL_EXPR:
+        {
+            cast_node_t *arg;
+            INIT_LIST_HEAD(&n->call_expr.args_list);
+            list_for_each_entry(arg, &node->call_expr.args_list, list) {
+                list_add_tail(&clone_expr(arg)->list, &n->call_expr.args_list);
+            }
+        }
+        break;
+    case CAST_LOGICAL_EXPR:
+    case CAST_RELATIONAL_EXPR:
+    case CAST_SIMPLE_EXPR:
+    case CAST_TERM:
+        n->expr.op.left = clone_expr(node->expr.op.left);
+        n->expr.op.right = clone_expr(node->expr.op.right);
+        break;
+    default:
+        break;
+    }
+    return n;
+}
+
+static void clone_stmt(cast_node_t *node, struct list_head *out);
+
+// statements of branch 'node' as a new compound statement
+static cast_node_t *clone_branch(cast_node_t *node)
+{
+    cast_node_t *c, *s;
+
+    if (!node)
+        return NULL;
+    c = new_compound(node->line_number);
+    if (node->type != CAST_COMPOUND_STMT) {
+        clone_stmt(node, &c->compound_stmt.stmts);
+        return c;
+    }
+    list_for_each_entry(s, &node->compound_stmt.stmts, list) {
+        clone_stmt(s, &c->compound_stmt.stmts);
+    }
+    return c;
+}
+
+// copy statement 'node' without returns into 'out', declarations become assignments
+static void clone_stmt(cast_node_t *node, struct list_head *out)
+{
+    cast_node_t *n;
+
+    switch (node->type) {
+    case CAST_VAR_DECLARATION:
+        {
+            cast_node_t *d;
+            list_for_each_entry(d, &node->var_declaration.var_declarator_list->var_declarator_list.var_declarators, list) {
+                if (!d->var_declarator.expr)
+                    continue;
+                n = new_assign(find_rename(d->var_declarator.identifier)->sym,
+                               clone_expr(d->var_declarator.expr));
+                list_add_tail(&n->list, out);
+            }
+        }
+        return;
+    case CAST_COMPOUND_STMT:
+        n = clone_branch(node);
+        break;
+    case CAST_ASSIGN_STMT:
+        n = copy_node(node);
+        n->assign_stmt.identifier = new_name(node->assign_stmt.identifier);
+        n->assign_stmt.array_expr = clone_expr(node->assign_stmt.array_expr);
+        n->assign_stmt.expr = clone_expr(node->assign_stmt.expr);
+        break;
+    case CAST_IF_STMT:
+        n = copy_node(node);
+        n->if_stmt.expr = clone_expr(node->if_stmt.expr);
+        n->if_stmt.if_stmt = clone_branch(node->if_stmt.if_stmt);
+        n->if_stmt.else_stmt = clone_branch(node->if_stmt.else_stmt);
+        break;
+    case CAST_WHILE_STMT:
+        n = copy_node(node);
+        n->while_stmt.expr = clone_expr(node->while_stmt.expr);
+        n->while_stmt.stmt = clone_branch(node->while_stmt.stmt);
+        n->while_stmt.effects = NULL;
+        break;
+    case CAST_CALL_STMT:
+        n = copy_node(node);
+        n->call_stmt.expr = clone_expr(node->call_stmt.expr);
+        break;
+    default:
+        panic("unexpected statement at line %d\n", node->line_number);
+    }
+    list_add_tail(&n->list, out);
+}
+
+// the statements of 'node' followed by 'rest'
+static cast_node_t **join_stmts(cast_node_t *node, cast_node_t **rest, int nr_rest, int *nr)
+{
+    cast_node_t **stmts, *s;
+    int n = 0;
+
+    if (node && node->type == CAST_COMPOUND_STMT)
+        n = list_size(&node->compound_stmt.stmts);
+    else if (node)
+        n = 1;
+    stmts = zalloc((n + nr_rest + 1) * sizeof(cast_node_t *));
+    n = 0;
+    if (node && node->type == CAST_COMPOUND_STMT) {
+        list_for_each_entry(s, &node->compound_stmt.stmts, list) {
+            stmts[n++] = s;
+        }
+    } else if (node)
+        stmts[n++] = node;
+    memcpy(stmts + n, rest, nr_rest * sizeof(cast_node_t *));
+    *nr = n + nr_rest;
+    return stmts;
+}
+
+// copy the statement list 'stmts' into 'out' storing returned values in the result
+static int lower_stmts(cast_node_t **stmts, int nr, struct list_head *out)
+{
+    for (int i = 0; i < nr; i++) {
+        cast_node_t *s = stmts[i], *n, **branch;
+        int nr_branch;
+
+        if (!visit_nodes(s, is_return)) {
+            clone_stmt(s, out);
+            continue;
+        }
+        switch (s->type) {
+        case CAST_RETURN_STMT:
+            if (s->return_stmt.expr && inl.result) {
+                n = new_assign(inl.result, clone_expr(s->return_stmt.expr));
+                list_add_tail(&n->list, out);
+            }
+            return 1; // the rest is unreachable
+        case CAST_COMPOUND_STMT:
+            branch = join_stmts(s, stmts + i + 1, nr - i - 1, &nr_branch);
+            return lower_stmts(branch, nr_branch, out);
+        case CAST_IF_STMT:
+            n = copy_node(s);
+            n->if_stmt.expr = clone_expr(s->if_stmt.expr);
+            n->if_stmt.if_stmt = new_compound(s->line_number);
+            n->if_stmt.else_stmt = new_compound(s->line_number);
+            list_add_tail(&n->list, out);
+            for (int k = 0; k < 2; k++) {
+                cast_node_t *b = k ? s->if_stmt.else_stmt : s->if_stmt.if_stmt;
+                cast_node_t *c = k ? n->if_stmt.else_stmt : n->if_stmt.if_stmt;
+
+                cast_node_t *other = k ? s->if_stmt.if_stmt : s->if_stmt.else_stmt;
+
+                if (always_returns(b))
+                    branch = join_stmts(b, NULL, 0, &nr_branch);
+                else if (always_returns(other) || !visit_nodes(other, is_return))
+                    branch = join_stmts(b, stmts + i + 1, nr - i - 1, &nr_branch);
+                else
+                    return 0; // both would need the rest of the list
+                if (!lower_stmts(branch, nr_branch, &c->compound_stmt.stmts))
+                    return 0;
+            }
+            return 1;
+        default:
+            return 0; // return in a loop
+        }
+    }
+    return 1;
+}
+
+static int has_array(symbol_table_t *t)
+{
+    for (int i = 0; i < TABLE_SIZE; i++) {
+        struct hlist_node *node;
+        hlist_for_each(node, t->table + i) {
+            symbol_t *s = hlist_entry(node, symbol_t, list);
+            if (s->array_size)
+                return 1;
+        }
+    }
+    return 0;
+}
+
+// the properties of the callee that don't depend on the call site
+static int inlinable(struct callee *f)
+{
+    cast_node_t *d = f->decl, **body;
+    struct list_head out;
+    int nr;
+
+    if (f->ok != -1)
+        return f->ok;
+    f->ok = 0;
+    if (!d->fun_declaration.compound_stmt || !strcmp(d->fun_declaration.identifier, "main"))
+        return 0;
+    if (has_array(d->fun_declaration.symbol_table) ||
+        visit_nodes(d->fun_declaration.compound_stmt, is_block))
+        return 0;
+    inl.stamp++;
+    if (reaches(f, f))
+        return 0; // recursive
+    inl.nr_map = 0;
+    map_symbols(f, 0);
+    inl.result = NULL;
+    INIT_LIST_HEAD(&out);
+    body = join_stmts(d->fun_declaration.compound_stmt, NULL, 0, &nr);
+    if (!lower_stmts(body, nr, &out))
+        return 0;
+    f->size = visit_nodes(d->fun_declaration.compound_stmt, one);
+    f->ok = 1;
+    return 1;
+}
+
+// names the callee takes from the file scope and the caller declares itself
+static int shadowed(cast_node_t *node)
+{
+    char *name;
+
+    if (node->type == CAST_IDENTIFIER)
+        name = node->expr.identifier;
+    else if (node->type == CAST_ASSIGN_STMT)
+        name = node->assign_stmt.identifier;
+    else
+        return 0;
+    return !symbol_table_lookup(inl.callee->decl->fun_declaration.symbol_table, name, 0) &&
+           symbol_table_lookup(inl.symtab, name, 0);
+}
+
+static int assigns_param(cast_node_t *node)
+{
+    return node->type == CAST_ASSIGN_STMT && !strcmp(node->assign_stmt.identifier, inl.map[inl.nr_map].name);
+}
+
+static struct callee *worth_inlining(cast_node_t *call)
+{
+    struct callee *f = find_callee(call->call_expr.identifier);
+    int budget, args = 0;
+    cast_node_t *arg;
+
+    if (!f || inl.sites == MAX_INLINE_SITES || !inlinable(f))
+        return NULL;
+    budget = f->decl->fun_declaration.is_inline ? INLINE_MAX_SIZE : INLINE_SIZE;
+    list_for_each_entry(arg, &call->call_expr.args_list, list) {
+        if (arg->type == CAST_STRING)
+            return NULL;
+        if (arg->type == CAST_NUMBER)
+            budget += INLINE_CONST_BONUS;
+        args++;
+    }
+    if (args != f->sym->arg_count || f->size > budget)
+        return NULL;
+    inl.callee = f;
+    if (visit_nodes(f->decl->fun_declaration.compound_stmt, shadowed))
+        return NULL;
+    return f;
+}
+
+/*
+ * Walk 'node' in evaluation order up to the first call, which is returned if
+ * it can be moved in front of the statement.
+ */
+static cast_node_t *find_call(cast_node_t *node)
+{
+    cast_node_t *call;
+    symbol_t *sym;
+
+    if (!node || inl.impure)
+        return NULL;
+    switch (node->type) {
+    case CAST_IDENTIFIER:
+        if ((call = find_call(node->expr.array_expr)))
+            return call;
+        sym = symbol_table_lookup(inl.symtab, node->expr.identifier, 1);
+        if (!sym->index)
+            inl.reads_global = 1;
+        return NULL;
+    case CAST_CALL_EXPR:
+        {
+            struct callee *f;
+            cast_node_t *arg;
+            list_for_each_entry(arg, &node->call_expr.args_list, list) {
+                if ((call = find_call(arg)))
+                    return call;
+            }
+            if (inl.impure)
+                return NULL;
+            inl.impure = 1;
+            if (inl.no_pick || !(f = worth_inlining(node)))
+                return NULL;
+            if (inl.reads_global && f->sym->effects->nr_writes)
+                return NULL; // a global read before may change in the call
+            return node;
+        }
+    case CAST_LOGICAL_EXPR:
+        if ((call = find_call(node->expr.op.left)))
+            return call;
+        inl.no_pick++; // short-circuited
+        call = find_call(node->expr.op.right);
+        inl.no_pick--;
+        return call;
+    case CAST_RELATIONAL_EXPR:
+    case CAST_SIMPLE_EXPR:
+    case CAST_TERM:
+        if ((call = find_call(node->expr.op.left)))
+            return call;
+        return find_call(node->expr.op.right);
+    default:
+        return NULL;
+    }
+}
+
+static cast_node_t *find_site(cast_node_t *stmt)
+{
+    inl.impure = inl.reads_global = inl.no_pick = 0;
+    switch (stmt->type) {
+    case CAST_VAR_DECLARATION:
+        {
+            cast_node_t *d;
+            list_for_each_entry(d, &stmt->var_declaration.var_declarator_list->var_declarator_list.var_declarators, list) {
+                if (d->var_declarator.expr)
+                    return find_call(d->var_declarator.expr); // the later ones see it initialized
+            }
+        }
+        return NULL;
+    case CAST_ASSIGN_STMT:
+        {
+            cast_node_t *call = find_call(stmt->assign_stmt.array_expr);
+            return call ? call : find_call(stmt->assign_stmt.expr);
+        }
+    case CAST_IF_STMT:
+        return find_call(stmt->if_stmt.expr);
+    case CAST_RETURN_STMT:
+        return find_call(stmt->return_stmt.expr);
+    case CAST_CALL_STMT:
+        return find_call(stmt->call_stmt.expr);
+    default:
+        return NULL;
+    }
+}
+
+// replace 'call' in statement 'stmt' with the body of the callee
+static void inline_call(cast_node_t *stmt, cast_node_t *call)
+{
+    struct callee *f = find_callee(call->call_expr.identifier);
+    cast_node_t *d = f->decl, *param, *arg, **body, *n;
+    int unused = stmt->type == CAST_CALL_STMT && stmt->call_stmt.expr == call;
+    struct list_head out;
+    int nr;
+
+    INIT_LIST_HEAD(&out);
+    inl.nr_map = 0;
+    arg = list_first_entry(&call->call_expr.args_list, cast_node_t, list);
+    if (d->fun_declaration.param_list) {
+        list_for_each_entry(param, &d->fun_declaration.param_list->param_list.params, list) {
+            cast_node_t *next = list_next_entry(arg, list);
+            struct rename *r;
+
+            ALLOC_GROW(inl.map, inl.nr_map + 1, inl.alloc_map);
+            r = inl.map + inl.nr_map;
+            r->name = param->param.identifier;
+            r->sym = NULL;
+            r->arg = NULL;
+            if (arg->type == CAST_NUMBER || local_scalar(inl.symtab, arg)) {
+                if (!visit_nodes(d->fun_declaration.compound_stmt, assigns_param))
+                    r->arg = arg;
+            }
+            if (!r->arg) {
+                r->sym = symbol_table_add_temp(inl.symtab, "p");
+                list_del(&arg->list);
+                n = new_assign(r->sym, arg);
+                list_add_tail(&n->list, &out);
+            }
+            inl.nr_map++;
+            arg = next;
+        }
+    }
+    map_symbols(f, 1);
+    inl.result = NULL;
+    if (d->fun_declaration.type != TOK_KEYWORD_VOID || !unused)
+        inl.result = symbol_table_add_temp(inl.symtab, "r");
+    body = join_stmts(d->fun_declaration.compound_stmt, NULL, 0, &nr);
+    if (!lower_stmts(body, nr, &out))
+        panic("can't inline %s\n", d->fun_declaration.identifier);
+
+    tc_debug(0, "inline %s into %s\n", d->fun_declaration.identifier, inl.symtab->name);
+    if (!list_empty(&out))
+        __list_splice(&out, stmt->list.prev, &stmt->list);
+    if (unused) {
+        list_del(&stmt->list);
+    } else {
+        call->type = CAST_IDENTIFIER;
+        call->expr.identifier = inl.result->name;
+        call->expr.array_expr = NULL;
+    }
+    inl.sites++;
+    stats.inlined++;
+}
+
+static void inline_list(struct list_head *stmts);
+
+static void inline_nested(cast_node_t *stmt);
+
+// inline into branch 'slot' of an if or while, making it a list when needed
+static void inline_branch(cast_node_t **slot)
+{
+    cast_node_t *s = *slot, *c;
+
+    if (!s)
+        return;
+    if (s->type != CAST_COMPOUND_STMT) {
+        if (!find_site(s)) {
+            inline_nested(s);
+            return;
+        }
+        c = new_compound(s->line_number);
+        list_add_tail(&s->list, &c->compound_stmt.stmts);
+        *slot = c;
+    }
+    inline_list(&(*slot)->compound_stmt.stmts);
+}
+
+static void inline_nested(cast_node_t *stmt)
+{
+    switch (stmt->type) {
+    case CAST_COMPOUND_STMT:
+        inline_list(&stmt->compound_stmt.stmts);
+        break;
+    case CAST_IF_STMT:
+        inline_branch(&stmt->if_stmt.if_stmt);
+        inline_branch(&stmt->if_stmt.else_stmt);
+        break;
+    case CAST_WHILE_STMT:
+        inline_branch(&stmt->while_stmt.stmt);
+        break;
+    default:
+        break;
+    }
+}
+
+static void inline_list(struct list_head *stmts)
+{
+    struct list_node *pos = stmts->n.next;
+
+    while (pos != &stmts->n) {
+        cast_node_t *s = list_entry(pos, cast_node_t, list), *call;
+        struct list_node *prev = pos->prev;
+
+        if ((call = find_site(s))) {
+            inline_call(s, call);
+            pos = prev->next; // the inlined body may have calls of its own
+            continue;
+        }
+        inline_nested(s);
+        pos = pos->next;
+    }
+}
+
+void inline_functions(cast_node_t *ast)
+{
+    symbol_table_t *global = ast->program.symbol_table;
+    cast_node_t *d;
+
+    if (options.no_inline)
+        goto out;
+    list_for_each_entry(d, &ast->program.declarations, list) {
+        struct callee *f;
+        if (d->type != CAST_FUN_DECLARATION)
+            continue;
+        ALLOC_GROW(inl.callees, inl.nr_callees + 1, inl.alloc_callees);
+        f = inl.callees + inl.nr_callees++;
+        f->decl = d;
+        f->sym = symbol_table_lookup(global, d->fun_declaration.identifier, 0);
+        f->ok = -1;
+        f->stamp = 0;
+    }
+    list_for_each_entry(d, &ast->program.declarations, list) {
+        if (d->type != CAST_FUN_DECLARATION || !d->fun_declaration.compound_stmt)
+            continue;
+        inl.symtab = d->fun_declaration.symbol_table;
+        inl.sites = 0;
+        inline_list(&d->fun_declaration.compound_stmt->compound_stmt.stmts);
+    }
+    if (stats.inlined)
+        analyze_effects(ast); // the loops now write the new locals
+out:
+    print_stat("inline", "calls inlined", stats.inlined);
+}
@@ -0,0 +1,796 @@
+#include "tc.h"
+
+/*
+ * SSA IR construction, run after the CAST passes. The IR of a function is
+ * built in a single walk of its CAST with the algorithm of Braun et al.,
+ * "Simple and Efficient Construction of Static Single Assignment Form":
+ * every block maps the variables to their current value, a read in a block
+ * without one looks it up in the preds and places a phi where they may
+ * disagree. A block is sealed once all its preds are known, phis asked for
+ * earlier are completed then. Phis whose operands are all the same value or
+ * the phi itself are replaced with that value right away.
+ *
+ * The dominator tree is computed afterwards with the iterative algorithm of
+ * Cooper, Harvey and Kennedy over the blocks in reverse postorder, and
+ * ir_verify() checks the result before anything relies on it.
+ */
+static struct {
+    struct ir_function *fn;
+    struct ir_block *cur; // NULL once the code can't be reached
+    struct ir_block **blocks; // every block created, reachable or not
+    int nr_blocks, alloc_blocks;
+    symbol_t **vars; // the variables kept in SSA form
+    int nr_vars, alloc_vars;
+    struct ir_value *undef;
+} ir;
+
+static struct ir_block *new_block(void)
+{
+    struct ir_block *b = zalloc(sizeof(struct ir_block));
+
+    INIT_LIST_HEAD(&b->insns);
+    ALLOC_GROW(ir.blocks, ir.nr_blocks + 1, ir.alloc_blocks);
+    ir.blocks[ir.nr_blocks++] = b;
+    return b;
+}
+
+static void add_user(struct ir_value *v, struct ir_value *user)
+{
+    ALLOC_GROW(v->users, v->nr_users + 1, v->alloc_users);
+    v->users[v->nr_users++] = user;
+}
+
+static void remove_user(struct ir_value *v, struct ir_value *user)
+{
+    for (int i = 0; i < v->nr_users; i++) {
+        if (v->users[i] == user) {
+            v->users[i] = v->users[--v->nr_users];
+            return;
+        }
+    }
+}
+
+static void add_arg(struct ir_value *v, struct ir_value *arg)
+{
+    ALLOC_GROW(v->args, v->nr_args + 1, v->alloc_args);
+    v->args[v->nr_args++] = arg;
+    add_user(arg, v);
+}
+
+static struct ir_value *new_value(enum ir_opcode op, cast_node_t *node)
+{
+    struct ir_value *v = zalloc(sizeof(struct ir_value));
+
+    v->op = op;
+    v->node = node;
+    return v;
+}
+
+// append 'v' to the current block
+static struct ir_value *emit(struct ir_value *v)
+{
+    v->block = ir.cur;
+    list_add_tail(&v->list, &ir.cur->insns);
+    return v;
+}
+
+static struct ir_value *emit_const(int num, cast_node_t *node)
+{
+    struct ir_value *v = new_value(IR_CONST, node);
+
+    v->num = num;
+    return emit(v);
+}
+
+static struct ir_value *emit_binop(enum token_type tok, struct ir_value *l,
+                                   struct ir_value *r, cast_node_t *node)
+{
+    struct ir_value *v = new_value(IR_BINOP, node);
+
+    v->tok = tok;
+    add_arg(v, l);
+    add_arg(v, r);
+    return emit(v);
+}
+
+static void add_edge(struct ir_block *from, struct ir_block *to)
+{
+    from->succs[from->nr_succs++] = to;
+    ALLOC_GROW(to->preds, to->nr_preds + 1, to->alloc_preds);
+    to->preds[to->nr_preds++] = from;
+}
+
+static void emit_jmp(struct ir_block *to, cast_node_t *node)
+{
+    emit(new_value(IR_JMP, node));
+    add_edge(ir.cur, to);
+    ir.cur = NULL;
+}
+
+static void emit_br(struct ir_value *cond, struct ir_block *t, struct ir_block *f, cast_node_t *node)
+{
+    struct ir_value *v = new_value(IR_BR, node);
+
+    add_arg(v, cond);
+    emit(v);
+    add_edge(ir.cur, t);
+    add_edge(ir.cur, f);
+    ir.cur = NULL;
+}
+
+// scalar locals and parameters are kept in SSA form, the rest in memory
+int is_ssa_var(symbol_t *sym)
+{
+    return sym->index && !sym->array_size && !sym->symbol_type;
+}
+
+static int var_id(symbol_t *sym)
+{
+    for (int i = 0; i < ir.nr_vars; i++)
+        if (ir.vars[i] == sym)
+            return i;
+    ALLOC_GROW(ir.vars, ir.nr_vars + 1, ir.alloc_vars);
+    ir.vars[ir.nr_vars] = sym;
+    return ir.nr_vars++;
+}
+
+static void write_var(symbol_t *sym, struct ir_block *b, struct ir_value *v)
+{
+    int id = var_id(sym), alloc = b->alloc_defs;
+
+    ALLOC_GROW(b->defs, id + 1, b->alloc_defs);
+    memset(b->defs + alloc, 0, (b->alloc_defs - alloc) * sizeof(*b->defs));
+    b->defs[id] = v;
+}
+
+static struct ir_value *new_phi(symbol_t *sym, struct ir_block *b)
+{
+    struct ir_value *phi = new_value(IR_PHI, NULL);
+
+    phi->sym = sym;
+    phi->block = b;
+    list_add(&phi->list, &b->insns);
+    return phi;
+}
+
+static struct ir_value *get_undef(void)
+{
+    struct ir_block *entry = ir.fn->blocks[0];
+
+    if (!ir.undef) {
+        ir.undef = new_value(IR_UNDEF, NULL);
+        ir.undef->block = entry;
+        list_add(&ir.undef->list, &entry->insns);
+    }
+    return ir.undef;
+}
+
+// replace every use of 'v' with 'with'
+static void replace_uses(struct ir_value *v, struct ir_value *with)
+{
+    for (int i = 0; i < v->nr_users; i++) {
+        struct ir_value *u = v->users[i];
+        for (int j = 0; j < u->nr_args; j++)
+            if (u->args[j] == v)
+                u->args[j] = with;
+        add_user(with, u);
+    }
+    v->nr_users = 0;
+}
+
+static struct ir_value *try_remove_trivial_phi(struct ir_value *phi)
+{
+    struct ir_value *same = NULL, **users;
+    int nr_users;
+
+    for (int i = 0; i < phi->nr_args; i++) {
+        struct ir_value *op = phi->args[i];
+        if (op == same || op == phi)
+            continue;
+        if (same) // merges at least two values
+            return phi;
+        same = op;
+    }
+    if (!same) // unreachable or only reads itself
+        same = get_undef();
+    // the uses of phi, without itself, may become trivial in turn
+    nr_users = phi->nr_users;
+    users = malloc(nr_users * sizeof(*users));
+    memcpy(users, phi->users, nr_users * sizeof(*users));
+    for (int i = 0; i < phi->nr_args; i++)
+        remove_user(phi->args[i], phi);
+    for (int i = 0; i < phi->nr_users; i++) // a self use goes away with phi
+        if (phi->users[i] == phi)
+            phi->users[i--] = phi->users[--phi->nr_users];
+    replace_uses(phi, same);
+    list_del(&phi->list);
+    phi->forward = same;
+    for (int i = 0; i < nr_users; i++)
+        if (users[i] != phi && users[i]->op == IR_PHI && !users[i]->forward)
+            try_remove_trivial_phi(users[i]);
+    free(users);
+    return same;
+}
+
+static struct ir_value *read_var(symbol_t *sym, struct ir_block *b);
+
+static struct ir_value *add_phi_operands(struct ir_value *phi)
+{
+    for (int i = 0; i < phi->block->nr_preds; i++)
+        add_arg(phi, read_var(phi->sym, phi->block->preds[i]));
+    return try_remove_trivial_phi(phi);
+}
+
+static struct ir_value *read_var_recursive(symbol_t *sym, struct ir_block *b)
+{
+    struct ir_value *v;
+
+    if (!b->sealed) { // completed when the last pred is added
+        v = new_phi(sym, b);
+        ALLOC_GROW(b->incomplete, b->nr_incomplete + 1, b->alloc_incomplete);
+        b->incomplete[b->nr_incomplete++] = v;
+    } else if (b->nr_preds == 0) {
+        v = get_undef();
+    } else if (b->nr_preds == 1) {
+        v = read_var(sym, b->preds[0]);
+    } else { // the phi breaks cycles of reads through loops
+        v = new_phi(sym, b);
+        write_var(sym, b, v);
+        v = add_phi_operands(v);
+    }
+    write_var(sym, b, v);
+    return v;
+}
+
+static struct ir_value *read_var(symbol_t *sym, struct ir_block *b)
+{
+    int id = var_id(sym);
+    struct ir_value *v = id < b->alloc_defs ? b->defs[id] : NULL;
+
+    if (!v)
+        return read_var_recursive(sym, b);
+    while (v->forward)
+        v = v->forward;
+    return v;
+}
+
+static void seal_block(struct ir_block *b)
+{
+    for (int i = 0; i < b->nr_incomplete; i++)
+        add_phi_operands(b->incomplete[i]);
+    b->nr_incomplete = 0;
+    b->sealed = 1;
+}
+
+static struct ir_value *build_expr(cast_node_t *node, symbol_table_t *symtab);
+
+// && and || evaluate the right operand only when the left one doesn't decide
+static struct ir_value *build_logical(cast_node_t *node, symbol_table_t *symtab)
+{
+    int and = node->expr.op.type == TOK_OPERATOR_LOGICAL_AND;
+    struct ir_block *rhs = new_block(), *join = new_block();
+    struct ir_value *l, *r, *decided, *phi;
+
+    l = build_expr(node->expr.op.left, symtab);
+    decided = emit_const(!and, NULL); // no CAST node computes these
+    if (and)
+        emit_br(l, rhs, join, node);
+    else
+        emit_br(l, join, rhs, node);
+    seal_block(rhs);
+    ir.cur = rhs;
+    r = build_expr(node->expr.op.right, symtab);
+    r = emit_binop(TOK_OPERATOR_NOT_EQUAL, r, emit_const(0, NULL), NULL);
+    emit_jmp(join, node);
+    seal_block(join);
+    ir.cur = join;
+    phi = new_phi(NULL, join);
+    phi->node = node;
+    add_arg(phi, decided);
+    add_arg(phi, r);
+    return phi;
+}
+
+// branch to 't' or 'f', && and || jump straight to where they are decided
+static void build_cond(cast_node_t *node, symbol_table_t *symtab,
+                       struct ir_block *t, struct ir_block *f)
+{
+    struct ir_block *rhs;
+
+    if (node->type != CAST_LOGICAL_EXPR) {
+        emit_br(build_expr(node, symtab), t, f, node);
+        return;
+    }
+    rhs = new_block();
+    if (node->expr.op.type == TOK_OPERATOR_LOGICAL_AND)
+        build_cond(node->expr.op.left, symtab, rhs, f);
+    else
+        build_cond(node->expr.op.left, symtab, t, rhs);
+    seal_block(rhs);
+    ir.cur = rhs;
+    build_cond(node->expr.op.right, symtab, t, f);
+}
+
+static struct ir_value *build_expr(cast_node_t *node, symbol_table_t *symtab)
+{
+    struct ir_value *v;
+
+    switch (node->type) {
+    case CAST_NUMBER:
+        return emit_const(node->expr.num, node);
+    case CAST_STRING:
+        v = new_value(IR_STR, node);
+        v->name = node->expr.string;
+        return emit(v);
+    case CAST_IDENTIFIER:
+        {
+            symbol_t *sym = symbol_table_lookup(symtab, node->expr.identifier, 1);
+            if (!node->expr.array_expr && is_ssa_var(sym))
+                return read_var(sym, ir.cur);
+            v = new_value(IR_LOAD, node);
+            v->sym = sym;
+            if (node->expr.array_expr)
+                add_arg(v, build_expr(node->expr.array_expr, symtab));
+            return emit(v);
+        }
+    case CAST_CALL_EXPR:
+        {
+            cast_node_t *arg;
+            v = new_value(IR_CALL, node);
+            v->name = node->call_expr.identifier;
+            list_for_each_entry(arg, &node->call_expr.args_list, list) {
+                add_arg(v, build_expr(arg, symtab));
+            }
+            return emit(v);
+        }
+    case CAST_LOGICAL_EXPR:
+        return build_logical(node, symtab);
+    case CAST_RELATIONAL_EXPR:
+    case CAST_SIMPLE_EXPR:
+    case CAST_TERM:
+        {
+            struct ir_value *l = build_expr(node->expr.op.left, symtab);
+            struct ir_value *r = build_expr(node->expr.op.right, symtab);
+            return emit_binop(node->expr.op.type, l, r, node);
+        }
+    default:
+        panic("unexpected expression %d\n", node->type);
+    }
+}
+
+static void build_assign(symbol_t *sym, cast_node_t *index, cast_node_t *expr,
+                         cast_node_t *node, symbol_table_t *symtab)
+{
+    struct ir_value *v, *idx = NULL;
+
+    if (index)
+        idx = build_expr(index, symtab);
+    v = build_expr(expr, symtab);
+    if (!idx && is_ssa_var(sym)) {
+        struct ir_function *fn = ir.fn;
+        ALLOC_GROW(fn->defs, fn->nr_defs + 1, fn->alloc_defs);
+        fn->defs[fn->nr_defs].node = node;
+        fn->defs[fn->nr_defs++].value = v;
+        write_var(sym, ir.cur, v);
+        return;
+    }
+    struct ir_value *store = new_value(IR_STORE, node);
+    store->sym = sym;
+    if (idx)
+        add_arg(store, idx);
+    add_arg(store, v);
+    emit(store);
+}
+
+static void build_stmt(cast_node_t *node, symbol_table_t *symtab)
+{
+    if (!node || !ir.cur) // nothing after a return runs
+        return;
+    switch (node->type) {
+    case CAST_COMPOUND_STMT:
+        {
+            cast_node_t *stmt;
+            list_for_each_entry(stmt, &node->compound_stmt.stmts, list) {
+                if (stmt->type == CAST_COMPOUND_STMT && stmt->compound_stmt.symbol_table)
+                    build_stmt(stmt, stmt->compound_stmt.symbol_table);
+                else
+                    build_stmt(stmt, symtab);
+            }
+        }
+        break;
+    case CAST_VAR_DECLARATION:
+        {
+            cast_node_t *d;
+            list_for_each_entry(d, &node->var_declaration.var_declarator_list->var_declarator_list.var_declarators, list) {
+                if (d->var_declarator.expr)
+                    build_assign(symbol_table_lookup(symtab, d->var_declarator.identifier, 1),
+                                 NULL, d->var_declarator.expr, d, symtab);
+            }
+        }
+        break;
+    case CAST_ASSIGN_STMT:
+        build_assign(symbol_table_lookup(symtab, node->assign_stmt.identifier, 1),
+                     node->assign_stmt.array_expr, node->assign_stmt.expr, node, symtab);
+        break;
+    case CAST_IF_STMT:
+        {
+            struct ir_block *then = new_block(), *join = new_block();
+            struct ir_block *other = node->if_stmt.else_stmt ? new_block() : join;
+            build_cond(node->if_stmt.expr, symtab, then, other);
+            seal_block(then);
+            ir.cur = then;
+            build_stmt(node->if_stmt.if_stmt, symtab);
+            if (ir.cur)
+                emit_jmp(join, node);
+            if (other != join) {
+                seal_block(other);
+                ir.cur = other;
+                build_stmt(node->if_stmt.else_stmt, symtab);
+                if (ir.cur)
+                    emit_jmp(join, node);
+            }
+            seal_block(join);
+            ir.cur = join->nr_preds ? join : NULL;
+        }
+        break;
+    case CAST_WHILE_STMT:
+        {
+            struct ir_block *head = new_block(), *body = new_block(), *exit = new_block();
+            emit_jmp(head, node);
+            ir.cur = head; // sealed after the back edge
+            build_cond(node->while_stmt.expr, symtab, body, exit);
+            seal_block(body);
+            ir.cur = body;
+            build_stmt(node->while_stmt.stmt, symtab);
+            if (ir.cur)
+                emit_jmp(head, node);
+            seal_block(head);
+            seal_block(exit);
+            ir.cur = exit;
+        }
+        break;
+    case CAST_RETURN_STMT:
+        {
+            struct ir_value *ret = new_value(IR_RET, node);
+            if (node->return_stmt.expr)
+                add_arg(ret, build_expr(node->return_stmt.expr, symtab));
+            emit(ret);
+            ir.cur = NULL;
+        }
+        break;
+    case CAST_CALL_STMT:
+        build_expr(node->call_stmt.expr, symtab);
+        break;
+    default:
+        break;
+    }
+}
+
+static void number_postorder(struct ir_block *b, int *n)
+{
+    b->rpo = -1; // visiting
+    for (int i = b->nr_succs - 1; i >= 0; i--) // taken branches first in the end
+        if (!b->succs[i]->rpo)
+            number_postorder(b->succs[i], n);
+    b->rpo = (*n)++;
+}
+
+static struct ir_block *intersect(struct ir_block *a, struct ir_block *b)
+{
+    while (a != b) {
+        while (a->rpo > b->rpo)
+            a = a->idom;
+        while (b->rpo > a->rpo)
+            b = b->idom;
+    }
+    return a;
+}
+
+static void number_dom_tree(struct ir_block *b, int *n)
+{
+    b->dom_pre = (*n)++;
+    for (int i = 0; i < b->nr_kids; i++)
+        number_dom_tree(b->kids[i], n);
+    b->dom_post = (*n)++;
+}
+
+// order the reachable blocks in reverse postorder and build the dominator tree
+static void compute_dominators(struct ir_function *fn)
+{
+    struct ir_block *entry = fn->blocks[0];
+    int n = 1, changed;
+
+    for (int i = 0; i < ir.nr_blocks; i++)
+        ir.blocks[i]->rpo = 0;
+    number_postorder(entry, &n); // 1..n-1, 0 means unreachable
+    fn->nr_blocks = 0;
+    ALLOC_GROW(fn->blocks, n - 1, fn->alloc_blocks);
+    for (int i = 0; i < ir.nr_blocks; i++) {
+        struct ir_block *b = ir.blocks[i];
+        if (b->rpo) {
+            b->rpo = n - 1 - b->rpo;
+            fn->blocks[b->rpo] = b;
+            fn->nr_blocks++;
+        }
+    }
+    for (int i = 0; i < fn->nr_blocks; i++)
+        fn->blocks[i]->id = i;
+    entry->idom = entry;
+    do {
+        changed = 0;
+        for (int i = 1; i < fn->nr_blocks; i++) {
+            struct ir_block *b = fn->blocks[i], *idom = NULL;
+            for (int j = 0; j < b->nr_preds; j++) {
+                struct ir_block *p = b->preds[j];
+                if (!p->idom)
+                    continue;
+                idom = idom ? intersect(p, idom) : p;
+            }
+            if (b->idom != idom) {
+                b->idom = idom;
+                changed = 1;
+            }
+        }
+    } while (changed);
+    entry->idom = NULL;
+    for (int i = 1; i < fn->nr_blocks; i++) {
+        struct ir_block *d = fn->blocks[i]->idom;
+        ALLOC_GROW(d->kids, d->nr_kids + 1, d->alloc_kids);
+        d->kids[d->nr_kids++] = fn->blocks[i];
+    }
+    n = 0;
+    number_dom_tree(entry, &n);
+}
+
+int ir_dominates(struct ir_block *a, struct ir_block *b)
+{
+    return a->dom_pre <= b->dom_pre && b->dom_post <= a->dom_post;
+}
+
+static struct ir_function *build_function(cast_node_t *decl, symbol_table_t *global)
+{
+    struct ir_function *fn = zalloc(sizeof(struct ir_function));
+    symbol_table_t *symtab = decl->fun_declaration.symbol_table;
+    struct ir_value *v;
+    int i = 0, id = 0;
+
+    fn->decl = decl;
+    fn->sym = symbol_table_lookup(global, decl->fun_declaration.identifier, 0);
+    ir.fn = fn;
+    ir.nr_blocks = ir.nr_vars = 0;
+    ir.undef = NULL;
+    ALLOC_GROW(fn->blocks, 1, fn->alloc_blocks);
+    fn->blocks[0] = ir.cur = new_block();
+    seal_block(ir.cur);
+    if (decl->fun_declaration.param_list) {
+        cast_node_t *param;
+        list_for_each_entry(param, &decl->fun_declaration.param_list->param_list.params, list) {
+            v = new_value(IR_PARAM, param);
+            v->sym = symbol_table_lookup(symtab, param->param.identifier, 0);
+            v->num = i++;
+            write_var(v->sym, ir.cur, emit(v));
+        }
+    }
+    build_stmt(decl->fun_declaration.compound_stmt, symtab);
+    if (ir.cur) // falls off the end
+        emit(new_value(IR_RET, decl));
+    compute_dominators(fn);
+    for (i = 0; i < fn->nr_blocks; i++) {
+        list_for_each_entry(v, &fn->blocks[i]->insns, list) {
+            v->id = id++;
+        }
+    }
+    fn->nr_values = id;
+    return fn;
+}
+
+// value 'v' is available where 'user' reads it, from 'pred' for phis
+static int available(struct ir_value *v, struct ir_value *user, struct ir_block *pred)
+{
+    struct ir_block *at = pred ? pred : user->block;
+    struct ir_value *i;
+
+    if (v->block != at)
+        return ir_dominates(v->block, at);
+    if (pred) // defined anywhere in the pred reaches its end
+        return 1;
+    list_for_each_entry(i, &at->insns, list) {
+        if (i == v)
+            return 1;
+        if (i == user)
+            return 0;
+    }
+    return 0;
+}
+
+static int count(struct ir_value **vals, int nr, struct ir_value *v)
+{
+    int n = 0;
+
+    for (int i = 0; i < nr; i++)
+        n += vals[i] == v;
+    return n;
+}
+
+static int count_preds(struct ir_block *b, struct ir_block *pred)
+{
+    int n = 0;
+
+    for (int i = 0; i < b->nr_preds; i++)
+        n += b->preds[i] == pred;
+    return n;
+}
+
+// check the invariants of the IR, anything broken is a bug of a pass
+void ir_verify(struct ir_function *fn)
+{
+    const char *name = fn->decl->fun_declaration.identifier;
+
+    if (fn->blocks[0]->nr_preds)
+        panic("%s: entry block has preds\n", name);
+    for (int i = 0; i < fn->nr_blocks; i++) {
+        struct ir_block *b = fn->blocks[i];
+        struct ir_value *v, *last = list_last_entry(&b->insns, struct ir_value, list);
+        int phis = 1;
+
+        if (!last || !ir_is_terminator(last))
+            panic("%s: b%d doesn't end with a jump or return\n", name, b->id);
+        if (b->nr_succs != (last->op == IR_RET ? 0 : last->op == IR_BR ? 2 : 1))
+            panic("%s: b%d has %d succs\n", name, b->id, b->nr_succs);
+        for (int j = 0; j < b->nr_succs; j++)
+            if (count_preds(b->succs[j], b) !=
+                (b->nr_succs == 2 && b->succs[0] == b->succs[1] ? 2 : 1))
+                panic("%s: b%d is not a pred of its succ b%d\n", name, b->id, b->succs[j]->id);
+        for (int j = 0; j < b->nr_preds; j++)
+            if (b->preds[j]->succs[0] != b && b->preds[j]->succs[1] != b)
+                panic("%s: b%d is not a succ of its pred\n", name, b->id);
+        if (i && (!b->idom || !ir_dominates(b->idom, b)))
+            panic("%s: b%d has no immediate dominator\n", name, b->id);
+        list_for_each_entry(v, &b->insns, list) {
+            if (v->block != b || v->forward)
+                panic("%s: v%d is not in b%d\n", name, v->id, b->id);
+            if (v->op != IR_PHI)
+                phis = 0;
+            else if (!phis)
+                panic("%s: phi v%d after other instructions\n", name, v->id);
+            else if (v->nr_args != b->nr_preds)
+                panic("%s: phi v%d has %d operands for %d preds\n", name, v->id, v->nr_args, b->nr_preds);
+            if (ir_is_terminator(v) && v != last)
+                panic("%s: v%d ends b%d early\n", name, v->id, b->id);
+            for (int j = 0; j < v->nr_args; j++) {
+                struct ir_value *a = v->args[j];
+                if (!available(a, v, v->op == IR_PHI ? b->preds[j] : NULL))
+                    panic("%s: v%d doesn't dominate its use in v%d\n", name, a->id, v->id);
+                if (count(a->users, a->nr_users, v) != count(v->args, v->nr_args, a))
+                    panic("%s: use of v%d in v%d is not on its def-use chain\n", name, a->id, v->id);
+            }
+            for (int j = 0; j < v->nr_users; j++)
+                if (!count(v->users[j]->args, v->users[j]->nr_args, v))
+                    panic("%s: v%d has a stale user v%d\n", name, v->id, v->users[j]->id);
+        }
+    }
+}
+
+static const char *op_name(enum token_type tok)
+{
+    switch (tok) {
+    case TOK_OPERATOR_ADD: return "add";
+    case TOK_OPERATOR_SUB: return "sub";
+    case TOK_OPERATOR_MUL: return "mul";
+    case TOK_OPERATOR_DIV: return "div";
+    case TOK_OPERATOR_MOD: return "mod";
+    case TOK_OPERATOR_LESS_THAN: return "lt";
+    case TOK_OPERATOR_LESS_THAN_OR_EQUAL_TO: return "le";
+    case TOK_OPERATOR_GREATER_THAN: return "gt";
+    case TOK_OPERATOR_GREATER_THAN_OR_EQUAL_TO: return "ge";
+    case TOK_OPERATOR_EQUAL: return "eq";
+    case TOK_OPERATOR_NOT_EQUAL: return "ne";
+    default: return "?";
+    }
+}
+
+static void dump_args(struct ir_value *v, int from, FILE *fp)
+{
+    for (int i = from; i < v->nr_args; i++)
+        fprintf(fp, "%sv%d", i > from ? ", " : "", v->args[i]->id);
+}
+
+static void dump_function(struct ir_function *fn, FILE *fp)
+{
+    fprintf(fp, "function %s\n", fn->decl->fun_declaration.identifier);
+    for (int i = 0; i < fn->nr_blocks; i++) {
+        struct ir_block *b = fn->blocks[i];
+        struct ir_value *v;
+
+        fprintf(fp, "b%d:", b->id);
+        for (int j = 0; j < b->nr_preds; j++)
+            fprintf(fp, "%s b%d", j ? "," : " ; preds", b->preds[j]->id);
+        if (b->idom)
+            fprintf(fp, " ; idom b%d", b->idom->id);
+        fprintf(fp, "\n");
+        list_for_each_entry(v, &b->insns, list) {
+            fprintf(fp, "    ");
+            if (!ir_is_terminator(v) && v->op != IR_STORE)
+                fprintf(fp, "v%d = ", v->id);
+            switch (v->op) {
+            case IR_UNDEF:
+                fprintf(fp, "undef");
+                break;
+            case IR_CONST:
+                fprintf(fp, "const %d", v->num);
+                break;
+            case IR_STR:
+                fprintf(fp, "str %s", v->name);
+                break;
+            case IR_PARAM:
+                fprintf(fp, "param %d %s", v->num, v->sym->name);
+                break;
+            case IR_BINOP:
+                fprintf(fp, "%s v%d, v%d", op_name(v->tok), v->args[0]->id, v->args[1]->id);
+                break;
+            case IR_LOAD:
+                fprintf(fp, "load %s", v->sym->name);
+                if (v->nr_args)
+                    fprintf(fp, "[v%d]", v->args[0]->id);
+                break;
+            case IR_STORE:
+                fprintf(fp, "store %s", v->sym->name);
+                if (v->nr_args == 2)
+                    fprintf(fp, "[v%d]", v->args[0]->id);
+                fprintf(fp, ", v%d", v->args[v->nr_args - 1]->id);
+                break;
+            case IR_CALL:
+                fprintf(fp, "call %s(", v->name);
+                dump_args(v, 0, fp);
+                fprintf(fp, ")");
+                break;
+            case IR_PHI:
+                fprintf(fp, "phi");
+                for (int j = 0; j < v->nr_args; j++)
+                    fprintf(fp, "%s [v%d, b%d]", j ? "," : "", v->args[j]->id, b->preds[j]->id);
+                if (v->sym)
+                    fprintf(fp, " ; %s", v->sym->name);
+                break;
+            case IR_JMP:
+                fprintf(fp, "jmp b%d", b->succs[0]->id);
+                break;
+            case IR_BR:
+                fprintf(fp, "br v%d, b%d, b%d", v->args[0]->id, b->succs[0]->id, b->succs[1]->id);
+                break;
+            case IR_RET:
+                fprintf(fp, "ret");
+                if (v->nr_args)
+                    fprintf(fp, " v%d", v->args[0]->id);
+                break;
+            default:
+                break;
+            }
+            fprintf(fp, "\n");
+        }
+    }
+}
+
+struct ir_program *build_ir(cast_node_t *ast)
+{
+    struct ir_program *prog = zalloc(sizeof(struct ir_program));
+    cast_node_t *d;
+
+    INIT_LIST_HEAD(&prog->functions);
+    list_for_each_entry(d, &ast->program.declarations, list) {
+        if (d->type != CAST_FUN_DECLARATION || !d->fun_declaration.compound_stmt)
+            continue;
+        struct ir_function *fn = build_function(d, ast->program.symbol_table);
+        ir_verify(fn);
+        list_add_tail(&fn->list, &prog->functions);
+    }
+    return prog;
+}
+
+void ir_dump(struct ir_program *prog, FILE *fp)
+{
+    struct ir_function *fn;
+
+    list_for_each_entry(fn, &prog->functions, list) {
+        dump_function(fn, fp);
+    }
+}
@@ -0,0 +1,751 @@
+#include "tc.h"
+
+/*
+ * Loop optimizations over the CAST, run after fold_constants(). Both rely on
+ * the effects the analyzer collected for every while loop.
+ *
+ * Loop-invariant code motion: maximal subexpressions of a loop whose inputs
+ * the loop never changes, like i / 2 or a global no call in the loop writes,
+ * are computed once into a new local in front of the loop, the preheader.
+ * Expressions that may trap are only moved out of the part of the condition
+ * every entry of the loop evaluates anyway.
+ *
+ * Induction variable strength reduction: when the body of a while loop steps
+ * a local i only by a top level 'i = i +- c', a product i * k by a constant
+ * or loop invariant k is replaced with a new local t. t is set to i * k in
+ * front of the loop and advanced by c * k right after the step of i, so the
+ * multiplication becomes an addition per iteration. i * i is reduced the same
+ * way, advancing t by 2 * c * i - c * c.
+ *
+ * Loop unrolling, with -funroll-loops: an innermost loop 'while (i < n) B'
+ * whose body steps i once by c and leaves n alone gets a copy in front that
+ * runs B unrolled U times while i < n - (U - 1) * c, so all U conditions in
+ * between hold. The original loop runs the remaining iterations. When n isn't
+ * a number the bound goes to a new local, guarded against wrapping around.
+ */
+#define MAX_HOISTED 4 // new locals per loop, each wants a register
+#define MAX_REDUCED 4
+#define MAX_STEPS 16
+#define UNROLL_SIZE_CAP 160 // nodes in an unrolled body
+#define MAX_STRIDE 0x10000 // (U - 1) * c can't overflow
+
+struct hoisted {
+    cast_node_t *expr;
+    symbol_t *sym;
+};
+
+struct loop_var {
+    symbol_t *sym;
+    cast_node_t *step; // 'i = i +- c' directly in the loop body
+    int stride;
+};
+
+struct reduction {
+    struct loop_var *iv;
+    cast_node_t *factor; // number, invariant local or the induction variable itself
+    symbol_t *sym;
+};
+
+static struct {
+    symbol_table_t *symtab;
+    cast_node_t **outer; // enclosing while loops, innermost last
+    int nr_outer, alloc_outer;
+    struct effects *effects; // of the loop being optimized
+    struct hoisted hoisted[MAX_HOISTED];
+    int nr_hoisted;
+    struct loop_var vars[MAX_STEPS];
+    int nr_vars;
+    struct reduction red[MAX_REDUCED];
+    int nr_red;
+} loop;
+
+static struct {
+    int hoisted; // invariant expressions moved to a preheader
+    int reduced; // products replaced with a new induction variable
+    int unrolled; // loops that got an unrolled copy
+} stats;
+
+static cast_node_t *new_num(int val, int line_number)
+{
+    cast_node_t *n = new_node(CAST_NUMBER, line_number);
+
+    n->expr.num = val;
+    return n;
+}
+
+static cast_node_t *new_ident(symbol_t *sym, int line_number)
+{
+    cast_node_t *n = new_node(CAST_IDENTIFIER, line_number);
+
+    n->expr.identifier = sym->name;
+    return n;
+}
+
+static cast_node_t *new_op(enum cast_node_type type, enum token_type op,
+                           cast_node_t *l, cast_node_t *r)
+{
+    cast_node_t *n = new_node(type, l->line_number);
+
+    n->expr.op.type = op;
+    n->expr.op.left = l;
+    n->expr.op.right = r;
+    return n;
+}
+
+static inline void insert_before(cast_node_t *node, cast_node_t *pos)
+{
+    __list_add(&node->list, pos->list.prev, &pos->list);
+}
+
+static inline void insert_after(cast_node_t *node, cast_node_t *pos)
+{
+    __list_add(&node->list, &pos->list, pos->list.next);
+}
+
+// the loops around a new assignment to 'sym' now write it too
+static void note_write(symbol_t *sym, int inside)
+{
+    for (int i = 0; i < loop.nr_outer; i++)
+        effects_add_write(loop.outer[i]->while_stmt.effects, sym);
+    if (inside)
+        effects_add_write(loop.effects, sym);
+}
+
+// call 'fn' on every expression of statement 'node'
+static void for_each_expr(cast_node_t *node, void (*fn)(cast_node_t *expr))
+{
+    if (!node)
+        return;
+    switch (node->type) {
+    case CAST_VAR_DECLARATION:
+        for_each_expr(node->var_declaration.var_declarator_list, fn);
+        break;
+    case CAST_VAR_DECLARATOR_LIST:
+        {
+            cast_node_t *var_declarator;
+            list_for_each_entry(var_declarator, &node->var_declarator_list.var_declarators, list) {
+                if (var_declarator->var_declarator.expr)
+                    fn(var_declarator->var_declarator.expr);
+            }
+        }
+        break;
+    case CAST_COMPOUND_STMT:
+        {
+            cast_node_t *s;
+            list_for_each_entry(s, &node->compound_stmt.stmts, list) {
+                for_each_expr(s, fn);
+            }
+        }
+        break;
+    case CAST_ASSIGN_STMT:
+        if (node->assign_stmt.array_expr)
+            fn(node->assign_stmt.array_expr);
+        fn(node->assign_stmt.expr);
+        break;
+    case CAST_IF_STMT:
+        fn(node->if_stmt.expr);
+        for_each_expr(node->if_stmt.if_stmt, fn);
+        for_each_expr(node->if_stmt.else_stmt, fn);
+        break;
+    case CAST_WHILE_STMT:
+        fn(node->while_stmt.expr);
+        for_each_expr(node->while_stmt.stmt, fn);
+        break;
+    case CAST_RETURN_STMT:
+        if (node->return_stmt.expr)
+            fn(node->return_stmt.expr);
+        break;
+    case CAST_CALL_STMT:
+        fn(node->call_stmt.expr);
+        break;
+    default:
+        break;
+    }
+}
+
+// whether expression 'node' has the same value everywhere in the loop
+static int invariant_expr(cast_node_t *node, int *traps)
+{
+    symbol_t *sym;
+
+    switch (node->type) {
+    case CAST_NUMBER:
+        return 1;
+    case CAST_IDENTIFIER:
+        sym = symbol_table_lookup(loop.symtab, node->expr.identifier, 1);
+        if (!sym || effects_clobber(loop.effects, sym))
+            return 0;
+        if (!node->expr.array_expr)
+            return !sym->array_size;
+        if (!invariant_expr(node->expr.array_expr, traps))
+            return 0;
+        if (node->expr.array_expr->type != CAST_NUMBER || node->expr.array_expr->expr.num < 0 ||
+            node->expr.array_expr->expr.num >= sym->array_size)
+            *traps = 1; // may be out of bounds
+        return 1;
+    case CAST_TERM:
+        if (node->expr.op.type != TOK_OPERATOR_MUL &&
+            (node->expr.op.right->type != CAST_NUMBER || node->expr.op.right->expr.num == 0 ||
+             node->expr.op.right->expr.num == -1))
+            *traps = 1; // division by zero or INT_MIN / -1
+        // fall through
+    case CAST_LOGICAL_EXPR:
+    case CAST_RELATIONAL_EXPR:
+    case CAST_SIMPLE_EXPR:
+        return invariant_expr(node->expr.op.left, traps) && invariant_expr(node->expr.op.right, traps);
+    default:
+        return 0;
+    }
+}
+
+// arithmetic and loads from memory, comparisons are better left fused with their branch
+static int worth_hoisting(cast_node_t *node)
+{
+    if (node->type == CAST_SIMPLE_EXPR || node->type == CAST_TERM)
+        return 1;
+    return node->type == CAST_IDENTIFIER && !local_scalar(loop.symtab, node);
+}
+
+static void hoist(cast_node_t *node)
+{
+    struct hoisted *h;
+    int i;
+
+    for (i = 0; i < loop.nr_hoisted; i++)
+        if (same_expr(loop.hoisted[i].expr, node))
+            break;
+    if (i == loop.nr_hoisted) {
+        if (loop.nr_hoisted == MAX_HOISTED)
+            return;
+        h = loop.hoisted + loop.nr_hoisted++;
+        h->expr = new_node(node->type, node->line_number);
+        h->expr->expr = node->expr;
+        h->sym = symbol_table_add_temp(loop.symtab, "inv");
+    } else
+        h = loop.hoisted + i;
+    node->type = CAST_IDENTIFIER;
+    node->expr.identifier = h->sym->name;
+    node->expr.array_expr = NULL;
+    stats.hoisted++;
+}
+
+// hoist the invariant parts of 'node', 'always' when every entry of the loop evaluates it
+static void hoist_expr(cast_node_t *node, int always)
+{
+    int traps = 0;
+
+    if (worth_hoisting(node) && invariant_expr(node, &traps) && (always || !traps)) {
+        hoist(node);
+        return;
+    }
+    switch (node->type) {
+    case CAST_IDENTIFIER:
+        if (node->expr.array_expr)
+            hoist_expr(node->expr.array_expr, always);
+        break;
+    case CAST_CALL_EXPR:
+        {
+            cast_node_t *arg;
+            list_for_each_entry(arg, &node->call_expr.args_list, list) {
+                hoist_expr(arg, always);
+            }
+        }
+        break;
+    case CAST_LOGICAL_EXPR:
+        hoist_expr(node->expr.op.left, always);
+        hoist_expr(node->expr.op.right, 0); // short-circuited
+        break;
+    case CAST_RELATIONAL_EXPR:
+    case CAST_SIMPLE_EXPR:
+    case CAST_TERM:
+        hoist_expr(node->expr.op.left, always);
+        hoist_expr(node->expr.op.right, always);
+        break;
+    default:
+        break;
+    }
+}
+
+static void hoist_in_body(cast_node_t *expr)
+{
+    hoist_expr(expr, 0);
+}
+
+static void hoist_invariants(cast_node_t *node)
+{
+    loop.nr_hoisted = 0;
+    hoist_expr(node->while_stmt.expr, 1);
+    for_each_expr(node->while_stmt.stmt, hoist_in_body);
+    for (int i = 0; i < loop.nr_hoisted; i++) {
+        struct hoisted *h = loop.hoisted + i;
+        insert_before(new_assign(h->sym, h->expr), node);
+        note_write(h->sym, 0);
+        tc_debug(0, "hoist %s out of loop at line %d\n", h->sym->name, node->line_number);
+    }
+}
+
+// 'i = i +- c' where i is written nowhere else in the loop
+static void find_step(cast_node_t *stmt)
+{
+    cast_node_t *expr;
+    struct loop_var *v;
+    symbol_t *sym;
+
+    if (stmt->type != CAST_ASSIGN_STMT || stmt->assign_stmt.array_expr)
+        return;
+    expr = stmt->assign_stmt.expr;
+    if (expr->type != CAST_SIMPLE_EXPR || expr->expr.op.right->type != CAST_NUMBER)
+        return;
+    sym = local_scalar(loop.symtab, expr->expr.op.left);
+    if (!sym || strcmp(sym->name, stmt->assign_stmt.identifier) ||
+        effects_writes(loop.effects, sym) != 1 || loop.nr_vars == MAX_STEPS)
+        return;
+    v = loop.vars + loop.nr_vars++;
+    v->sym = sym;
+    v->step = stmt;
+    v->stride = expr->expr.op.right->expr.num;
+    if (expr->expr.op.type == TOK_OPERATOR_SUB)
+        v->stride = -(unsigned int)v->stride;
+}
+
+static struct loop_var *induction_var(cast_node_t *node)
+{
+    symbol_t *sym = local_scalar(loop.symtab, node);
+
+    for (int i = 0; sym && i < loop.nr_vars; i++)
+        if (loop.vars[i].sym == sym)
+            return loop.vars + i;
+    return NULL;
+}
+
+static int invariant(cast_node_t *node)
+{
+    symbol_t *sym;
+
+    if (node->type == CAST_NUMBER)
+        return 1;
+    sym = local_scalar(loop.symtab, node);
+    return sym && !effects_writes(loop.effects, sym);
+}
+
+static int same_factor(cast_node_t *a, cast_node_t *b)
+{
+    if (a->type != b->type)
+        return 0;
+    if (a->type == CAST_NUMBER)
+        return a->expr.num == b->expr.num;
+    return !strcmp(a->expr.identifier, b->expr.identifier);
+}
+
+// turn 'i * k' into its reduced variable if it is one
+static int reduce_product(cast_node_t *node)
+{
+    cast_node_t *l = node->expr.op.left, *r = node->expr.op.right;
+    struct loop_var *iv = induction_var(l);
+    struct reduction *red;
+    int i;
+
+    if (!iv || !(invariant(r) || induction_var(r) == iv)) {
+        iv = induction_var(r);
+        if (!iv || !invariant(l))
+            return 0;
+        r = l; // k * i
+    }
+    for (i = 0; i < loop.nr_red; i++)
+        if (loop.red[i].iv == iv && same_factor(loop.red[i].factor, r))
+            break;
+    if (i == loop.nr_red) {
+        if (loop.nr_red == MAX_REDUCED)
+            return 0;
+        red = loop.red + loop.nr_red++;
+        red->iv = iv;
+        red->factor = r;
+        red->sym = symbol_table_add_temp(loop.symtab, "iv");
+    } else
+        red = loop.red + i;
+    node->type = CAST_IDENTIFIER;
+    node->expr.identifier = red->sym->name;
+    node->expr.array_expr = NULL;
+    stats.reduced++;
+    return 1;
+}
+
+static void reduce_expr(cast_node_t *node)
+{
+    if (!node)
+        return;
+    switch (node->type) {
+    case CAST_IDENTIFIER:
+        reduce_expr(node->expr.array_expr);
+        break;
+    case CAST_CALL_EXPR:
+        {
+            cast_node_t *arg;
+            list_for_each_entry(arg, &node->call_expr.args_list, list) {
+                reduce_expr(arg);
+            }
+        }
+        break;
+    case CAST_TERM:
+        if (node->expr.op.type == TOK_OPERATOR_MUL && reduce_product(node))
+            break;
+        // fall through
+    case CAST_LOGICAL_EXPR:
+    case CAST_RELATIONAL_EXPR:
+    case CAST_SIMPLE_EXPR:
+        reduce_expr(node->expr.op.left);
+        reduce_expr(node->expr.op.right);
+        break;
+    default:
+        break;
+    }
+}
+
+// t = t + c * k, or t = t + 2 * c * i - c * c for t = i * i
+static cast_node_t *advance_expr(struct reduction *red)
+{
+    struct loop_var *iv = red->iv;
+    cast_node_t *t = new_ident(red->sym, iv->step->line_number), *k = red->factor;
+    unsigned int c = iv->stride;
+
+    if (k->type == CAST_NUMBER)
+        return new_op(CAST_SIMPLE_EXPR, TOK_OPERATOR_ADD, t, new_num(c * k->expr.num, t->line_number));
+    if (induction_var(k) == iv) {
+        cast_node_t *i2c = new_op(CAST_TERM, TOK_OPERATOR_MUL, new_ident(iv->sym, t->line_number),
+                                  new_num(2 * c, t->line_number));
+        return new_op(CAST_SIMPLE_EXPR, TOK_OPERATOR_ADD, t,
+                      new_op(CAST_SIMPLE_EXPR, TOK_OPERATOR_SUB, i2c, new_num(c * c, t->line_number)));
+    }
+    k = new_ident(symbol_table_lookup(loop.symtab, k->expr.identifier, 1), t->line_number);
+    if (c == 1)
+        return new_op(CAST_SIMPLE_EXPR, TOK_OPERATOR_ADD, t, k);
+    if (c == -1U)
+        return new_op(CAST_SIMPLE_EXPR, TOK_OPERATOR_SUB, t, k);
+    return new_op(CAST_SIMPLE_EXPR, TOK_OPERATOR_ADD, t,
+                  new_op(CAST_TERM, TOK_OPERATOR_MUL, k, new_num(c, t->line_number)));
+}
+
+static void reduce_induction_vars(cast_node_t *node)
+{
+    cast_node_t *body = node->while_stmt.stmt, *s;
+
+    if (body->type != CAST_COMPOUND_STMT)
+        return;
+    loop.nr_vars = loop.nr_red = 0;
+    list_for_each_entry(s, &body->compound_stmt.stmts, list) {
+        find_step(s);
+    }
+    for_each_expr(node, reduce_expr);
+    for (int i = 0; i < loop.nr_red; i++) {
+        struct reduction *red = loop.red + i;
+        cast_node_t *iv = new_ident(red->iv->sym, node->line_number);
+        insert_before(new_assign(red->sym, new_op(CAST_TERM, TOK_OPERATOR_MUL, iv, red->factor)), node);
+        insert_after(new_assign(red->sym, advance_expr(red)), red->iv->step);
+        note_write(red->sym, 1);
+        tc_debug(0, "%s = %s * ... in loop at line %d\n", red->sym->name, red->iv->sym->name,
+                 node->line_number);
+    }
+}
+
+// deep copy of statement or expression 'node'
+static cast_node_t *clone_node(cast_node_t *node)
+{
+    cast_node_t *n, *s;
+
+    if (!node)
+        return NULL;
+    n = new_node(node->type, node->line_number);
+    switch (node->type) {
+    case CAST_COMPOUND_STMT:
+        INIT_LIST_HEAD(&n->compound_stmt.stmts);
+        n->compound_stmt.symbol_table = node->compound_stmt.symbol_table;
+        list_for_each_entry(s, &node->compound_stmt.stmts, list) {
+            list_add_tail(&clone_node(s)->list, &n->compound_stmt.stmts);
+        }
+        break;
+    case CAST_ASSIGN_STMT:
+        n->assign_stmt.identifier = node->assign_stmt.identifier;
+        n->assign_stmt.array_expr = clone_node(node->assign_stmt.array_expr);
+        n->assign_stmt.expr = clone_node(node->assign_stmt.expr);
+        break;
+    case CAST_IF_STMT:
+        n->if_stmt.expr = clone_node(node->if_stmt.expr);
+        n->if_stmt.if_stmt = clone_node(node->if_stmt.if_stmt);
+        n->if_stmt.else_stmt = clone_node(node->if_stmt.else_stmt);
+        break;
+    case CAST_RETURN_STMT:
+        n->return_stmt.expr = clone_node(node->return_stmt.expr);
+        break;
+    case CAST_CALL_STMT:
+        n->call_stmt.expr = clone_node(node->call_stmt.expr);
+        break;
+    case CAST_CALL_EXPR:
+        n->call_expr.identifier = node->call_expr.identifier;
+        INIT_LIST_HEAD(&n->call_expr.args_list);
+        list_for_each_entry(s, &node->call_expr.args_list, list) {
+            list_add_tail(&clone_node(s)->list, &n->call_expr.args_list);
+        }
+        break;
+    case CAST_LOGICAL_EXPR:
+    case CAST_RELATIONAL_EXPR:
+    case CAST_SIMPLE_EXPR:
+    case CAST_TERM:
+        n->expr.op.type = node->expr.op.type;
+        n->expr.op.left = clone_node(node->expr.op.left);
+        n->expr.op.right = clone_node(node->expr.op.right);
+        break;
+    case CAST_IDENTIFIER:
+        n->expr.identifier = node->expr.identifier;
+        n->expr.array_expr = clone_node(node->expr.array_expr);
+        break;
+    case CAST_NUMBER:
+    case CAST_STRING:
+        n->expr = node->expr;
+        break;
+    default:
+        panic("Can't copy node type %d\n", node->type);
+    }
+    return n;
+}
+
+// number of nodes of statement 'node', -1 when it has a loop or declarations
+static int body_size(cast_node_t *node)
+{
+    int size = 1, n;
+    cast_node_t *s;
+
+    if (!node)
+        return 0;
+    switch (node->type) {
+    case CAST_COMPOUND_STMT:
+        list_for_each_entry(s, &node->compound_stmt.stmts, list) {
+            if ((n = body_size(s)) < 0)
+                return -1;
+            size += n;
+        }
+        return size;
+    case CAST_IF_STMT:
+        if ((n = body_size(node->if_stmt.if_stmt)) < 0)
+            return -1;
+        size += n;
+        if ((n = body_size(node->if_stmt.else_stmt)) < 0)
+            return -1;
+        size += n;
+        node = node->if_stmt.expr;
+        break;
+    case CAST_ASSIGN_STMT:
+        size += node->assign_stmt.array_expr ? body_size(node->assign_stmt.array_expr) : 0;
+        node = node->assign_stmt.expr;
+        break;
+    case CAST_RETURN_STMT:
+        node = node->return_stmt.expr;
+        break;
+    case CAST_CALL_STMT:
+        node = node->call_stmt.expr;
+        break;
+    case CAST_CALL_EXPR:
+        list_for_each_entry(s, &node->call_expr.args_list, list) {
+            size += body_size(s);
+        }
+        return size;
+    case CAST_LOGICAL_EXPR:
+    case CAST_RELATIONAL_EXPR:
+    case CAST_SIMPLE_EXPR:
+    case CAST_TERM:
+        return size + body_size(node->expr.op.left) + body_size(node->expr.op.right);
+    case CAST_IDENTIFIER:
+        return size + body_size(node->expr.array_expr);
+    case CAST_NUMBER:
+    case CAST_STRING:
+        return size;
+    default:
+        return -1;
+    }
+    return size + body_size(node);
+}
+
+// whether expression 'node' reads 'i' only to index elements [i]
+static int indexes_by(cast_node_t *node, symbol_t *i)
+{
+    if (!node)
+        return 1;
+    switch (node->type) {
+    case CAST_IDENTIFIER:
+        if (!node->expr.array_expr)
+            return local_scalar(loop.symtab, node) != i;
+        return local_scalar(loop.symtab, node->expr.array_expr) == i;
+    case CAST_LOGICAL_EXPR:
+    case CAST_RELATIONAL_EXPR:
+    case CAST_SIMPLE_EXPR:
+    case CAST_TERM:
+        return indexes_by(node->expr.op.left, i) && indexes_by(node->expr.op.right, i);
+    case CAST_NUMBER:
+        return 1;
+    default:
+        return 0; // calls
+    }
+}
+
+/*
+ * Straight assignments to elements [i] are what the vectorizer in the code
+ * generator looks for, it does more for them than unrolling would.
+ */
+static int vectorizable(cast_node_t *body, struct loop_var *iv)
+{
+    cast_node_t *s;
+
+    if (options.no_vectorize)
+        return 0;
+    list_for_each_entry(s, &body->compound_stmt.stmts, list) {
+        if (s == iv->step)
+            continue;
+        if (s->type != CAST_ASSIGN_STMT || !indexes_by(s->assign_stmt.expr, iv->sym) ||
+            (s->assign_stmt.array_expr && local_scalar(loop.symtab, s->assign_stmt.array_expr) != iv->sym))
+            return 0;
+    }
+    return 1;
+}
+
+static void unroll_loop(cast_node_t *node)
+{
+    cast_node_t *cond = node->while_stmt.expr, *body = node->while_stmt.stmt, *s;
+    cast_node_t *limit, *copy, *guard = NULL;
+    struct loop_var *iv;
+    int size, factor, up, stride;
+    unsigned int span;
+
+    if (body->type != CAST_COMPOUND_STMT || cond->type != CAST_RELATIONAL_EXPR)
+        return;
+    switch (cond->expr.op.type) {
+    case TOK_OPERATOR_LESS_THAN:
+    case TOK_OPERATOR_LESS_THAN_OR_EQUAL_TO:
+        up = 1;
+        break;
+    case TOK_OPERATOR_GREATER_THAN:
+    case TOK_OPERATOR_GREATER_THAN_OR_EQUAL_TO:
+        up = 0;
+        break;
+    default:
+        return;
+    }
+    loop.nr_vars = 0;
+    list_for_each_entry(s, &body->compound_stmt.stmts, list) {
+        find_step(s);
+    }
+    iv = induction_var(cond->expr.op.left);
+    limit = cond->expr.op.right;
+    if (!iv || !invariant(limit) || local_scalar(loop.symtab, limit) == iv->sym)
+        return;
+    stride = iv->stride;
+    if (up ? stride <= 0 || stride > MAX_STRIDE : stride >= 0 || stride < -MAX_STRIDE)
+        return;
+    size = body_size(body);
+    if (size <= 0 || vectorizable(body, iv))
+        return;
+    factor = options.unroll_loops;
+    if (factor > UNROLL_SIZE_CAP / size)
+        factor = UNROLL_SIZE_CAP / size;
+    if (factor < 2)
+        return;
+
+    // i < n - span or i > n + span for the unrolled loop
+    span = (unsigned int)(factor - 1) * (up ? stride : -stride);
+    copy = new_node(CAST_WHILE_STMT, node->line_number);
+    copy->while_stmt.expr = new_op(CAST_RELATIONAL_EXPR, cond->expr.op.type,
+                                   clone_node(cond->expr.op.left), NULL);
+    copy->while_stmt.stmt = new_node(CAST_COMPOUND_STMT, body->line_number);
+    INIT_LIST_HEAD(&copy->while_stmt.stmt->compound_stmt.stmts);
+    copy->while_stmt.stmt->compound_stmt.symbol_table = body->compound_stmt.symbol_table;
+    for (int k = 0; k < factor; k++) {
+        list_for_each_entry(s, &body->compound_stmt.stmts, list) {
+            list_add_tail(&clone_node(s)->list, &copy->while_stmt.stmt->compound_stmt.stmts);
+        }
+    }
+    if (limit->type == CAST_NUMBER &&
+        (up ? limit->expr.num >= (int)(0x80000000U + span) : limit->expr.num <= (int)(0x7fffffffU - span))) {
+        copy->while_stmt.expr->expr.op.right = new_num(up ? limit->expr.num - span : limit->expr.num + span,
+                                                       limit->line_number);
+    } else {
+        // bound = n -+ span, which has to stay on the same side of n
+        symbol_t *bound = symbol_table_add_temp(loop.symtab, "ulim");
+        insert_before(new_assign(bound, new_op(CAST_SIMPLE_EXPR,
+                                               up ? TOK_OPERATOR_SUB : TOK_OPERATOR_ADD,
+                                               clone_node(limit), new_num(span, limit->line_number))),
+                      node);
+        note_write(bound, 0);
+        copy->while_stmt.expr->expr.op.right = new_ident(bound, limit->line_number);
+        guard = new_node(CAST_IF_STMT, node->line_number);
+        guard->if_stmt.expr = new_op(CAST_RELATIONAL_EXPR,
+                                     up ? TOK_OPERATOR_LESS_THAN : TOK_OPERATOR_GREATER_THAN,
+                                     new_ident(bound, limit->line_number), clone_node(limit));
+        guard->if_stmt.if_stmt = new_node(CAST_COMPOUND_STMT, node->line_number);
+        INIT_LIST_HEAD(&guard->if_stmt.if_stmt->compound_stmt.stmts);
+        list_add_tail(&copy->list, &guard->if_stmt.if_stmt->compound_stmt.stmts);
+    }
+    insert_before(guard ? guard : copy, node);
+    stats.unrolled++;
+    tc_debug(0, "unroll loop at line %d %d times\n", node->line_number, factor);
+}
+
+/*
+ * Invariants are hoisted from the outermost loop first, so an expression
+ * leaves the whole nest at once. Induction variables are reduced innermost
+ * first, the new variables of an inner loop are then just assigned twice in
+ * the outer one.
+ */
+static void walk_stmt(cast_node_t *node, void (*optimize)(cast_node_t *loop), int outer_first)
+{
+    if (!node)
+        return;
+    switch (node->type) {
+    case CAST_COMPOUND_STMT:
+        {
+            cast_node_t *s;
+            list_for_each_entry(s, &node->compound_stmt.stmts, list) {
+                walk_stmt(s, optimize, outer_first);
+            }
+        }
+        break;
+    case CAST_IF_STMT:
+        walk_stmt(node->if_stmt.if_stmt, optimize, outer_first);
+        walk_stmt(node->if_stmt.else_stmt, optimize, outer_first);
+        break;
+    case CAST_WHILE_STMT:
+        // new statements go in front of the loop, which needs it to be in a list
+        if (outer_first && list_linked(&node->list)) {
+            loop.effects = node->while_stmt.effects;
+            optimize(node);
+        }
+        ALLOC_GROW(loop.outer, loop.nr_outer + 1, loop.alloc_outer);
+        loop.outer[loop.nr_outer++] = node;
+        walk_stmt(node->while_stmt.stmt, optimize, outer_first);
+        loop.nr_outer--;
+        if (!outer_first && list_linked(&node->list)) {
+            loop.effects = node->while_stmt.effects;
+            optimize(node);
+        }
+        break;
+    default:
+        break;
+    }
+}
+
+void optimize_loops(cast_node_t *ast)
+{
+    cast_node_t *d;
+
+    list_for_each_entry(d, &ast->program.declarations, list) {
+        if (d->type != CAST_FUN_DECLARATION)
+            continue;
+        loop.symtab = d->fun_declaration.symbol_table;
+        walk_stmt(d->fun_declaration.compound_stmt, hoist_invariants, 1);
+        walk_stmt(d->fun_declaration.compound_stmt, reduce_induction_vars, 0);
+        if (options.unroll_loops > 1)
+            walk_stmt(d->fun_declaration.compound_stmt, unroll_loop, 0);
+    }
+    if (stats.unrolled)
+        analyze_effects(ast); // for the new loops
+    print_stat("loop", "invariants hoisted", stats.hoisted);
+    print_stat("loop", "strength reduced", stats.reduced);
+    print_stat("loop", "loops unrolled", stats.unrolled);
+}
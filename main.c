@@ -14,9 +14,12 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <getopt.h>
+#include <limits.h>
 
 #include "tc.h"
 
+struct options options;
+
 static char *read_file(const char *filename)
 {
     FILE *file = fopen(filename, "r");
@@ -63,7 +66,7 @@ int main(int argc, char **argv)
     int opt, need_free = 0;
 
     // Parse command line options
-    while ((opt = getopt(argc, argv, "s:l:")) != -1) {
+    while ((opt = getopt(argc, argv, "s:l:f:m:")) != -1) {
         switch (opt) {
         case 's':
             source_code = optarg;
@@ -71,8 +74,41 @@ int main(int argc, char **argv)
         case 'l':
             linker_arg = optarg;
             break;
+        case 'f':
+            if (!strcmp(optarg, "stats"))
+                options.stats = 1;
+            else if (!strcmp(optarg, "no-inline"))
+                options.no_inline = 1;
+            else if (!strcmp(optarg, "no-eval"))
+                options.no_eval = 1;
+            else if (!strcmp(optarg, "no-specialize"))
+                options.no_specialize = 1;
+            else if (!strcmp(optarg, "omit-frame-pointer"))
+                options.omit_frame_pointer = 1;
+            else if (!strcmp(optarg, "dump-ir"))
+                options.dump_ir = 1;
+            else if (!strcmp(optarg, "no-vectorize"))
+                options.no_vectorize = 1;
+            else if (!strcmp(optarg, "unroll-loops"))
+                options.unroll_loops = 4;
+            else if (!strncmp(optarg, "unroll-loops=", 13)) {
+                char *end;
+                long n = strtol(optarg + 13, &end, 10);
+                if (end == optarg + 13 || *end || n < 2 || n > INT_MAX)
+                    panic("Unknown option -f%s\n", optarg);
+                options.unroll_loops = n;
+            }
+            else
+                panic("Unknown option -f%s\n", optarg);
+            break;
+        case 'm':
+            if (!strcmp(optarg, "avx2"))
+                options.avx2 = 1;
+            else
+                panic("Unknown option -m%s\n", optarg);
+            break;
         default:
-            panic("Usage: %s [-s source_code] [-l linker arg] [input_file]\n", argv[0]);
+            panic("Usage: %s [-s source_code] [-l linker arg] [-f option] [-m target] [input_file]\n", argv[0]);
         }
     }
 
@@ -98,11 +134,45 @@ int main(int argc, char **argv)
     // Perform semantic analysis
     analyze_semantics(ast);
 
+    // Evaluate calls to pure functions with constant arguments
+    evaluate_pure_calls(ast);
+
+    // Inline small functions
+    inline_functions(ast);
+
+    // Clone functions for constant arguments
+    specialize_functions(ast);
+
+    // Fold constant expressions
+    fold_constants(ast);
+
+    // Optimize loops
+    optimize_loops(ast);
+
+    // Build the SSA IR
+    struct ir_program *ir = build_ir(ast);
+
+    // Eliminate common subexpressions
+    number_values(ast, ir);
+
+    // Fold comparisons and note signs from value ranges
+    propagate_ranges(ast);
+
+    // Remove unreachable code, dead stores and unused locals
+    eliminate_dead_code(ast);
+
+    // Print the SSA IR of what is left
+    if (options.dump_ir)
+        ir_dump(build_ir(ast), stderr);
+
     // Generate code
-    struct strbuf *code = generate_code(ast);
+    struct mir_program *prog = generate_code(ast);
 
     // Optimize code
-    optimize_code(code);
+    optimize_code(prog);
+
+    // Print the assembly
+    struct strbuf *code = emit_asm(prog);
 
     generate_machine_code(code->buf, linker_arg);
     // Debug code
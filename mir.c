@@ -0,0 +1,417 @@
+#include "tc.h"
+
+static const char *reg64[REG_NR] = {
+    "", "%rax", "%rbx", "%rcx", "%rdx", "%rsi", "%rdi", "%r8",
+    "%r9", "%r10", "%r11", "%r12", "%r13", "%r14", "%r15", "%rbp", "%rsp"
+};
+static const char *reg32[REG_NR] = {
+    "", "%eax", "%ebx", "%ecx", "%edx", "%esi", "%edi", "%r8d",
+    "%r9d", "%r10d", "%r11d", "%r12d", "%r13d", "%r14d", "%r15d", "%ebp", "%esp"
+};
+static const char *reg8[REG_NR] = {
+    "", "%al", "%bl", "%cl", "%dl", "%sil", "%dil", "%r8b",
+    "%r9b", "%r10b", "%r11b", "%r12b", "%r13b", "%r14b", "%r15b", "%bpl", "%spl"
+};
+
+static const char *cond_name[] = {
+    "", "e", "ne", "l", "le", "g", "ge"
+};
+
+#define READS_SRC  0x1
+#define READS_DST  0x2
+#define WRITES_DST 0x4
+#define VECTOR     0x8 // printed by emit_vector_insn()
+
+// mnemonic, register width of src and dst in bytes and how operands are used
+static const struct {
+    const char *name;
+    int src_size, dst_size;
+    int flags;
+} opinfo[MIR_NR] = {
+    [MIR_LABEL]   = { "", 0, 0, 0 },
+    [MIR_ALIGN]   = { ".p2align", 0, 0, 0 },
+    [MIR_MOVL]    = { "movl", 4, 4, READS_SRC | WRITES_DST },
+    [MIR_MOVQ]    = { "movq", 8, 8, READS_SRC | WRITES_DST },
+    [MIR_MOVSLQ]  = { "movslq", 4, 8, READS_SRC | WRITES_DST },
+    [MIR_MOVZBL]  = { "movzbl", 1, 4, READS_SRC | WRITES_DST },
+    [MIR_LEAQ]    = { "leaq", 8, 8, WRITES_DST },
+    [MIR_LEAL]    = { "leal", 8, 4, WRITES_DST }, // 32-bit result of a 64-bit address
+    [MIR_ADDL]    = { "addl", 4, 4, READS_SRC | READS_DST | WRITES_DST },
+    [MIR_SUBL]    = { "subl", 4, 4, READS_SRC | READS_DST | WRITES_DST },
+    [MIR_IMULL]   = { "imull", 4, 4, READS_SRC | READS_DST | WRITES_DST },
+    [MIR_IMULQ]   = { "imulq", 8, 8, READS_SRC | READS_DST | WRITES_DST },
+    [MIR_NEGL]    = { "negl", 0, 4, READS_DST | WRITES_DST },
+    [MIR_INCL]    = { "incl", 0, 4, READS_DST | WRITES_DST },
+    [MIR_DECL]    = { "decl", 0, 4, READS_DST | WRITES_DST },
+    [MIR_ANDL]    = { "andl", 4, 4, READS_SRC | READS_DST | WRITES_DST },
+    [MIR_ORL]     = { "orl", 4, 4, READS_SRC | READS_DST | WRITES_DST },
+    [MIR_SARL]    = { "sarl", 1, 4, READS_SRC | READS_DST | WRITES_DST }, // count is $imm or %cl
+    [MIR_SARQ]    = { "sarq", 1, 8, READS_SRC | READS_DST | WRITES_DST },
+    [MIR_SHLL]    = { "shll", 1, 4, READS_SRC | READS_DST | WRITES_DST },
+    [MIR_SHRL]    = { "shrl", 1, 4, READS_SRC | READS_DST | WRITES_DST },
+    [MIR_CMPL]    = { "cmpl", 4, 4, READS_SRC | READS_DST },
+    [MIR_TESTL]   = { "testl", 4, 4, READS_SRC | READS_DST },
+    [MIR_CLTD]    = { "cltd", 0, 0, 0 },
+    [MIR_IDIVL]   = { "idivl", 4, 0, READS_SRC },
+    [MIR_DIVL]    = { "divl", 4, 0, READS_SRC },
+    [MIR_SET]     = { "set", 0, 1, READS_DST | WRITES_DST }, // only the low byte is written
+    [MIR_CMOV]    = { "cmov", 4, 4, READS_SRC | READS_DST | WRITES_DST }, // dst kept unless cond holds
+    [MIR_JMP]     = { "jmp", 0, 0, 0 },
+    [MIR_JCC]     = { "j", 0, 0, 0 },
+    [MIR_CALL]    = { "call", 0, 0, 0 },
+    [MIR_PUSHQ]   = { "pushq", 8, 0, READS_SRC },
+    [MIR_POPQ]    = { "popq", 0, 8, WRITES_DST },
+    [MIR_SUBQ]    = { "subq", 8, 8, READS_SRC | READS_DST | WRITES_DST },
+    [MIR_ADDQ]    = { "addq", 8, 8, READS_SRC | READS_DST | WRITES_DST },
+    [MIR_CMPQ]    = { "cmpq", 8, 8, READS_SRC | READS_DST },
+    [MIR_LEAVE]   = { "leave", 0, 0, 0 },
+    [MIR_RET]     = { "ret", 0, 0, 0 },
+    [MIR_ENDBR64] = { "endbr64", 0, 0, 0 },
+    [MIR_VMOVDQU] = { "movdqu", 16, 16, VECTOR | READS_SRC | WRITES_DST },
+    [MIR_VPADDD]  = { "paddd", 16, 16, VECTOR | READS_SRC | READS_DST | WRITES_DST },
+    [MIR_VPSUBD]  = { "psubd", 16, 16, VECTOR | READS_SRC | READS_DST | WRITES_DST },
+    [MIR_VPMULLD] = { "pmulld", 16, 16, VECTOR | READS_SRC | READS_DST | WRITES_DST },
+    [MIR_VPXOR]   = { "pxor", 16, 16, VECTOR | READS_SRC | READS_DST | WRITES_DST },
+    [MIR_VBROADCAST] = { "pbroadcastd", 4, 16, VECTOR | READS_SRC | WRITES_DST },
+    [MIR_VHSUM]   = { "phsum", 16, 4, VECTOR | READS_SRC | WRITES_DST },
+    [MIR_VZEROUPPER] = { "vzeroupper", 0, 0, VECTOR },
+};
+
+#define REG_BIT(r) (1U << (r))
+#define ARG_REGS (REG_BIT(REG_RDI) | REG_BIT(REG_RSI) | REG_BIT(REG_RDX) | \
+                  REG_BIT(REG_RCX) | REG_BIT(REG_R8) | REG_BIT(REG_R9))
+#define CALLER_SAVED_REGS (ARG_REGS | REG_BIT(REG_RAX) | REG_BIT(REG_R10) | REG_BIT(REG_R11))
+#define CALLEE_SAVED_REGS (REG_BIT(REG_RBX) | REG_BIT(REG_R12) | REG_BIT(REG_R13) | \
+                           REG_BIT(REG_R14) | REG_BIT(REG_R15))
+
+const char *mir_reg_name(enum reg reg)
+{
+    return reg64[reg];
+}
+
+struct mir_insn *mir_insn_new(enum mir_opcode op, struct mir_operand src, struct mir_operand dst)
+{
+    struct mir_insn *insn = zalloc(sizeof(struct mir_insn));
+
+    insn->op = op;
+    insn->src = src;
+    insn->dst = dst;
+    return insn;
+}
+
+// registers needed to compute the address of a memory operand
+static inline unsigned int address_regs(struct mir_operand *o)
+{
+    if (o->kind != OPND_MEM)
+        return 0;
+    return (o->reg ? REG_BIT(o->reg) : 0) | (o->index ? REG_BIT(o->index) : 0);
+}
+
+// registers read by the instruction
+unsigned int mir_uses(struct mir_insn *insn)
+{
+    int flags = opinfo[insn->op].flags;
+    unsigned int uses = address_regs(&insn->src) | address_regs(&insn->dst);
+
+    if ((flags & READS_SRC) && insn->src.kind == OPND_REG)
+        uses |= REG_BIT(insn->src.reg);
+    if ((flags & READS_DST) && insn->dst.kind == OPND_REG)
+        uses |= REG_BIT(insn->dst.reg);
+    switch (insn->op) {
+    case MIR_CLTD:
+        uses |= REG_BIT(REG_RAX);
+        break;
+    case MIR_IDIVL:
+    case MIR_DIVL:
+        uses |= REG_BIT(REG_RAX) | REG_BIT(REG_RDX);
+        break;
+    case MIR_CALL:
+        uses |= ARG_REGS | REG_BIT(REG_RAX); // %al counts vector args of variadic calls
+        break;
+    case MIR_RET:
+        uses |= REG_BIT(REG_RAX) | CALLEE_SAVED_REGS | REG_BIT(REG_RBP);
+        break;
+    case MIR_JMP:
+        if (insn->src.kind == OPND_SYM) // tail call
+            uses |= ARG_REGS | REG_BIT(REG_RAX) | CALLEE_SAVED_REGS;
+        break;
+    case MIR_PUSHQ:
+    case MIR_POPQ:
+        uses |= REG_BIT(REG_RSP);
+        break;
+    case MIR_LEAVE:
+        uses |= REG_BIT(REG_RBP);
+        break;
+    default:
+        break;
+    }
+    return uses;
+}
+
+// registers written by the instruction
+unsigned int mir_defs(struct mir_insn *insn)
+{
+    unsigned int defs = 0;
+
+    if ((opinfo[insn->op].flags & WRITES_DST) && insn->dst.kind == OPND_REG)
+        defs |= REG_BIT(insn->dst.reg);
+    switch (insn->op) {
+    case MIR_CLTD:
+        defs |= REG_BIT(REG_RDX);
+        break;
+    case MIR_IDIVL:
+    case MIR_DIVL:
+        defs |= REG_BIT(REG_RAX) | REG_BIT(REG_RDX);
+        break;
+    case MIR_CALL:
+        defs |= CALLER_SAVED_REGS;
+        break;
+    case MIR_PUSHQ:
+    case MIR_POPQ:
+        defs |= REG_BIT(REG_RSP);
+        break;
+    case MIR_LEAVE:
+        defs |= REG_BIT(REG_RSP) | REG_BIT(REG_RBP);
+        break;
+    default:
+        break;
+    }
+    return defs;
+}
+
+/*
+ * Whether the value of 'reg' after 'insn' is never read. We only look at the
+ * next few instructions of the basic block and otherwise assume it is live,
+ * which keeps callers like the peephole optimizer linear.
+ */
+#define DEAD_SCAN_LIMIT 16
+
+int mir_reg_dead_after(struct mir_function *fn, struct mir_insn *insn, enum reg reg)
+{
+    struct list_node *pos;
+    int n = 0;
+
+    for (pos = insn->list.next; pos != &fn->insns.n && n++ < DEAD_SCAN_LIMIT; pos = pos->next) {
+        struct mir_insn *i = list_entry(pos, struct mir_insn, list);
+        if (mir_starts_block(i))
+            return 0;
+        if (mir_uses(i) & REG_BIT(reg))
+            return 0;
+        if (mir_defs(i) & REG_BIT(reg))
+            return 1;
+        if (mir_ends_block(i))
+            return 0;
+    }
+    return 0;
+}
+
+// appending pieces directly is much cheaper than a vsnprintf per instruction
+static inline void emit_char(struct strbuf *sb, char c)
+{
+    strbuf_add(sb, &c, 1);
+}
+
+static void emit_int(struct strbuf *sb, int val)
+{
+    char buf[16], *p = buf + sizeof(buf);
+    unsigned int u = val < 0 ? -(unsigned int)val : val;
+
+    do {
+        *--p = '0' + u % 10;
+        u /= 10;
+    } while (u);
+    if (val < 0)
+        *--p = '-';
+    strbuf_add(sb, p, buf + sizeof(buf) - p);
+}
+
+static void emit_operand(struct strbuf *sb, struct mir_operand *o, int size)
+{
+    switch (o->kind) {
+    case OPND_REG:
+        strbuf_addstr(sb, size == 8 ? reg64[o->reg] : size == 1 ? reg8[o->reg] : reg32[o->reg]);
+        break;
+    case OPND_IMM:
+        emit_char(sb, '$');
+        emit_int(sb, o->val);
+        break;
+    case OPND_MEM:
+        if (o->sym) { // %rip relative
+            strbuf_addstr(sb, o->sym);
+            if (o->val) {
+                if (o->val > 0)
+                    emit_char(sb, '+');
+                emit_int(sb, o->val);
+            }
+            strbuf_addstr(sb, "(%rip)");
+            break;
+        }
+        if (o->val)
+            emit_int(sb, o->val);
+        emit_char(sb, '(');
+        strbuf_addstr(sb, reg64[o->reg]); // empty for an index without base
+        if (o->index) {
+            emit_char(sb, ',');
+            strbuf_addstr(sb, reg64[o->index]);
+            emit_char(sb, ',');
+            emit_int(sb, o->scale);
+        }
+        emit_char(sb, ')');
+        break;
+    case OPND_LABEL:
+        strbuf_add(sb, ".L", 2);
+        emit_int(sb, o->val);
+        break;
+    case OPND_SYM:
+        strbuf_addstr(sb, o->sym);
+        break;
+    case OPND_XREG:
+        strbuf_addstr(sb, size == 32 ? "%ymm" : "%xmm");
+        emit_int(sb, o->val);
+        break;
+    case OPND_NONE:
+        break;
+    }
+}
+
+// name [$imm,] src, [src2,] dst where 'size' is the width of src2 and dst
+static void emit_vop(struct strbuf *sb, const char *name, int imm, struct mir_operand *src,
+                     int src_size, struct mir_operand *src2, struct mir_operand *dst, int size)
+{
+    emit_char(sb, '\t');
+    strbuf_addstr(sb, name);
+    emit_char(sb, ' ');
+    if (imm >= 0) {
+        emit_char(sb, '$');
+        emit_int(sb, imm);
+        strbuf_add(sb, ", ", 2);
+    }
+    emit_operand(sb, src, src_size);
+    if (src2) {
+        strbuf_add(sb, ", ", 2);
+        emit_operand(sb, src2, size);
+    }
+    strbuf_add(sb, ", ", 2);
+    emit_operand(sb, dst, size);
+    emit_char(sb, '\n');
+}
+
+/*
+ * Vector instructions take their VEX encoded three operand form with -mavx2.
+ * SSE2 has no pmulld, the low halves of two pmuludq products are shuffled
+ * together instead. %xmm14 and %xmm15 are scratch for these sequences.
+ */
+static void emit_vector_insn(struct strbuf *sb, struct mir_insn *insn, int avx)
+{
+    int size = avx ? 32 : 16;
+    struct mir_operand t = mir_xreg(15), t2 = mir_xreg(14);
+    struct mir_operand *src = &insn->src, *dst = &insn->dst;
+    char name[16];
+
+    switch (insn->op) {
+    case MIR_VBROADCAST:
+        if (avx && src->kind == OPND_MEM) {
+            emit_vop(sb, "vpbroadcastd", -1, src, 4, NULL, dst, 32);
+        } else if (avx) {
+            emit_vop(sb, "vmovd", -1, src, 4, NULL, dst, 16);
+            emit_vop(sb, "vpbroadcastd", -1, dst, 16, NULL, dst, 32);
+        } else {
+            emit_vop(sb, "movd", -1, src, 4, NULL, dst, 16);
+            emit_vop(sb, "pshufd", 0, dst, 16, NULL, dst, 16);
+        }
+        return;
+    case MIR_VHSUM: // add the upper half to the lower one until a lane is left
+        if (avx) {
+            emit_vop(sb, "vextracti128", 1, src, 32, NULL, &t, 16);
+            emit_vop(sb, "vpaddd", -1, &t, 16, src, src, 16);
+        }
+        emit_vop(sb, avx ? "vpshufd" : "pshufd", 0x4e, src, 16, NULL, &t, 16);
+        emit_vop(sb, avx ? "vpaddd" : "paddd", -1, &t, 16, avx ? src : NULL, src, 16);
+        emit_vop(sb, avx ? "vpshufd" : "pshufd", 0xb1, src, 16, NULL, &t, 16);
+        emit_vop(sb, avx ? "vpaddd" : "paddd", -1, &t, 16, avx ? src : NULL, src, 16);
+        emit_vop(sb, avx ? "vmovd" : "movd", -1, src, 16, NULL, dst, 4);
+        return;
+    case MIR_VPMULLD:
+        if (avx)
+            break;
+        emit_vop(sb, "pshufd", 0xf5, dst, 16, NULL, &t, 16); // odd lanes to the even ones
+        emit_vop(sb, "pshufd", 0xf5, src, 16, NULL, &t2, 16);
+        emit_vop(sb, "pmuludq", -1, src, 16, NULL, dst, 16);
+        emit_vop(sb, "pmuludq", -1, &t2, 16, NULL, &t, 16);
+        emit_vop(sb, "pshufd", 8, dst, 16, NULL, dst, 16); // low halves of the products
+        emit_vop(sb, "pshufd", 8, &t, 16, NULL, &t, 16);
+        emit_vop(sb, "punpckldq", -1, &t, 16, NULL, dst, 16);
+        return;
+    case MIR_VZEROUPPER:
+        strbuf_addstr(sb, "\tvzeroupper\n");
+        return;
+    default:
+        break;
+    }
+    snprintf(name, sizeof(name), "%s%s", avx ? "v" : "", opinfo[insn->op].name);
+    emit_vop(sb, name, -1, src, size,
+             avx && (opinfo[insn->op].flags & READS_DST) ? dst : NULL, dst, size);
+}
+
+static void emit_insn(struct strbuf *sb, struct mir_insn *insn, int avx2)
+{
+    if (insn->op == MIR_LABEL) {
+        emit_operand(sb, &insn->src, 0);
+        strbuf_add(sb, ":\n", 2);
+        return;
+    }
+    if (insn->op == MIR_ALIGN) { // power of two and the most padding allowed
+        strbuf_addstr(sb, "\t.p2align ");
+        emit_int(sb, insn->src.val);
+        strbuf_add(sb, ",,", 2);
+        emit_int(sb, insn->dst.val);
+        emit_char(sb, '\n');
+        return;
+    }
+    if (opinfo[insn->op].flags & VECTOR) {
+        emit_vector_insn(sb, insn, avx2);
+        return;
+    }
+    emit_char(sb, '\t');
+    strbuf_addstr(sb, opinfo[insn->op].name);
+    if (insn->cond)
+        strbuf_addstr(sb, cond_name[insn->cond]);
+    if (insn->src.kind != OPND_NONE) {
+        emit_char(sb, ' ');
+        emit_operand(sb, &insn->src, opinfo[insn->op].src_size);
+        if (insn->dst.kind != OPND_NONE)
+            strbuf_add(sb, ", ", 2);
+    } else if (insn->dst.kind != OPND_NONE)
+        emit_char(sb, ' ');
+    if (insn->dst.kind != OPND_NONE)
+        emit_operand(sb, &insn->dst, opinfo[insn->op].dst_size);
+    emit_char(sb, '\n');
+}
+
+// print the program as GNU assembly
+struct strbuf *emit_asm(struct mir_program *prog)
+{
+    static struct strbuf out = STRBUF_INIT;
+    struct mir_function *fn;
+    struct mir_insn *insn;
+
+    strbuf_add(&out, "", 0); // allocate the buffer even for an empty program
+    if (prog->rodata.len)
+        strbuf_add(&out, prog->rodata.buf, prog->rodata.len);
+    if (prog->data.len)
+        strbuf_add(&out, prog->data.buf, prog->data.len);
+    list_for_each_entry(fn, &prog->functions, list) {
+        strbuf_add(&out, "\n\t.globl ", 9);
+        strbuf_addstr(&out, fn->name);
+        strbuf_addstr(&out, "\n\t.text\n\t.type ");
+        strbuf_addstr(&out, fn->name);
+        strbuf_addstr(&out, ", @function\n");
+        strbuf_addstr(&out, fn->name);
+        strbuf_add(&out, ":\n", 2);
+        list_for_each_entry(insn, &fn->insns, list) {
+            emit_insn(&out, insn, prog->avx2);
+        }
+    }
+    tc_debug(1, "The assembly code:\n%s", out.buf);
+    return &out;
+}
@@ -1,43 +1,118 @@
 #include "tc.h"
 
-void optimize_code(struct strbuf *code)
+/*
+ * Peephole optimizer. Instructions stream through a small window in a single
+ * pass over each function. A rule looks at the instructions starting at the
+ * window head and rewrites them in place, returning the instruction to resume
+ * from. Every rule has to remove at least one instruction, so after a match
+ * we only back up by the window size to catch patterns the rewrite created
+ * and the whole pass stays linear in the number of instructions.
+ */
+#define PEEPHOLE_WINDOW 3
+
+struct peephole_rule {
+    const char *name;
+    int (*match)(struct mir_function *fn, struct mir_insn **w, int n);
+};
+
+static inline void remove_insn(struct mir_insn *insn)
 {
-    int pos, start = 0;
-    do { // remove useless paired pushq/popq with same %rax
-        char *str = "\tpushq %rax\n\tpopq %rax\n";
-        pos = strbuf_findstr(code, str);
-        if (pos != -1) {
-            tc_debug(0, "optimize[1] pos = %d\n", pos);
-            strbuf_remove(code, pos, strlen(str));
-        }
-    } while (pos != -1);
-    do {// replace pushq/popq with movq
-        char *str = "\tpushq %rax\n\tpopq";
-        char *new = "\tmovq %rax,";
-        pos = strbuf_findstr(code, str);
-        if (pos != -1) {
-            tc_debug(0, "optimize[2] pos = %d\n", pos);
-            strbuf_splice(code, pos, strlen(str), new, strlen(new));
-        }
-    } while (pos != -1);
-    do {// merge double mov
-        char *str = ", %eax\n\tmovl %eax";
-        pos = strbuf_findstr_pos(code, str, start);
-        if (pos != -1) {
-            int ipos = pos;
-            if (strncmp(code->buf + ipos - 1, ")", 1) == 0)
-                goto forward; // first oprand is a memory address, just skip
-            while (!isspace(code->buf[ipos--]))
-                ; // skip first oprand of movl xxx, %eax
-            while (!isspace(code->buf[--ipos]))
-                ; // get the pos of instruction
-            if (strncmp(code->buf + ipos + 1, "mov", 3) == 0) {
-                tc_debug(0, "optimize[3] pos = %d\n", pos);
-                strbuf_remove(code, pos, strlen(str));
+    list_del(&insn->list);
+    free(insn);
+}
+
+// pushq %reg; popq %reg => (nothing)
+static int push_pop_same(struct mir_function *fn, struct mir_insn **w, int n)
+{
+    if (n < 2 || w[0]->op != MIR_PUSHQ || w[1]->op != MIR_POPQ ||
+        w[0]->src.kind != OPND_REG || !mir_is_reg(&w[1]->dst, w[0]->src.reg))
+        return 0;
+    remove_insn(w[0]);
+    remove_insn(w[1]);
+    return 1;
+}
+
+// pushq %reg; popq X => movq %reg, X
+static int push_pop_to_mov(struct mir_function *fn, struct mir_insn **w, int n)
+{
+    if (n < 2 || w[0]->op != MIR_PUSHQ || w[1]->op != MIR_POPQ ||
+        w[0]->src.kind != OPND_REG)
+        return 0;
+    w[1]->op = MIR_MOVQ;
+    w[1]->src = w[0]->src;
+    remove_insn(w[0]);
+    return 1;
+}
+
+// movl A, %eax; movl %eax, B => movl A, B when %eax is dead afterwards
+static int double_mov(struct mir_function *fn, struct mir_insn **w, int n)
+{
+    if (n < 2 || w[0]->op != MIR_MOVL || w[1]->op != MIR_MOVL ||
+        !mir_is_reg(&w[0]->dst, REG_RAX) || !mir_is_reg(&w[1]->src, REG_RAX) ||
+        mir_is_reg(&w[1]->dst, REG_RAX))
+        return 0;
+    if (w[0]->src.kind == OPND_MEM && w[1]->dst.kind == OPND_MEM)
+        return 0; // no memory to memory move
+    if (!mir_reg_dead_after(fn, w[1], REG_RAX))
+        return 0;
+    w[1]->src = w[0]->src;
+    remove_insn(w[0]);
+    return 1;
+}
+
+static const struct peephole_rule rules[] = {
+    { "push/pop elimination", push_pop_same },
+    { "push/pop to mov", push_pop_to_mov },
+    { "double mov merge", double_mov },
+};
+
+#define NR_RULES (sizeof(rules) / sizeof(rules[0]))
+static int rule_hits[NR_RULES];
+
+// fill the window with up to PEEPHOLE_WINDOW instructions starting at 'pos'
+static int fill_window(struct mir_function *fn, struct list_node *pos, struct mir_insn **w)
+{
+    int n = 0;
+
+    for (; n < PEEPHOLE_WINDOW && pos != &fn->insns.n; pos = pos->next)
+        w[n++] = list_entry(pos, struct mir_insn, list);
+    return n;
+}
+
+static void peephole_function(struct mir_function *fn)
+{
+    struct list_node *pos = fn->insns.n.next;
+    struct mir_insn *w[PEEPHOLE_WINDOW];
+
+    while (pos != &fn->insns.n) {
+        struct list_node *prev = pos->prev;
+        int n = fill_window(fn, pos, w), i;
+
+        for (i = 0; i < NR_RULES; i++) {
+            if (rules[i].match(fn, w, n)) {
+                tc_debug(0, "optimize %s: %s\n", fn->name, rules[i].name);
+                rule_hits[i]++;
+                break;
             }
-forward:
-            start = pos + strlen(str);
         }
-    } while (pos != -1);
-	tc_debug(1, "The assembly code:\n%s", code->buf);
+        if (i == NR_RULES) {
+            pos = pos->next;
+            continue;
+        }
+        // back up so the rewritten code is matched with what precedes it
+        for (i = 1; i < PEEPHOLE_WINDOW && prev != &fn->insns.n; i++)
+            prev = prev->prev;
+        pos = prev->next;
+    }
+}
+
+void optimize_code(struct mir_program *prog)
+{
+    struct mir_function *fn;
+
+    list_for_each_entry(fn, &prog->functions, list) {
+        peephole_function(fn);
+    }
+    for (int i = 0; i < NR_RULES; i++)
+        print_stat("peephole", rules[i].name, rule_hits[i]);
 }
@@ -507,18 +507,31 @@ static cast_node_t *parse_fun_declaration(void)
     return n;
 }
 
-// declaration = var_declaration | fun_declaration
+// declaration = {"static" | "inline"} (var_declaration | fun_declaration)
 static cast_node_t *parse_declaration(void)
 {
-    token_t *next_tok = next_token(current_tok);
+    token_t *next_tok;
+    int is_inline = 0;
+
+    // static is accepted for compatibility, every function is file local anyway
+    while (current_tok->type == TOK_KEYWORD_STATIC || current_tok->type == TOK_KEYWORD_INLINE) {
+        if (current_tok->type == TOK_KEYWORD_INLINE)
+            is_inline = 1;
+        eat_current_tok(); // eat specifier
+    }
 
     if (!is_type_specifier(current_tok))
         panic("Expected type specifier, but got %s\n", current_tok->lexeme);
 
+    next_tok = next_token(current_tok);
     if (possible_var_declarator(next_tok)) {
+        if (is_inline)
+            panic("'inline' is only valid for functions\n");
         return parse_var_declaration();
     } else if (possible_fun_declarator(next_tok)) {
-        return parse_fun_declaration();
+        cast_node_t *n = parse_fun_declaration();
+        n->fun_declaration.is_inline = is_inline;
+        return n;
     } else {
         panic("Expected var or fun declarator\n");
     }
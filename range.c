@@ -0,0 +1,463 @@
+#include "tc.h"
+
+/*
+ * Value range propagation over the SSA IR, run after global value numbering.
+ * Every value gets the interval of ints it can take: constants are exact,
+ * arithmetic is done on the bounds and gives up on overflow, and phis join
+ * what comes in over their edges. A value used below a branch on a
+ * comparison of it is narrowed by that comparison in the blocks the taken
+ * edge dominates, so in while (i < n) the body sees i < n. Loops iterate
+ * to a fixpoint: a phi that keeps growing is widened to the type's bounds,
+ * and a few more rounds without widening get the bounds the loop tests back.
+ *
+ * Comparisons whose outcome is known become constants in the CAST, for dead
+ * code elimination to drop the branch. The operands of divisions keep their
+ * range in the CAST so the generator can leave out sign corrections.
+ */
+#define WIDEN_AFTER 2 // rounds a phi may grow before it is widened
+#define NARROW_ROUNDS 2
+
+#define INT_LO (-2147483647LL - 1)
+#define INT_HI 2147483647LL
+
+struct interval {
+    long long lo, hi; // empty while lo > hi, the value isn't known to be computed yet
+};
+
+static struct {
+    struct interval *range; // by value id
+    char *grown; // by value id, rounds a phi grew
+    int widen;
+} rp;
+
+static struct {
+    int folded; // comparisons with a known outcome
+    int nonneg; // dividends known to be >= 0
+} stats;
+
+static const struct interval full = { INT_LO, INT_HI };
+static const struct interval empty = { 1, 0 };
+
+static inline int is_empty(struct interval r)
+{
+    return r.lo > r.hi;
+}
+
+static inline struct interval make(long long lo, long long hi)
+{
+    if (lo < INT_LO || hi > INT_HI) // wraps around
+        return full;
+    return (struct interval){ lo, hi };
+}
+
+static inline struct interval join(struct interval a, struct interval b)
+{
+    if (is_empty(a))
+        return b;
+    if (is_empty(b))
+        return a;
+    return (struct interval){ a.lo < b.lo ? a.lo : b.lo, a.hi > b.hi ? a.hi : b.hi };
+}
+
+static inline long long min4(long long a, long long b, long long c, long long d)
+{
+    long long m = a < b ? a : b;
+
+    m = m < c ? m : c;
+    return m < d ? m : d;
+}
+
+static inline long long max4(long long a, long long b, long long c, long long d)
+{
+    long long m = a > b ? a : b;
+
+    m = m > c ? m : c;
+    return m > d ? m : d;
+}
+
+static int is_compare(enum token_type tok)
+{
+    switch (tok) {
+    case TOK_OPERATOR_LESS_THAN:
+    case TOK_OPERATOR_GREATER_THAN:
+    case TOK_OPERATOR_LESS_THAN_OR_EQUAL_TO:
+    case TOK_OPERATOR_GREATER_THAN_OR_EQUAL_TO:
+    case TOK_OPERATOR_EQUAL:
+    case TOK_OPERATOR_NOT_EQUAL:
+        return 1;
+    default:
+        return 0;
+    }
+}
+
+static enum token_type negate(enum token_type tok)
+{
+    switch (tok) {
+    case TOK_OPERATOR_LESS_THAN:
+        return TOK_OPERATOR_GREATER_THAN_OR_EQUAL_TO;
+    case TOK_OPERATOR_GREATER_THAN:
+        return TOK_OPERATOR_LESS_THAN_OR_EQUAL_TO;
+    case TOK_OPERATOR_LESS_THAN_OR_EQUAL_TO:
+        return TOK_OPERATOR_GREATER_THAN;
+    case TOK_OPERATOR_GREATER_THAN_OR_EQUAL_TO:
+        return TOK_OPERATOR_LESS_THAN;
+    case TOK_OPERATOR_EQUAL:
+        return TOK_OPERATOR_NOT_EQUAL;
+    default:
+        return TOK_OPERATOR_EQUAL;
+    }
+}
+
+// a tok b == b swap(tok) a
+static enum token_type swap(enum token_type tok)
+{
+    switch (tok) {
+    case TOK_OPERATOR_LESS_THAN:
+        return TOK_OPERATOR_GREATER_THAN;
+    case TOK_OPERATOR_GREATER_THAN:
+        return TOK_OPERATOR_LESS_THAN;
+    case TOK_OPERATOR_LESS_THAN_OR_EQUAL_TO:
+        return TOK_OPERATOR_GREATER_THAN_OR_EQUAL_TO;
+    case TOK_OPERATOR_GREATER_THAN_OR_EQUAL_TO:
+        return TOK_OPERATOR_LESS_THAN_OR_EQUAL_TO;
+    default:
+        return tok;
+    }
+}
+
+// values of 'r' for which r tok o can hold
+static struct interval restrict_to(struct interval r, enum token_type tok, struct interval o)
+{
+    if (is_empty(r) || is_empty(o))
+        return r;
+    switch (tok) {
+    case TOK_OPERATOR_LESS_THAN:
+        if (r.hi > o.hi - 1)
+            r.hi = o.hi - 1;
+        break;
+    case TOK_OPERATOR_LESS_THAN_OR_EQUAL_TO:
+        if (r.hi > o.hi)
+            r.hi = o.hi;
+        break;
+    case TOK_OPERATOR_GREATER_THAN:
+        if (r.lo < o.lo + 1)
+            r.lo = o.lo + 1;
+        break;
+    case TOK_OPERATOR_GREATER_THAN_OR_EQUAL_TO:
+        if (r.lo < o.lo)
+            r.lo = o.lo;
+        break;
+    case TOK_OPERATOR_EQUAL:
+        if (r.lo < o.lo)
+            r.lo = o.lo;
+        if (r.hi > o.hi)
+            r.hi = o.hi;
+        break;
+    case TOK_OPERATOR_NOT_EQUAL:
+        if (o.lo == o.hi && r.lo == o.lo)
+            r.lo++;
+        else if (o.lo == o.hi && r.hi == o.lo)
+            r.hi--;
+        break;
+    default:
+        break;
+    }
+    return r;
+}
+
+// 1 or 0 when l tok r holds for all or none of the values, -1 otherwise
+static int compare(enum token_type tok, struct interval l, struct interval r)
+{
+    switch (tok) {
+    case TOK_OPERATOR_LESS_THAN:
+        return l.hi < r.lo ? 1 : l.lo >= r.hi ? 0 : -1;
+    case TOK_OPERATOR_LESS_THAN_OR_EQUAL_TO:
+        return l.hi <= r.lo ? 1 : l.lo > r.hi ? 0 : -1;
+    case TOK_OPERATOR_GREATER_THAN:
+        return compare(TOK_OPERATOR_LESS_THAN, r, l);
+    case TOK_OPERATOR_GREATER_THAN_OR_EQUAL_TO:
+        return compare(TOK_OPERATOR_LESS_THAN_OR_EQUAL_TO, r, l);
+    case TOK_OPERATOR_EQUAL:
+        if (l.lo == l.hi && r.lo == r.hi && l.lo == r.lo)
+            return 1;
+        return l.hi < r.lo || l.lo > r.hi ? 0 : -1;
+    case TOK_OPERATOR_NOT_EQUAL:
+        return compare(TOK_OPERATOR_EQUAL, l, r) < 0 ? -1 : !compare(TOK_OPERATOR_EQUAL, l, r);
+    default:
+        return -1;
+    }
+}
+
+static struct interval range_at(struct ir_value *v, struct ir_block *b);
+
+// what holds of 'v' in block 'b' when 'cond' at the end of 'from' went to b
+static struct interval refine(struct interval r, struct ir_value *v, struct ir_block *from,
+                              struct ir_block *b)
+{
+    struct ir_value *br = list_last_entry(&from->insns, struct ir_value, list);
+    struct ir_value *cond;
+    enum token_type tok;
+    int taken;
+
+    if (br->op != IR_BR || from->succs[0] == from->succs[1])
+        return r;
+    cond = br->args[0];
+    taken = b == from->succs[0];
+    if (cond == v) // plain truth value
+        return restrict_to(r, taken ? TOK_OPERATOR_NOT_EQUAL : TOK_OPERATOR_EQUAL, make(0, 0));
+    if (cond->op != IR_BINOP || !is_compare(cond->tok))
+        return r;
+    tok = taken ? cond->tok : negate(cond->tok);
+    if (cond->args[0] == v)
+        r = restrict_to(r, tok, range_at(cond->args[1], from));
+    if (cond->args[1] == v)
+        r = restrict_to(r, swap(tok), range_at(cond->args[0], from));
+    return r;
+}
+
+// range of 'v' in block 'b', narrowed by the branches that decide b runs
+static struct interval range_at(struct ir_value *v, struct ir_block *b)
+{
+    struct interval r = rp.range[v->id];
+
+    for (; b->idom && !is_empty(r); b = b->idom) {
+        // an edge dominates what its target dominates when it is the only way in
+        if (b->nr_preds == 1)
+            r = refine(r, v, b->preds[0], b);
+    }
+    return r;
+}
+
+static struct interval divide(struct interval l, struct interval r)
+{
+    if (r.lo <= 0 && r.hi >= 0)
+        return full; // may divide by zero
+    if (l.lo == INT_LO && r.lo <= -1 && r.hi >= -1)
+        return full; // may overflow
+    // monotonic in each operand while the divisor keeps its sign
+    return make(min4(l.lo / r.lo, l.lo / r.hi, l.hi / r.lo, l.hi / r.hi),
+                max4(l.lo / r.lo, l.lo / r.hi, l.hi / r.lo, l.hi / r.hi));
+}
+
+static struct interval modulo(struct interval l, struct interval r)
+{
+    long long m;
+
+    if (r.lo <= 0 && r.hi >= 0)
+        return full;
+    m = (r.lo < 0 ? -r.lo : r.lo) > (r.hi < 0 ? -r.hi : r.hi) ?
+        (r.lo < 0 ? -r.lo : r.lo) : (r.hi < 0 ? -r.hi : r.hi);
+    // the remainder is smaller than the divisor and has the sign of the dividend
+    if (l.lo >= 0)
+        return make(0, l.hi < m - 1 ? l.hi : m - 1);
+    if (l.hi <= 0)
+        return make(l.lo > 1 - m ? l.lo : 1 - m, 0);
+    return make(1 - m, m - 1);
+}
+
+static struct interval binop(enum token_type tok, struct interval l, struct interval r)
+{
+    int known;
+
+    if (is_empty(l) || is_empty(r))
+        return empty;
+    switch (tok) {
+    case TOK_OPERATOR_ADD:
+        return make(l.lo + r.lo, l.hi + r.hi);
+    case TOK_OPERATOR_SUB:
+        return make(l.lo - r.hi, l.hi - r.lo);
+    case TOK_OPERATOR_MUL:
+        return make(min4(l.lo * r.lo, l.lo * r.hi, l.hi * r.lo, l.hi * r.hi),
+                    max4(l.lo * r.lo, l.lo * r.hi, l.hi * r.lo, l.hi * r.hi));
+    case TOK_OPERATOR_DIV:
+        return divide(l, r);
+    case TOK_OPERATOR_MOD:
+        return modulo(l, r);
+    default:
+        if (!is_compare(tok))
+            return full;
+        known = compare(tok, l, r);
+        return known < 0 ? make(0, 1) : make(known, known);
+    }
+}
+
+static struct interval evaluate(struct ir_value *v)
+{
+    struct interval r = empty;
+
+    switch (v->op) {
+    case IR_CONST:
+        return make(v->num, v->num);
+    case IR_BINOP:
+        return binop(v->tok, range_at(v->args[0], v->block), range_at(v->args[1], v->block));
+    case IR_PHI:
+        for (int i = 0; i < v->nr_args; i++) {
+            struct ir_block *pred = v->block->preds[i];
+            r = join(r, refine(range_at(v->args[i], pred), v->args[i], pred, v->block));
+        }
+        return r;
+    default: // loaded, called or a parameter
+        return full;
+    }
+}
+
+// one round over the function in reverse postorder, whether anything changed
+static int propagate(struct ir_function *fn)
+{
+    struct ir_value *v;
+    int changed = 0;
+
+    for (int i = 0; i < fn->nr_blocks; i++) {
+        list_for_each_entry(v, &fn->blocks[i]->insns, list) {
+            struct interval old = rp.range[v->id], r = evaluate(v);
+            if (v->op == IR_PHI && rp.widen) {
+                r = join(old, r);
+                if (!is_empty(old) && (r.lo < old.lo || r.hi > old.hi) &&
+                    ++rp.grown[v->id] > WIDEN_AFTER) {
+                    if (r.lo < old.lo)
+                        r.lo = INT_LO;
+                    if (r.hi > old.hi)
+                        r.hi = INT_HI;
+                }
+            }
+            if (r.lo != old.lo || r.hi != old.hi) {
+                rp.range[v->id] = r;
+                changed = 1;
+            }
+        }
+    }
+    return changed;
+}
+
+// remember that CAST 'node' takes values in 'r', one node may be built more than once
+static void annotate(cast_node_t *node, struct interval r)
+{
+    if (is_empty(r))
+        r = full; // not reached, nothing is known
+    if (!node->range) {
+        node->range = zalloc(sizeof(*node->range));
+        node->range->lo = r.lo;
+        node->range->hi = r.hi;
+        return;
+    }
+    if (r.lo < node->range->lo)
+        node->range->lo = r.lo;
+    if (r.hi > node->range->hi)
+        node->range->hi = r.hi;
+}
+
+static void annotate_function(struct ir_function *fn)
+{
+    struct ir_value *v;
+
+    for (int i = 0; i < fn->nr_blocks; i++) {
+        list_for_each_entry(v, &fn->blocks[i]->insns, list) {
+            if (!v->node || v->op != IR_BINOP)
+                continue;
+            if (is_compare(v->tok)) {
+                annotate(v->node, rp.range[v->id]);
+            } else if (v->tok == TOK_OPERATOR_DIV || v->tok == TOK_OPERATOR_MOD) {
+                annotate(v->node->expr.op.left, range_at(v->args[0], v->block));
+                annotate(v->node->expr.op.right, range_at(v->args[1], v->block));
+            }
+        }
+    }
+}
+
+// fold the comparisons of 'node' that have one outcome
+static void fold_node(cast_node_t *node)
+{
+    cast_node_t *s;
+
+    if (!node)
+        return;
+    switch (node->type) {
+    case CAST_PROGRAM:
+        list_for_each_entry(s, &node->program.declarations, list)
+            fold_node(s);
+        break;
+    case CAST_FUN_DECLARATION:
+        fold_node(node->fun_declaration.compound_stmt);
+        break;
+    case CAST_COMPOUND_STMT:
+        list_for_each_entry(s, &node->compound_stmt.stmts, list)
+            fold_node(s);
+        break;
+    case CAST_VAR_DECLARATION:
+        list_for_each_entry(s, &node->var_declaration.var_declarator_list->var_declarator_list.var_declarators, list)
+            fold_node(s->var_declarator.expr);
+        break;
+    case CAST_ASSIGN_STMT:
+        fold_node(node->assign_stmt.array_expr);
+        fold_node(node->assign_stmt.expr);
+        break;
+    case CAST_IF_STMT:
+        fold_node(node->if_stmt.expr);
+        fold_node(node->if_stmt.if_stmt);
+        fold_node(node->if_stmt.else_stmt);
+        break;
+    case CAST_WHILE_STMT:
+        fold_node(node->while_stmt.expr);
+        fold_node(node->while_stmt.stmt);
+        break;
+    case CAST_RETURN_STMT:
+        fold_node(node->return_stmt.expr);
+        break;
+    case CAST_CALL_STMT:
+        fold_node(node->call_stmt.expr);
+        break;
+    case CAST_CALL_EXPR:
+        list_for_each_entry(s, &node->call_expr.args_list, list)
+            fold_node(s);
+        break;
+    case CAST_RELATIONAL_EXPR:
+        if (node->range && node->range->lo == node->range->hi && is_pure(node)) {
+            int val = node->range->lo;
+            node->type = CAST_NUMBER;
+            node->expr.num = val;
+            stats.folded++;
+            break;
+        }
+        // fall through
+    case CAST_LOGICAL_EXPR:
+    case CAST_SIMPLE_EXPR:
+    case CAST_TERM:
+        fold_node(node->expr.op.left);
+        fold_node(node->expr.op.right);
+        if (node->type == CAST_TERM && node->expr.op.type != TOK_OPERATOR_MUL &&
+            node->expr.op.left->range && node->expr.op.left->range->lo >= 0)
+            stats.nonneg++;
+        break;
+    case CAST_IDENTIFIER:
+        fold_node(node->expr.array_expr);
+        break;
+    default:
+        break;
+    }
+}
+
+void propagate_ranges(cast_node_t *ast)
+{
+    struct ir_program *prog = build_ir(ast);
+    struct ir_function *fn;
+    int round;
+
+    list_for_each_entry(fn, &prog->functions, list) {
+        rp.range = malloc(fn->nr_values * sizeof(*rp.range));
+        rp.grown = zalloc(fn->nr_values);
+        for (int i = 0; i < fn->nr_values; i++)
+            rp.range[i] = empty;
+        rp.widen = 1;
+        while (propagate(fn))
+            ;
+        rp.widen = 0;
+        for (round = 0; round < NARROW_ROUNDS && propagate(fn); round++)
+            ;
+        annotate_function(fn);
+        free(rp.range);
+        free(rp.grown);
+    }
+    fold_node(ast);
+    print_stat("range", "comparisons folded", stats.folded);
+    print_stat("range", "non-negative dividends", stats.nonneg);
+}
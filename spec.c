@@ -0,0 +1,510 @@
+#include "tc.h"
+
+/*
+ * Function specialization over the CAST, run after inline_functions() for
+ * the calls it left: functions too big to inline or recursive ones.
+ *
+ * A function called with the same constant arguments from a loop or from
+ * several places gets a clone in which those parameters are replaced with
+ * the constants. fold_constants() and the passes after it then simplify the
+ * clone like an inlined body, and the calls pass the clone what is left of
+ * their arguments. Calls in the clones are redirected too, so a recursive
+ * function passing a parameter through keeps calling its clone.
+ *
+ * Only parameters the function never assigns and never shadows with a local
+ * can be replaced. Clones are made for the hottest argument sets first, a
+ * call in a loop weighing as much as SPEC_LOOP_WEIGHT calls, until they
+ * would grow the program by more than SPEC_GROWTH percent. A function all
+ * of whose calls went to its clones is dropped.
+ */
+#define SPEC_MIN_WEIGHT 2 // calls with an argument set worth a clone
+#define SPEC_LOOP_WEIGHT 8
+#define SPEC_MAX_SIZE 400 // CAST nodes of a function worth cloning
+#define SPEC_GROWTH 50 // percent of the program the clones may add
+#define SPEC_MAX_CLONES 4 // per function
+#define SPEC_MAX_PARAMS 6 // of a function that can be cloned
+
+struct func {
+    cast_node_t *decl;
+    symbol_t *sym;
+    char *params[SPEC_MAX_PARAMS];
+    int size; // CAST nodes
+    unsigned int can; // parameters that may be replaced, by bit
+    int clones;
+    int calls; // left to the original after redirecting
+};
+
+// the constant arguments of some calls
+struct spec {
+    struct func *f;
+    unsigned int mask; // parameters passed a constant
+    int vals[SPEC_MAX_PARAMS];
+    int weight;
+    int order; // of the first call
+    cast_node_t *clone; // NULL until it is made
+};
+
+static struct {
+    struct func *funcs;
+    int nr_funcs, alloc_funcs;
+    struct spec *specs;
+    int nr_specs, alloc_specs;
+    struct func *f; // being scanned
+    struct spec *s; // being cloned
+    cast_node_t *ast;
+} sp;
+
+static struct {
+    int cloned;     // functions specialized
+    int redirected; // calls to a clone
+    int removed;    // originals no call was left to
+} stats;
+
+static struct func *find_func(char *name)
+{
+    for (int i = 0; i < sp.nr_funcs; i++)
+        if (!strcmp(sp.funcs[i].decl->fun_declaration.identifier, name))
+            return sp.funcs + i;
+    return NULL;
+}
+
+static void cant_replace(char *name)
+{
+    for (int i = 0; i < SPEC_MAX_PARAMS; i++)
+        if (sp.f->params[i] && !strcmp(sp.f->params[i], name))
+            sp.f->can &= ~(1U << i);
+}
+
+// size of the function body 'node', ruling out the parameters it writes or shadows
+static int scan_body(cast_node_t *node)
+{
+    int n = 1;
+
+    if (!node)
+        return 0;
+    switch (node->type) {
+    case CAST_VAR_DECLARATION:
+        return n + scan_body(node->var_declaration.var_declarator_list);
+    case CAST_VAR_DECLARATOR_LIST:
+        {
+            cast_node_t *d;
+            list_for_each_entry(d, &node->var_declarator_list.var_declarators, list) {
+                n += scan_body(d);
+            }
+        }
+        return n;
+    case CAST_VAR_DECLARATOR:
+        cant_replace(node->var_declarator.identifier);
+        return n + scan_body(node->var_declarator.expr);
+    case CAST_COMPOUND_STMT:
+        {
+            cast_node_t *s;
+            list_for_each_entry(s, &node->compound_stmt.stmts, list) {
+                n += scan_body(s);
+            }
+        }
+        return n;
+    case CAST_ASSIGN_STMT:
+        cant_replace(node->assign_stmt.identifier);
+        return n + scan_body(node->assign_stmt.array_expr) + scan_body(node->assign_stmt.expr);
+    case CAST_IF_STMT:
+        return n + scan_body(node->if_stmt.expr) + scan_body(node->if_stmt.if_stmt) +
+               scan_body(node->if_stmt.else_stmt);
+    case CAST_WHILE_STMT:
+        return n + scan_body(node->while_stmt.expr) + scan_body(node->while_stmt.stmt);
+    case CAST_RETURN_STMT:
+        return n + scan_body(node->return_stmt.expr);
+    case CAST_CALL_STMT:
+        return n + scan_body(node->call_stmt.expr);
+    case CAST_CALL_EXPR:
+        {
+            cast_node_t *arg;
+            list_for_each_entry(arg, &node->call_expr.args_list, list) {
+                n += scan_body(arg);
+            }
+        }
+        return n;
+    case CAST_LOGICAL_EXPR:
+    case CAST_RELATIONAL_EXPR:
+    case CAST_SIMPLE_EXPR:
+    case CAST_TERM:
+        return n + scan_body(node->expr.op.left) + scan_body(node->expr.op.right);
+    case CAST_IDENTIFIER:
+        return n + scan_body(node->expr.array_expr);
+    default:
+        return n;
+    }
+}
+
+// call 'fn' on every call in 'node', arguments first, with the number of loops around it
+static void walk_calls(cast_node_t *node, int loops, void (*fn)(cast_node_t *call, int loops))
+{
+    if (!node)
+        return;
+    switch (node->type) {
+    case CAST_VAR_DECLARATION:
+        walk_calls(node->var_declaration.var_declarator_list, loops, fn);
+        break;
+    case CAST_VAR_DECLARATOR_LIST:
+        {
+            cast_node_t *d;
+            list_for_each_entry(d, &node->var_declarator_list.var_declarators, list) {
+                walk_calls(d->var_declarator.expr, loops, fn);
+            }
+        }
+        break;
+    case CAST_FUN_DECLARATION:
+        walk_calls(node->fun_declaration.compound_stmt, loops, fn);
+        break;
+    case CAST_COMPOUND_STMT:
+        {
+            cast_node_t *s;
+            list_for_each_entry(s, &node->compound_stmt.stmts, list) {
+                walk_calls(s, loops, fn);
+            }
+        }
+        break;
+    case CAST_ASSIGN_STMT:
+        walk_calls(node->assign_stmt.array_expr, loops, fn);
+        walk_calls(node->assign_stmt.expr, loops, fn);
+        break;
+    case CAST_IF_STMT:
+        walk_calls(node->if_stmt.expr, loops, fn);
+        walk_calls(node->if_stmt.if_stmt, loops, fn);
+        walk_calls(node->if_stmt.else_stmt, loops, fn);
+        break;
+    case CAST_WHILE_STMT:
+        walk_calls(node->while_stmt.expr, loops + 1, fn);
+        walk_calls(node->while_stmt.stmt, loops + 1, fn);
+        break;
+    case CAST_RETURN_STMT:
+        walk_calls(node->return_stmt.expr, loops, fn);
+        break;
+    case CAST_CALL_STMT:
+        walk_calls(node->call_stmt.expr, loops, fn);
+        break;
+    case CAST_CALL_EXPR:
+        {
+            cast_node_t *arg;
+            list_for_each_entry(arg, &node->call_expr.args_list, list) {
+                walk_calls(arg, loops, fn);
+            }
+            fn(node, loops);
+        }
+        break;
+    case CAST_LOGICAL_EXPR:
+    case CAST_RELATIONAL_EXPR:
+    case CAST_SIMPLE_EXPR:
+    case CAST_TERM:
+        walk_calls(node->expr.op.left, loops, fn);
+        walk_calls(node->expr.op.right, loops, fn);
+        break;
+    case CAST_IDENTIFIER:
+        walk_calls(node->expr.array_expr, loops, fn);
+        break;
+    default:
+        break;
+    }
+}
+
+// the function 'call' calls with its arguments in 'args', NULL if it can't be cloned
+static struct func *callee_args(cast_node_t *call, cast_node_t **args)
+{
+    struct func *f = find_func(call->call_expr.identifier);
+    cast_node_t *arg;
+    int n = 0;
+
+    if (!f)
+        return NULL;
+    list_for_each_entry(arg, &call->call_expr.args_list, list) {
+        if (n == SPEC_MAX_PARAMS)
+            return NULL;
+        args[n++] = arg;
+    }
+    return n == f->sym->arg_count ? f : NULL;
+}
+
+static void add_site(cast_node_t *call, int loops)
+{
+    cast_node_t *args[SPEC_MAX_PARAMS];
+    struct func *f = callee_args(call, args);
+    struct spec s = { f, 0 }, *t;
+
+    if (!f)
+        return;
+    for (int i = 0; i < f->sym->arg_count; i++) {
+        if ((f->can & (1U << i)) && args[i]->type == CAST_NUMBER) {
+            s.mask |= 1U << i;
+            s.vals[i] = args[i]->expr.num;
+        }
+    }
+    if (!s.mask)
+        return;
+    for (t = sp.specs; t < sp.specs + sp.nr_specs; t++) {
+        if (t->f == f && t->mask == s.mask && !memcmp(t->vals, s.vals, sizeof(s.vals)))
+            break;
+    }
+    if (t == sp.specs + sp.nr_specs) {
+        ALLOC_GROW(sp.specs, sp.nr_specs + 1, sp.alloc_specs);
+        t = sp.specs + sp.nr_specs;
+        *t = s;
+        t->order = sp.nr_specs++;
+    }
+    t->weight += loops ? SPEC_LOOP_WEIGHT : 1;
+}
+
+static int hotter(const void *a, const void *b)
+{
+    const struct spec *x = a, *y = b;
+
+    if (x->weight != y->weight)
+        return y->weight - x->weight;
+    return x->order - y->order;
+}
+
+static cast_node_t *copy_tree(cast_node_t *node);
+
+static void copy_list(struct list_head *to, struct list_head *from)
+{
+    cast_node_t *s;
+
+    INIT_LIST_HEAD(to);
+    list_for_each_entry(s, from, list) {
+        list_add_tail(&copy_tree(s)->list, to);
+    }
+}
+
+// copy of 'node' with the parameters of the clone being made replaced
+static cast_node_t *copy_tree(cast_node_t *node)
+{
+    cast_node_t *n;
+
+    if (!node)
+        return NULL;
+    n = copy_node(node);
+    switch (node->type) {
+    case CAST_VAR_DECLARATION:
+        n->var_declaration.var_declarator_list = copy_tree(node->var_declaration.var_declarator_list);
+        break;
+    case CAST_VAR_DECLARATOR_LIST:
+        copy_list(&n->var_declarator_list.var_declarators, &node->var_declarator_list.var_declarators);
+        break;
+    case CAST_VAR_DECLARATOR:
+        n->var_declarator.expr = copy_tree(node->var_declarator.expr);
+        break;
+    case CAST_COMPOUND_STMT:
+        copy_list(&n->compound_stmt.stmts, &node->compound_stmt.stmts);
+        n->compound_stmt.symbol_table = NULL; // made by the analyzer
+        break;
+    case CAST_ASSIGN_STMT:
+        n->assign_stmt.array_expr = copy_tree(node->assign_stmt.array_expr);
+        n->assign_stmt.expr = copy_tree(node->assign_stmt.expr);
+        break;
+    case CAST_IF_STMT:
+        n->if_stmt.expr = copy_tree(node->if_stmt.expr);
+        n->if_stmt.if_stmt = copy_tree(node->if_stmt.if_stmt);
+        n->if_stmt.else_stmt = copy_tree(node->if_stmt.else_stmt);
+        break;
+    case CAST_WHILE_STMT:
+        n->while_stmt.expr = copy_tree(node->while_stmt.expr);
+        n->while_stmt.stmt = copy_tree(node->while_stmt.stmt);
+        n->while_stmt.effects = NULL;
+        break;
+    case CAST_RETURN_STMT:
+        n->return_stmt.expr = copy_tree(node->return_stmt.expr);
+        break;
+    case CAST_CALL_STMT:
+        n->call_stmt.expr = copy_tree(node->call_stmt.expr);
+        break;
+    case CAST_CALL_EXPR:
+        copy_list(&n->call_expr.args_list, &node->call_expr.args_list);
+        break;
+    case CAST_LOGICAL_EXPR:
+    case CAST_RELATIONAL_EXPR:
+    case CAST_SIMPLE_EXPR:
+    case CAST_TERM:
+        n->expr.op.left = copy_tree(node->expr.op.left);
+        n->expr.op.right = copy_tree(node->expr.op.right);
+        break;
+    case CAST_IDENTIFIER:
+        for (int i = 0; i < SPEC_MAX_PARAMS; i++) {
+            if ((sp.s->mask & (1U << i)) && !strcmp(sp.s->f->params[i], node->expr.identifier)) {
+                n->type = CAST_NUMBER;
+                n->expr.num = sp.s->vals[i];
+                return n;
+            }
+        }
+        n->expr.array_expr = copy_tree(node->expr.array_expr);
+        break;
+    default:
+        break;
+    }
+    return n;
+}
+
+/*
+ * Declare the locals inlining added to function 'd' at the top of 'body' of
+ * its clone, they are only in the symbol table of 'd'.
+ */
+static void declare_temps(cast_node_t *d, cast_node_t *body)
+{
+    symbol_table_t *t = d->fun_declaration.symbol_table;
+    cast_node_t *decl = new_node(CAST_VAR_DECLARATION, body->line_number);
+    cast_node_t *list = new_node(CAST_VAR_DECLARATOR_LIST, body->line_number);
+
+    decl->var_declaration.type = TOK_KEYWORD_INT;
+    decl->var_declaration.var_declarator_list = list;
+    INIT_LIST_HEAD(&list->var_declarator_list.var_declarators);
+    for (int i = 0; i < TABLE_SIZE; i++) {
+        struct hlist_node *node;
+        hlist_for_each(node, t->table + i) {
+            symbol_t *s = hlist_entry(node, symbol_t, list);
+            cast_node_t *v;
+            if (s->name[0] != '.')
+                continue;
+            v = new_node(CAST_VAR_DECLARATOR, body->line_number);
+            v->var_declarator.type = TOK_KEYWORD_INT;
+            v->var_declarator.identifier = s->name;
+            list_add_tail(&v->list, &list->var_declarator_list.var_declarators);
+        }
+    }
+    if (list_empty(&list->var_declarator_list.var_declarators)) {
+        free(list);
+        free(decl);
+        return;
+    }
+    list_add(&decl->list, &body->compound_stmt.stmts);
+}
+
+// add a copy of the function of 's' without its constant parameters after it
+static void make_clone(struct spec *s)
+{
+    cast_node_t *d = s->f->decl, *c, *param;
+    char name[64];
+    int i = 0;
+
+    sp.s = s;
+    c = copy_node(d);
+    snprintf(name, sizeof(name), "%s.spec%d", d->fun_declaration.identifier, s->f->clones++);
+    c->fun_declaration.identifier = strdup(name); // can't clash with identifiers
+    c->fun_declaration.symbol_table = NULL;
+    c->fun_declaration.param_list = NULL;
+    if (d->fun_declaration.param_list) {
+        c->fun_declaration.param_list = copy_node(d->fun_declaration.param_list);
+        INIT_LIST_HEAD(&c->fun_declaration.param_list->param_list.params);
+        list_for_each_entry(param, &d->fun_declaration.param_list->param_list.params, list) {
+            if (!(s->mask & (1U << i++)))
+                list_add_tail(&copy_node(param)->list, &c->fun_declaration.param_list->param_list.params);
+        }
+    }
+    c->fun_declaration.compound_stmt = copy_tree(d->fun_declaration.compound_stmt);
+    declare_temps(d, c->fun_declaration.compound_stmt);
+    __list_add(&c->list, &d->list, d->list.next);
+    analyze_declaration(sp.ast, c);
+    s->clone = c;
+    tc_debug(0, "specialize %s as %s\n", d->fun_declaration.identifier, name);
+    stats.cloned++;
+}
+
+// call the clone taking the most of the constant arguments of 'call'
+static void redirect(cast_node_t *call, int loops)
+{
+    cast_node_t *args[SPEC_MAX_PARAMS];
+    struct func *f = callee_args(call, args);
+    struct spec *best = NULL;
+
+    if (!f || !f->clones)
+        return;
+    for (struct spec *s = sp.specs; s < sp.specs + sp.nr_specs; s++) {
+        int i;
+        if (s->f != f || !s->clone)
+            continue;
+        for (i = 0; i < f->sym->arg_count; i++) {
+            if ((s->mask & (1U << i)) &&
+                (args[i]->type != CAST_NUMBER || args[i]->expr.num != s->vals[i]))
+                break;
+        }
+        if (i == f->sym->arg_count &&
+            (!best || __builtin_popcount(s->mask) > __builtin_popcount(best->mask)))
+            best = s;
+    }
+    if (!best)
+        return;
+    for (int i = 0; i < f->sym->arg_count; i++)
+        if (best->mask & (1U << i))
+            list_del(&args[i]->list);
+    call->call_expr.identifier = best->clone->fun_declaration.identifier;
+    stats.redirected++;
+}
+
+static void count_call(cast_node_t *call, int loops)
+{
+    struct func *f = find_func(call->call_expr.identifier);
+
+    if (f)
+        f->calls++;
+}
+
+void specialize_functions(cast_node_t *ast)
+{
+    symbol_table_t *global = ast->program.symbol_table;
+    int size = 0, budget;
+    cast_node_t *d;
+
+    if (options.no_specialize)
+        goto out;
+    sp.ast = ast;
+    list_for_each_entry(d, &ast->program.declarations, list) {
+        struct func *f;
+        cast_node_t *param;
+        int i = 0;
+        if (d->type != CAST_FUN_DECLARATION || !d->fun_declaration.compound_stmt)
+            continue;
+        ALLOC_GROW(sp.funcs, sp.nr_funcs + 1, sp.alloc_funcs);
+        f = sp.funcs + sp.nr_funcs++;
+        memset(f, 0, sizeof(*f));
+        f->decl = d;
+        f->sym = symbol_table_lookup(global, d->fun_declaration.identifier, 0);
+        if (d->fun_declaration.param_list) {
+            list_for_each_entry(param, &d->fun_declaration.param_list->param_list.params, list) {
+                if (i < SPEC_MAX_PARAMS)
+                    f->params[i] = param->param.identifier;
+                i++;
+            }
+        }
+        if (i <= SPEC_MAX_PARAMS && strcmp(d->fun_declaration.identifier, "main"))
+            f->can = (1U << i) - 1;
+        sp.f = f;
+        f->size = scan_body(d->fun_declaration.compound_stmt);
+        size += f->size;
+    }
+    list_for_each_entry(d, &ast->program.declarations, list) {
+        walk_calls(d, 0, add_site);
+    }
+    qsort(sp.specs, sp.nr_specs, sizeof(struct spec), hotter);
+    budget = size * SPEC_GROWTH / 100;
+    for (struct spec *s = sp.specs; s < sp.specs + sp.nr_specs; s++) {
+        if (s->weight < SPEC_MIN_WEIGHT || s->f->size > SPEC_MAX_SIZE ||
+            s->f->clones == SPEC_MAX_CLONES || s->f->size > budget)
+            continue;
+        make_clone(s);
+        budget -= s->f->size;
+    }
+    if (!stats.cloned)
+        goto out;
+    list_for_each_entry(d, &ast->program.declarations, list) {
+        walk_calls(d, 0, redirect);
+        walk_calls(d, 0, count_call);
+    }
+    for (int i = 0; i < sp.nr_funcs; i++) {
+        if (sp.funcs[i].clones && !sp.funcs[i].calls) { // only the clones run
+            list_del(&sp.funcs[i].decl->list);
+            stats.removed++;
+        }
+    }
+    analyze_effects(ast); // for the clones and the calls to them
+out:
+    print_stat("spec", "functions specialized", stats.cloned);
+    print_stat("spec", "calls redirected", stats.redirected);
+    print_stat("spec", "originals removed", stats.removed);
+}
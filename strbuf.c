@@ -0,0 +1,92 @@
+#include "tc.h"
+
+static void strbuf_grow(struct strbuf *sb, size_t extra)
+{
+	if (sb->len + extra + 1 <= sb->len)
+    	panic("you want to use way too much memory");
+	ALLOC_GROW(sb->buf, sb->len + extra + 1, sb->alloc);
+}
+
+static inline size_t strbuf_avail(struct strbuf *sb)
+{
+	return sb->alloc ? sb->alloc - sb->len - 1 : 0;
+}
+
+void strbuf_add(struct strbuf *sb, const void *data, size_t len)
+{
+	strbuf_grow(sb, len);
+	memcpy(sb->buf + sb->len, data, len);
+	strbuf_setlen(sb, sb->len + len);
+}
+
+void strbuf_addf(struct strbuf *sb, const char *fmt, ...)
+{
+	int len;
+	va_list ap;
+
+	va_start(ap, fmt);
+	len = vsnprintf(sb->buf + sb->len, sb->alloc - sb->len, fmt, ap);
+	va_end(ap);
+	if (len < 0)
+		len = 0;
+	if (len > strbuf_avail(sb)) {
+		strbuf_grow(sb, len);
+		va_start(ap, fmt);
+		len = vsnprintf(sb->buf + sb->len, sb->alloc - sb->len, fmt, ap);
+		va_end(ap);
+	}
+	strbuf_setlen(sb, sb->len + len);
+}
+
+static void strbuf_vinsertf(struct strbuf *sb, size_t pos, const char *fmt, va_list ap)
+{
+    int len, len2;
+    char save;
+    va_list cp;
+
+    if (pos > sb->len)
+        panic("`pos' is too far after the end of the buffer");
+    va_copy(cp, ap);
+    len = vsnprintf(sb->buf + sb->len, 0, fmt, cp);
+    va_end(cp);
+    if (len < 0)
+        panic("your vsnprintf is broken (returned %d)", len);
+    if (!len)
+        return; /* nothing to do */
+    strbuf_grow(sb, len);
+    memmove(sb->buf + pos + len, sb->buf + pos, sb->len - pos);
+    /* vsnprintf() will append a NUL, overwriting one of our characters */
+    save = sb->buf[pos + len];
+    len2 = vsnprintf(sb->buf + pos, len + 1, fmt, ap);
+    sb->buf[pos + len] = save;
+    if (len2 != len)
+        panic("your vsnprintf is broken (returns inconsistent lengths)");
+    strbuf_setlen(sb, sb->len + len);
+}
+
+static inline void strbuf_insertf(struct strbuf *sb, size_t pos, const char *fmt, ...)
+{
+    va_list ap;
+    va_start(ap, fmt);
+    strbuf_vinsertf(sb, pos, fmt, ap);
+    va_end(ap);
+}
+
+void strbuf_splice(struct strbuf *sb, size_t pos, size_t len,
+                   const void *data, size_t dlen)
+{
+    if ((pos + len < pos))
+		panic("you want to use way too much memory");
+	if ((pos > sb->len))
+		panic("`pos' is too far after the end of the buffer");
+	if ((pos + len > sb->len))
+		panic("`pos + len' is too far after the end of the buffer");
+
+	if (dlen >= len)
+		strbuf_grow(sb, dlen - len);
+    memmove(sb->buf + pos + dlen,
+            sb->buf + pos + len,
+            sb->len - pos - len);
+    memcpy(sb->buf + pos, data, dlen);
+	strbuf_setlen(sb, sb->len + dlen - len);
+}
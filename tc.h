@@ -106,6 +106,28 @@ typedef struct token {
     enum token_type type;
 } token_t;
 
+// x86-64 general purpose registers, REG_NONE means the value lives in memory
+enum reg {
+    REG_NONE,
+    REG_RAX,
+    REG_RBX,
+    REG_RCX,
+    REG_RDX,
+    REG_RSI,
+    REG_RDI,
+    REG_R8,
+    REG_R9,
+    REG_R10,
+    REG_R11,
+    REG_R12,
+    REG_R13,
+    REG_R14,
+    REG_R15,
+    REG_RBP,
+    REG_RSP,
+    REG_NR
+};
+
 typedef struct symbol {
     struct hlist_node list;
     char *name;
@@ -113,11 +135,28 @@ typedef struct symbol {
     int symbol_type;// variable[0], function[1], struct, enum, ...
     // variable specific
     int index; // for stack index, 0 means global
+    int array_size; // 0 means scalar
+    enum reg reg; // register assigned by the generator
     // functioin specific
     int arg_count; // used by generator
     int var_count; // used by generator
+    int defined; // has a body in this file
+    struct effects *effects; // globals written, including by callees
 } symbol_t;
 
+/*
+ * Side effects of a while loop or a function body collected by the analyzer:
+ * the symbols assigned, once per assignment, and the names of the functions
+ * called. Functions that are not defined in the program can't see its
+ * globals and are assumed not to write them.
+ */
+struct effects {
+    symbol_t **writes;
+    int nr_writes, alloc_writes;
+    char **calls;
+    int nr_calls, alloc_calls;
+};
+
 /*
  * Scopes are implemented as linked lists of symbol tables.
  * There is one file scope and nested scopes for functions.
@@ -162,11 +201,18 @@ enum cast_node_type {
     CAST_STRING
 };
 
+// ints an expression can evaluate to, see propagate_ranges()
+struct value_range {
+    int lo, hi;
+};
+
 // C Abstract Syntax Tree (CAST) node
 typedef struct cast_node {
     struct list_node list;
     enum cast_node_type type;
     int line_number;
+    struct burs_state *state; // instruction selection label, see generator.c
+    struct value_range *range; // NULL when nothing is known
     union {
         struct {
             struct list_head declarations;
@@ -195,6 +241,7 @@ typedef struct cast_node {
             struct cast_node *param_list;
             struct cast_node *compound_stmt;
             symbol_table_t *symbol_table;
+            int is_inline;
         } fun_declaration;
         struct {
             struct list_head params;
@@ -220,6 +267,7 @@ typedef struct cast_node {
         struct {
             struct cast_node *expr;
             struct cast_node *stmt;
+            struct effects *effects;
         } while_stmt;
         struct {
             struct cast_node *expr;
@@ -255,6 +303,307 @@ struct strbuf {
 	char *buf;
 };
 
+#define STRBUF_INIT  { 0, 0, 0, NULL }
+
+#define alloc_nr(x) (((x)+16)*3/2)
+
+#define ALLOC_GROW(x, nr, alloc) \
+	do { \
+		if ((nr) > alloc) { \
+			if (alloc_nr(alloc) < (nr)) \
+				alloc = (nr); \
+			else \
+				alloc = alloc_nr(alloc); \
+			x = realloc((x), alloc * sizeof(*(x))); \
+		} \
+	} while (0)
+
+/*
+ * SSA IR of the functions, built from the CAST by build_ir() in ir.c. Scalar
+ * locals and parameters become values defined exactly once, joined by phi
+ * nodes where control flow merges. Globals and arrays stay in memory and are
+ * accessed by IR_LOAD and IR_STORE in program order.
+ *
+ * Every value remembers the CAST node it was built from, so passes working
+ * on the IR rewrite the CAST that generate_code() turns into x86-64.
+ */
+enum ir_opcode {
+    IR_UNDEF, // a local read before it is assigned
+    IR_CONST, // num
+    IR_STR, // string literal 'name'
+    IR_PARAM, // the num-th parameter 'sym', from 0
+    IR_BINOP, // args[0] tok args[1], comparisons give 0 or 1
+    IR_LOAD, // sym or sym[args[0]]
+    IR_STORE, // sym = args[0] or sym[args[0]] = args[1]
+    IR_CALL, // name(args...)
+    IR_PHI, // args[i] comes from block->preds[i]
+    IR_JMP, // to succs[0]
+    IR_BR, // to succs[0] if args[0] != 0, to succs[1] otherwise
+    IR_RET, // args[0] if any
+    IR_NR
+};
+
+struct ir_value {
+    struct list_node list; // in block->insns, phis first
+    enum ir_opcode op;
+    enum token_type tok; // operator of IR_BINOP
+    int id;
+    int num;
+    symbol_t *sym;
+    char *name;
+    struct ir_value **args;
+    int nr_args, alloc_args;
+    struct ir_value **users; // def-use chain, once per use
+    int nr_users, alloc_users;
+    struct ir_block *block;
+    struct ir_value *forward; // what a removed phi was replaced with
+    cast_node_t *node; // expression or statement it was built from
+};
+
+struct ir_block {
+    int id;
+    struct list_head insns; // ends with IR_JMP, IR_BR or IR_RET
+    struct ir_block **preds;
+    int nr_preds, alloc_preds;
+    struct ir_block *succs[2];
+    int nr_succs;
+    // dominator tree
+    struct ir_block *idom; // NULL for the entry
+    struct ir_block **kids;
+    int nr_kids, alloc_kids;
+    int rpo; // reverse postorder index
+    int dom_pre, dom_post; // walk of the tree, for ir_dominates()
+    // SSA construction
+    struct ir_value **defs; // current value of each variable
+    int alloc_defs;
+    struct ir_value **incomplete; // phis waiting for the preds
+    int nr_incomplete, alloc_incomplete;
+    int sealed; // all preds are known
+};
+
+// an assignment to an SSA variable, the only statement without an instruction
+struct ir_def {
+    cast_node_t *node; // CAST_ASSIGN_STMT or CAST_VAR_DECLARATOR
+    struct ir_value *value; // follow 'forward' if it was a removed phi
+};
+
+struct ir_function {
+    struct list_node list;
+    cast_node_t *decl;
+    symbol_t *sym;
+    struct ir_block **blocks; // reverse postorder, entry first
+    int nr_blocks, alloc_blocks;
+    int nr_values;
+    struct ir_def *defs;
+    int nr_defs, alloc_defs;
+};
+
+struct ir_program {
+    struct list_head functions;
+};
+
+static inline int ir_is_terminator(struct ir_value *v)
+{
+    return v->op == IR_JMP || v->op == IR_BR || v->op == IR_RET;
+}
+
+/*
+ * Machine IR: a list of x86-64 instructions per function in AT&T operand
+ * order. The generator emits into it, optimizer passes rewrite it and
+ * emit_asm() prints it as GNU assembly at the very end.
+ *
+ * Labels start basic blocks, jumps and returns end them.
+ */
+enum mir_opcode {
+    MIR_LABEL, // .L<n>:
+    MIR_ALIGN, // .p2align <src>,,<dst>
+    MIR_MOVL,
+    MIR_MOVQ,
+    MIR_MOVSLQ,
+    MIR_MOVZBL,
+    MIR_LEAQ,
+    MIR_LEAL,
+    MIR_ADDL,
+    MIR_SUBL,
+    MIR_IMULL,
+    MIR_IMULQ,
+    MIR_NEGL,
+    MIR_INCL,
+    MIR_DECL,
+    MIR_ANDL,
+    MIR_ORL,
+    MIR_SARL,
+    MIR_SARQ,
+    MIR_SHLL,
+    MIR_SHRL,
+    MIR_CMPL,
+    MIR_TESTL,
+    MIR_CLTD,
+    MIR_IDIVL,
+    MIR_DIVL, // unsigned
+    MIR_SET, // set<cond>
+    MIR_CMOV, // cmov<cond>, 32-bit
+    MIR_JMP,
+    MIR_JCC, // j<cond>
+    MIR_CALL,
+    MIR_PUSHQ,
+    MIR_POPQ,
+    MIR_SUBQ,
+    MIR_ADDQ,
+    MIR_CMPQ,
+    MIR_LEAVE,
+    MIR_RET,
+    MIR_ENDBR64,
+    // packed 32-bit integers in %xmm (SSE2) or %ymm (AVX2) registers
+    MIR_VMOVDQU,
+    MIR_VPADDD,
+    MIR_VPSUBD,
+    MIR_VPMULLD, // a pmuludq sequence without AVX2
+    MIR_VPXOR,
+    MIR_VBROADCAST, // every lane = 32-bit src
+    MIR_VHSUM, // 32-bit dst = sum of the lanes of src, clobbers src
+    MIR_VZEROUPPER,
+    MIR_NR
+};
+
+enum mir_cond {
+    CC_NONE,
+    CC_E,
+    CC_NE,
+    CC_L,
+    CC_LE,
+    CC_G,
+    CC_GE
+};
+
+enum mir_operand_kind {
+    OPND_NONE,
+    OPND_REG,
+    OPND_IMM,
+    OPND_MEM,
+    OPND_LABEL,
+    OPND_SYM,
+    OPND_XREG // vector register number in 'val'
+};
+
+struct mir_operand {
+    enum mir_operand_kind kind;
+    enum reg reg; // OPND_REG, base of OPND_MEM where REG_NONE means %rip
+    enum reg index; // OPND_MEM
+    int scale; // OPND_MEM
+    int val; // OPND_IMM value, OPND_MEM displacement, OPND_LABEL number
+    const char *sym; // OPND_SYM, symbol of %rip relative OPND_MEM
+};
+
+// one-operand instructions use 'dst' when they write it, 'src' otherwise
+struct mir_insn {
+    struct list_node list;
+    enum mir_opcode op;
+    enum mir_cond cond; // MIR_SET, MIR_CMOV and MIR_JCC
+    struct mir_operand src;
+    struct mir_operand dst;
+};
+
+struct mir_function {
+    struct list_node list;
+    char *name;
+    struct list_head insns;
+};
+
+struct mir_program {
+    struct list_head functions;
+    struct strbuf data; // global variables
+    struct strbuf rodata; // string literals
+    int avx2; // vector instructions are 256-bit wide and VEX encoded
+};
+
+static inline struct mir_operand mir_reg(enum reg reg)
+{
+    return (struct mir_operand){ .kind = OPND_REG, .reg = reg };
+}
+
+static inline struct mir_operand mir_imm(int val)
+{
+    return (struct mir_operand){ .kind = OPND_IMM, .val = val };
+}
+
+static inline struct mir_operand mir_mem(enum reg base, int disp)
+{
+    return (struct mir_operand){ .kind = OPND_MEM, .reg = base, .val = disp };
+}
+
+static inline struct mir_operand mir_mem_index(enum reg base, enum reg index, int scale, int disp)
+{
+    return (struct mir_operand){ .kind = OPND_MEM, .reg = base, .index = index,
+                                 .scale = scale, .val = disp };
+}
+
+static inline struct mir_operand mir_rip(const char *sym, int disp)
+{
+    return (struct mir_operand){ .kind = OPND_MEM, .sym = sym, .val = disp };
+}
+
+static inline struct mir_operand mir_xreg(int n)
+{
+    return (struct mir_operand){ .kind = OPND_XREG, .val = n };
+}
+
+static inline struct mir_operand mir_label(int label)
+{
+    return (struct mir_operand){ .kind = OPND_LABEL, .val = label };
+}
+
+static inline struct mir_operand mir_sym(const char *sym)
+{
+    return (struct mir_operand){ .kind = OPND_SYM, .sym = sym };
+}
+
+static inline struct mir_operand mir_none(void)
+{
+    return (struct mir_operand){ .kind = OPND_NONE };
+}
+
+// condition that holds when the operands of the comparison are exchanged
+static inline enum mir_cond mir_cond_swap(enum mir_cond cond)
+{
+    static const enum mir_cond swapped[] = {
+        [CC_NONE] = CC_NONE, [CC_E] = CC_E, [CC_NE] = CC_NE,
+        [CC_L] = CC_G, [CC_LE] = CC_GE, [CC_G] = CC_L, [CC_GE] = CC_LE
+    };
+    return swapped[cond];
+}
+
+static inline enum mir_cond mir_cond_negate(enum mir_cond cond)
+{
+    static const enum mir_cond negated[] = {
+        [CC_NONE] = CC_NONE, [CC_E] = CC_NE, [CC_NE] = CC_E,
+        [CC_L] = CC_GE, [CC_LE] = CC_G, [CC_G] = CC_LE, [CC_GE] = CC_L
+    };
+    return negated[cond];
+}
+
+static inline int mir_operand_eq(struct mir_operand *a, struct mir_operand *b)
+{
+    return a->kind == b->kind && a->reg == b->reg && a->index == b->index &&
+           a->scale == b->scale && a->val == b->val &&
+           (a->sym == b->sym || (a->sym && b->sym && !strcmp(a->sym, b->sym)));
+}
+
+static inline int mir_is_reg(struct mir_operand *o, enum reg reg)
+{
+    return o->kind == OPND_REG && o->reg == reg;
+}
+
+static inline int mir_ends_block(struct mir_insn *insn)
+{
+    return insn->op == MIR_JMP || insn->op == MIR_JCC || insn->op == MIR_RET;
+}
+
+static inline int mir_starts_block(struct mir_insn *insn)
+{
+    return insn->op == MIR_LABEL;
+}
+
 // Lexical Analysis and helpers in lex.c
 struct list_head *lex(char *source_code);
 const char *token_type_to_str(enum token_type type);
@@ -297,11 +646,31 @@ cast_node_t *parse(struct list_head *tokens);
 
 // Semantic Analysis
 void analyze_semantics(cast_node_t *ast);
+void analyze_effects(cast_node_t *ast);
 symbol_t *symbol_table_lookup(symbol_table_t *t, char *name, int upward);
+symbol_t *symbol_table_add_temp(symbol_table_t *t, const char *prefix);
+symbol_t *local_scalar(symbol_table_t *t, cast_node_t *node);
+cast_node_t *new_node(enum cast_node_type type, int line_number);
+cast_node_t *new_assign(symbol_t *sym, cast_node_t *expr);
+cast_node_t *copy_node(cast_node_t *node);
+void effects_add_write(struct effects *e, symbol_t *sym);
+int effects_writes(struct effects *e, symbol_t *sym);
+int effects_clobber(struct effects *e, symbol_t *sym);
+void analyze_declaration(cast_node_t *ast, cast_node_t *decl);
 
-// Code Generation
-struct strbuf *generate_code(cast_node_t *ast);
+// String buffer in strbuf.c
+void strbuf_add(struct strbuf *sb, const void *data, size_t len);
+void strbuf_addf(struct strbuf *sb, const char *fmt, ...);
 void strbuf_splice(struct strbuf *sb, size_t pos, size_t len, const void *data, size_t dlen);
+static inline void strbuf_setlen(struct strbuf *sb, size_t len)
+{
+	sb->len = len;
+	sb->buf[len] = '\0';
+}
+static inline void strbuf_addstr(struct strbuf *sb, const char *s)
+{
+	strbuf_add(sb, s, strlen(s));
+}
 static inline void strbuf_remove(struct strbuf *sb, size_t pos, size_t len)
 {
 	strbuf_splice(sb, pos, len, NULL, 0);
@@ -326,12 +695,77 @@ static inline int strbuf_findstr(struct strbuf *buf, const char *str)
     return strbuf_findstr_pos(buf, str, 0);
 }
 
+// Compile-time evaluation of pure functions in eval.c
+void evaluate_pure_calls(cast_node_t *ast);
+
+// Function inlining in inline.c
+void inline_functions(cast_node_t *ast);
+
+// Function specialization in spec.c
+void specialize_functions(cast_node_t *ast);
+
+// Constant folding in fold.c
+void fold_constants(cast_node_t *ast);
+int is_pure(cast_node_t *node);
+int same_expr(cast_node_t *a, cast_node_t *b);
+int eval_op(enum token_type op, int l, int r, int *val);
+
+// Loop optimizations in loop.c
+void optimize_loops(cast_node_t *ast);
+
+// SSA IR in ir.c
+struct ir_program *build_ir(cast_node_t *ast);
+void ir_verify(struct ir_function *fn);
+void ir_dump(struct ir_program *prog, FILE *fp);
+int ir_dominates(struct ir_block *a, struct ir_block *b);
+int is_ssa_var(symbol_t *sym);
+
+// Global value numbering in gvn.c
+void number_values(cast_node_t *ast, struct ir_program *prog);
+
+// Value range propagation in range.c
+void propagate_ranges(cast_node_t *ast);
+
+// Dead code elimination in dce.c
+void eliminate_dead_code(cast_node_t *ast);
+
+// Code Generation
+struct mir_program *generate_code(cast_node_t *ast);
+
 // Optimization
-void optimize_code(struct strbuf *code);
+void optimize_code(struct mir_program *prog);
+
+// Machine IR helpers and assembly emission in mir.c
+const char *mir_reg_name(enum reg reg);
+struct mir_insn *mir_insn_new(enum mir_opcode op, struct mir_operand src, struct mir_operand dst);
+unsigned int mir_uses(struct mir_insn *insn);
+unsigned int mir_defs(struct mir_insn *insn);
+int mir_reg_dead_after(struct mir_function *fn, struct mir_insn *insn, enum reg reg);
+struct strbuf *emit_asm(struct mir_program *prog);
 
 // Debugging
 void debug_code();
 
+// Command line options
+struct options {
+    int stats; // -fstats, print the counters of optimization passes
+    int no_inline; // -fno-inline, keep every call
+    int no_eval; // -fno-eval, run calls to pure functions at run time
+    int no_specialize; // -fno-specialize, make no clones of functions for constant arguments
+    int omit_frame_pointer; // -fomit-frame-pointer, address every frame from %rsp
+    int dump_ir; // -fdump-ir, print the SSA IR of every function
+    int no_vectorize; // -fno-vectorize, keep loops scalar
+    int avx2; // -mavx2, vectorize with 256-bit registers instead of SSE2
+    int unroll_loops; // -funroll-loops[=N], copies of a loop body to run per iteration
+};
+extern struct options options;
+
+#define print_stat(pass, counter, val) \
+    do { \
+        if (options.stats) \
+            fprintf(stderr, "[STAT] %s: %s %d\n", pass, counter, val); \
+    } while (0)
+
 // Reporting the error and exiting
 #define panic(fmt, ...) \
     do { \
@@ -0,0 +1,72 @@
+/*
+ * Benchmark of the peephole optimizer on large synthetic functions.
+ *
+ * Every block of the input exercises all rules, including a nested push/pop
+ * pair that only disappears after the inner one is removed. The time per
+ * instruction should stay flat as the input grows.
+ */
+#include <time.h>
+#include "../tc.h"
+
+#define BLOCK_INSNS 12
+#define BLOCK_LEFT 4 // instructions of a block left after optimization
+
+struct options options; // main.c is not linked in, the defaults print no stats
+
+static void add(struct mir_function *fn, enum mir_opcode op, struct mir_operand src, struct mir_operand dst)
+{
+    list_add_tail(&mir_insn_new(op, src, dst)->list, &fn->insns);
+}
+
+static struct mir_program *build(int blocks)
+{
+    struct mir_program *prog = zalloc(sizeof(struct mir_program));
+    struct mir_function *fn = zalloc(sizeof(struct mir_function));
+
+    INIT_LIST_HEAD(&prog->functions);
+    INIT_LIST_HEAD(&fn->insns);
+    fn->name = "bench";
+    list_add_tail(&fn->list, &prog->functions);
+    for (int i = 0; i < blocks; i++) {
+        add(fn, MIR_PUSHQ, mir_reg(REG_RAX), mir_none());
+        add(fn, MIR_POPQ, mir_none(), mir_reg(REG_RAX));
+        add(fn, MIR_PUSHQ, mir_reg(REG_RCX), mir_none());
+        add(fn, MIR_POPQ, mir_none(), mir_reg(REG_RDX));
+        add(fn, MIR_MOVL, mir_imm(i), mir_reg(REG_RAX));
+        add(fn, MIR_MOVL, mir_reg(REG_RAX), mir_reg(REG_RCX));
+        add(fn, MIR_MOVL, mir_imm(0), mir_reg(REG_RAX));
+        add(fn, MIR_ADDL, mir_reg(REG_RCX), mir_reg(REG_RSI));
+        add(fn, MIR_PUSHQ, mir_reg(REG_RAX), mir_none());
+        add(fn, MIR_PUSHQ, mir_reg(REG_RBX), mir_none());
+        add(fn, MIR_POPQ, mir_none(), mir_reg(REG_RBX));
+        add(fn, MIR_POPQ, mir_none(), mir_reg(REG_RAX));
+    }
+    return prog;
+}
+
+static double now_ms(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e3 + ts.tv_nsec / 1e6;
+}
+
+int main(void)
+{
+    printf("%12s %12s %12s\n", "insns", "ms", "ns/insn");
+    for (int blocks = 20000; blocks <= 320000; blocks *= 2) {
+        struct mir_program *prog = build(blocks);
+        struct mir_function *fn = list_first_entry(&prog->functions, struct mir_function, list);
+        double start = now_ms(), ms;
+        size_t left;
+
+        optimize_code(prog);
+        ms = now_ms() - start;
+        left = list_size(&fn->insns);
+        if (left != (size_t)blocks * BLOCK_LEFT)
+            panic("%zu instructions left, expected %d\n", left, blocks * BLOCK_LEFT);
+        printf("%12d %12.2f %12.2f\n", blocks * BLOCK_INSNS, ms, ms * 1e6 / (blocks * BLOCK_INSNS));
+    }
+    return 0;
+}
@@ -0,0 +1,60 @@
+// Hash quotients and remainders of constant divisors over the whole int range
+int h;
+
+int mix(int q, int r)
+{
+    h = h * 31 + q;
+    h = h * 31 + r;
+    return 0;
+}
+
+int check(int n)
+{
+    mix(n / 2, n % 2);
+    mix(n / 3, n % 3);
+    mix(n / 5, n % 5);
+    mix(n / 6, n % 6);
+    mix(n / 7, n % 7);
+    mix(n / 10, n % 10);
+    mix(n / 16, n % 16);
+    mix(n / 25, n % 25);
+    mix(n / 100, n % 100);
+    mix(n / 125, n % 125);
+    mix(n / 641, n % 641);
+    mix(n / 1000, n % 1000);
+    mix(n / 10000, n % 10000);
+    mix(n / 65536, n % 65536);
+    mix(n / 1073741824, n % 1073741824);
+    mix(n / 2147483647, n % 2147483647);
+    mix(n / (0 - 2), n % (0 - 2));
+    mix(n / (0 - 3), n % (0 - 3));
+    mix(n / (0 - 7), n % (0 - 7));
+    mix(n / (0 - 16), n % (0 - 16));
+    mix(n / (0 - 10000), n % (0 - 10000));
+    mix(n / (0 - 2147483647), n % (0 - 2147483647));
+    return 0;
+}
+
+int main()
+{
+    int i = 0;
+    int n = 0 - 2147483647 - 1;
+    h = 0;
+    // stride through the whole range, wrapping around at the end
+    while (i < 1048576) {
+        check(n);
+        n = n + 4093;
+        i = i + 1;
+    }
+    // and around the edges
+    i = 0 - 20000;
+    while (i <= 20000) {
+        check(i);
+        check(2147483647 - i);
+        check(0 - 2147483647 + i);
+        i = i + 1;
+    }
+    check(0 - 2147483647 - 1);
+    printf("%d\n", h);
+    return 0;
+}
@@ -0,0 +1,131 @@
+// Hash products by constants and reduced induction variables, compare with gcc
+int a[40];
+int h;
+
+int mix(int v)
+{
+    h = h * 31 + v;
+    return v;
+}
+
+int consts(int x)
+{
+    int y;
+    mix(x * (0 - 12));
+    mix(x * (0 - 11));
+    mix(x * (0 - 10));
+    mix(x * (0 - 9));
+    mix(x * (0 - 8));
+    mix(x * (0 - 7));
+    mix(x * (0 - 6));
+    mix(x * (0 - 5));
+    mix(x * (0 - 4));
+    mix(x * (0 - 3));
+    mix(x * (0 - 2));
+    mix(x * (0 - 1));
+    mix(x * 0);
+    mix(x * 1);
+    mix(x * 2);
+    mix(x * 3);
+    mix(x * 4);
+    mix(x * 5);
+    mix(x * 6);
+    mix(x * 7);
+    mix(x * 8);
+    mix(x * 9);
+    mix(x * 10);
+    mix(x * 11);
+    mix(x * 12);
+    mix(x * 13);
+    mix(x * 14);
+    mix(x * 15);
+    mix(x * 16);
+    mix(x * 17);
+    mix(x * 18);
+    mix(x * 19);
+    mix(x * 20);
+    mix(x * 21);
+    mix(x * 22);
+    mix(x * 23);
+    mix(x * 24);
+    mix(x * 25);
+    mix(x * 26);
+    mix(x * 27);
+    mix(x * 28);
+    mix(x * 29);
+    mix(x * 30);
+    mix(x * 31);
+    mix(x * 32);
+    mix(x * 33);
+    mix(x * 34);
+    mix(x * 35);
+    mix(x * 36);
+    mix(x * 37);
+    mix(x * 38);
+    mix(x * 39);
+    mix(x * 40);
+    mix(x * 45);
+    mix(x * 64);
+    mix(x * 81);
+    mix(x * 100);
+    mix(x * 127);
+    mix(x * 129);
+    mix(x * 1000);
+    mix(x * 1025);
+    mix(x * 10000);
+    mix(x * 65535);
+    mix(x * 2147483647);
+    y = x;
+    y = y * 3;
+    y = y * 40;
+    y = y * 17;
+    y = y * (0 - 4);
+    mix(y);
+    return 0;
+}
+
+int loops(int n, int k)
+{
+    int i = 0 - n, j, s = 0;
+    while (i * i <= n * n) {
+        s = s + i * i + mix(i * 7);
+        i = i + 2;
+    }
+    i = n;
+    while (i > 0 - n) {
+        j = 0;
+        while (j < 10) {
+            a[j * 3 + 1] = i * k + j * 5;
+            s = s + a[j * 3 + 1] * 2 + i * 4;
+            j = j + 1;
+        }
+        i = i - 3;
+    }
+    i = 0;
+    while (i < 20) {
+        s = s + i * 9;
+        if (s % 7 == 0) {
+            i = i + 1;
+        }
+        i = i + 1;
+    }
+    return s;
+}
+
+int main()
+{
+    int x = 0 - 100000;
+    while (x < 100000) {
+        consts(x);
+        x = x + 3;
+    }
+    consts(2147483647);
+    consts(0 - 2147483647 - 1);
+    x = 0 - 3;
+    while (x < 4) {
+        mix(loops(21, x));
+        x = x + 1;
+    }
+    printf("%d\n", h);
+    return 0;
+}
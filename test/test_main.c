@@ -545,6 +545,356 @@ Suite *parser_suite(void)
     return s;
 }
 
+/**********************************************************************
+ * Code generation tests
+ **********************************************************************/
+START_TEST(test_gen_register_allocation)
+{
+    // more live values than registers, kept across calls
+    char *cmd = "./tc -s 'int f(int x){return x * 2 + 1;}"
+                "int main(){int a = 1, b = 2, c = 3, d = 4, e = 5, g = 6, h = 7, i = 8, j = 9, k = 10;"
+                "printf(\"%d \", a + (b + (c + (d + (e + (g + (h + (i + (j + (k + f(a)))))))))));"
+                "printf(\"%d\\n\", f(a) * f(b) - f(c) * (f(d) - f(e) * (f(g) - f(h))));}' && ./a.tc";
+    int ck = check_cmd(cmd, "58 -202");
+    ck_assert_int_eq(ck, 1);
+}
+END_TEST
+
+START_TEST(test_gen_deep_expression)
+{
+    // f(1) + (f(2) + (... + f(140))): every call spills the sums waiting on it
+    static char cmd[8192];
+    int n = snprintf(cmd, sizeof(cmd), "./tc -fno-inline -s 'int f(int x){printf(\"\"); return x;}"
+                     "int main(){printf(\"%%d\\n\", f(1)");
+    for (int i = 2; i <= 140; i++)
+        n += snprintf(cmd + n, sizeof(cmd) - n, " + (f(%d)", i);
+    for (int i = 2; i <= 140; i++)
+        n += snprintf(cmd + n, sizeof(cmd) - n, ")");
+    snprintf(cmd + n, sizeof(cmd) - n, ");}' && ./a.tc");
+    int ck = check_cmd(cmd, "9870");
+    ck_assert_int_eq(ck, 1);
+}
+END_TEST
+
+START_TEST(test_gen_branch_fusion)
+{
+    // conditions of if/while jump on the comparison itself
+    char *cmd = "./tc -s 'int main(){int i = 0, n = 0;"
+                "while (i < 10) {if (i > 2 && i < 7 || i == 9) n = n + 1; i = i + 1;}"
+                "if (2 && 1) printf(\"ok %d\\n\", n); else printf(\"bad\\n\");}' && ./a.tc";
+    int ck = check_cmd(cmd, "ok 5");
+    ck_assert_int_eq(ck, 1);
+}
+END_TEST
+
+START_TEST(test_gen_short_circuit)
+{
+    // the right operand is only evaluated when the left one doesn't decide
+    char *cmd = "./tc -s 'int c; int t(int v){c = c + 1; return v;}"
+                "int main(){int b = t(0) && t(1); if (t(1) || t(2)) b = b + 10;"
+                "printf(\"%d %d\\n\", b + (t(2) && t(3)), c);}' && ./a.tc";
+    int ck = check_cmd(cmd, "11 4");
+    ck_assert_int_eq(ck, 1);
+}
+END_TEST
+
+START_TEST(test_fold_constants)
+{
+    // sort reads all the output, so tc is never cut off by a closed pipe
+    char *cmd = "./tc -fstats -s 'int main(){int x = 5; printf(\"%d\\n\", (x + 1) + 2 * 3 - 0);}' 2>&1 | sort";
+    ck_assert_int_eq(check_cmd(cmd, "[STAT] fold: constants folded 1"), 1);
+    ck_assert_int_eq(check_cmd(cmd, "[STAT] fold: identities simplified 1"), 1);
+    ck_assert_int_eq(check_cmd(cmd, "[STAT] fold: constants reassociated 1"), 1);
+    ck_assert_int_eq(check_cmd("./a.tc", "12"), 1);
+}
+END_TEST
+
+START_TEST(test_gen_div_by_const)
+{
+    // constant divisors are lowered without idivl, results must match gcc
+    char *cmd = "./tc test/divmod.c && ./a.tc > divmod.out && "
+                "gcc -w -fwrapv -o divmod.ref test/divmod.c && ./divmod.ref | cmp -s - divmod.out && "
+                "echo identical; rm -f divmod.out divmod.ref";
+    int ck = check_cmd(cmd, "identical");
+    ck_assert_int_eq(ck, 1);
+}
+END_TEST
+
+START_TEST(test_gen_mul_strength_reduction)
+{
+    // constant multipliers become lea/shl/add and loop products additions
+    char *cmd = "./tc -fstats test/mul.c 2>&1 | sort";
+    ck_assert_int_eq(check_cmd(cmd, "[STAT] loop: strength reduced 8"), 1);
+    cmd = "./a.tc > mul.out && gcc -w -fwrapv -o mul.ref test/mul.c && "
+          "./mul.ref | cmp -s - mul.out && echo identical; rm -f mul.out mul.ref";
+    ck_assert_int_eq(check_cmd(cmd, "identical"), 1);
+}
+END_TEST
+
+START_TEST(test_loop_invariant_code_motion)
+{
+    // g * 2 and n / 2 are computed once, bump() may change g in the second loop
+    char *cmd = "./tc -fstats -s 'int g; int bump(){g = g + 1; return 0;}"
+                "int main(){int i = 0, s = 0, n = 10; g = 3;"
+                "while (i < n) { s = s + g * 2 + n / 2; i = i + 1; }"
+                "while (i > 0) { s = s + g * 2; bump(); i = i - 1; }"
+                "printf(\"%d\\n\", s);}' 2>&1 | sort";
+    ck_assert_int_eq(check_cmd(cmd, "[STAT] loop: invariants hoisted 2"), 1);
+    ck_assert_int_eq(check_cmd("./a.tc", "260"), 1);
+}
+END_TEST
+
+START_TEST(test_gen_loop_rotation)
+{
+    // the condition is tested once in front of the loop and then at the bottom
+    char *cmd = "./tc -s 'int c; int t(int v){c = c + 1; return v;}"
+                "int main(){int i = 0; while (t(i) < 3) i = i + 1;"
+                "while (t(i) < 3) i = i + 1; printf(\"%d %d\\n\", i, c);}' && ./a.tc";
+    ck_assert_int_eq(check_cmd(cmd, "3 5"), 1);
+}
+END_TEST
+
+START_TEST(test_inline_functions)
+{
+    // sq and max are inlined, fact is recursive and keeps its calls
+    char *src = "-fno-eval -s 'static inline int sq(int x){return x * x;}"
+                "int max(int a, int b){if (a > b) return a; return b;}"
+                "int fact(int n){if (n <= 1) return 1; return n * fact(n - 1);}"
+                "int main(){printf(\"%d\\n\", max(sq(3), 7) + fact(4));}' 2>&1 | sort";
+    char cmd[512];
+
+    snprintf(cmd, sizeof(cmd), "./tc -fstats %s", src);
+    ck_assert_int_eq(check_cmd(cmd, "[STAT] inline: calls inlined 2"), 1);
+    ck_assert_int_eq(check_cmd("./a.tc", "33"), 1);
+    snprintf(cmd, sizeof(cmd), "./tc -fstats -fno-inline %s", src);
+    ck_assert_int_eq(check_cmd(cmd, "[STAT] inline: calls inlined 0"), 1);
+    ck_assert_int_eq(check_cmd("./a.tc", "33"), 1);
+}
+END_TEST
+
+START_TEST(test_gen_tail_calls)
+{
+    // ten million frames would overflow the stack, tail calls reuse one
+    char *cmd = "./tc -s 'int sum(int n, int acc){if (n == 0) return acc; return sum(n - 1, acc + 1);}"
+                "int odd(int n){if (n == 0) return 0; return even(n - 1);}"
+                "int even(int n){if (n == 0) return 1; return odd(n - 1);}"
+                "int main(){printf(\"%d %d\\n\", sum(10000000, 0), even(10000000));}' && ./a.tc";
+    ck_assert_int_eq(check_cmd(cmd, "10000000 1"), 1);
+}
+END_TEST
+
+START_TEST(test_gen_frame_omission)
+{
+    // the leaf sq keeps its frame in the red zone, main needs -fomit-frame-pointer
+    char *src = "'int sq(int x){int y = x * x; return y;}"
+                "int main(){printf(\"%d\\n\", sq(7));}' 2>&1 | sort";
+    char cmd[256];
+
+    snprintf(cmd, sizeof(cmd), "./tc -fstats -fno-inline -s %s", src);
+    ck_assert_int_eq(check_cmd(cmd, "[STAT] generator: frames omitted 1"), 1);
+    ck_assert_int_eq(check_cmd("./a.tc", "49"), 1);
+    snprintf(cmd, sizeof(cmd), "./tc -fstats -fno-inline -fomit-frame-pointer -s %s", src);
+    ck_assert_int_eq(check_cmd(cmd, "[STAT] generator: frames omitted 2"), 1);
+    ck_assert_int_eq(check_cmd("./a.tc", "49"), 1);
+}
+END_TEST
+
+START_TEST(test_gen_internal_calls)
+{
+    // parameters stay in their argument registers while the callees swap them
+    char *cmd = "./tc -fno-inline -s 'int g(int a, int b, int c){return a * 100 + b * 10 + c;}"
+                "int f(int a, int b, int c){return g(c, a, b) + g(b, c + 1, a);}"
+                "int main(){printf(\"%d %d\\n\", f(1, 2, 3), g(f(0, 0, 1), 2, 3));}' && ./a.tc";
+    int ck = check_cmd(cmd, "553 12023");
+    ck_assert_int_eq(ck, 1);
+}
+END_TEST
+
+START_TEST(test_ir_ssa_form)
+{
+    // the loop variable gets a phi in the loop head, joining entry and back edge
+    char *cmd = "./tc -fdump-ir -s 'int main(){int i = 0; while (i < 10) i = i + 1; printf(\"%d\\n\", i);}' 2>&1 | sort";
+
+    ck_assert_int_eq(check_cmd(cmd, "b1: ; preds b0, b2 ; idom b0"), 1);
+    ck_assert_int_eq(check_cmd(cmd, "v2 = phi [v0, b0], [v7, b2] ; i"), 1);
+    ck_assert_int_eq(check_cmd("./a.tc", "10"), 1);
+}
+END_TEST
+
+START_TEST(test_gvn_common_subexpressions)
+{
+    // i - j is reused from the condition, a[i - 6] and its index from the first load
+    char *cmd = "./tc -fstats -fno-inline -s 'int a[4]; int p(int n){return n > 2;}"
+                "int main(){int i = 7, j = 3; a[1] = 5; if (p(j) && p(i - j)) printf(\"%d \", i - j);"
+                "printf(\"%d\\n\", a[i - 6] * a[i - 6]);}' 2>&1 | sort";
+
+    ck_assert_int_eq(check_cmd(cmd, "[STAT] gvn: expressions eliminated 3"), 1);
+    ck_assert_int_eq(check_cmd("./a.tc", "4 25"), 1);
+}
+END_TEST
+
+START_TEST(test_dce_dead_code)
+{
+    // constant branches and code after the returns go, so do z, b and their stores
+    char *cmd = "./tc -fstats -fno-inline -s 'int g; int f(int x){int unused, y = x * 2, z; z = y + 1;"
+                "if (0) g = 5; else g = 7; while (0) g = 9; if (x > 0) return y; else return 0; g = 1;}"
+                "int main(){int a = f(3), b = 4; b = 5; printf(\"%d %d\\n\", a, g);}' 2>&1 | sort";
+
+    ck_assert_int_eq(check_cmd(cmd, "[STAT] dce: unreachable statements removed 5"), 1);
+    ck_assert_int_eq(check_cmd(cmd, "[STAT] dce: dead stores removed 3"), 1);
+    ck_assert_int_eq(check_cmd(cmd, "[STAT] dce: unused locals removed 3"), 1);
+    ck_assert_int_eq(check_cmd("./a.tc", "6 7"), 1);
+}
+END_TEST
+
+START_TEST(test_gen_vectorize_loops)
+{
+    // the first loop reads i itself, the other two run 4 or 8 elements at a time
+    char *src = "'int a[10]; int main(){int b[10], i = 0, s = 0, k = 5;"
+                "while (i < 10) { a[i] = i; i = i + 1; } i = 0;"
+                "while (i < 10) { b[i] = a[i] * 3 + k; i = i + 1; } i = 0;"
+                "while (i < 10) { s = s + b[i]; i = i + 1; } printf(\"%d %d\\n\", s, b[9]);}'";
+    char cmd[512];
+
+    snprintf(cmd, sizeof(cmd), "./tc -fstats -s %s 2>&1 | sort", src);
+    ck_assert_int_eq(check_cmd(cmd, "[STAT] generator: loops vectorized 2"), 1);
+    ck_assert_int_eq(check_cmd("./a.tc", "185 32"), 1);
+    snprintf(cmd, sizeof(cmd), "./tc -fstats -mavx2 -s %s 2>&1 | sort", src);
+    ck_assert_int_eq(check_cmd(cmd, "[STAT] generator: loops vectorized 2"), 1);
+    ck_assert_int_eq(check_cmd("./a.tc", "185 32"), 1);
+}
+END_TEST
+
+START_TEST(test_loop_unrolling)
+{
+    // 10 iterations are 2 unrolled ones and 2 left, f(6) takes its bound from a register
+    char *cmd = "./tc -fstats -fno-inline -funroll-loops=4 -s 'int f(int n){int i = 0, s = 0;"
+                "while (i < n) { s = s * 3 + i; i = i + 1; } return s;}"
+                "int main(){int i = 0, s = 0; while (i < 10) { s = s * 3 + i; i = i + 1; }"
+                "printf(\"%d %d %d\\n\", s, i, f(6));}' 2>&1 | sort";
+
+    ck_assert_int_eq(check_cmd(cmd, "[STAT] loop: loops unrolled 2"), 1);
+    ck_assert_int_eq(check_cmd("./a.tc", "14757 10 179"), 1);
+}
+END_TEST
+
+START_TEST(test_gen_instruction_selection)
+{
+    // x * 4 + y + 3 is one lea, the updates add to memory, a[1] is an operand of subl
+    char *cmd = "./tc -fstats -fno-inline -s 'int g; int a[4]; int f(int x, int y){a[x] = a[x] + y;"
+                "g = g + 1; return x * 4 + y + 3 - a[1];}"
+                "int main(){int r = f(1, 2); printf(\"%d %d %d\\n\", r, a[1], g);}' 2>&1 | sort";
+
+    ck_assert_int_eq(check_cmd(cmd, "[STAT] generator: lea selected 1"), 1);
+    ck_assert_int_eq(check_cmd(cmd, "[STAT] generator: memory operands 1"), 1);
+    ck_assert_int_eq(check_cmd(cmd, "[STAT] generator: memory updates 2"), 1);
+    ck_assert_int_eq(check_cmd("./a.tc", "7 2 1"), 1);
+}
+END_TEST
+
+START_TEST(test_gen_if_conversion)
+{
+    // the else-if clamp becomes two cmovs, the flag of global x a setcc
+    char *cmd = "./tc -fstats -fno-inline -s 'int x; int clamp(int v){if (v > 9) v = 0; else if (v < 0) v = 9;"
+                "return v;} int main(){int i = 0 - 2, s = 0; while (i < 12) { s = s * 3 + clamp(i); i = i + 1; }"
+                "if (s > 100) x = 1; else x = 0; printf(\"%d %d\\n\", s, x);}' 2>&1 | sort";
+
+    ck_assert_int_eq(check_cmd(cmd, "[STAT] generator: branches converted 2"), 1);
+    ck_assert_int_eq(check_cmd("./a.tc", "19264689 1"), 1);
+}
+END_TEST
+
+START_TEST(test_gen_sethi_ullman_order)
+{
+    // the deeper right operands go first, so the products never run out of registers
+    char *cmd = "./tc -fstats -fno-inline -s 'int f(int a, int b, int c, int d){int e = a - b, g = c * d, h = a + d;"
+                "return (a * b) - ((c * d) - ((e * g) - ((h * a) - ((b * c) - ((d * e) - ((g * h) - ((a * c) -"
+                "((b * d) - ((e * h) - ((g * a) - ((h * b) - ((c * e) - (d * g)))))))))))));}"
+                "int main(){printf(\"%d\\n\", f(3, 5, 7, 11));}' 2>&1 | sort";
+
+    ck_assert_int_eq(check_cmd(cmd, "[STAT] generator: operands reordered 12"), 1);
+    ck_assert_int_eq(check_cmd(cmd, "[STAT] generator: temporaries spilled 0"), 1);
+    ck_assert_int_eq(check_cmd("./a.tc", "239"), 1);
+}
+END_TEST
+
+START_TEST(test_gen_value_ranges)
+{
+    // i stays within [0, n), so the check folds away and i % 2, i / 8 need no sign fixup
+    char *cmd = "./tc -fstats -fno-inline -s 'int f(int n){int i = 0, s = 0; while (i < n) {"
+                "if (i >= 0) s = s + i % 2 + i / 8; i = i + 1;} return s;}"
+                "int main(){printf(\"%d\\n\", f(100));}' 2>&1 | sort";
+
+    ck_assert_int_eq(check_cmd(cmd, "[STAT] range: comparisons folded 1"), 1);
+    ck_assert_int_eq(check_cmd(cmd, "[STAT] range: non-negative dividends 2"), 1);
+    ck_assert_int_eq(check_cmd("./a.tc", "626"), 1);
+}
+END_TEST
+
+START_TEST(test_eval_pure_functions)
+{
+    // fib and is_prime run while compiling, count writes a global and stays a call
+    char *cmd = "./tc -fstats -fno-inline -s 'int n;int fib(int k){if (k < 2) return k; return fib(k - 1) + fib(k - 2);}"
+                "int is_prime(int k){int i = 2; while (i * i <= k) {if (k % i == 0) return 0; i = i + 1;} return k > 1;}"
+                "int count(int k){n = n + k; return n;}"
+                "int main(){printf(\"%d %d %d %d\\n\", fib(20), is_prime(97), is_prime(91), count(2));}' 2>&1 | sort";
+
+    ck_assert_int_eq(check_cmd(cmd, "[STAT] eval: pure functions 2"), 1);
+    ck_assert_int_eq(check_cmd(cmd, "[STAT] eval: calls evaluated 3"), 1);
+    ck_assert_int_eq(check_cmd("./a.tc", "6765 1 0 2"), 1);
+}
+END_TEST
+
+START_TEST(test_spec_functions)
+{
+    // fill gets a clone with w = 10, both calls take it and the original goes away
+    char *cmd = "./tc -fstats -fno-inline -s 'int n;int fill(int w, int v){int i = 0; while (i < w) {n = n + v * i; i = i + 1;} return n;}"
+                "int main(){int k = 0; while (k < 3) {fill(10, k); k = k + 1;} fill(10, 1); printf(\"%d\\n\", n);}' 2>&1 | sort";
+
+    ck_assert_int_eq(check_cmd(cmd, "[STAT] spec: functions specialized 1"), 1);
+    ck_assert_int_eq(check_cmd(cmd, "[STAT] spec: calls redirected 2"), 1);
+    ck_assert_int_eq(check_cmd(cmd, "[STAT] spec: originals removed 1"), 1);
+    ck_assert_int_eq(check_cmd("./a.tc", "180"), 1);
+}
+END_TEST
+
+Suite *generator_suite(void)
+{
+    Suite *s;
+    TCase *generator;
+
+    s = suite_create("Code Generation Tests");
+
+    generator = tcase_create("Generator");
+    tcase_add_test(generator, test_gen_register_allocation);
+    tcase_add_test(generator, test_gen_deep_expression);
+    tcase_add_test(generator, test_gen_branch_fusion);
+    tcase_add_test(generator, test_gen_short_circuit);
+    tcase_add_test(generator, test_fold_constants);
+    tcase_add_test(generator, test_gen_div_by_const);
+    tcase_add_test(generator, test_gen_mul_strength_reduction);
+    tcase_add_test(generator, test_loop_invariant_code_motion);
+    tcase_add_test(generator, test_gen_loop_rotation);
+    tcase_add_test(generator, test_inline_functions);
+    tcase_add_test(generator, test_gen_tail_calls);
+    tcase_add_test(generator, test_gen_frame_omission);
+    tcase_add_test(generator, test_gen_internal_calls);
+    tcase_add_test(generator, test_ir_ssa_form);
+    tcase_add_test(generator, test_gvn_common_subexpressions);
+    tcase_add_test(generator, test_dce_dead_code);
+    tcase_add_test(generator, test_gen_vectorize_loops);
+    tcase_add_test(generator, test_loop_unrolling);
+    tcase_add_test(generator, test_gen_instruction_selection);
+    tcase_add_test(generator, test_gen_if_conversion);
+    tcase_add_test(generator, test_gen_sethi_ullman_order);
+    tcase_add_test(generator, test_gen_value_ranges);
+    tcase_add_test(generator, test_eval_pure_functions);
+    tcase_add_test(generator, test_spec_functions);
+    suite_add_tcase(s, generator);
+
+    return s;
+}
+
 int main(void)
 {
     int number_failed;
@@ -555,6 +905,8 @@ int main(void)
     sr = srunner_create(s);
     s = parser_suite();
     srunner_add_suite(sr, s);
+    s = generator_suite();
+    srunner_add_suite(sr, s);
     srunner_run_all(sr, CK_VERBOSE);
     number_failed = srunner_ntests_failed(sr);
     srunner_free(sr);